@@ -0,0 +1,1049 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file benchmark.c
+ *  @brief Latency and throughput benchmark of the DMA, RDMA and compute paths.
+ *
+ *  Every combination of the swept message sizes, batch depths, QP counts and thread
+ *  counts is measured for each selected test. Each point reports the p50/p99/p99.9
+ *  latency of single operations together with GB/s and Mops, as CSV or JSON.
+ *
+ *  DMA and compute tests run on one node. RDMA tests run between a server (-s) and a
+ *  client (-c) started with the same sweeps; the client issues the operations and
+ *  reports, the server exposes its buffer and consumes RDMA SENDs.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reconic.h"
+#include "rdma_api.h"
+#include "rdma_cm.h"
+#include "rdma_engine.h"
+#include "memory_api.h"
+#include "compute_queue.h"
+#include "rn_trace.h"
+#include "benchmark.h"
+
+// Time allowed for an outstanding operation before the benchmark gives up
+#define BENCH_OP_TIMEOUT_NS 10000000000UL
+
+// Systolic accelerator tile dimension
+#define BENCH_TILE_DIM 16
+
+// Initial packet sequence number of the local QPs
+#define BENCH_SQ_PSN 0xabc
+
+struct mac_addr_t src_mac;
+
+uint32_t src_ip = 0;
+char src_ip_str[16];
+char dst_ip_str[16];
+uint16_t tcp_sport = TCP_PORT;
+uint16_t udp_sport = 0;
+
+uint16_t num_data_buf          = 4096;
+uint16_t per_data_buf_size     = 4096;
+uint16_t ipkt_err_stat_q_size  = 8192;
+uint16_t num_err_buf           = 256;
+uint16_t per_err_buf_size      = 256;
+uint64_t resp_err_pkt_buf_size = 65536;
+
+struct rn_dev_t* rn_dev;
+struct rdma_dev_t* rdma_dev;
+struct rdma_cm_conn_t* conn;
+struct rdma_buff_t* rdma_buf;
+
+// State of one DMA benchmark thread
+struct dma_thread_t {
+  const struct bench_config_t* config;
+  pthread_barrier_t* barrier;
+  char* host_buf;
+  uint64_t dev_addr;
+  struct bench_hist_t hist;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  int rc;
+};
+
+// Per-worker state of an RDMA benchmark run
+struct rdma_worker_run_t {
+  struct bench_hist_t hist;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  int rc;
+};
+
+// Shared state of an RDMA benchmark run
+struct rdma_run_t {
+  const struct bench_config_t* config;
+  uint32_t max_size;
+  uint32_t opcode;
+  struct rdma_worker_run_t* workers;
+};
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * NSEC_DIV) + (uint64_t) ts.tv_nsec;
+}
+
+static void hist_init(struct bench_hist_t* hist) {
+  memset(hist, 0, sizeof(struct bench_hist_t));
+  hist->min = UINT64_MAX;
+}
+
+static uint32_t hist_index(uint64_t value) {
+  uint32_t msb;
+
+  if(value < (1UL << BENCH_HIST_SUB_BITS)) {
+    return (uint32_t) value;
+  }
+
+  msb = 63 - __builtin_clzll(value);
+  return ((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) |
+         ((uint32_t) (value >> (msb - BENCH_HIST_SUB_BITS)) & ((1 << BENCH_HIST_SUB_BITS) - 1));
+}
+
+// Middle of the value range covered by a bucket
+static uint64_t hist_value(uint32_t idx) {
+  uint32_t shift;
+
+  if(idx < (1 << BENCH_HIST_SUB_BITS)) {
+    return idx;
+  }
+
+  shift = (idx >> BENCH_HIST_SUB_BITS) - 1;
+  return (((uint64_t) ((1 << BENCH_HIST_SUB_BITS) | (idx & ((1 << BENCH_HIST_SUB_BITS) - 1)))) << shift) +
+         ((1UL << shift) >> 1);
+}
+
+static void hist_add(struct bench_hist_t* hist, uint64_t value) {
+  hist->buckets[hist_index(value)]++;
+  hist->count++;
+  hist->sum += value;
+  hist->min = (value < hist->min) ? value : hist->min;
+  hist->max = (value > hist->max) ? value : hist->max;
+}
+
+static void hist_merge(struct bench_hist_t* dst, const struct bench_hist_t* src) {
+  uint32_t i;
+
+  for(i=0; i<BENCH_HIST_BUCKETS; i++) {
+    dst->buckets[i] += src->buckets[i];
+  }
+  dst->count += src->count;
+  dst->sum   += src->sum;
+  dst->min = (src->min < dst->min) ? src->min : dst->min;
+  dst->max = (src->max > dst->max) ? src->max : dst->max;
+}
+
+static uint64_t hist_percentile(const struct bench_hist_t* hist, double pct) {
+  uint64_t rank;
+  uint64_t seen = 0;
+  uint64_t value;
+  uint32_t i;
+
+  if(hist->count == 0) {
+    return 0;
+  }
+
+  rank = (uint64_t) ((pct / 100.0) * (double) hist->count + 0.5);
+  rank = (rank == 0) ? 1 : rank;
+  for(i=0; i<BENCH_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if(seen >= rank) {
+      value = hist_value(i);
+      return (value > hist->max) ? hist->max : ((value < hist->min) ? hist->min : value);
+    }
+  }
+
+  return hist->max;
+}
+
+// Parse a comma-separated list of unsigned values
+static uint32_t parse_list(const char* str, uint32_t* values, const char* name) {
+  char* copy = strdup(str);
+  char* saveptr = NULL;
+  char* token;
+  uint32_t num = 0;
+
+  for(token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+    if(num == BENCH_MAX_SWEEP) {
+      fprintf(stderr, "Error: at most %d %s can be swept\n", BENCH_MAX_SWEEP, name);
+      exit(EXIT_FAILURE);
+    }
+    values[num] = (uint32_t) strtoul(token, NULL, 0);
+    if(values[num] == 0) {
+      fprintf(stderr, "Error: invalid %s value '%s'\n", name, token);
+      exit(EXIT_FAILURE);
+    }
+    num++;
+  }
+
+  free(copy);
+  return num;
+}
+
+// Parse a comma-separated list of test names into a bit mask
+static uint32_t parse_tests(const char* str) {
+  char* copy = strdup(str);
+  char* saveptr = NULL;
+  char* token;
+  uint32_t mask = 0;
+  int i;
+
+  for(token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+    for(i=0; i<BENCH_NUM_TESTS; i++) {
+      if(!strcmp(token, bench_test_names[i])) {
+        mask |= (1 << i);
+        break;
+      }
+    }
+    if(i == BENCH_NUM_TESTS) {
+      fprintf(stderr, "Error: unknown test '%s'\n", token);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  free(copy);
+  return mask;
+}
+
+static int is_rdma_test(bench_test_t test) {
+  return (test == BENCH_RDMA_READ) || (test == BENCH_RDMA_WRITE) || (test == BENCH_RDMA_SEND);
+}
+
+// Whether a point of the sweep is measured. Both RDMA nodes apply the same rules so that
+// they walk through the same points.
+static int bench_config_valid(const struct bench_config_t* config, uint32_t first_size) {
+  switch(config->test) {
+  case BENCH_RDMA_SEND:
+    // A SEND lands in a single RQE
+    if(config->size > RQE_SIZE) {
+      return 0;
+    }
+    // Fall through
+  case BENCH_RDMA_READ:
+  case BENCH_RDMA_WRITE:
+    return (config->threads <= config->num_qps) && (config->batch < BENCH_QDEPTH);
+  case BENCH_DMA_STRIPE_H2C:
+  case BENCH_DMA_STRIPE_C2H:
+  case BENCH_DMA_AUTO_H2C:
+  case BENCH_DMA_AUTO_C2H:
+    // Every transfer is already spread over all MM queues
+    return (config->num_qps == 1) && (config->batch == 1);
+  case BENCH_COMPUTE:
+    // Jobs are single tiles on one job queue, only the batch depth is swept
+    return (config->threads == 1) && (config->size == first_size) && (config->num_qps == 1) &&
+           (config->batch <= RN_CQ_MAX_DEPTH);
+  default:
+    // The QP count does not apply to DMA
+    return config->num_qps == 1;
+  }
+}
+
+static void* dma_thread_main(void* data) {
+  struct dma_thread_t* thread = (struct dma_thread_t* ) data;
+  const struct bench_config_t* config = thread->config;
+  int dir = ((config->test == BENCH_DMA_H2C) || (config->test == BENCH_DMA_STRIPE_H2C) ||
+             (config->test == BENCH_DMA_AUTO_H2C)) ? RN_DMA_H2C : RN_DMA_C2H;
+  int autotune = (config->test == BENCH_DMA_AUTO_H2C) || (config->test == BENCH_DMA_AUTO_C2H);
+  int stripe = autotune || (config->test == BENCH_DMA_STRIPE_H2C) || 
+               (config->test == BENCH_DMA_STRIPE_C2H);
+  struct rn_dma_ctx_t* ctx = NULL;
+  struct rn_dma_req_t** reqs = NULL;
+  uint64_t* submit_ns = NULL;
+  struct rn_dma_seg_t seg;
+  uint64_t t0;
+  uint32_t it;
+  uint32_t b;
+  ssize_t rc;
+
+  if(stripe) {
+    // One DMA worker per MM queue, each transfer is split across all of them
+    ctx = rn_dma_ctx_create_striped(device, fpga_fd, 0);
+    if(ctx == NULL) {
+      thread->rc = -1;
+    }
+  } else if(config->batch > 1) {
+    // One DMA worker per request in flight
+    ctx = rn_dma_ctx_create(device, fpga_fd, config->batch);
+    reqs = (struct rn_dma_req_t** ) calloc(config->batch, sizeof(struct rn_dma_req_t*));
+    submit_ns = (uint64_t* ) calloc(config->batch, sizeof(uint64_t));
+    if((ctx == NULL) || (reqs == NULL) || (submit_ns == NULL)) {
+      thread->rc = -1;
+    }
+  }
+
+  pthread_barrier_wait(thread->barrier);
+
+  for(it=0; (it < config->warmup + config->iters) && (thread->rc == 0); it++) {
+    if(it == config->warmup) {
+      thread->start_ns = bench_now_ns();
+    }
+
+    if(config->batch == 1) {
+      t0 = bench_now_ns();
+      if(autotune) {
+        // The size picks the strategy, the first split transfer tunes the chunk size
+        rc = rn_dma_transfer(ctx, rn_dev, dir, thread->host_buf, config->size, thread->dev_addr);
+      } else if(stripe) {
+        rc = rn_dma_stripe(ctx, dir, thread->host_buf, config->size, thread->dev_addr);
+      } else if(dir == RN_DMA_H2C) {
+        rc = write_from_buffer(device, fpga_fd, thread->host_buf, config->size, thread->dev_addr);
+      } else {
+        rc = read_to_buffer(device, fpga_fd, thread->host_buf, config->size, thread->dev_addr);
+      }
+      if(rc < 0) {
+        thread->rc = -1;
+        break;
+      }
+      if(it >= config->warmup) {
+        hist_add(&thread->hist, bench_now_ns() - t0);
+      }
+      continue;
+    }
+
+    for(b=0; b<config->batch; b++) {
+      seg.host_buf   = thread->host_buf + (uint64_t) b * config->size;
+      seg.dev_offset = thread->dev_addr + (uint64_t) b * config->size;
+      seg.len        = config->size;
+      submit_ns[b] = bench_now_ns();
+      reqs[b] = rn_dma_submit(ctx, dir, &seg, 1);
+      if(reqs[b] == NULL) {
+        thread->rc = -1;
+        break;
+      }
+    }
+
+    // Requests are waited for in order, a completion is timed when its wait returns
+    for(b=0; b<config->batch; b++) {
+      if(reqs[b] == NULL) {
+        continue;
+      }
+      if(rn_dma_wait(reqs[b]) < 0) {
+        thread->rc = -1;
+      } else if(it >= config->warmup) {
+        hist_add(&thread->hist, bench_now_ns() - submit_ns[b]);
+      }
+      rn_dma_req_free(reqs[b]);
+      reqs[b] = NULL;
+    }
+  }
+  thread->end_ns = bench_now_ns();
+
+  if(ctx != NULL) {
+    rn_dma_ctx_destroy(ctx);
+  }
+  free(reqs);
+  free(submit_ns);
+  return NULL;
+}
+
+static int bench_dma(const struct bench_config_t* config, struct bench_result_t* result) {
+  struct dma_thread_t* threads;
+  pthread_t* tids;
+  pthread_barrier_t barrier;
+  struct rdma_buff_t* dev_buf;
+  uint64_t per_thread = (uint64_t) config->size * config->batch;
+  uint64_t start_ns = UINT64_MAX;
+  uint64_t end_ns = 0;
+  uint32_t i;
+  int rc = 0;
+
+  dev_buf = allocate_rdma_dev_buffer(rn_dev, per_thread * config->threads, RN_DEV_PLACE_AUTO);
+  threads = (struct dma_thread_t* ) calloc(config->threads, sizeof(struct dma_thread_t));
+  tids = (pthread_t* ) calloc(config->threads, sizeof(pthread_t));
+  if((dev_buf == NULL) || (threads == NULL) || (tids == NULL)) {
+    fprintf(stderr, "Error: failed to allocate the buffers of the DMA benchmark\n");
+    free_rdma_buffer(dev_buf);
+    free(threads);
+    free(tids);
+    return -1;
+  }
+
+  pthread_barrier_init(&barrier, NULL, config->threads);
+  for(i=0; i<config->threads; i++) {
+    threads[i].config   = config;
+    threads[i].barrier  = &barrier;
+    threads[i].dev_addr = dev_buf->dma_addr + i * per_thread;
+    hist_init(&threads[i].hist);
+    if(posix_memalign((void** ) &threads[i].host_buf, 4096, per_thread) != 0) {
+      threads[i].host_buf = NULL;
+      threads[i].rc = -1;
+    } else {
+      memset(threads[i].host_buf, (int) i, per_thread);
+    }
+  }
+
+  for(i=0; i<config->threads; i++) {
+    pthread_create(&tids[i], NULL, dma_thread_main, &threads[i]);
+  }
+
+  for(i=0; i<config->threads; i++) {
+    pthread_join(tids[i], NULL);
+    if(threads[i].rc < 0) {
+      rc = -1;
+    }
+    hist_merge(&result->hist, &threads[i].hist);
+    start_ns = (threads[i].start_ns < start_ns) ? threads[i].start_ns : start_ns;
+    end_ns   = (threads[i].end_ns > end_ns) ? threads[i].end_ns : end_ns;
+    free(threads[i].host_buf);
+  }
+  pthread_barrier_destroy(&barrier);
+
+  result->ops        = result->hist.count;
+  result->bytes      = result->ops * config->size;
+  result->elapsed_ns = (end_ns > start_ns) ? (end_ns - start_ns) : 0;
+
+  free_rdma_buffer(dev_buf);
+  free(threads);
+  free(tids);
+  return rc;
+}
+
+static int bench_compute(const struct bench_config_t* config, struct bench_result_t* result) {
+  uint32_t tile_size = BENCH_TILE_DIM * BENCH_TILE_DIM * sizeof(uint32_t);
+  uint32_t total = config->warmup + config->iters;
+  struct rn_compute_queue_t* cq;
+  struct rdma_buff_t* dev_buf;
+  uint64_t* submit_ns;
+  uint32_t* work_ids;
+  void** user_data;
+  ctl_cmd_t ctl_cmd;
+  uint64_t c_addr;
+  uint64_t now;
+  uint32_t submitted = 0;
+  uint32_t reaped = 0;
+  uint32_t num;
+  uint32_t i;
+  uint32_t job;
+  int rc = 0;
+
+  // A and B are shared, each job in flight has its own C tile
+  dev_buf = allocate_rdma_dev_buffer(rn_dev, (uint64_t) (2 + config->batch) * tile_size, RN_DEV_PLACE_AUTO);
+  if(dev_buf == NULL) {
+    return -1;
+  }
+
+  if((dev_buf->dma_addr + (uint64_t) (2 + config->batch) * tile_size - 1) & ~DEVICE_MEM_MASK & ~0xffffffffUL) {
+    fprintf(stderr, "Error: compute buffers must be in the first 4GB of device memory\n");
+    free_rdma_buffer(dev_buf);
+    return -1;
+  }
+
+  cq = rn_cq_create((void* ) rn_dev->axil_ctl, config->batch);
+  submit_ns = (uint64_t* ) calloc(total, sizeof(uint64_t));
+  work_ids = (uint32_t* ) calloc(config->batch, sizeof(uint32_t));
+  user_data = (void** ) calloc(config->batch, sizeof(void*));
+  if((cq == NULL) || (submit_ns == NULL) || (work_ids == NULL) || (user_data == NULL)) {
+    rc = -1;
+    goto out;
+  }
+
+  while((reaped < total) && (rc == 0)) {
+    while((submitted < total) && (rn_cq_outstanding(cq) < config->batch)) {
+      if(submitted == config->warmup) {
+        // Measure from the first job after the warm-up
+        while(rn_cq_outstanding(cq) > 0) {
+          num = rn_cq_reap(cq, work_ids, user_data, config->batch);
+          reaped += num;
+        }
+        result->elapsed_ns = bench_now_ns();
+      }
+
+      c_addr = dev_buf->dma_addr + (uint64_t) (2 + (submitted % config->batch)) * tile_size;
+      gen_ctl_cmd(&ctl_cmd, (uint32_t) dev_buf->dma_addr, (uint32_t) (dev_buf->dma_addr + tile_size),
+                  (uint32_t) c_addr, 6, BENCH_TILE_DIM, BENCH_TILE_DIM, BENCH_TILE_DIM, 0);
+      submit_ns[submitted] = bench_now_ns();
+      if(rn_cq_submit(cq, &ctl_cmd, (void* ) (uintptr_t) submitted) < 0) {
+        break;
+      }
+      submitted++;
+    }
+
+    num = rn_cq_reap(cq, work_ids, user_data, config->batch);
+    now = bench_now_ns();
+    for(i=0; i<num; i++) {
+      job = (uint32_t) (uintptr_t) user_data[i];
+      if(job >= config->warmup) {
+        hist_add(&result->hist, now - submit_ns[job]);
+      }
+    }
+    reaped += num;
+
+    if((num == 0) && (rn_cq_outstanding(cq) > 0) && (now - submit_ns[reaped] > BENCH_OP_TIMEOUT_NS)) {
+      fprintf(stderr, "Error: compute job %d did not complete\n", reaped);
+      rc = -1;
+    }
+    cpu_relax();
+  }
+
+  result->elapsed_ns = bench_now_ns() - result->elapsed_ns;
+  result->ops   = result->hist.count;
+  result->bytes = result->ops * 3 * (uint64_t) tile_size;
+
+out:
+  if(cq != NULL) {
+    rn_cq_destroy(cq);
+  }
+  free(submit_ns);
+  free(work_ids);
+  free(user_data);
+  free_rdma_buffer(dev_buf);
+  return rc;
+}
+
+static void* rdma_worker_main(struct rdma_worker_t* worker, void* arg) {
+  struct rdma_run_t* run = (struct rdma_run_t* ) arg;
+  const struct bench_config_t* config = run->config;
+  struct rdma_worker_run_t* wr = &run->workers[worker->index];
+  struct rdma_qp_t* qp;
+  uint64_t* post_ns;
+  uint32_t* pending;
+  uint64_t laddr;
+  uint64_t raddr;
+  uint64_t now;
+  uint32_t remaining;
+  uint32_t idx;
+  uint32_t it;
+  uint32_t q;
+  uint32_t b;
+  int num;
+
+  post_ns = (uint64_t* ) calloc(worker->num_qps, sizeof(uint64_t));
+  pending = (uint32_t* ) calloc(worker->num_qps, sizeof(uint32_t));
+  if((post_ns == NULL) || (pending == NULL)) {
+    wr->rc = -1;
+    goto out;
+  }
+
+  for(it=0; it < config->warmup + config->iters; it++) {
+    if(it == config->warmup) {
+      wr->start_ns = bench_now_ns();
+    }
+
+    // Post a batch on every QP of the worker, ringing each SQ doorbell once
+    for(q=0; q<worker->num_qps; q++) {
+      qp  = worker->qps[q];
+      idx = qp->qpid - BENCH_FIRST_QPID;
+      laddr = rdma_buf->dma_addr + (uint64_t) idx * run->max_size;
+      raddr = conn->remote[idx].buf_offset;
+      for(b=0; b<config->batch; b++) {
+        create_a_wqe(rdma_dev, qp->qpid, (uint16_t) b, rdma_ring_add(qp->sq_pidb, b, qp->qdepth),
+                     laddr, config->size, run->opcode, raddr, conn->remote[idx].r_key, 0, 0, 0, 0, 0);
+      }
+      post_ns[q] = bench_now_ns();
+      if(rdma_post_send_async(rdma_dev, qp->qpid, config->batch) < 0) {
+        fprintf(stderr, "Error: failed to post %d WQEs on QP%d\n", config->batch, qp->qpid);
+        wr->rc = -1;
+        goto out;
+      }
+      pending[q] = config->batch;
+    }
+
+    // Each completion is timed from the doorbell of its batch
+    remaining = config->batch * worker->num_qps;
+    while(remaining > 0) {
+      for(q=0; q<worker->num_qps; q++) {
+        if(pending[q] == 0) {
+          continue;
+        }
+        num = rdma_poll_cq(worker->qps[q], pending[q], NULL);
+        now = bench_now_ns();
+        if(num > 0) {
+          for(b=0; (it >= config->warmup) && (b < (uint32_t) num); b++) {
+            hist_add(&wr->hist, now - post_ns[q]);
+          }
+          pending[q] -= (uint32_t) num;
+          remaining  -= (uint32_t) num;
+        } else if(now - post_ns[q] > BENCH_OP_TIMEOUT_NS) {
+          fprintf(stderr, "Error: %d WQEs of QP%d did not complete\n", pending[q], worker->qps[q]->qpid);
+          wr->rc = -1;
+          goto out;
+        }
+      }
+      cpu_relax();
+    }
+  }
+
+out:
+  wr->end_ns = bench_now_ns();
+  free(post_ns);
+  free(pending);
+  return NULL;
+}
+
+static int bench_rdma_client(const struct bench_config_t* config, struct bench_result_t* result,
+                             uint32_t max_size) {
+  struct rdma_engine_t* engine;
+  struct rdma_run_t run;
+  uint64_t start_ns = UINT64_MAX;
+  uint64_t end_ns = 0;
+  uint32_t i;
+  int rc = 0;
+
+  run.config   = config;
+  run.max_size = max_size;
+  run.opcode   = (config->test == BENCH_RDMA_READ) ? RNIC_OP_READ :
+                 ((config->test == BENCH_RDMA_WRITE) ? RNIC_OP_WRITE : RNIC_OP_SEND);
+  run.workers  = (struct rdma_worker_run_t* ) calloc(config->threads, sizeof(struct rdma_worker_run_t));
+  engine = create_rdma_engine(rdma_dev, config->threads, NULL);
+  if((run.workers == NULL) || (engine == NULL)) {
+    free(run.workers);
+    destroy_rdma_engine(engine);
+    return -1;
+  }
+
+  for(i=0; i<config->threads; i++) {
+    hist_init(&run.workers[i].hist);
+  }
+
+  // QPs are spread over the workers round-robin
+  for(i=0; i<config->num_qps; i++) {
+    if(rdma_engine_assign_qp(engine, i % config->threads, conn->qps[i]) < 0) {
+      rc = -1;
+      goto out;
+    }
+  }
+
+  if(rdma_engine_start(engine, rdma_worker_main, &run) < 0) {
+    rc = -1;
+    goto out;
+  }
+  rdma_engine_join(engine, 0);
+
+  for(i=0; i<config->threads; i++) {
+    if(run.workers[i].rc < 0) {
+      rc = -1;
+    }
+    hist_merge(&result->hist, &run.workers[i].hist);
+    start_ns = (run.workers[i].start_ns < start_ns) ? run.workers[i].start_ns : start_ns;
+    end_ns   = (run.workers[i].end_ns > end_ns) ? run.workers[i].end_ns : end_ns;
+  }
+
+  result->ops        = result->hist.count;
+  result->bytes      = result->ops * config->size;
+  result->elapsed_ns = (end_ns > start_ns) ? (end_ns - start_ns) : 0;
+
+out:
+  destroy_rdma_engine(engine);
+  free(run.workers);
+  return rc;
+}
+
+// The server side of an RDMA point: consume the SENDs of the client
+static int bench_rdma_server(const struct bench_config_t* config) {
+  void* rqes[BENCH_QDEPTH];
+  uint64_t expected;
+  uint64_t received[RDMA_CM_MAX_QPS];
+  uint64_t last_ns = bench_now_ns();
+  uint32_t done = 0;
+  uint32_t i;
+  int num;
+
+  if(config->test != BENCH_RDMA_SEND) {
+    return 0;
+  }
+
+  expected = (uint64_t) (config->warmup + config->iters) * config->batch;
+  memset(received, 0, sizeof(received));
+  while(done < config->num_qps) {
+    for(i=0; i<config->num_qps; i++) {
+      if(received[i] == expected) {
+        continue;
+      }
+      num = rdma_post_receive_batch(rdma_dev, conn->qps[i], rqes, BENCH_QDEPTH, 0);
+      if(num < 0) {
+        return -1;
+      }
+      if(num > 0) {
+        rdma_release_rq_batch(rdma_dev, conn->qps[i], (uint32_t) num);
+        received[i] += (uint64_t) num;
+        done += (received[i] == expected) ? 1 : 0;
+        last_ns = bench_now_ns();
+      }
+    }
+
+    if(bench_now_ns() - last_ns > BENCH_OP_TIMEOUT_NS) {
+      fprintf(stderr, "Error: the server stopped receiving RDMA SENDs\n");
+      return -1;
+    }
+    cpu_relax();
+  }
+
+  return 0;
+}
+
+static void report_header(FILE* out, int json) {
+  if(json) {
+    fprintf(out, "{\n  \"results\": [");
+  } else {
+    fprintf(out, "test,size,batch,qps,threads,iterations,ops,bytes,elapsed_ns,min_ns,mean_ns,"
+                 "p50_ns,p99_ns,p999_ns,max_ns,gbps,mops\n");
+  }
+}
+
+static void report_result(FILE* out, int json, const struct bench_result_t* result, int first) {
+  const struct bench_config_t* config = &result->config;
+  const struct bench_hist_t* hist = &result->hist;
+  double seconds = (double) result->elapsed_ns / NSEC_DIV;
+  double gbps = (seconds > 0) ? ((double) result->bytes / seconds) / GB_DIV : 0.0;
+  double mops = (seconds > 0) ? ((double) result->ops / seconds) / MB_DIV : 0.0;
+  double mean = (hist->count > 0) ? ((double) hist->sum / hist->count) : 0.0;
+  uint64_t min = (hist->count > 0) ? hist->min : 0;
+
+  if(json) {
+    fprintf(out, "%s\n    {\"test\": \"%s\", \"size\": %u, \"batch\": %u, \"qps\": %u, \"threads\": %u, "
+                 "\"iterations\": %u, \"ops\": %lu, \"bytes\": %lu, \"elapsed_ns\": %lu, "
+                 "\"min_ns\": %lu, \"mean_ns\": %.1f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+                 "\"p999_ns\": %lu, \"max_ns\": %lu, \"gbps\": %.4f, \"mops\": %.4f}",
+            first ? "" : ",", bench_test_names[config->test], config->size, config->batch,
+            config->num_qps, config->threads, config->iters, result->ops, result->bytes,
+            result->elapsed_ns, min, mean, hist_percentile(hist, 50.0),
+            hist_percentile(hist, 99.0), hist_percentile(hist, 99.9), hist->max, gbps, mops);
+  } else {
+    fprintf(out, "%s,%u,%u,%u,%u,%u,%lu,%lu,%lu,%lu,%.1f,%lu,%lu,%lu,%lu,%.4f,%.4f\n",
+            bench_test_names[config->test], config->size, config->batch, config->num_qps,
+            config->threads, config->iters, result->ops, result->bytes, result->elapsed_ns,
+            min, mean, hist_percentile(hist, 50.0), hist_percentile(hist, 99.0),
+            hist_percentile(hist, 99.9), hist->max, gbps, mops);
+  }
+  fflush(out);
+}
+
+static void report_footer(FILE* out, int json) {
+  if(json) {
+    fprintf(out, "\n  ]\n}\n");
+  }
+}
+
+// Open the RDMA engine and connect max_qps queue pairs with the peer
+static void rdma_setup(uint8_t server, uint32_t max_qps, uint32_t max_size, char* qp_location) {
+  struct rdma_buff_t* cidb_buffer;
+  struct rdma_buff_t* data_buf;
+  struct rdma_buff_t* ipkterr_buf;
+  struct rdma_buff_t* err_buf;
+  struct rdma_buff_t* resp_err_pkt_buf;
+  struct rdma_pd_t* rdma_pd;
+  uint64_t cq_cidb_addr;
+  uint64_t rq_cidb_addr;
+  int listen_fd;
+  uint32_t i;
+  int rc;
+
+  rdma_dev = create_rdma_dev(rn_dev);
+
+  // CQ and RQ doorbells of all QPs share a hugepage, indexed by QP ID
+  cidb_buffer = allocate_rdma_buffer(rn_dev, (uint64_t) (1 << HUGE_PAGE_SHIFT), HOST_MEM);
+  cq_cidb_addr = cidb_buffer->dma_addr;
+  rq_cidb_addr = cidb_buffer->dma_addr + (rn_dev->num_qp << 2);
+
+  data_buf = allocate_rdma_buffer(rn_dev, (uint64_t) (num_data_buf*per_data_buf_size), HOST_MEM);
+  ipkterr_buf = allocate_rdma_buffer(rn_dev, (uint64_t) ipkt_err_stat_q_size, HOST_MEM);
+  err_buf = allocate_rdma_buffer(rn_dev, (uint64_t) (num_err_buf*per_err_buf_size), HOST_MEM);
+  resp_err_pkt_buf = allocate_rdma_buffer(rn_dev, (uint64_t) resp_err_pkt_buf_size, HOST_MEM);
+
+  open_rdma_dev(rdma_dev, src_mac, src_ip, udp_sport, num_data_buf, per_data_buf_size,
+                data_buf->dma_addr, ipkt_err_stat_q_size, ipkterr_buf->dma_addr, num_err_buf,
+                per_err_buf_size, err_buf->dma_addr, resp_err_pkt_buf_size, resp_err_pkt_buf->dma_addr);
+
+  rdma_pd = allocate_rdma_pd(rdma_dev, 0 /* pd_num */);
+
+  // Every QP reads from, writes to or sends from its own slice of the buffer
+  rdma_buf = allocate_rdma_buffer(rn_dev, (uint64_t) max_qps * max_size, qp_location);
+  if(rdma_buf == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RDMA buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, rdma_buf);
+
+  conn = rdma_cm_create(max_qps);
+  if(conn == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  for(i=0; i<max_qps; i++) {
+    rdma_cm_set_local_qp(conn, i, BENCH_FIRST_QPID + i, BENCH_SQ_PSN + i, R_KEY,
+                         rdma_buf->dma_addr + (uint64_t) i * max_size, max_size);
+  }
+
+  if(server) {
+    fprintf(stderr, "Info: Server is waiting for the client\n");
+    listen_fd = rdma_cm_listen(src_ip_str, tcp_sport);
+    rc = (listen_fd < 0) ? -1 : rdma_cm_accept(conn, listen_fd);
+    if(listen_fd >= 0) {
+      close(listen_fd);
+    }
+  } else {
+    fprintf(stderr, "Info: Client is connecting to %s\n", dst_ip_str);
+    rc = rdma_cm_connect(conn, dst_ip_str, tcp_sport, BENCH_CONNECT_TIMEOUT_MS);
+  }
+
+  if((rc < 0) || (rdma_cm_exchange(conn, rdma_dev) < 0) ||
+     (rdma_cm_bring_up(conn, rdma_dev, rdma_pd, cq_cidb_addr, rq_cidb_addr, BENCH_QDEPTH,
+                       qp_location, P_KEY) < 0)) {
+    fprintf(stderr, "Error: failed to connect the queue pairs with the peer\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "Info: %d queue pairs connected\n", max_qps);
+}
+
+int main(int argc, char *argv[])
+{
+  int cmd_opt;
+  int sockfd;
+  int   pcie_resource_fd;
+  char *pcie_resource = NULL;
+  char *qp_location = QP_LOCATION_DEFAULT;
+  char *output = NULL;
+  char *trace_file = NULL;
+  char *persist = NULL;
+  FILE *out = stdout;
+  int json = 0;
+  uint8_t server = 0;
+  uint8_t client = 0;
+
+  uint32_t test_mask = parse_tests(BENCH_TESTS_DEFAULT);
+  uint32_t sizes[BENCH_MAX_SWEEP];
+  uint32_t batches[BENCH_MAX_SWEEP];
+  uint32_t qps[BENCH_MAX_SWEEP];
+  uint32_t threads[BENCH_MAX_SWEEP];
+  uint32_t num_sizes   = parse_list(BENCH_SIZES_DEFAULT, sizes, "sizes");
+  uint32_t num_batches = parse_list(BENCH_BATCHES_DEFAULT, batches, "batches");
+  uint32_t num_qps     = parse_list(BENCH_QPS_DEFAULT, qps, "QP counts");
+  uint32_t num_threads = parse_list(BENCH_THREADS_DEFAULT, threads, "thread counts");
+  uint32_t iters  = BENCH_ITERS_DEFAULT;
+  uint32_t warmup = BENCH_WARMUP_DEFAULT;
+
+  struct bench_config_t config;
+  struct bench_result_t* result;
+  uint32_t max_qps = 0;
+  uint32_t max_size = 0;
+  uint32_t t, si, bi, qi, ti;
+  int first = 1;
+  int rc = 0;
+
+  device = DEVICE_NAME_DEFAULT;
+
+  while ((cmd_opt = getopt_long(argc, argv, "d:p:r:i:u:t:T:z:b:n:j:I:w:l:o:f:x:P:sch", \
+          long_opts, NULL)) != -1) {
+    switch (cmd_opt) {
+    case 'd':
+      device = optarg;
+      break;
+    case 'p':
+      pcie_resource = optarg;
+      break;
+    case 'r':
+      src_ip = convert_ip_addr_to_uint(optarg);
+      strncpy(src_ip_str, optarg, sizeof(src_ip_str) - 1);
+      break;
+    case 'i':
+      strncpy(dst_ip_str, optarg, sizeof(dst_ip_str) - 1);
+      break;
+    case 'u':
+      udp_sport = (uint16_t) atoi(optarg);
+      break;
+    case 't':
+      tcp_sport = (uint16_t) atoi(optarg);
+      break;
+    case 'T':
+      test_mask = parse_tests(optarg);
+      break;
+    case 'z':
+      num_sizes = parse_list(optarg, sizes, "sizes");
+      break;
+    case 'b':
+      num_batches = parse_list(optarg, batches, "batches");
+      break;
+    case 'n':
+      num_qps = parse_list(optarg, qps, "QP counts");
+      break;
+    case 'j':
+      num_threads = parse_list(optarg, threads, "thread counts");
+      break;
+    case 'I':
+      iters = (uint32_t) atoi(optarg);
+      break;
+    case 'w':
+      warmup = (uint32_t) atoi(optarg);
+      break;
+    case 'l':
+      qp_location = optarg;
+      if (strcmp(qp_location, HOST_MEM) && strcmp(qp_location, DEVICE_MEM)) {
+        usage(argv[0]);
+        exit(0);
+      }
+      break;
+    case 'o':
+      json = !strcmp(optarg, "json");
+      break;
+    case 'f':
+      output = optarg;
+      break;
+    case 'x':
+      trace_file = optarg;
+      break;
+    case 'P':
+      persist = optarg;
+      break;
+    case 's':
+      server = 1;
+      client = 0;
+      break;
+    case 'c':
+      server = 0;
+      client = 1;
+      break;
+    /* print usage help and exit */
+    case 'h':
+    default:
+      usage(argv[0]);
+      exit(0);
+      break;
+    }
+  }
+
+  for(qi=0; qi<num_qps; qi++) {
+    max_qps = (qps[qi] > max_qps) ? qps[qi] : max_qps;
+  }
+  for(si=0; si<num_sizes; si++) {
+    max_size = (sizes[si] > max_size) ? sizes[si] : max_size;
+  }
+
+  if(iters == 0) {
+    fprintf(stderr, "Error: at least one iteration is needed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(test_mask & ((1 << BENCH_RDMA_READ) | (1 << BENCH_RDMA_WRITE) | (1 << BENCH_RDMA_SEND))) {
+    if(!(server || client)) {
+      fprintf(stderr, "Error: RDMA tests need a server (-s) and a client (-c) node\n");
+      exit(EXIT_FAILURE);
+    }
+    if(max_qps > RDMA_CM_MAX_QPS) {
+      fprintf(stderr, "Error: at most %d queue pairs are supported\n", RDMA_CM_MAX_QPS);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    server = 0;
+    client = 0;
+  }
+
+  // The server only takes part in the RDMA tests
+  if(server) {
+    test_mask &= (1 << BENCH_RDMA_READ) | (1 << BENCH_RDMA_WRITE) | (1 << BENCH_RDMA_SEND);
+  }
+
+  if(persist != NULL) {
+    rn_dev = attach_rn_dev(pcie_resource, &pcie_resource_fd, preallocated_hugepages, BENCH_FIRST_QPID + max_qps, persist);
+  } else {
+    rn_dev = create_rn_dev(pcie_resource, &pcie_resource_fd, preallocated_hugepages, BENCH_FIRST_QPID + max_qps);
+  }
+
+  fpga_fd = open(device, O_RDWR);
+  if (fpga_fd < 0) {
+    fprintf(stderr, "unable to open device %s, %d.\n", device, fpga_fd);
+    perror("open device");
+    return -EINVAL;
+  }
+
+  if(server || client) {
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    src_mac = get_mac_addr_from_str_ip(sockfd, src_ip_str);
+    close(sockfd);
+    rdma_setup(server, max_qps, max_size, qp_location);
+  }
+
+  if(output != NULL) {
+    out = fopen(output, "w");
+    if(out == NULL) {
+      perror("Error: fopen");
+      return -1;
+    }
+  }
+
+  result = (struct bench_result_t* ) malloc(sizeof(struct bench_result_t));
+  if(result == NULL) {
+    return -1;
+  }
+
+  if(!server) {
+    report_header(out, json);
+  }
+
+  config.iters  = iters;
+  config.warmup = warmup;
+  for(t=0; (rc == 0) && (t < BENCH_NUM_TESTS); t++) {
+    if(!(test_mask & (1 << t))) {
+      continue;
+    }
+    config.test = (bench_test_t) t;
+    for(si=0; si<num_sizes; si++) {
+      for(bi=0; bi<num_batches; bi++) {
+        for(qi=0; qi<num_qps; qi++) {
+          for(ti=0; (rc == 0) && (ti < num_threads); ti++) {
+            config.size    = sizes[si];
+            config.batch   = batches[bi];
+            config.num_qps = is_rdma_test(config.test) ? qps[qi] : 1;
+            config.threads = threads[ti];
+            if((!is_rdma_test(config.test) && (qi > 0)) || !bench_config_valid(&config, sizes[0])) {
+              continue;
+            }
+
+            fprintf(stderr, "Info: %s size=%d batch=%d qps=%d threads=%d\n", bench_test_names[t],
+                    config.size, config.batch, config.num_qps, config.threads);
+            memset(result, 0, sizeof(struct bench_result_t));
+            result->config = config;
+            hist_init(&result->hist);
+
+            if(server) {
+              rc = bench_rdma_server(&config);
+            } else if(is_rdma_test(config.test)) {
+              rc = bench_rdma_client(&config, result, max_size);
+            } else if(config.test == BENCH_COMPUTE) {
+              rc = bench_compute(&config, result);
+            } else {
+              rc = bench_dma(&config, result);
+            }
+
+            // Both nodes move to the next point together
+            if(is_rdma_test(config.test) && (rdma_cm_sync(conn) < 0)) {
+              rc = -1;
+            }
+
+            if(rc < 0) {
+              fprintf(stderr, "Error: %s failed\n", bench_test_names[t]);
+            } else if(!server) {
+              report_result(out, json, result, first);
+              first = 0;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  if(!server) {
+    report_footer(out, json);
+  }
+
+  // Trace points of the measured operations, only recorded by a 'make TRACE=1' library
+  if((trace_file != NULL) && (rn_trace_dump(trace_file) < 0)) {
+    rc = -1;
+  }
+
+  if(out != stdout) {
+    fclose(out);
+  }
+  free(result);
+  close(fpga_fd);
+  return rc;
+}
@@ -0,0 +1,215 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEVICE_NAME_DEFAULT "/dev/reconic-mm"
+
+#define TCP_PORT 11111
+
+#define QP_LOCATION_DEFAULT HOST_MEM
+
+// Hardcoded some of the configurations
+#define P_KEY 0x1234
+#define R_KEY 0x0008
+
+// Total number of hugepages allocated: preallocated_hugepages * per_hugepage_size
+//    -- 256 * 2MB = 512MB
+#define preallocated_hugepages 256
+
+#define GB_DIV 1000000000
+#define MB_DIV 1000000
+
+// ID of the first QP, queue pairs are numbered from it upwards
+#define BENCH_FIRST_QPID 2
+
+// Queue depth of every QP
+#define BENCH_QDEPTH 64
+
+// Maximum number of values of a swept parameter
+#define BENCH_MAX_SWEEP 32
+
+// Default sweeps and iteration counts
+#define BENCH_TESTS_DEFAULT   "dma_h2c,dma_c2h"
+#define BENCH_SIZES_DEFAULT   "64,4096,65536,1048576"
+#define BENCH_BATCHES_DEFAULT "1,16"
+#define BENCH_QPS_DEFAULT     "1"
+#define BENCH_THREADS_DEFAULT "1"
+#define BENCH_ITERS_DEFAULT   1000
+#define BENCH_WARMUP_DEFAULT  100
+
+// Latency histogram: values below 2^BENCH_HIST_SUB_BITS ns get their own bucket, larger
+// values get 2^BENCH_HIST_SUB_BITS buckets per power of two (about 6% resolution).
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_BUCKETS  1024
+
+// Time spent waiting for the peer to connect in milliseconds
+#define BENCH_CONNECT_TIMEOUT_MS 60000
+
+/*! \enum bench_test_t
+    \brief Paths measured by the benchmark.
+*/
+typedef enum {
+  BENCH_DMA_H2C = 0,
+  BENCH_DMA_C2H,
+  BENCH_RDMA_READ,
+  BENCH_RDMA_WRITE,
+  BENCH_RDMA_SEND,
+  BENCH_COMPUTE,
+  BENCH_DMA_STRIPE_H2C,
+  BENCH_DMA_STRIPE_C2H,
+  BENCH_DMA_AUTO_H2C,
+  BENCH_DMA_AUTO_C2H,
+  BENCH_NUM_TESTS
+} bench_test_t;
+
+static const char* const bench_test_names[BENCH_NUM_TESTS] = {
+  "dma_h2c", "dma_c2h", "rdma_read", "rdma_write", "rdma_send", "compute",
+  "dma_stripe_h2c", "dma_stripe_c2h", "dma_auto_h2c", "dma_auto_c2h"
+};
+
+/*! \struct bench_hist_t
+    \brief Log-linear latency histogram in nanoseconds.
+*/
+struct bench_hist_t {
+  uint64_t buckets[BENCH_HIST_BUCKETS]; /*!< buckets sample count of each bucket. */
+  uint64_t count;  /*!< count number of samples. */
+  uint64_t sum;    /*!< sum sum of the samples. */
+  uint64_t min;    /*!< min smallest sample. */
+  uint64_t max;    /*!< max largest sample. */
+};
+
+/*! \struct bench_config_t
+    \brief One point of the sweep.
+*/
+struct bench_config_t {
+  bench_test_t test;  /*!< test path measured. */
+  uint32_t size;      /*!< size message size in bytes. */
+  uint32_t batch;     /*!< batch operations in flight per thread or per QP. */
+  uint32_t num_qps;   /*!< num_qps queue pairs used by RDMA tests. */
+  uint32_t threads;   /*!< threads number of threads issuing operations. */
+  uint32_t iters;     /*!< iters measured iterations per thread. */
+  uint32_t warmup;    /*!< warmup iterations run before measuring. */
+};
+
+/*! \struct bench_result_t
+    \brief Measurements of one point of the sweep.
+*/
+struct bench_result_t {
+  struct bench_config_t config; /*!< config point measured. */
+  struct bench_hist_t hist;     /*!< hist latency of every operation. */
+  uint64_t ops;                 /*!< ops operations completed. */
+  uint64_t bytes;               /*!< bytes payload bytes moved. */
+  uint64_t elapsed_ns;          /*!< elapsed_ns wall-clock time of the measured iterations. */
+};
+
+static struct option const long_opts[] = {
+  {"device"        , required_argument, NULL, 'd'},
+  {"pcie_resource" , required_argument, NULL, 'p'},
+  {"src_ip"        , required_argument, NULL, 'r'},
+  {"dst_ip"        , required_argument, NULL, 'i'},
+  {"udp_sport"     , required_argument, NULL, 'u'},
+  {"tcp_sport"     , required_argument, NULL, 't'},
+  {"tests"         , required_argument, NULL, 'T'},
+  {"sizes"         , required_argument, NULL, 'z'},
+  {"batches"       , required_argument, NULL, 'b'},
+  {"qps"           , required_argument, NULL, 'n'},
+  {"threads"       , required_argument, NULL, 'j'},
+  {"iterations"    , required_argument, NULL, 'I'},
+  {"warmup"        , required_argument, NULL, 'w'},
+  {"qp_location"   , required_argument, NULL, 'l'},
+  {"format"        , required_argument, NULL, 'o'},
+  {"output"        , required_argument, NULL, 'f'},
+  {"trace"         , required_argument, NULL, 'x'},
+  {"persist"       , required_argument, NULL, 'P'},
+  {"server"        , no_argument      , NULL, 's'},
+  {"client"        , no_argument      , NULL, 'c'},
+  {"help"          , no_argument      , NULL, 'h'},
+  {0               , 0                , 0   ,  0 }
+};
+
+static void usage(const char *name)
+{
+  int i = 0;
+
+  fprintf(stdout, "usage: %s [OPTIONS]\n\n", name);
+
+  fprintf(stdout, "  -%c (--%s) character device name (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, DEVICE_NAME_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) PCIe resource \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Source IP address \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Destination IP address, client only \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) UDP source port \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) TCP port used to connect both nodes (defaults to %d)\n",
+    long_opts[i].val, long_opts[i].name, TCP_PORT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Comma-separated tests: dma_h2c, dma_c2h, rdma_read, rdma_write, rdma_send, compute, dma_stripe_h2c, dma_stripe_c2h, dma_auto_h2c, dma_auto_c2h (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_TESTS_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Comma-separated message sizes in bytes (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_SIZES_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Comma-separated batch depths (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_BATCHES_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Comma-separated QP counts of the RDMA tests (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_QPS_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Comma-separated thread counts (defaults to %s)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_THREADS_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Measured iterations per thread (defaults to %d)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_ITERS_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Warm-up iterations per thread (defaults to %d)\n",
+    long_opts[i].val, long_opts[i].name, BENCH_WARMUP_DEFAULT);
+  i++;
+  fprintf(stdout, "  -%c (--%s) QP/mem-registered buffers' location: [host_mem | dev_mem] \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Report format: [csv | json] (defaults to csv)\n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Report file (defaults to stdout)\n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Trace file written at exit, needs a library built with 'make TRACE=1'\n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Attach to the named persistent context instead of setting up the device from scratch\n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Server node of the RDMA tests \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) Client node of the RDMA tests \n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
+    long_opts[i].val, long_opts[i].name);
+  fprintf(stdout, "\nBoth RDMA nodes must be started with the same tests and sweeps.\n");
+}
+
+#endif /* __BENCHMARK_H__ */
@@ -0,0 +1,232 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file buffer_pool_test.c
+ *  @brief Standalone checks of the buffer pool allocator.
+ *
+ *  The pools only manage offsets, so the checks run on any host without a RecoNIC
+ *  device or hugepages. They cover page allocation and buddy coalescing, slab reuse,
+ *  slab reclaim, pool exhaustion and the alignment guarantees of rn_pool_alloc().
+ */
+
+#include "buffer_pool.h"
+
+#define PAGE_SIZE_4K 4096UL
+
+// A power-of-two pool, the whole region is one buddy block when it is free
+#define POOL_PAGES 1024
+
+// A pool whose size is not a power of two and not a multiple of 4KB
+#define ODD_POOL_PAGES 1000
+#define ODD_POOL_TAIL  123
+
+#define TEST_ASSERT(cond, msg) do {                                        \
+    if(!(cond)) {                                                          \
+      fprintf(stderr, "Error: %s:%d: %s\n", __func__, __LINE__, msg);      \
+      return -1;                                                           \
+    }                                                                      \
+  } while(0)
+
+static int test_alloc_free_coalesce(void) {
+  struct rn_pool_t pool;
+  struct rn_slab_t* slab;
+  uint64_t offset[POOL_PAGES];
+  uint64_t big_offset;
+  uint32_t i;
+
+  TEST_ASSERT(rn_pool_init(&pool, POOL_PAGES * PAGE_SIZE_4K) == 0, "rn_pool_init failed");
+  TEST_ASSERT(pool.free_bytes == POOL_PAGES * PAGE_SIZE_4K, "a new pool is not all free");
+
+  // Split the pool into single pages
+  for(i=0; i<POOL_PAGES; i++) {
+    TEST_ASSERT(rn_pool_alloc(&pool, PAGE_SIZE_4K, &offset[i], &slab) == 0, "page allocation failed");
+    TEST_ASSERT(slab == NULL, "a page range came from a slab");
+  }
+  TEST_ASSERT(pool.free_bytes == 0, "free_bytes is not 0 on a full pool");
+
+  // Every other page free, so nothing larger than one page is available
+  for(i=0; i<POOL_PAGES; i+=2) {
+    rn_pool_free(&pool, offset[i], PAGE_SIZE_4K, NULL);
+  }
+  TEST_ASSERT(rn_pool_alloc(&pool, 2 * PAGE_SIZE_4K, &big_offset, &slab) < 0,
+              "allocated two pages from single free pages");
+
+  // Freeing the rest must merge the buddies back into one block
+  for(i=1; i<POOL_PAGES; i+=2) {
+    rn_pool_free(&pool, offset[i], PAGE_SIZE_4K, NULL);
+  }
+  TEST_ASSERT(pool.free_bytes == POOL_PAGES * PAGE_SIZE_4K, "free_bytes is off after freeing all");
+  TEST_ASSERT(rn_pool_alloc(&pool, POOL_PAGES * PAGE_SIZE_4K, &big_offset, &slab) == 0,
+              "freed pages did not coalesce");
+  TEST_ASSERT(big_offset == 0, "the whole-pool range does not start at 0");
+  rn_pool_free(&pool, big_offset, POOL_PAGES * PAGE_SIZE_4K, NULL);
+
+  // A request that is not a power of two of pages only takes the pages it covers
+  TEST_ASSERT(rn_pool_alloc(&pool, 3 * PAGE_SIZE_4K + 1, &offset[0], &slab) == 0,
+              "4-page allocation failed");
+  TEST_ASSERT(pool.free_bytes == (POOL_PAGES - 4) * PAGE_SIZE_4K, "4-page allocation took extra pages");
+  TEST_ASSERT(rn_pool_alloc(&pool, 5 * PAGE_SIZE_4K, &offset[1], &slab) == 0,
+              "5-page allocation failed");
+  TEST_ASSERT(pool.free_bytes == (POOL_PAGES - 9) * PAGE_SIZE_4K, "5-page allocation took extra pages");
+  rn_pool_free(&pool, offset[0], 3 * PAGE_SIZE_4K + 1, NULL);
+  rn_pool_free(&pool, offset[1], 5 * PAGE_SIZE_4K, NULL);
+  TEST_ASSERT(rn_pool_alloc(&pool, POOL_PAGES * PAGE_SIZE_4K, &big_offset, &slab) == 0,
+              "split blocks did not coalesce");
+  rn_pool_free(&pool, big_offset, POOL_PAGES * PAGE_SIZE_4K, NULL);
+
+  rn_pool_destroy(&pool);
+  return 0;
+}
+
+static int test_slab_reuse(void) {
+  struct rn_pool_t pool;
+  struct rn_slab_t* slab[2];
+  struct rn_slab_t* extra_slab;
+  struct rn_slab_t* objs_slab[PAGE_SIZE_4K / RN_POOL_MIN_SLAB_SIZE];
+  uint64_t offset[2];
+  uint64_t extra_offset;
+  uint64_t objs[PAGE_SIZE_4K / RN_POOL_MIN_SLAB_SIZE];
+  uint64_t reused_offset;
+  uint32_t num_objs = PAGE_SIZE_4K / RN_POOL_MIN_SLAB_SIZE;
+  uint32_t i;
+
+  TEST_ASSERT(rn_pool_init(&pool, POOL_PAGES * PAGE_SIZE_4K) == 0, "rn_pool_init failed");
+
+  TEST_ASSERT(rn_pool_alloc(&pool, 40, &offset[0], &slab[0]) == 0, "slab allocation failed");
+  TEST_ASSERT(rn_pool_alloc(&pool, 40, &offset[1], &slab[1]) == 0, "slab allocation failed");
+  TEST_ASSERT((slab[0] != NULL) && (slab[0] == slab[1]), "small objects are not in the same slab");
+  TEST_ASSERT(offset[1] == offset[0] + RN_POOL_MIN_SLAB_SIZE, "small objects are not packed");
+  TEST_ASSERT(pool.free_bytes == POOL_PAGES * PAGE_SIZE_4K - 2 * RN_POOL_MIN_SLAB_SIZE,
+              "free_bytes does not count slab objects");
+
+  // A freed object is handed out again before the rest of the slab
+  rn_pool_free(&pool, offset[0], 40, slab[0]);
+  TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &reused_offset, &extra_slab) == 0,
+              "slab allocation failed");
+  TEST_ASSERT((reused_offset == offset[0]) && (extra_slab == slab[0]), "freed object was not reused");
+  rn_pool_free(&pool, reused_offset, RN_POOL_MIN_SLAB_SIZE, extra_slab);
+  rn_pool_free(&pool, offset[1], 40, slab[1]);
+  TEST_ASSERT(pool.free_bytes == POOL_PAGES * PAGE_SIZE_4K, "free_bytes is off after freeing objects");
+
+  // The empty slab stays cached as the only one of its class, so no new page is taken
+  TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &reused_offset, &extra_slab) == 0,
+              "slab allocation failed");
+  TEST_ASSERT(reused_offset == offset[0], "the cached empty slab was not reused");
+  rn_pool_free(&pool, reused_offset, RN_POOL_MIN_SLAB_SIZE, extra_slab);
+
+  // A full slab leaves the partial list, the next object starts a new page
+  for(i=0; i<num_objs; i++) {
+    TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &objs[i], &objs_slab[i]) == 0,
+                "slab allocation failed");
+  }
+  TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &extra_offset, &extra_slab) == 0,
+              "slab allocation failed");
+  TEST_ASSERT(extra_slab != objs_slab[0], "a full slab handed out another object");
+  TEST_ASSERT((extra_offset / PAGE_SIZE_4K) != (objs[0] / PAGE_SIZE_4K), "the new slab shares a page");
+  for(i=0; i<num_objs; i++) {
+    rn_pool_free(&pool, objs[i], RN_POOL_MIN_SLAB_SIZE, objs_slab[i]);
+  }
+  rn_pool_free(&pool, extra_offset, RN_POOL_MIN_SLAB_SIZE, extra_slab);
+  TEST_ASSERT(pool.free_bytes == POOL_PAGES * PAGE_SIZE_4K, "free_bytes is off after freeing slabs");
+
+  // The page of the cached empty slab is reclaimed when a page range needs it
+  TEST_ASSERT(rn_pool_alloc(&pool, POOL_PAGES * PAGE_SIZE_4K, &extra_offset, &extra_slab) == 0,
+              "cached slab page was not reclaimed");
+  rn_pool_free(&pool, extra_offset, POOL_PAGES * PAGE_SIZE_4K, NULL);
+
+  rn_pool_destroy(&pool);
+  return 0;
+}
+
+static int test_exhaustion(void) {
+  struct rn_pool_t pool;
+  struct rn_slab_t* slab;
+  uint64_t offset[ODD_POOL_PAGES];
+  uint64_t extra_offset;
+  uint32_t num_pages = 0;
+
+  TEST_ASSERT(rn_pool_init(&pool, ODD_POOL_PAGES * PAGE_SIZE_4K + ODD_POOL_TAIL) == 0,
+              "rn_pool_init failed");
+  TEST_ASSERT(pool.size == ODD_POOL_PAGES * PAGE_SIZE_4K, "pool size is not rounded down to 4KB");
+  TEST_ASSERT(rn_pool_alloc(&pool, pool.size + PAGE_SIZE_4K, &extra_offset, &slab) < 0,
+              "allocated more than the pool size");
+
+  while(rn_pool_alloc(&pool, PAGE_SIZE_4K, &extra_offset, &slab) == 0) {
+    TEST_ASSERT(num_pages < ODD_POOL_PAGES, "allocated more pages than the pool has");
+    TEST_ASSERT(extra_offset + PAGE_SIZE_4K <= pool.size, "range is past the end of the pool");
+    offset[num_pages] = extra_offset;
+    num_pages++;
+  }
+  TEST_ASSERT(num_pages == ODD_POOL_PAGES, "pool ran out before all pages were used");
+  TEST_ASSERT(pool.free_bytes == 0, "free_bytes is not 0 on an exhausted pool");
+  TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &extra_offset, &slab) < 0,
+              "slab allocated from an exhausted pool");
+
+  // One freed page is enough to start a slab again
+  num_pages--;
+  rn_pool_free(&pool, offset[num_pages], PAGE_SIZE_4K, NULL);
+  TEST_ASSERT(rn_pool_alloc(&pool, RN_POOL_MIN_SLAB_SIZE, &extra_offset, &slab) == 0,
+              "slab allocation failed after a free");
+  TEST_ASSERT(extra_offset == offset[num_pages], "slab did not take the freed page");
+  rn_pool_free(&pool, extra_offset, RN_POOL_MIN_SLAB_SIZE, slab);
+
+  while(num_pages > 0) {
+    num_pages--;
+    rn_pool_free(&pool, offset[num_pages], PAGE_SIZE_4K, NULL);
+  }
+  TEST_ASSERT(pool.free_bytes == pool.size, "free_bytes is off after freeing all");
+
+  rn_pool_destroy(&pool);
+  return 0;
+}
+
+static int test_alignment(void) {
+  struct rn_pool_t pool;
+  struct rn_slab_t* slab;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t obj_size;
+
+  TEST_ASSERT(rn_pool_init(&pool, POOL_PAGES * PAGE_SIZE_4K) == 0, "rn_pool_init failed");
+
+  for(size=1; size<=RN_POOL_MAX_SLAB_SIZE; size=size*3+1) {
+    TEST_ASSERT(rn_pool_alloc(&pool, size, &offset, &slab) == 0, "slab allocation failed");
+    TEST_ASSERT(slab != NULL, "a small range did not come from a slab");
+    obj_size = RN_POOL_MIN_SLAB_SIZE;
+    while(obj_size < size) {
+      obj_size <<= 1;
+    }
+    TEST_ASSERT(slab->obj_size == obj_size, "range is in the wrong slab class");
+    TEST_ASSERT((offset % obj_size) == 0, "slab object is not aligned to its size");
+    TEST_ASSERT((offset / PAGE_SIZE_4K) == ((offset + size - 1) / PAGE_SIZE_4K),
+                "slab object crosses a 4KB boundary");
+  }
+
+  for(size=RN_POOL_MAX_SLAB_SIZE+1; size<=64*PAGE_SIZE_4K; size=size*2+1) {
+    TEST_ASSERT(rn_pool_alloc(&pool, size, &offset, &slab) == 0, "page allocation failed");
+    TEST_ASSERT(slab == NULL, "a large range came from a slab");
+    TEST_ASSERT((offset % PAGE_SIZE_4K) == 0, "page range is not 4KB aligned");
+  }
+
+  rn_pool_destroy(&pool);
+  return 0;
+}
+
+int main(void) {
+  int num_failed = 0;
+
+  num_failed += (test_alloc_free_coalesce() < 0);
+  num_failed += (test_slab_reuse() < 0);
+  num_failed += (test_exhaustion() < 0);
+  num_failed += (test_alignment() < 0);
+
+  if(num_failed > 0) {
+    fprintf(stderr, "Error: %d buffer pool test(s) failed\n", num_failed);
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Info: all buffer pool tests passed\n");
+  return EXIT_SUCCESS;
+}
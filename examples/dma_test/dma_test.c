@@ -30,7 +30,7 @@ static struct option const long_opts[] = {
 
 // Function prototypes for clarity
 static void usage(const char *name);
-static void dump_buffers(const char* golden_buffer, const char* received_buffer, uint64_t size);
+static void dump_buffers(const char* golden_buffer, const char* received_buffer, uint64_t size, uint64_t mismatch);
 static int test_dma_with_verification(char *devname, uint64_t addr, uint64_t size,
                                       uint64_t offset, uint64_t count);
 
@@ -135,9 +135,10 @@ int main(int argc, char *argv[])
 /**
  * @brief NEW: Dumps the content of two buffers side-by-side for comparison.
  */
-static void dump_buffers(const char* golden_buffer, const char* received_buffer, uint64_t size) {
-    const uint64_t MAX_DUMP_SIZE = 256; // Limit dump to first 256 bytes
-    uint64_t dump_size = (size > MAX_DUMP_SIZE) ? MAX_DUMP_SIZE : size;
+static void dump_buffers(const char* golden_buffer, const char* received_buffer, uint64_t size, uint64_t mismatch) {
+    const uint64_t MAX_DUMP_SIZE = 256; // Limit dump to 256 bytes from the first mismatch
+    uint64_t start = mismatch & ~(uint64_t)0xF;
+    uint64_t dump_size = (size - start > MAX_DUMP_SIZE) ? MAX_DUMP_SIZE : size - start;
 
     fprintf(stderr, "--------------------------------------------------\n");
     fprintf(stderr, "           Data Buffer Comparison Dump\n");
@@ -145,7 +146,7 @@ static void dump_buffers(const char* golden_buffer, const char* received_buffer,
     fprintf(stderr, "Offset(h) | Expected (Golden) | Received (Actual) | Status\n");
     fprintf(stderr, "--------------------------------------------------\n");
 
-    for (uint64_t i = 0; i < dump_size; i++) {
+    for (uint64_t i = start; i < start + dump_size; i++) {
         unsigned char golden_char = (unsigned char)golden_buffer[i];
         unsigned char received_char = (unsigned char)received_buffer[i];
         const char* status = (golden_char == received_char) ? "" : "<<<<< MISMATCH";
@@ -155,7 +156,7 @@ static void dump_buffers(const char* golden_buffer, const char* received_buffer,
     }
 
     if (size > dump_size) {
-        fprintf(stderr, "... (dump truncated to first %lu bytes) ...\n", dump_size);
+        fprintf(stderr, "... (dump truncated to %lu bytes from offset 0x%lx) ...\n", dump_size, start);
     }
     fprintf(stderr, "--------------------------------------------------\n");
 }
@@ -167,6 +168,7 @@ static int test_dma_with_verification(char *devname, uint64_t addr, uint64_t siz
                                       uint64_t offset, uint64_t count)
 {
     ssize_t rc;
+    int64_t mismatch;
     char *write_buffer = NULL;
     char *read_buffer = NULL;
     int fpga_fd;
@@ -200,9 +202,7 @@ static int test_dma_with_verification(char *devname, uint64_t addr, uint64_t siz
 
         // 1. Prepare golden data
         printf("Step 1: Preparing golden data pattern...\n");
-        for (uint64_t j = 0; j < size; j++) {
-            write_buffer[j] = (char)((i + j) & 0xFF);
-        }
+        rn_fill_seq8(write_buffer, size, (uint8_t)i);
 
         // 2. Write from host to FPGA (H2C)
         printf("Step 2: Writing %lu bytes from host to FPGA at address 0x%lx...\n", size, addr);
@@ -225,14 +225,14 @@ static int test_dma_with_verification(char *devname, uint64_t addr, uint64_t siz
 
         // 4. Verify data integrity
         printf("Step 4: Verifying data integrity...\n");
-        rc = memcmp(write_buffer, read_buffer, size);
-        if (rc == 0) {
+        mismatch = rn_mem_mismatch(write_buffer, read_buffer, size);
+        if (mismatch < 0) {
             printf("         SUCCESS: Data read back matches data written.\n");
         } else {
-            fprintf(stderr, "         FAILURE: Data verification failed on cycle %lu!\n", i + 1);
+            fprintf(stderr, "         FAILURE: Data verification failed on cycle %lu at offset 0x%lx!\n", i + 1, mismatch);
             
             // Call the helper function to dump buffers for detailed comparison
-            dump_buffers(write_buffer, read_buffer, size);
+            dump_buffers(write_buffer, read_buffer, size, (uint64_t)mismatch);
             
             rc = -1; // Set an error code
             goto out; // Exit immediately on error
@@ -8,13 +8,6 @@
 
 int verbose = 0;
 
-/* Subtract timespec t2 from t1
- *
- * Both t1 and t2 must already be normalized
- * i.e. 0 <= nsec < 1000000000
- */
-static int timespec_check(struct timespec *t);
-
 uint64_t getopt_integer(char *optarg)
 {
 	int rc;
@@ -40,37 +33,6 @@ void dump_throughput_result(uint64_t size, float result, float lat_result) {
 		printf("Average BW = %f Bytes/sec, average latency = %f us\n", ((double)result), ((double) lat_result * 1000000.0));
 }
 
-static int timespec_check(struct timespec *t)
-{
-	if ((t->tv_nsec < 0) || (t->tv_nsec >= 1000000000))
-		return -1;
-	return 0;
-
-}
-
-void timespec_sub(struct timespec *t1, struct timespec *t2)
-{
-	if (timespec_check(t1) < 0) {
-		fprintf(stderr, "invalid time #1: %lld.%.9ld.\n",
-			(long long)t1->tv_sec, t1->tv_nsec);
-		return;
-	}
-	if (timespec_check(t2) < 0) {
-		fprintf(stderr, "invalid time #2: %lld.%.9ld.\n",
-			(long long)t2->tv_sec, t2->tv_nsec);
-		return;
-	}
-	t1->tv_sec -= t2->tv_sec;
-	t1->tv_nsec -= t2->tv_nsec;
-	if (t1->tv_nsec >= 1000000000) {
-		t1->tv_sec++;
-		t1->tv_nsec -= 1000000000;
-	} else if (t1->tv_nsec < 0) {
-		t1->tv_sec--;
-		t1->tv_nsec += 1000000000;
-	}
-}
-
 ssize_t read_to_buffer(char *fname, int fd, char *buffer, uint64_t size,
 			uint64_t base)
 {
@@ -25,6 +25,8 @@
 #include <sys/types.h>
 #include <assert.h>
 
+#include "auxiliary.h"
+
 /*
  * man 2 write:
  * On Linux, write() (and similar system calls) will transfer at most
@@ -45,8 +47,6 @@ uint64_t getopt_integer(char *optarg);
 
 void dump_throughput_result(uint64_t size, float result, float lat_result);
 
-void timespec_sub(struct timespec *t1, struct timespec *t2);
-
 ssize_t read_to_buffer(char *fname, int fd, char *buffer, uint64_t size,
 			uint64_t base);
 
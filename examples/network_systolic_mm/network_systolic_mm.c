@@ -13,15 +13,40 @@
 // 		and at the same time, it will also write a complete signal to the status FIFO
 // 		attached. The host will do polling on this status FIFO. Once, it detects non-
 // 		empty of the FIFO, it will copy the result back to the host memory.
+//
+//    With --num_jobs, the client streams jobs through a pipeline instead: while job N
+//    computes, the operands of job N+1 are fetched over RDMA into the alternate device
+//    buffers and the result of job N-1 is sent back to the server with an RDMA WRITE
+//    straight from device memory.
 //==============================================================================
 
 #include "network_systolic_mm.h"
 #include "reconic.h"
 #include "rdma_api.h"
 #include "rdma_test.h"
+#include "compute_queue.h"
+#include "rdma_cm.h"
 
 #define DEVICE_NAME_DEFAULT "/dev/reconic-mm"
 
+// Number of device buffer sets used by the pipeline mode
+#define PIPELINE_SLOTS 2
+
+// Time the client keeps retrying to reach the server
+#define CONNECT_TIMEOUT_MS 60000
+// Initial SQ PSN of both peers
+#define SQ_PSN 0xabc
+
+// Remote offsets of the server's arrays, sent to the client as private data of the
+// connection in network byte order
+struct mm_conn_priv_t {
+  uint64_t a_offset;
+  uint64_t b_offset;
+  uint64_t c_offset; // results of the pipeline mode, 0 in the serial mode
+  uint32_t num_jobs; // results the region at c_offset has room for
+  uint32_t reserved;
+};
+
 uint8_t server;
 uint8_t client;
 
@@ -71,30 +96,172 @@ void software_mmult(
     int out[DATA_SIZE*DATA_SIZE]  //Output Matrix
 ) {
     //Perform Matrix multiply Out = In1 x In2
-    for (int i = 0; i < DATA_SIZE; i++) {
-        for (int j = 0; j < DATA_SIZE; j++) {
-            for (int k = 0; k < DATA_SIZE; k++) {
-                out[i * DATA_SIZE + j] +=
-                    in1[i * DATA_SIZE + k] * in2[k * DATA_SIZE + j];
-            }
-        }
+    rn_gemm_ref(in1, in2, out, DATA_SIZE, DATA_SIZE, DATA_SIZE);
+}
+
+// Reap RDMA completions of a queue pair until at least target WQEs have completed
+static void wait_rdma_completions(struct rdma_qp_t* qp, uint64_t* completed, uint64_t target) {
+  while(*completed < target) {
+    *completed += rdma_poll_cq(qp, qp->qdepth, NULL);
+  }
+}
+
+// Create an RDMA WQE at the next SQ slot, waiting for a free slot if needed. The WQEs
+// created are posted by rdma_post_send_async().
+static void create_pipeline_wqe(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint64_t* created, 
+                                uint64_t* completed, uint64_t laddr, uint32_t length, 
+                                uint32_t opcode, uint64_t remote_offset) {
+  struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
+
+  // One SQ entry is kept free, see rdma_sq_credits()
+  while((*created - *completed) >= (uint64_t) (qp->qdepth - 1)) {
+    *completed += rdma_poll_cq(qp, qp->qdepth, NULL);
+  }
+  create_a_wqe(rdma_dev, qpid, (uint16_t) *created, (uint32_t) *created, laddr, length, opcode, 
+               remote_offset, R_KEY, 0, 0, 0, 0, 0);
+  (*created)++;
+}
+
+// Client side of the pipeline mode. Each job reads A and B from the server, multiplies 
+// them and writes C back to the server at remote_c + job * matrix size. Jobs alternate
+// between PIPELINE_SLOTS sets of device buffers, so that fetching the operands of the
+// next job and returning the result of the previous job overlap with the computation.
+static int run_pipeline(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t num_jobs, 
+                        uint64_t remote_a, uint64_t remote_b, uint64_t remote_c, 
+                        uint32_t transfer_size, int* sw_results) {
+  struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
+  struct rn_compute_queue_t* cq;
+  struct rdma_buff_t* dev_a[PIPELINE_SLOTS];
+  struct rdma_buff_t* dev_b[PIPELINE_SLOTS];
+  struct rdma_buff_t* dev_c[PIPELINE_SLOTS];
+  uint64_t fetch_seq[PIPELINE_SLOTS];  // WQEs completed once the operands of the slot arrived
+  uint64_t return_seq[PIPELINE_SLOTS]; // WQEs completed once the result of the slot is sent
+  uint64_t created   = 0;
+  uint64_t posted    = 0;
+  uint64_t completed = 0;
+  uint32_t hw_results[DATA_SIZE * DATA_SIZE];
+  ctl_cmd_t ctl_cmd;
+  struct timespec ts_start, ts_end;
+  double total_time;
+  uint32_t i, s;
+  int work_id;
+  int rc = 0;
+
+  for(s=0; s<PIPELINE_SLOTS; s++) {
+    dev_a[s] = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    dev_b[s] = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    dev_c[s] = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    if((dev_a[s] == NULL) || (dev_b[s] == NULL) || (dev_c[s] == NULL)) {
+      fprintf(stderr, "Error: failed to allocate device buffers for the pipeline\n");
+      exit(EXIT_FAILURE);
+    }
+    // The compute control command carries 32-bit array addresses
+    if(((dev_a[s]->dma_addr | dev_b[s]->dma_addr | dev_c[s]->dma_addr) & ~DEVICE_MEM_MASK) >> 32) {
+      fprintf(stderr, "Error: arrays A, B and C must be in the first 4GB of device memory\n");
+      exit(EXIT_FAILURE);
+    }
+    fetch_seq[s]  = 0;
+    return_seq[s] = 0;
+  }
+
+  cq = rn_cq_create((void *)rdma_dev->axil_ctl, PIPELINE_SLOTS);
+  if(cq == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "Info: streaming %d jobs through the pipeline\n", num_jobs);
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+  // Fetch the operands of the first job
+  create_pipeline_wqe(rdma_dev, qpid, &created, &completed, dev_a[0]->dma_addr, transfer_size, RNIC_OP_READ, remote_a);
+  create_pipeline_wqe(rdma_dev, qpid, &created, &completed, dev_b[0]->dma_addr, transfer_size, RNIC_OP_READ, remote_b);
+  if(rdma_post_send_async(rdma_dev, qpid, (uint32_t) (created - posted)) < 0) {
+    rc = -1;
+    goto out;
+  }
+  posted = created;
+  fetch_seq[0] = posted;
+
+  for(i=0; i<num_jobs; i++) {
+    s = i % PIPELINE_SLOTS;
+
+    // Operands of this job are in place and the result of job i-PIPELINE_SLOTS is sent
+    wait_rdma_completions(qp, &completed, (fetch_seq[s] > return_seq[s]) ? fetch_seq[s] : return_seq[s]);
+
+    gen_ctl_cmd(&ctl_cmd, (uint32_t) dev_a[s]->dma_addr, (uint32_t) dev_b[s]->dma_addr, (uint32_t) dev_c[s]->dma_addr, 6, DATA_SIZE, DATA_SIZE, DATA_SIZE, 0);
+    work_id = rn_cq_submit(cq, &ctl_cmd, NULL);
+    if(work_id < 0) {
+      fprintf(stderr, "Error: failed to submit job %d to the accelerator\n", i);
+      rc = -1;
+      goto out;
+    }
+
+    // Fetch the operands of the next job while this one computes. The A and B buffers of
+    // the other slot were consumed by job i-1, which has completed.
+    if(i + 1 < num_jobs) {
+      create_pipeline_wqe(rdma_dev, qpid, &created, &completed, dev_a[s ^ 1]->dma_addr, transfer_size, RNIC_OP_READ, remote_a);
+      create_pipeline_wqe(rdma_dev, qpid, &created, &completed, dev_b[s ^ 1]->dma_addr, transfer_size, RNIC_OP_READ, remote_b);
+      if(rdma_post_send_async(rdma_dev, qpid, (uint32_t) (created - posted)) < 0) {
+        rc = -1;
+        goto out;
+      }
+      posted = created;
+      fetch_seq[s ^ 1] = posted;
+    }
+
+    if(rn_cq_wait(cq, (uint32_t) work_id, NULL, NULL) < 0) {
+      fprintf(stderr, "Error: job %d did not complete\n", i);
+      rc = -1;
+      goto out;
+    }
+
+    // Return the result straight from device memory
+    create_pipeline_wqe(rdma_dev, qpid, &created, &completed, dev_c[s]->dma_addr, transfer_size, RNIC_OP_WRITE, remote_c + (uint64_t) i * transfer_size);
+    if(rdma_post_send_async(rdma_dev, qpid, (uint32_t) (created - posted)) < 0) {
+      rc = -1;
+      goto out;
+    }
+    posted = created;
+    return_seq[s] = posted;
+  }
+
+  wait_rdma_completions(qp, &completed, posted);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  timespec_sub(&ts_end, &ts_start);
+  total_time = (ts_end.tv_sec + ((double)ts_end.tv_nsec/NSEC_DIV));
+  fprintf(stderr, "** Pipeline: %d jobs in %f sec, %f jobs/sec, size = %d\n", num_jobs, total_time, num_jobs / total_time, DATA_SIZE);
+
+  // The last result is still in device memory, check it locally
+  s = (num_jobs - 1) % PIPELINE_SLOTS;
+  if(read_to_buffer(device, fpga_fd, (char*) hw_results, transfer_size, dev_c[s]->dma_addr) < 0) {
+    rc = -1;
+    goto out;
+  }
+  for(i=0; i<DATA_SIZE * DATA_SIZE; i++) {
+    if(hw_results[i] != sw_results[i]) {
+      fprintf(stderr, "Error: Result mismatch, i = %d, CPU result = %d, Hardware result = %d\n", i, sw_results[i], hw_results[i]);
+      rc = -1;
+      break;
     }
+  }
+
+out:
+  rn_cq_destroy(cq);
+  for(s=0; s<PIPELINE_SLOTS; s++) {
+    free_rdma_buffer(dev_a[s]);
+    free_rdma_buffer(dev_b[s]);
+    free_rdma_buffer(dev_c[s]);
+  }
+  return rc;
 }
 
 int main(int argc, char *argv[])
 {
   int sockfd;
-  int accepted_sockfd;
-  struct sockaddr_in server_addr;
-  struct sockaddr_in client_addr;
-  socklen_t addr_size;
-  char command[64];
-  FILE *dst_mac_fp;
-  char *line = NULL;
-  size_t len = 0;
-  char *tmp_mac_addr_ptr = NULL;
-  char tmp_mac_addr_str[18] = "";
-  ssize_t command_read;
+  int listen_fd;
+  struct rdma_cm_conn_t* conn = NULL;
+  struct mm_conn_priv_t conn_priv;
 
   int cmd_opt;
   device = DEVICE_NAME_DEFAULT;
@@ -116,10 +283,9 @@ int main(int argc, char *argv[])
   struct timespec ts_start, ts_end;
 
   int   pcie_resource_fd;
-  char  val = 0;
 
   struct rdma_buff_t* cidb_buffer;
-  struct rdma_buff_t* tmp_buffer;
+  struct rdma_buff_t* tmp_buffer = NULL;
   struct rdma_buff_t* mr_bufferA = malloc(sizeof(struct rdma_buff_t));
   struct rdma_buff_t* mr_bufferB = malloc(sizeof(struct rdma_buff_t));
   struct rdma_buff_t* device_bufferA;
@@ -135,10 +301,7 @@ int main(int argc, char *argv[])
   struct rdma_buff_t* err_buf;
   struct rdma_buff_t* resp_err_pkt_buf;
 
-  uint32_t rq_psn = 0xabc;
-  uint32_t sq_psn = 0xabc + 1;
   uint32_t qpid;
-  uint32_t dst_qpid;
   uint32_t qdepth;
   uint16_t wrid;
   uint32_t wqe_idx;
@@ -146,9 +309,12 @@ int main(int argc, char *argv[])
 
   uint64_t read_A_offset;
   uint64_t read_B_offset;
+  uint64_t write_C_offset;
+  uint32_t num_jobs = 0;
+  uint64_t mr_size = 0;
+  uint32_t* result_data;
   int      ret_val;
 
-  uint64_t read_offset;
   uint32_t* matrix_data;
 
   server = 0;
@@ -164,7 +330,7 @@ int main(int argc, char *argv[])
 
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
-  while ((cmd_opt = getopt_long(argc, argv, "d:p:r:i:u:t:q:z:l:scgh", \
+  while ((cmd_opt = getopt_long(argc, argv, "d:p:r:i:u:t:q:z:l:n:scgh", \
           long_opts, NULL)) != -1) {
     switch (cmd_opt) {
     case 'd':
@@ -186,33 +352,6 @@ int main(int argc, char *argv[])
       dst_ip = convert_ip_addr_to_uint(optarg);
       strcpy(dst_ip_str, optarg);
       fprintf(stderr, "dst_ip_str = %s\n", (char*) dst_ip_str);
-      sprintf(command, "arp -a %s", dst_ip_str);
-      dst_mac_fp = popen(command, "r");
-      if(dst_mac_fp == NULL) {
-        perror("Error: popen\n");
-        exit(EXIT_FAILURE);
-      }
-
-      while((command_read = getline(&line, &len, dst_mac_fp)) != -1) {
-        // Check if we find an entry
-        if (strstr(line, "no match found") != NULL) {
-          fprintf(stderr, "Error: No arp cache entry for the IP (%s). Please use \"arping | ping -c 1 %s\" to create the cache entry", dst_ip_str, dst_ip_str);
-          exit(0);
-        }
-
-        if (strstr(line, "at") != NULL) {
-          // Get the MAC address from the line
-          tmp_mac_addr_ptr = strstr(line, "at")+3;
-          strncpy(tmp_mac_addr_str, tmp_mac_addr_ptr, 17);
-          dst_mac = convert_mac_addr_str_to_uint(tmp_mac_addr_str);
-          break;
-        }
-      }
-
-      pclose(dst_mac_fp);
-      free(line);
-
-      break;
     case 'u':
       udp_sport = (uint16_t) atoi(optarg);
       break;
@@ -234,6 +373,9 @@ int main(int argc, char *argv[])
         exit(0);
       }
       break;
+    case 'n':
+      num_jobs = (uint32_t) atoi(optarg);
+      break;
     case 's':
       server = 1;
       client = 0;
@@ -256,6 +398,7 @@ int main(int argc, char *argv[])
   }
 
   src_mac = get_mac_addr_from_str_ip(sockfd, src_ip_str);
+  close(sockfd);
 
   /*
    * 1. Create an RecoNIC device instance
@@ -303,7 +446,6 @@ int main(int argc, char *argv[])
 
   qdepth = 64;
   qpid   = 2;
-  //sq_psn = 0xabc;
 
   fprintf(stderr, "Info: OPEN DEVICE FILE\n");
   // Open the character device, reconic-mm, for data communication between host and device memory
@@ -315,25 +457,6 @@ int main(int argc, char *argv[])
     return -EINVAL;
   }
 
-  /*
-   * 6. Allocate a queue pair
-   */
-  fprintf(stderr, "Info: ALLOCATE RDMA QP\n");
-  // Allocate SQ, CQ and RQ: (num_qp * qdepth * entry_size)
-  //  --  32KB SQ (8 SQs, each has 4KB and can accommodate 64 WQEs)
-  //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
-  //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
-  // All SQ, CQ and RQ resources can be used for a single QP.
-    //struct rdma_qp_t* qp =
-  allocate_rdma_qp(rdma_dev, qpid, dst_qpid, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, &dst_mac, dst_ip, P_KEY, R_KEY);
-
-  /*
-   * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
-   */
-  fprintf(stderr, "Info: CONFIGURE PSN\n");
-  config_last_rq_psn(rdma_dev, qpid, rq_psn);
-  config_sq_psn(rdma_dev, qpid, sq_psn);
-
   fprintf(stderr, "Info: generating matrix data, matrix_size = %ld\n", matrix_size);
   matrix_data = (uint32_t* ) malloc(matrix_size * sizeof(uint32_t));
   if(matrix_data != NULL)
@@ -347,51 +470,137 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Error: matrix_data Memory allocation failed\n");
   }
 
-  if(client) {
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port   = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr(dst_ip_str);
+  if(server) {
+    // A and B, followed by the results written back by the client in the pipeline mode
+    mr_size = (uint64_t) (2 + num_jobs) * (matrix_size << 2);
+    mr_size = (mr_size < 4096) ? 4096 : mr_size;
+    tmp_buffer = allocate_rdma_buffer(rn_dev, mr_size, /*qp_location*/"dev_mem");
+    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
+    fprintf(stderr, "Info: allocating buffer for array A\n");
+    mr_bufferA->buffer   = tmp_buffer->buffer;
+    mr_bufferA->dma_addr = tmp_buffer->dma_addr;
+    fprintf(stderr, "Info: mr_bufferA->buffer = %p, mr_bufferA->dma_addr = 0x%lx\n", (uint64_t *) mr_bufferA->buffer, mr_bufferA->dma_addr);
+    fprintf(stderr, "Info: allocating buffer for array B\n");
+    mr_bufferB->buffer   = (void *) ((uint64_t) tmp_buffer->buffer + ((uint64_t) (matrix_size << 2)));
+    mr_bufferB->dma_addr = tmp_buffer->dma_addr + ((uint64_t) (matrix_size << 2));
+    fprintf(stderr, "Info: mr_bufferB->buffer = %p, mr_bufferB->dma_addr = 0x%lx\n", (uint64_t *) mr_bufferB->buffer, mr_bufferB->dma_addr);
 
-    fprintf(stderr, "Info: Client is connecting to a remote server\n");
-    connect(sockfd, (struct sockaddr* )&server_addr, sizeof(server_addr));
+    if(is_device_address(tmp_buffer->dma_addr)) {
+      // Device memory address
+      fprintf(stderr, "Info: copy matrix data to the device memory\n");
+      rc1 = write_from_buffer(device, fpga_fd, (char* ) matrix_data, (uint32_t)(matrix_size*4), mr_bufferA->dma_addr);
+      rc2 = write_from_buffer(device, fpga_fd, (char* ) matrix_data, (uint32_t)(matrix_size*4), mr_bufferB->dma_addr);
+      if (rc1 < 0 || rc2 < 0){
+        goto out;
+        fprintf(stderr, "Info: copied matrix data to the device memory succesfully\n");
+      }
+    } else {
+      // Host memory address
+      fprintf(stderr, "Info: Initialize matrix data on the host memory\n");
+      for (size_t i = 0; i < matrix_size; i++) {
+        *((uint32_t* )(mr_bufferA->buffer) + i) = i % 10;
+        *((uint32_t* )(mr_bufferB->buffer) + i) = i % 10;
+    }
+   }
 
-    fprintf(stderr, "Info: Client is connected to a remote server\n");
+    fprintf(stderr, "Info: Host buffer vir address used for RDMA read operation is mr_bufferA = %p, mr_bufferB = %p\n", (uint64_t *) mr_bufferA->buffer, (uint64_t *) mr_bufferB->buffer);
+  }
 
-    // get remote virtual address from the server for a RDMA read operation
-    rc = read(sockfd, &read_A_offset, sizeof(read_A_offset));
+  /*
+   * 6. Connect a queue pair with the client. The server exposes A and B, and the region
+   *    the pipeline mode writes the results to; their offsets are sent as private data.
+   */
+  fprintf(stderr, "Info: CONNECT RDMA QP\n");
+  // Allocate SQ, CQ and RQ: (num_qp * qdepth * entry_size)
+  //  --  32KB SQ (8 SQs, each has 4KB and can accommodate 64 WQEs)
+  //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
+  //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
+  // All SQ, CQ and RQ resources can be used for a single QP.
+  conn = rdma_cm_create(1);
+  if(conn == NULL) {
+    goto out;
+  }
+  rdma_cm_set_local_qp(conn, 0, qpid, SQ_PSN, R_KEY, server ? (uint64_t) tmp_buffer->buffer : 0, 
+                       mr_size);
+  if(server) {
+    conn_priv.a_offset = htonll((uint64_t) mr_bufferA->buffer);
+    conn_priv.b_offset = htonll((uint64_t) mr_bufferB->buffer);
+    conn_priv.c_offset = htonll((num_jobs > 0) ? ((uint64_t) tmp_buffer->buffer + ((uint64_t) (matrix_size << 3))) : 0);
+    conn_priv.num_jobs = htonl(num_jobs);
+    conn_priv.reserved = 0;
+    rdma_cm_set_private_data(conn, &conn_priv, sizeof(conn_priv));
 
-    if(rc > 0) {
-      fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", ntohll(read_A_offset));
-    } else {
-      fprintf(stderr, "Error: Can't receive remote offset of A from the remote peer\n");
-      close(sockfd);
-      return -1;
+    fprintf(stderr, "Info: Server is listening to a remote peer\n");
+    listen_fd = rdma_cm_listen(src_ip_str, tcp_sport);
+    if(listen_fd < 0) {
+      goto out;
     }
+    rc = rdma_cm_accept(conn, listen_fd);
+    close(listen_fd);
+  } else {
+    fprintf(stderr, "Info: Client is connecting to a remote server\n");
+    rc = rdma_cm_connect(conn, dst_ip_str, tcp_sport, CONNECT_TIMEOUT_MS);
+  }
+  if((rc < 0) || (rdma_cm_exchange(conn, rdma_dev) < 0) || 
+     (rdma_cm_bring_up(conn, rdma_dev, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, P_KEY) < 0)) {
+    fprintf(stderr, "Error: failed to connect QP%d with the remote peer\n", qpid);
+    goto out;
+  }
 
-    read_A_offset = ntohll(read_A_offset);
+  if(client) {
+    if(conn->remote_priv_len != sizeof(conn_priv)) {
+      fprintf(stderr, "Error: the server sent %d bytes of private data instead of %ld\n", conn->remote_priv_len, sizeof(conn_priv));
+      goto out;
+    }
+    memcpy(&conn_priv, conn->remote_priv, sizeof(conn_priv));
+    read_A_offset  = ntohll(conn_priv.a_offset);
+    read_B_offset  = ntohll(conn_priv.b_offset);
+    write_C_offset = ntohll(conn_priv.c_offset);
+    fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", read_A_offset);
+    fprintf(stderr, "Info: client received remote offset of B = 0x%lx\n", read_B_offset);
+
+    if(num_jobs > 0) {
+      // The results are written past the end of the server's region otherwise
+      if((write_C_offset == 0) || (num_jobs > ntohl(conn_priv.num_jobs))) {
+        fprintf(stderr, "Error: the server has room for the results of %d jobs, %d requested\n", ntohl(conn_priv.num_jobs), num_jobs);
+        goto out;
+      }
+      fprintf(stderr, "Info: client received remote offset of C = 0x%lx\n", write_C_offset);
 
-    rc = read(sockfd, &read_B_offset, sizeof(read_B_offset));
+      for (int i = 0; i < matrix_size; i++) {
+        source_in1[i] = i % 10;
+        source_in2[i] = i % 10;
+        source_sw_results[i] = 0;
+      }
+      software_mmult(source_in1, source_in2, source_sw_results);
 
-    if(rc > 0) {
-      fprintf(stderr, "Info: client received remote offset of B = 0x%lx\n", ntohll(read_B_offset));
-    } else {
-      fprintf(stderr, "Error: Can't receive remote offset of B from the remote peer\n");
-      close(sockfd);
-      return -1;
+      rc = run_pipeline(rdma_dev, qpid, num_jobs, read_A_offset, read_B_offset, write_C_offset, 
+                        matrix_size * 4, source_sw_results);
+      fprintf(stderr, (rc < 0) ? "Test failed!\n" : "Test passed!\n");
     }
+  }
 
-    read_B_offset = ntohll(read_B_offset);
-
+  // Serial mode: a single job, one phase after the other
+  if(client && (num_jobs == 0)) {
     wqe_idx   = 0;
     wrid      = 0;
     transfer_size = matrix_size * 4;
 
     fprintf(stderr, "Info: creating an RDMA read WQE for getting Array A\n");
 
-    device_bufferA = allocate_rdma_buffer(rn_dev, (uint64_t) transfer_size, "dev_mem");
-    device_bufferB = allocate_rdma_buffer(rn_dev, (uint64_t) transfer_size, "dev_mem");
-    device_bufferC = allocate_rdma_buffer(rn_dev, (uint64_t) transfer_size, "dev_mem");
+    // Place A, B and C on different DDR channels when the design has several
+    device_bufferA = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    device_bufferB = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    device_bufferC = allocate_rdma_dev_buffer(rn_dev, (uint64_t) transfer_size, RN_DEV_PLACE_SPREAD);
+    if((device_bufferA == NULL) || (device_bufferB == NULL) || (device_bufferC == NULL)) {
+      fprintf(stderr, "Error: failed to allocate device buffers for arrays A, B and C\n");
+      exit(EXIT_FAILURE);
+    }
+    // The compute control command carries 32-bit array addresses
+    if(((device_bufferA->dma_addr | device_bufferB->dma_addr | device_bufferC->dma_addr) & ~DEVICE_MEM_MASK) >> 32) {
+      fprintf(stderr, "Error: arrays A, B and C must be in the first 4GB of device memory\n");
+      exit(EXIT_FAILURE);
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
@@ -487,94 +696,66 @@ int main(int argc, char *argv[])
     }
   }
 
-  if(server) {
-    // Connect to the remote peer via TCP/IP
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr((char *) src_ip_str);
-
-    bind(sockfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
-
-    fprintf(stderr, "Info: Server is listening to a remote peer\n");
-    listen(sockfd, LISTENQ);
+  if(client) {
+    // Tell the server that its arrays are no longer accessed
+    rdma_cm_sync(conn);
+  }
 
-    addr_size = sizeof(client_addr);
-    accepted_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &addr_size);
+  if(server) {
+    fprintf(stderr, "Info: Server is waiting for the client to finish its RDMA operations\n");
+    if(rdma_cm_sync(conn) < 0) {
+      fprintf(stderr, "Error: lost the connection with the client\n");
+      goto out;
+    }
 
-    fprintf(stderr, "Info: Server is connected to a remote peer\n");
+    dump_registers(rn_dev->rdma_dev, 0, qpid);
 
-    tmp_buffer = allocate_rdma_buffer(rn_dev, 4096, /*qp_location*/"dev_mem");
-    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
-    fprintf(stderr, "Info: allocating buffer for array A\n");
-    mr_bufferA->buffer   = tmp_buffer->buffer;
-    mr_bufferA->dma_addr = tmp_buffer->dma_addr;
-    fprintf(stderr, "Info: mr_bufferA->buffer = %p, mr_bufferA->dma_addr = 0x%lx\n", (uint64_t *) mr_bufferA->buffer, mr_bufferA->dma_addr);
-    fprintf(stderr, "Info: allocating buffer for array B\n");
-    mr_bufferB->buffer   = (void *) ((uint64_t) tmp_buffer->buffer + ((uint64_t) (matrix_size << 2)));
-    mr_bufferB->dma_addr = tmp_buffer->dma_addr + ((uint64_t) (matrix_size << 2));
-    fprintf(stderr, "Info: mr_bufferB->buffer = %p, mr_bufferB->dma_addr = 0x%lx\n", (uint64_t *) mr_bufferB->buffer, mr_bufferB->dma_addr);
+    if(num_jobs > 0) {
+      // Check the results written back by the client
+      for (int i = 0; i < matrix_size; i++) {
+        source_in1[i] = i % 10;
+        source_in2[i] = i % 10;
+        source_sw_results[i] = 0;
+      }
+      software_mmult(source_in1, source_in2, source_sw_results);
 
-    if(is_device_address(tmp_buffer->dma_addr)) {
-      // Device memory address
-      fprintf(stderr, "Info: copy matrix data to the device memory\n");
-      rc1 = write_from_buffer(device, fpga_fd, (char* ) matrix_data, (uint32_t)(matrix_size*4), mr_bufferA->dma_addr);
-      rc2 = write_from_buffer(device, fpga_fd, (char* ) matrix_data, (uint32_t)(matrix_size*4), mr_bufferB->dma_addr);
-      if (rc1 < 0 || rc2 < 0){
+      result_data = (uint32_t* ) malloc((uint64_t) num_jobs * (matrix_size << 2));
+      if(result_data == NULL) {
+        fprintf(stderr, "Error: result_data Memory allocation failed\n");
         goto out;
-        fprintf(stderr, "Info: copied matrix data to the device memory succesfully\n");
       }
-    } else {
-      // Host memory address
-      fprintf(stderr, "Info: Initialize matrix data on the host memory\n");
-      for (size_t i = 0; i < matrix_size; i++) {
-        *((uint32_t* )(mr_bufferA->buffer) + i) = i % 10;
-        *((uint32_t* )(mr_bufferB->buffer) + i) = i % 10;
-    }
-   }
-
-    fprintf(stderr, "Info: Host buffer vir address used for RDMA read operation is mr_bufferA = %p, mr_bufferB = %p\n", (uint64_t *) mr_bufferA->buffer, (uint64_t *) mr_bufferB->buffer);
-
-    read_offset = htonll((uint64_t) mr_bufferA->buffer);
-    write(accepted_sockfd, &read_offset, sizeof(uint64_t));
-    fprintf(stderr, "Sending read_offsetA (%lx) to the remote client\n", ntohll(read_offset));
-
-    read_offset = htonll((uint64_t) mr_bufferB->buffer);
-    write(accepted_sockfd, &read_offset, sizeof(uint64_t));
-    fprintf(stderr, "Sending read_offsetB (%lx) to the remote client\n", ntohll(read_offset));
-
-    // Does the client finish its RDMA operation?
-    fprintf(stderr, "Does the client finish its RDMA read operation? If yes, please press any key\n");
-
-    while(val != '\r' && val != '\n') {
-      val = getchar();
-    }
-    fprintf(stderr, "\n");
-
-    dump_registers(rn_dev->rdma_dev, 0, qpid);
+      if(is_device_address(tmp_buffer->dma_addr)) {
+        rc = read_to_buffer(device, fpga_fd, (char* ) result_data, (uint64_t) num_jobs * (matrix_size << 2), tmp_buffer->dma_addr + ((uint64_t) (matrix_size << 3)));
+      } else {
+        memcpy(result_data, (void *) ((uint64_t) tmp_buffer->buffer + ((uint64_t) (matrix_size << 3))), (uint64_t) num_jobs * (matrix_size << 2));
+        rc = 0;
+      }
 
-    if(shutdown(accepted_sockfd, SHUT_RDWR) < 0){
-      fprintf(stderr, "accepted_sockfd shutdown failed\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
+      for (uint32_t j = 0; (rc >= 0) && (j < num_jobs); j++) {
+        for (int i = 0; i < matrix_size; i++) {
+          if (result_data[j * matrix_size + i] != source_sw_results[i]) {
+            fprintf(stderr, "Error: Result mismatch, job = %d, i = %d, CPU result = %d, Hardware result = %d\n", j, i, source_sw_results[i], result_data[j * matrix_size + i]);
+            rc = -1;
+            break;
+          }
+        }
+      }
+      fprintf(stderr, (rc < 0) ? "Test failed!\n" : "Test passed!\n");
+      free(result_data);
     }
-    close(accepted_sockfd);
   }
 
-  if(shutdown(sockfd, SHUT_RDWR) < 0){
-    fprintf(stderr, "sockfd shutdown failed\n");
-    fprintf(stderr, "Error: %s\n", strerror(errno));
-  }
-  close(sockfd);
-
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(matrix_data);
   close(fpga_fd);
   close(pcie_resource_fd);
   destroy_rn_dev(rn_dev);
+  // The QP keeps a pointer to the peer MAC address of the connection
+  rdma_cm_destroy(conn);
   return 0;
 }
@@ -37,6 +37,7 @@ static struct option const long_opts[] = {
 	{"dst_qp"        , required_argument, NULL, 'q'},
 	{"payload_size"  , required_argument, NULL, 'z'},
 	{"qp_location"   , required_argument, NULL, 'l'},
+	{"num_jobs"      , required_argument, NULL, 'n'},
 	{"server"        , no_argument      , NULL, 's'},
 	{"client"        , no_argument      , NULL, 'c'},
   {"debug"         , no_argument      , NULL, 'g'},
@@ -76,6 +77,9 @@ static void usage(const char *name)
 	fprintf(stdout, "  -%c (--%s) QP/mem-registered buffers' location: [host_mem | dev_mem] \n",
 		long_opts[i].val, long_opts[i].name);
 	i++;
+	fprintf(stdout, "  -%c (--%s) Number of jobs streamed through the fetch-compute-return pipeline, 0 runs a single serial job (defaults to 0)\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
 	fprintf(stdout, "  -%c (--%s) Server node \n",
 		long_opts[i].val, long_opts[i].name);
 	i++;
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "rdma_cm.h"
 
 #define DEVICE_NAME_DEFAULT "/dev/reconic-mm"
 
@@ -18,6 +19,12 @@
 
 #define LISTENQ 8
 
+// Time the client keeps retrying to reach the server
+#define CONNECT_TIMEOUT_MS 60000
+
+// Initial SQ PSN of the test QP on both nodes
+#define SQ_PSN 0xabc
+
 #define QP_LOCATION_DEFAULT HOST_MEM
 
 // Hardcoded some of the configurations
@@ -92,4 +99,45 @@ static void usage(const char *name)
 	i++;
 	fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
 		long_opts[i].val, long_opts[i].name);
-}
\ No newline at end of file
+}
+
+// Bring up one QP with the peer through the connection manager. The server listens on
+// src_ip_str and the client connects to dst_ip_str. Each side exposes buf_size bytes at
+// buf_offset under R_KEY, 0 if it exposes no buffer. QP IDs, PSNs, remote keys, buffer 
+// offsets and MAC and IP addresses are exchanged in one round trip.
+static inline struct rdma_cm_conn_t* connect_test_qp(struct rdma_dev_t* rdma_dev, struct rdma_pd_t* rdma_pd, 
+                                                    uint32_t qpid, uint64_t buf_offset, uint64_t buf_size, 
+                                                    uint64_t cq_cidb_addr, uint64_t rq_cidb_addr, 
+                                                    uint32_t qdepth, char* qp_location, uint8_t is_server,
+                                                    char* src_ip_str, char* dst_ip_str, uint16_t tcp_sport)
+{
+  struct rdma_cm_conn_t* conn;
+  int listen_fd;
+  int rc;
+
+  conn = rdma_cm_create(1);
+  if(conn == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  rdma_cm_set_local_qp(conn, 0, qpid, SQ_PSN, R_KEY, buf_offset, buf_size);
+
+  if(is_server) {
+    fprintf(stderr, "Info: Server is waiting for the client\n");
+    listen_fd = rdma_cm_listen(src_ip_str, tcp_sport);
+    rc = (listen_fd < 0) ? -1 : rdma_cm_accept(conn, listen_fd);
+    if(listen_fd >= 0) {
+      close(listen_fd);
+    }
+  } else {
+    fprintf(stderr, "Info: Client is connecting to %s\n", dst_ip_str);
+    rc = rdma_cm_connect(conn, dst_ip_str, tcp_sport, CONNECT_TIMEOUT_MS);
+  }
+
+  if((rc < 0) || (rdma_cm_exchange(conn, rdma_dev) < 0) ||
+     (rdma_cm_bring_up(conn, rdma_dev, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, 
+                       qp_location, P_KEY) < 0)) {
+    fprintf(stderr, "Error: failed to connect QP%d with the peer\n", qpid);
+    exit(EXIT_FAILURE);
+  }
+  return conn;
+}
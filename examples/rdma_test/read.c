@@ -63,20 +63,10 @@ struct rn_dev_t* rn_dev;
 int main(int argc, char *argv[])
 {
   // --- 变量声明 ---
-  // 网络编程相关变量 (用于带外TCP元数据交换)
+  // 网络编程相关变量 (用于查询本机MAC地址)
   int sockfd;
-  int accepted_sockfd;
-  struct sockaddr_in server_addr;
-  struct sockaddr_in client_addr;
-  socklen_t addr_size;
-   // 用于执行arp命令的辅助变量
-  char command[64];
-  FILE *dst_mac_fp;
-  char *line = NULL;
-  size_t len = 0;
-  char *tmp_mac_addr_ptr = NULL;
-  char tmp_mac_addr_str[18] = "";
-  ssize_t command_read;
+  // 与远端交换QP信息的连接
+  struct rdma_cm_conn_t* conn = NULL;
 
   // 命令行参数解析相关变量
   int cmd_opt;
@@ -93,11 +83,10 @@ int main(int argc, char *argv[])
   //payload size in bytes
   uint32_t payload_size = 4;  // RDMA操作的数据负载大小
   int   pcie_resource_fd;     // PCIe资源文件的文件描述符
-  char  val = 0;              // 用于getchar()
 
    // RDMA缓冲区指针
   struct rdma_buff_t* cidb_buffer;  // 用于CQ/RQ doorbell的缓冲区
-  struct rdma_buff_t* tmp_buffer;   // 通用临时缓冲区
+  struct rdma_buff_t* tmp_buffer = NULL;   // 通用临时缓冲区
   struct rdma_buff_t* device_buffer;  // 客户端用于接收数据的缓冲区
 
   uint64_t cq_cidb_addr;
@@ -113,22 +102,20 @@ int main(int argc, char *argv[])
   struct rdma_buff_t* resp_err_pkt_buf;
 
   // RDMA QP相关参数
-  uint32_t rq_psn = 0xabc;     // 接收队列的包序列号
-  uint32_t sq_psn = 0xabc + 1; // 发送队列的包序列号
   uint32_t qpid;               // 本地QP ID
-  uint32_t dst_qpid;           // 目标QP ID
   uint32_t qdepth;             // 队列深度
   uint16_t wrid;               // 工作请求ID
   uint32_t wqe_idx;            // 工作队列项索引
   //uint32_t transfer_size;
 
-  // 用于在客户端和服务器之间传递远程内存地址的变量
+  // 服务器通过连接管理器公布的远程内存地址和远程密钥
   uint64_t read_A_offset;
+  uint32_t read_A_key;
   int      ret_val;
 
-  uint64_t read_offset;
   // 用于数据验证的本地缓冲区
   uint32_t* sw_golden;
+  int64_t mismatch;
   ssize_t rc;
 
   // --- 初始化 ---
@@ -137,7 +124,7 @@ int main(int argc, char *argv[])
   client = 0;
   dst_qpid = 2;
   
-  // 创建一个TCP socket，用于后续客户端和服务器之间的元数据交换
+  // 创建一个socket，用于查询本机的MAC地址
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
   // --- 1. 命令行参数解析 ---
@@ -176,37 +163,10 @@ int main(int argc, char *argv[])
       fprintf(stderr, "src_ip_str = %s\n", (char*) src_ip_str);
       break;
     case 'i':
-      // 获取目标IP后，立即通过执行"arp -a"命令来获取目标MAC地址。
-      // 这是RoCEv2通信的必要前提，因为需要二层MAC地址来构建以太网帧。
+      // 目标MAC地址和QP ID由连接管理器与服务器交换获得
       dst_ip = convert_ip_addr_to_uint(optarg);
       strcpy(dst_ip_str, optarg);
       fprintf(stderr, "dst_ip_str = %s\n", (char*) dst_ip_str);
-      sprintf(command, "arp -a %s", dst_ip_str);
-      dst_mac_fp = popen(command, "r");
-      if(dst_mac_fp == NULL) {
-        perror("Error: popen\n");
-        exit(EXIT_FAILURE);
-      }
-
-      while((command_read = getline(&line, &len, dst_mac_fp)) != -1) {
-        // Check if we find an entry
-        if (strstr(line, "no match found") != NULL) {
-          fprintf(stderr, "Error: No arp cache entry for the IP (%s). Please use \"arping | ping -c 1 %s\" to create the cache entry", dst_ip_str, dst_ip_str);
-          exit(0);
-        }
-
-        if (strstr(line, "at") != NULL) {
-          // Get the MAC address from the line
-          tmp_mac_addr_ptr = strstr(line, "at")+3;
-          strncpy(tmp_mac_addr_str, tmp_mac_addr_ptr, 17);
-          dst_mac = convert_mac_addr_str_to_uint(tmp_mac_addr_str);
-          break;
-        }
-      }
-
-      pclose(dst_mac_fp);
-      free(line);
-
       break;
     case 'u':
       udp_sport = (uint16_t) atoi(optarg);
@@ -255,6 +215,7 @@ int main(int argc, char *argv[])
   // (这是最可能出现问题的地方)
   // 2.1 获取本机的源MAC地址
   src_mac = get_mac_addr_from_str_ip(sockfd, src_ip_str);
+  close(sockfd);
 
   /* 
    * 1. Create an RecoNIC device instance
@@ -314,32 +275,43 @@ int main(int argc, char *argv[])
     return -EINVAL;
   }
 
-  /* 
-   * 6. Allocate a queue pair
-   */
-  fprintf(stderr, "Info: ALLOCATE RDMA QP\n");
-  // Allocate SQ, CQ and RQ: (num_qp * qdepth * entry_size)
-  //  --  32KB SQ (8 SQs, each has 4KB and can accommodate 64 WQEs)
-  //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
-  //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
-  // All SQ, CQ and RQ resources can be used for a single QP.
-    //struct rdma_qp_t* qp = 
-  allocate_rdma_qp(rdma_dev, qpid, dst_qpid, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, &dst_mac, dst_ip, P_KEY, R_KEY);
-
-  /* 
-   * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
-   */
-  fprintf(stderr, "Info: CONFIGURE PSN\n");
-  config_last_rq_psn(rdma_dev, qpid, rq_psn);
-  config_sq_psn(rdma_dev, qpid, sq_psn);
-
   // Get golden data for verification
   fprintf(stderr, "payload_size = %d, payload_size>>2 = %d\n", payload_size, payload_size>>2);
   sw_golden = (uint32_t* ) malloc(payload_size);
-  for (uint32_t i = 0; i < payload_size>>2; i++) {
-    sw_golden[i] = i % 10;
+  rn_fill_mod32(sw_golden, payload_size>>2, 10);
+
+  if(server) {
+    // 在FPGA设备内存上分配数据缓冲区
+    tmp_buffer = allocate_rdma_buffer(rn_dev, payload_size, /*qp_location*/"dev_mem");
+    // 注册该内存区域，使其能被远程访问
+    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
+    fprintf(stderr, "Info: allocating buffer for payload data\n");
+    fprintf(stderr, "Info: tmp_buffer->buffer = %p, tmp_buffer->dma_addr = 0x%lx\n", (uint64_t *) tmp_buffer->buffer, tmp_buffer->dma_addr);
+
+    // 判断数据缓冲区是否在设备内存上
+    if(is_device_address(tmp_buffer->dma_addr)) {
+      // 将黄金标准数据从主机内存DMA写入到FPGA设备内存
+      fprintf(stderr, "Info: copy payload data to the device memory\n");
+      rc = write_from_buffer(device, fpga_fd, (char* ) sw_golden, (uint32_t)(payload_size), tmp_buffer->dma_addr);
+      fprintf(stderr, "Info: copied payload data to the device memory succesfully rc = %ld\n", rc);
+      if (rc < 0){
+        goto out;
+      }
+    } else {
+      // 如果缓冲区在主机内存，则直接写入
+      fprintf(stderr, "Info: Initialize payload data on the host memory\n");
+      rn_fill_mod32((uint32_t* ) tmp_buffer->buffer, payload_size>>2, 10);
+    }
   }
 
+  /* 
+   * 6. Connect a queue pair with the peer. The server exposes the payload buffer,
+   *    the client reads it with its remote offset and key.
+   */
+  fprintf(stderr, "Info: CONNECT RDMA QP\n");
+  conn = connect_test_qp(rdma_dev, rdma_pd, qpid, server ? (uint64_t) tmp_buffer->buffer : 0, 
+                         server ? payload_size : 0, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, 
+                         server, src_ip_str, dst_ip_str, tcp_sport);
 
   if(client) {
 
@@ -350,27 +322,9 @@ int main(int argc, char *argv[])
     
     uint32_t* recv_tmp = malloc(buf_size);
 
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port   = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr(dst_ip_str);
-
-    fprintf(stderr, "Info: Client is connecting to a remote server\n");
-    connect(sockfd, (struct sockaddr* )&server_addr, sizeof(server_addr));
-
-    fprintf(stderr, "Info: Client is connected to a remote server\n");
-
-    rc = read(sockfd, &read_A_offset, sizeof(read_A_offset));
-
-    if(rc > 0) {
-      fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", ntohll(read_A_offset));
-    } else {
-      fprintf(stderr, "Error: Can't receive remote offset of A from the remote peer\n");
-      close(sockfd);
-      return -1;
-    }
-
-    read_A_offset = ntohll(read_A_offset);
+    read_A_offset = conn->remote[0].buf_offset;
+    read_A_key    = conn->remote[0].r_key;
+    fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", read_A_offset);
 
     wqe_idx   = 0;
     wrid      = 0;
@@ -380,7 +334,7 @@ int main(int argc, char *argv[])
     buf_phy_addr = device_buffer->dma_addr;
 
     fprintf(stderr, "Info: creating an RDMA read WQE for getting data\n");
-    create_a_wqe(rn_dev->rdma_dev, qpid, wrid, wqe_idx, device_buffer->dma_addr, payload_size, RNIC_OP_READ, read_A_offset, R_KEY, 0, 0, 0, 0, 0);
+    create_a_wqe(rn_dev->rdma_dev, qpid, wrid, wqe_idx, device_buffer->dma_addr, payload_size, RNIC_OP_READ, read_A_offset, read_A_key, 0, 0, 0, 0, 0);
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
     ret_val = rdma_post_send(rn_dev->rdma_dev, qpid);
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
@@ -429,11 +383,10 @@ int main(int argc, char *argv[])
     * 10. Check received data.
     */
     fprintf(stderr, "Info: CHECK RECEIVED DATA\n");
-    for (uint32_t i = 0; i < payload_size>>2; i++) {
-      if(recv_tmp[i] != sw_golden[i]) {
-        fprintf(stderr, "Error: received data mismatched: recv[%d]=%d, sw_golden[%d]=%d\n", i, recv_tmp[i], i, sw_golden[i]);
-        goto out;
-      }
+    mismatch = rn_mem_mismatch(recv_tmp, sw_golden, (payload_size>>2)<<2);
+    if(mismatch >= 0) {
+      fprintf(stderr, "Error: received data mismatched: recv[%ld]=%d, sw_golden[%ld]=%d\n", mismatch>>2, recv_tmp[mismatch>>2], mismatch>>2, sw_golden[mismatch>>2]);
+      goto out;
     }
 
     fprintf(stderr, "Info: Data read successfully\n");
@@ -446,128 +399,17 @@ int main(int argc, char *argv[])
     // Dump RDMA registers
     dump_registers(rdma_dev, 1, qpid);
 
-
+    // 通知服务器读操作已完成
+    rdma_cm_sync(conn);
   }
 
-  // if(server) {
-  //   // Connect to the remote peer via TCP/IP
-  //   //uint32_t* sent_tmp = malloc(payload_size);
-  //   memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-  //   server_addr.sin_family = AF_INET;
-  //   server_addr.sin_port = htons(tcp_sport);
-  //   server_addr.sin_addr.s_addr = inet_addr((char *) src_ip_str);
-
-  //   bind(sockfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
-
-  //   fprintf(stderr, "Info: Server is listening to a remote peer\n");
-  //   listen(sockfd, LISTENQ);
-
-  //   addr_size = sizeof(client_addr);
-  //   accepted_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &addr_size);
-
-  //   fprintf(stderr, "Info: Server is connected to a remote peer\n");
-
-  //   tmp_buffer = allocate_rdma_buffer(rn_dev, payload_size, /*qp_location*/"dev_mem");
-  //   rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
-  //   fprintf(stderr, "Info: allocating buffer for payload data\n");
-  //   fprintf(stderr, "Info: tmp_buffer->buffer = %p, tmp_buffer->dma_addr = 0x%lx\n", (uint64_t *) tmp_buffer->buffer, tmp_buffer->dma_addr);
-
-  //   if(is_device_address(tmp_buffer->dma_addr)) {
-  //     // Device memory address
-  //     fprintf(stderr, "Info: copy payload data to the device memory\n");
-  //     rc = write_from_buffer(device, fpga_fd, (char* ) sw_golden, (uint32_t)(payload_size), tmp_buffer->dma_addr);
-  //     fprintf(stderr, "Info: copied payload data to the device memory succesfully rc = %ld\n", rc);
-  //     if (rc < 0){
-  //       goto out;
-  //     }
-  //   } else {
-  //     // Host memory address
-  //     fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-  //     for (uint32_t i = 0; i < payload_size>>2; i++) {
-  //       *((uint32_t* )(tmp_buffer->buffer) + i) = i % 10;
-  //     }
-  //   }
-
-  //   read_offset = htonll((uint64_t) tmp_buffer->buffer);
-  //   write(accepted_sockfd, &read_offset, sizeof(uint64_t));
-  //   fprintf(stderr, "Sending read_offset (%lx) to the remote client\n", ntohll(read_offset));
-  //   /*
-  //   rc = read_to_buffer(device, fpga_fd, (char* ) sent_tmp, (uint64_t) payload_size, (uint64_t) tmp_buffer->dma_addr);
-  //   for (uint32_t i = 0; i < payload_size>>2; i++) {
-  //       fprintf(stderr, "Info: sent data: sent[%d]=%d\n", i, sent_tmp[i]);
-  //   }*/
-
-  //   fprintf(stderr, "Does the client finish its RDMA read operation? If yes, please press any key\n");
-    
-  //   while(val != '\r' && val != '\n') {
-  //     val = getchar();
-  //   }
-  //   fprintf(stderr, "\n");
-
-  //   dump_registers(rn_dev->rdma_dev, 0, qpid);
-
-  //   if(shutdown(accepted_sockfd, SHUT_RDWR) < 0){
-  //     fprintf(stderr, "accepted_sockfd shutdown failed\n");
-  //     fprintf(stderr, "Error: %s\n", strerror(errno));
-  //   }
-  //   close(accepted_sockfd);
-  // }
-
-
 // ====================== 服务端逻辑 (请用这个版本完整替换) ======================
 if(server) {
-    // 为TCP连接设置地址信息
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr((char *) src_ip_str);
-
-    bind(sockfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
-
-    // 进入监听状态，等待客户端连接
-    fprintf(stderr, "Info: Server is listening to a remote peer\n");
-    listen(sockfd, LISTENQ);
-
-    addr_size = sizeof(client_addr);
-    accepted_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &addr_size);
-
-    fprintf(stderr, "Info: Server is connected to a remote peer\n");
-
-    // 在FPGA设备内存上分配数据缓冲区
-    tmp_buffer = allocate_rdma_buffer(rn_dev, payload_size, /*qp_location*/"dev_mem");
-    // 注册该内存区域，使其能被远程访问
-    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
-    fprintf(stderr, "Info: allocating buffer for payload data\n");
-    fprintf(stderr, "Info: tmp_buffer->buffer = %p, tmp_buffer->dma_addr = 0x%lx\n", (uint64_t *) tmp_buffer->buffer, tmp_buffer->dma_addr);
-
-    // 判断数据缓冲区是否在设备内存上
-    if(is_device_address(tmp_buffer->dma_addr)) {
-      // 将黄金标准数据从主机内存DMA写入到FPGA设备内存
-      fprintf(stderr, "Info: copy payload data to the device memory\n");
-      rc = write_from_buffer(device, fpga_fd, (char* ) sw_golden, (uint32_t)(payload_size), tmp_buffer->dma_addr);
-      fprintf(stderr, "Info: copied payload data to the device memory succesfully rc = %ld\n", rc);
-      if (rc < 0){
-        goto out;
-      }
-    } else {
-      // 如果缓冲区在主机内存，则直接写入
-      fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-      for (uint32_t i = 0; i < payload_size>>2; i++) {
-        *((uint32_t* )(tmp_buffer->buffer) + i) = i % 10;
-      }
-    }
-
-    // 将数据在FPGA上的物理地址通过TCP发送给客户端
-    read_offset = htonll((uint64_t) tmp_buffer->buffer);
-    write(accepted_sockfd, &read_offset, sizeof(uint64_t));
-    fprintf(stderr, "Sending read_offset (%lx) to the remote client\n", ntohll(read_offset));
-    
-    // 等待用户输入，表示客户端的操作已完成
-    fprintf(stderr, "Does the client finish its RDMA read operation? If yes, please press any key\n");
-    while(val != '\r' && val != '\n') {
-      val = getchar();
+    // 等待客户端完成RDMA读操作
+    fprintf(stderr, "Info: Server is waiting for the client to finish its RDMA read operation\n");
+    if(rdma_cm_sync(conn) < 0) {
+      fprintf(stderr, "Error: lost the connection with the client\n");
     }
-    fprintf(stderr, "\n");
 
     // 打印常规的寄存器状态
     dump_registers(rn_dev->rdma_dev, 0, qpid);
@@ -606,34 +448,20 @@ if(server) {
      ****************************************************************************/
 
 
-    // 关闭TCP连接
-    if(shutdown(accepted_sockfd, SHUT_RDWR) < 0){
-      fprintf(stderr, "accepted_sockfd shutdown failed\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-    }
-    close(accepted_sockfd);
 }
 
-
-
-
-
-  if(shutdown(sockfd, SHUT_RDWR) < 0){
-    fprintf(stderr, "sockfd shutdown failed\n");
-    fprintf(stderr, "Error: %s\n", strerror(errno));
-  }
-  close(sockfd);	
-
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(sw_golden);
   close(fpga_fd);
   close(pcie_resource_fd);
   destroy_rn_dev(rn_dev);
+  // The QPs keep a pointer to the peer MAC address of the connection
+  rdma_cm_destroy(conn);
   return 0;
 }
 
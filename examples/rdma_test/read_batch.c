@@ -281,8 +281,10 @@ int main(int argc, char *argv[])
   //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
   //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
   // All SQ, CQ and RQ resources can be used for a single QP.
-    //struct rdma_qp_t* qp = 
-  allocate_rdma_qp(rdma_dev, qpid, dst_qpid, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, &dst_mac, dst_ip, P_KEY, R_KEY);
+  if(allocate_rdma_qp(rdma_dev, qpid, dst_qpid, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, &dst_mac, dst_ip, P_KEY, R_KEY) == NULL) {
+    fprintf(stderr, "Error: failed to allocate QP%d\n", qpid);
+    exit(EXIT_FAILURE);
+  }
 
   /* 
    * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
@@ -294,9 +296,7 @@ int main(int argc, char *argv[])
   // Get golden data for verification
   fprintf(stderr, "total_payload_size = %d, total_payload_size>>2 = %d\n", total_payload_size, total_payload_size>>2);
   sw_golden = (uint32_t* ) malloc(total_payload_size);
-  for (uint32_t i = 0; i < total_payload_size>>2; i++) {
-    sw_golden[i] = i % 10;
-  }
+  rn_fill_mod32(sw_golden, total_payload_size>>2, 10);
 
 
   if(client) {
@@ -423,9 +423,7 @@ int main(int argc, char *argv[])
     } else {
       // Host memory address
       fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-      for (uint32_t i = 0; i < total_payload_size>>2; i++) {
-        *((uint32_t* )(tmp_buffer->buffer) + i) = i % 10;
-      }
+      rn_fill_mod32((uint32_t* ) tmp_buffer->buffer, total_payload_size>>2, 10);
     }
 
     read_offset = htonll((uint64_t) tmp_buffer->buffer);
@@ -467,11 +465,11 @@ int main(int argc, char *argv[])
   close(sockfd);	
 
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(sw_golden);
   close(fpga_fd);
   close(pcie_resource_fd);
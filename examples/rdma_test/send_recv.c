@@ -51,18 +51,10 @@ int main(int argc, char **argv) {
   device = DEVICE_NAME_DEFAULT;
   char *pcie_resource = NULL;
   char *qp_location = QP_LOCATION_DEFAULT;
-  char command[64];
-
-  uint32_t i;
+  struct rdma_cm_conn_t* conn = NULL;
 
   uint32_t* sw_golden;
-
-  FILE *dst_mac_fp;
-  char *line = NULL;
-  size_t len = 0;
-  char *tmp_mac_addr_ptr = NULL;
-  char tmp_mac_addr_str[18] = "";
-  ssize_t command_read;
+  int64_t mismatch;
 
   int cmd_opt;
 
@@ -109,33 +101,6 @@ int main(int argc, char **argv) {
       dst_ip = convert_ip_addr_to_uint(optarg);
       strcpy(dst_ip_str, optarg);
       fprintf(stderr, "dst_ip_str = %s\n", (char*) dst_ip_str);
-      sprintf(command, "arp -a %s", dst_ip_str);
-      dst_mac_fp = popen(command, "r");
-      if(dst_mac_fp == NULL) {
-        perror("Error: popen\n");
-        exit(EXIT_FAILURE);
-      }
-
-      while((command_read = getline(&line, &len, dst_mac_fp)) != -1) {
-        // Check if we find an entry
-        if (strstr(line, "no match found") != NULL) {
-          fprintf(stderr, "Error: No arp cache entry for the IP (%s). Please use \"arping | ping -c 1 %s\" to create the cache entry", dst_ip_str, dst_ip_str);
-          exit(0);
-        }
-
-        if (strstr(line, "at") != NULL) {
-          // Get the MAC address from the line
-          tmp_mac_addr_ptr = strstr(line, "at")+3;
-          strncpy(tmp_mac_addr_str, tmp_mac_addr_ptr, 17);
-          dst_mac = convert_mac_addr_str_to_uint(tmp_mac_addr_str);
-          break;
-        }
-      }
-
-      pclose(dst_mac_fp);
-      free(line);
-
-      break;
     case 'u':
       udp_sport = (uint16_t) atoi(optarg);
       break;
@@ -179,6 +144,7 @@ int main(int argc, char **argv) {
   }
 
   src_mac = get_mac_addr_from_str_ip(sockfd, src_ip_str);
+  close(sockfd);
 
   /* 
    * 1. Create an RecoNIC device instance
@@ -238,9 +204,10 @@ int main(int argc, char **argv) {
   }
 
   /* 
-   * 6. Allocate a queue pair
+   * 6. Connect a queue pair with the peer. No memory region is exposed, as this
+   *    example only uses RDMA send/receive.
    */
-  fprintf(stderr, "Info: ALLOCATE RDMA QP\n");
+  fprintf(stderr, "Info: CONNECT RDMA QP\n");
   uint32_t qpid    = 2;
   uint32_t qdepth  = 64;
   // Allocate SQ, CQ and RQ: (num_qp * qdepth * entry_size)
@@ -248,28 +215,9 @@ int main(int argc, char **argv) {
   //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
   //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
   // All SQ, CQ and RQ resources can be used for a single QP.
-  allocate_rdma_qp(rdma_dev, 
-                   qpid,
-                   dst_qpid,
-                   rdma_pd,
-                   cq_cidb_addr,
-                   rq_cidb_addr,
-                   qdepth,
-                   qp_location,
-                   &dst_mac,
-                   dst_ip,
-                   P_KEY,
-                   R_KEY);
+  conn = connect_test_qp(rdma_dev, rdma_pd, qpid, 0, 0, cq_cidb_addr, rq_cidb_addr, qdepth,
+                         qp_location, server, src_ip_str, dst_ip_str, tcp_sport);
 
-  /* 
-   * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
-   */
-  fprintf(stderr, "Info: CONFIGURE PSN\n");
-  uint32_t rq_psn = 0xabc;
-  uint32_t sq_psn = 0xabc + 1;
-  config_last_rq_psn(rdma_dev, qpid, rq_psn);
-  config_sq_psn(rdma_dev, qpid, sq_psn);
-  
   fprintf(stderr, "Info: APPLICATION START\n");
 
   uint32_t wqe_idx   = 0;
@@ -279,9 +227,7 @@ int main(int argc, char **argv) {
   // Get golden data for verification
   fprintf(stderr, "payload_size = %d, payload_size>>2 = %d\n", payload_size, payload_size>>2);
   sw_golden = (uint32_t* ) malloc(payload_size);
-  for (i = 0; i < payload_size>>2; i++) {
-    sw_golden[i] = i % 10;
-  }
+  rn_fill_mod32(sw_golden, payload_size>>2, 10);
 
   if(client) {
     uint32_t buf_size;
@@ -324,11 +270,10 @@ int main(int argc, char **argv) {
     * 10. Check received data.
     */
     fprintf(stderr, "Info: CHECK RECEIVED DATA\n");
-    for (i = 0; i < payload_size>>2; i++) {
-      if(recv_tmp[i] != sw_golden[i]) {
-        fprintf(stderr, "Error: received data mismatched: recv[%d]=%d, sw_golden[%d]=%d\n", i, recv_tmp[i], i, sw_golden[i]);
-        goto out;
-      }
+    mismatch = rn_mem_mismatch(recv_tmp, sw_golden, (payload_size>>2)<<2);
+    if(mismatch >= 0) {
+      fprintf(stderr, "Error: received data mismatched: recv[%ld]=%d, sw_golden[%ld]=%d\n", mismatch>>2, recv_tmp[mismatch>>2], mismatch>>2, sw_golden[mismatch>>2]);
+      goto out;
     }
 
     fprintf(stderr, "Info: Data is successfully received!\n");
@@ -341,6 +286,9 @@ int main(int argc, char **argv) {
     // Dump RDMA registers
     fprintf(stderr, "Info: Printing RDMA registers from the client side\n");
     dump_registers(rdma_dev, 0, qpid);
+
+    // Tell the server that the payload has been received
+    rdma_cm_sync(conn);
   }
 
   if(server) {
@@ -364,9 +312,7 @@ int main(int argc, char **argv) {
     } else {
       // Host memory address
       fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-      for (i = 0; i < payload_size>>2; i++) {
-        *((uint32_t* )(payload_tmp->buffer) + i) = i % 10;
-      }
+      rn_fill_mod32((uint32_t* ) payload_tmp->buffer, payload_size>>2, 10);
     }
 
     /* 
@@ -406,29 +352,27 @@ int main(int argc, char **argv) {
     bandwidth = ((double) payload_size) / time_spent;
     fprintf(stderr, "Info: Time spent %f sec, size = %d bytes, Bandwidth = %f bytes/sec\n",	time_spent, payload_size, bandwidth);
 
-    fprintf(stderr, "Press any key to proceed\n");
-    char  val = 0;
-    while(val != '\r' && val != '\n') {
-      val = getchar();
+    fprintf(stderr, "Info: Waiting for the client to receive the payload\n");
+    if(rdma_cm_sync(conn) < 0) {
+      fprintf(stderr, "Error: lost the connection with the client\n");
     }
-    fprintf(stderr, "\n");
 
     fprintf(stderr, "Info: Dump registers after rdma_post_send()\n");
     dump_registers(rdma_dev, 1, qpid);
   }
 
-  close(sockfd);
-
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(sw_golden);
   close(fpga_fd);
   close(pcie_resource_fd);
   destroy_rn_dev(rn_dev);
+  // The QPs keep a pointer to the peer MAC address of the connection
+  rdma_cm_destroy(conn);
 
   return 0;
 }
\ No newline at end of file
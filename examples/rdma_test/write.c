@@ -55,17 +55,7 @@ struct rn_dev_t* rn_dev;
 int main(int argc, char *argv[])
 {
   int sockfd;
-  int accepted_sockfd;
-  struct sockaddr_in server_addr;
-  struct sockaddr_in client_addr;
-  socklen_t addr_size;
-  char command[64];
-  FILE *dst_mac_fp;
-  char *line = NULL;
-  size_t len = 0;
-  char *tmp_mac_addr_ptr = NULL;
-  char tmp_mac_addr_str[18] = "";
-  ssize_t command_read;
+  struct rdma_cm_conn_t* conn = NULL;
 
   int cmd_opt;
   device = DEVICE_NAME_DEFAULT;
@@ -77,10 +67,9 @@ int main(int argc, char *argv[])
   //payload size in bytes
   uint32_t payload_size = 4;
   int   pcie_resource_fd;
-  char  val = 0;
 
   struct rdma_buff_t* cidb_buffer;
-  struct rdma_buff_t* tmp_buffer;
+  struct rdma_buff_t* tmp_buffer = NULL;
   struct rdma_buff_t* device_buffer;
 
   uint64_t cq_cidb_addr;
@@ -93,19 +82,17 @@ int main(int argc, char *argv[])
   struct rdma_buff_t* err_buf;
   struct rdma_buff_t* resp_err_pkt_buf;
 
-  uint32_t rq_psn = 0xabc;
-  uint32_t sq_psn = 0xabc + 1;
   uint32_t qpid;
-  uint32_t dst_qpid;
   uint32_t qdepth;
   uint16_t wrid;
   uint32_t wqe_idx;
 
   uint64_t write_offset_client;
+  uint32_t write_key_client;
   int      ret_val;
 
-  uint64_t write_offset_server;
   uint32_t* sw_golden;
+  int64_t mismatch;
   ssize_t rc;
 
   server = 0;
@@ -136,33 +123,6 @@ int main(int argc, char *argv[])
       dst_ip = convert_ip_addr_to_uint(optarg);
       strcpy(dst_ip_str, optarg);
       fprintf(stderr, "dst_ip_str = %s\n", (char*) dst_ip_str);
-      sprintf(command, "arp -a %s", dst_ip_str);
-      dst_mac_fp = popen(command, "r");
-      if(dst_mac_fp == NULL) {
-        perror("Error: popen\n");
-        exit(EXIT_FAILURE);
-      }
-
-      while((command_read = getline(&line, &len, dst_mac_fp)) != -1) {
-        // Check if we find an entry
-        if (strstr(line, "no match found") != NULL) {
-          fprintf(stderr, "Error: No arp cache entry for the IP (%s). Please use \"arping | ping -c 1 %s\" to create the cache entry", dst_ip_str, dst_ip_str);
-          exit(0);
-        }
-
-        if (strstr(line, "at") != NULL) {
-          // Get the MAC address from the line
-          tmp_mac_addr_ptr = strstr(line, "at")+3;
-          strncpy(tmp_mac_addr_str, tmp_mac_addr_ptr, 17);
-          dst_mac = convert_mac_addr_str_to_uint(tmp_mac_addr_str);
-          break;
-        }
-      }
-
-      pclose(dst_mac_fp);
-      free(line);
-
-      break;
     case 'u':
       udp_sport = (uint16_t) atoi(optarg);
       break;
@@ -206,6 +166,7 @@ int main(int argc, char *argv[])
   }
 
   src_mac = get_mac_addr_from_str_ip(sockfd, src_ip_str);
+  close(sockfd);
 
   /* 
    * 1. Create an RecoNIC device instance
@@ -266,54 +227,32 @@ int main(int argc, char *argv[])
     return -EINVAL;
   }
 
-  /* 
-   * 6. Allocate a queue pair
-   */
-  fprintf(stderr, "Info: ALLOCATE RDMA QP\n");
-  // Allocate SQ, CQ and RQ: (num_qp * qdepth * entry_size)
-  //  --  32KB SQ (8 SQs, each has 4KB and can accommodate 64 WQEs)
-  //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
-  //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
-  // All SQ, CQ and RQ resources can be used for a single QP.
-    //struct rdma_qp_t* qp = 
-  allocate_rdma_qp(rdma_dev,qpid,dst_qpid,rdma_pd,cq_cidb_addr,rq_cidb_addr,qdepth,qp_location,&dst_mac,dst_ip,P_KEY,R_KEY);
-
-  /* 
-   * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
-   */
-  fprintf(stderr, "Info: CONFIGURE PSN\n");
-  config_last_rq_psn(rdma_dev, qpid, rq_psn);
-  config_sq_psn(rdma_dev, qpid, sq_psn);
-
   // Get golden data for verification
   fprintf(stderr, "payload_size = %d, payload_size>>2 = %d\n", payload_size, payload_size>>2);
   sw_golden = (uint32_t* ) malloc(payload_size);
-  for (uint32_t i = 0; i < payload_size>>2; i++) {
-    sw_golden[i] = i % 10;
-  }
+  rn_fill_mod32(sw_golden, payload_size>>2, 10);
 
-if(client) {
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port   = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr(dst_ip_str);
-
-    fprintf(stderr, "Info: Client is connecting to a remote server\n");
-    connect(sockfd, (struct sockaddr* )&server_addr, sizeof(server_addr));
-
-    fprintf(stderr, "Info: Client is connected to a remote server\n");
-
-    rc = read(sockfd, &write_offset_client, sizeof(write_offset_client));
+  if(server) {
+    tmp_buffer = allocate_rdma_buffer(rn_dev, payload_size, /*qp_location*/"dev_mem");
+    fprintf(stderr,"tmp_buffer size is %d\n", tmp_buffer->buf_size);
+    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
+    fprintf(stderr, "Info: allocating buffer for payload data\n");
+    fprintf(stderr, "Info: tmp_buffer->buffer = %p, tmp_buffer->dma_addr = 0x%lx\n", (uint64_t *) tmp_buffer->buffer, tmp_buffer->dma_addr);
+  }
 
-    if(rc > 0) {
-      fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", ntohll(write_offset_client));
-    } else {
-      fprintf(stderr, "Error: Can't receive remote offset of A from the remote peer\n");
-      close(sockfd);
-      return -1;
-    }
+  /* 
+   * 6. Connect a queue pair with the peer. The server exposes the payload buffer,
+   *    the client writes into it with its remote offset and key.
+   */
+  fprintf(stderr, "Info: CONNECT RDMA QP\n");
+  conn = connect_test_qp(rdma_dev, rdma_pd, qpid, server ? (uint64_t) tmp_buffer->buffer : 0,
+                         server ? payload_size : 0, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location,
+                         server, src_ip_str, dst_ip_str, tcp_sport);
 
-    write_offset_client = ntohll(write_offset_client);
+  if(client) {
+    write_offset_client = conn->remote[0].buf_offset;
+    write_key_client    = conn->remote[0].r_key;
+    fprintf(stderr, "Info: client received remote offset of A = 0x%lx\n", write_offset_client);
 
     wqe_idx   = 0;
     wrid      = 0;
@@ -331,15 +270,13 @@ if(client) {
     } else {
       // Host memory address
       fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-      for (uint32_t i = 0; i < payload_size>>2; i++) {
-        *((uint32_t* )(device_buffer->buffer) + i) = i % 10;
-      }
+      rn_fill_mod32((uint32_t* ) device_buffer->buffer, payload_size>>2, 10);
     }
     fprintf(stderr, "Info: buffer physical address is 0x%lx\n",device_buffer->dma_addr);
 
     fprintf(stderr, "Info: creating an RDMA write WQE for writing data\n");
     
-    create_a_wqe(rn_dev->rdma_dev, qpid, wrid, wqe_idx, device_buffer->dma_addr, payload_size, RNIC_OP_WRITE, write_offset_client, R_KEY, 0, 0, 0, 0, 0);
+    create_a_wqe(rn_dev->rdma_dev, qpid, wrid, wqe_idx, device_buffer->dma_addr, payload_size, RNIC_OP_WRITE, write_offset_client, write_key_client, 0, 0, 0, 0, 0);
     if (!strcmp(qp_location, DEVICE_MEM))
       {
         fprintf(stderr, "Info: Adding delay of 1s\n");
@@ -365,6 +302,9 @@ if(client) {
 
     // Dump RDMA registers
     dump_registers(rdma_dev, 1, qpid);
+
+    // Tell the server that the RDMA write has been posted
+    rdma_cm_sync(conn);
   }
 
   if(server) {
@@ -373,41 +313,13 @@ if(client) {
     buf_size = payload_size;
     uint32_t* recv_tmp = malloc(buf_size);
 
-    memset(&server_addr, '\0', sizeof(struct sockaddr_in));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(tcp_sport);
-    server_addr.sin_addr.s_addr = inet_addr((char *) src_ip_str);
-
-    bind(sockfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
-
-    fprintf(stderr, "Info: Server is listening to a remote peer\n");
-    
-    listen(sockfd, LISTENQ);
-
-    addr_size = sizeof(client_addr);
-    accepted_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &addr_size);
-
-    fprintf(stderr, "Info: Server is connected to a remote peer\n");
-
     dump_registers(rn_dev->rdma_dev, 0, qpid);
 
-    tmp_buffer = allocate_rdma_buffer(rn_dev, payload_size, /*qp_location*/"dev_mem");
-    fprintf(stderr,"tmp_buffer size is %d\n", tmp_buffer->buf_size);
-    rdma_register_memory_region(rdma_dev, rdma_pd, R_KEY, tmp_buffer);
-    fprintf(stderr, "Info: allocating buffer for payload data\n");
-    fprintf(stderr, "Info: tmp_buffer->buffer = %p, tmp_buffer->dma_addr = 0x%lx\n", (uint64_t *) tmp_buffer->buffer, tmp_buffer->dma_addr);
-    
-    write_offset_server = htonll((uint64_t) tmp_buffer->buffer);
-    write(accepted_sockfd, &write_offset_server, sizeof(uint64_t));
-    dump_registers(rn_dev->rdma_dev, 0, qpid);
-    fprintf(stderr, "Sending write_offset (%lx) to the remote client\n", ntohll(write_offset_server));
-
-    fprintf(stderr, "Does the client finish its RDMA write operation? If yes, please press any key\n");
-    
-    while(val != '\r' && val != '\n') {
-      val = getchar();
+    fprintf(stderr, "Info: Server is waiting for the client to finish its RDMA write operation\n");
+    if(rdma_cm_sync(conn) < 0) {
+      fprintf(stderr, "Error: lost the connection with the client\n");
+      goto out;
     }
-    fprintf(stderr, "\n");
 
     
     if(is_device_address(tmp_buffer->dma_addr)) {
@@ -427,11 +339,10 @@ if(client) {
     * 10. Check received data.
     */
     fprintf(stderr, "Info: CHECK RECEIVED DATA\n");
-    for (uint32_t i = 0; i < payload_size>>2; i++) {
-      if(recv_tmp[i] != sw_golden[i]) {
-        fprintf(stderr, "Error: received data mismatched: recv[%d]=%d, sw_golden[%d]=%d\n", i, recv_tmp[i], i, sw_golden[i]);
-        goto out;
-      }
+    mismatch = rn_mem_mismatch(recv_tmp, sw_golden, (payload_size>>2)<<2);
+    if(mismatch >= 0) {
+      fprintf(stderr, "Error: received data mismatched: recv[%ld]=%d, sw_golden[%ld]=%d\n", mismatch>>2, recv_tmp[mismatch>>2], mismatch>>2, sw_golden[mismatch>>2]);
+      goto out;
     }
 
     fprintf(stderr, "Info: Data write successfully\n");
@@ -442,30 +353,20 @@ if(client) {
     }
     
     dump_registers(rn_dev->rdma_dev, 0, qpid);
-
-    if(shutdown(accepted_sockfd, SHUT_RDWR) < 0){
-      fprintf(stderr, "accepted_sockfd shutdown failed\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-    }
-    close(accepted_sockfd);
-  }
-
-  if(shutdown(sockfd, SHUT_RDWR) < 0){
-    fprintf(stderr, "sockfd shutdown failed\n");
-    fprintf(stderr, "Error: %s\n", strerror(errno));
   }
-  close(sockfd);	
 
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(sw_golden);
   close(fpga_fd);
   close(pcie_resource_fd);
   destroy_rn_dev(rn_dev);
+  // The QPs keep a pointer to the peer MAC address of the connection
+  rdma_cm_destroy(conn);
   return 0;
 }
 
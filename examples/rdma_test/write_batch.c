@@ -282,8 +282,10 @@ int main(int argc, char *argv[])
   //  --   2KB CQ (8 CQs, each has 256B and can accommodate 64 CQEs)
   //  -- 128KB RQ (8 RQs, each has 16KB and can accommodate 64 RQE)
   // All SQ, CQ and RQ resources can be used for a single QP.
-    //struct rdma_qp_t* qp = 
-    allocate_rdma_qp(rdma_dev,qpid,dst_qpid,rdma_pd,cq_cidb_addr,rq_cidb_addr,qdepth,qp_location,&dst_mac,dst_ip,P_KEY,R_KEY);
+  if(allocate_rdma_qp(rdma_dev, qpid, dst_qpid, rdma_pd, cq_cidb_addr, rq_cidb_addr, qdepth, qp_location, &dst_mac, dst_ip, P_KEY, R_KEY) == NULL) {
+    fprintf(stderr, "Error: failed to allocate QP%d\n", qpid);
+    exit(EXIT_FAILURE);
+  }
 
   /* 
    * 7. Configure last_rq_psn, so that the RDMA packets can be accepted at the remote side
@@ -295,9 +297,7 @@ int main(int argc, char *argv[])
   // Get golden data for verification
   fprintf(stderr, "total_payload_size = %d, total_payload_size>>2 = %d\n", total_payload_size, total_payload_size>>2);
   sw_golden = (uint32_t* ) malloc(total_payload_size);
-  for (uint32_t i = 0; i < total_payload_size>>2; i++) {
-    sw_golden[i] = i % 10;
-  }
+  rn_fill_mod32(sw_golden, total_payload_size>>2, 10);
 
 if(client) {
     memset(&server_addr, '\0', sizeof(struct sockaddr_in));
@@ -337,9 +337,7 @@ if(client) {
       } else {
         // Host memory address
         fprintf(stderr, "Info: Initialize payload data on the host memory\n");
-        for (uint32_t i = 0; i < payload_size>>2; i++) {
-          *((uint32_t* )(device_buffer->buffer) + i) = i % 10;
-        }
+        rn_fill_mod32((uint32_t* ) device_buffer->buffer, payload_size>>2, 10);
       }
       fprintf(stderr, "Info: buffer physical address is 0x%lx\n",device_buffer->dma_addr);
 
@@ -430,11 +428,11 @@ if(client) {
   close(sockfd);	
 
 out:
-  free(cidb_buffer);
-  free(data_buf);
-  free(ipkterr_buf);
-  free(err_buf);
-  free(resp_err_pkt_buf);
+  free_rdma_buffer(cidb_buffer);
+  free_rdma_buffer(data_buf);
+  free_rdma_buffer(ipkterr_buf);
+  free_rdma_buffer(err_buf);
+  free_rdma_buffer(resp_err_pkt_buf);
   free(sw_golden);
   close(fpga_fd);
   close(pcie_resource_fd);
@@ -27,14 +27,7 @@ void software_mmult(
     int out[DATA_SIZE*DATA_SIZE]  //Output Matrix
 ) {
     //Perform Matrix multiply Out = In1 x In2
-    for (int i = 0; i < DATA_SIZE; i++) {
-        for (int j = 0; j < DATA_SIZE; j++) {
-            for (int k = 0; k < DATA_SIZE; k++) {
-                out[i * DATA_SIZE + j] +=
-                    in1[i * DATA_SIZE + k] * in2[k * DATA_SIZE + j];
-            }
-        }
-    }
+    rn_gemm_ref(in1, in2, out, DATA_SIZE, DATA_SIZE, DATA_SIZE);
 }
 
 static struct option const long_opts[] = {
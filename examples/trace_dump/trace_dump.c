@@ -0,0 +1,377 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file trace_dump.c
+ *  @brief Turn a trace file written by rn_trace_dump() into per-stage latencies.
+ *
+ *  Records of all threads are merged by timestamp. WQEs are followed through the SQ
+ *  slot they were written to: build to doorbell, doorbell to completion and build to
+ *  completion. The gap between RQ arrivals is reported per QP, and DMA transfers and
+ *  asynchronous DMA requests are paired by direction and tag.
+ */
+
+#include <getopt.h>
+#include "memory_api.h"
+#include "rn_trace.h"
+
+// Number of SQ slots tracked per QP, ring indices are 16 bits wide
+#define TRACE_MAX_SLOTS 65536
+
+// Number of QPs tracked, QP IDs are 16 bits wide
+#define TRACE_MAX_QPS 65536
+
+// Number of DMA transfers that can be in flight at the same time
+#define TRACE_MAX_PENDING 4096
+
+/*! \enum trace_stage_t
+    \brief Stages reported by the tool.
+*/
+typedef enum {
+  STAGE_BUILD_TO_DOORBELL = 0,
+  STAGE_DOORBELL_TO_CQ,
+  STAGE_BUILD_TO_CQ,
+  STAGE_RQ_GAP,
+  STAGE_DMA_H2C,
+  STAGE_DMA_C2H,
+  STAGE_DMA_REQ_H2C,
+  STAGE_DMA_REQ_C2H,
+  NUM_STAGES
+} trace_stage_t;
+
+static const char* const stage_names[NUM_STAGES] = {
+  "wqe_build->doorbell", "doorbell->cq", "wqe_build->cq", "rq_gap",
+  "dma_h2c", "dma_c2h", "dma_req_h2c", "dma_req_c2h"
+};
+
+/*! \struct trace_samples_t
+    \brief Latency samples of a stage in timestamp counter ticks.
+*/
+struct trace_samples_t {
+  uint64_t* values; /*!< values samples. */
+  uint64_t num;     /*!< num number of samples. */
+  uint64_t cap;     /*!< cap capacity of values. */
+};
+
+/*! \struct trace_qp_t
+    \brief Per-QP state while walking the records.
+*/
+struct trace_qp_t {
+  uint64_t* build;    /*!< build timestamp of the last WQE written to each SQ slot, 0 if none. */
+  uint64_t* doorbell; /*!< doorbell timestamp of the doorbell that posted each SQ slot, 0 if none. */
+  uint32_t sq_pidb;   /*!< sq_pidb SQ producer index of the last doorbell. */
+  uint32_t sq_cidb;   /*!< sq_cidb SQ consumer index of the last completion. */
+  uint64_t last_rq;   /*!< last_rq timestamp of the last RQ arrival, 0 if none. */
+};
+
+/*! \struct trace_pending_t
+    \brief A DMA transfer or request waiting for its completion.
+*/
+struct trace_pending_t {
+  uint64_t tsc;    /*!< tsc timestamp of the start event, 0 if the entry is free. */
+  uint16_t event;  /*!< event start event. */
+  uint16_t id;     /*!< id direction. */
+  uint32_t arg;    /*!< arg tag. */
+};
+
+static struct trace_samples_t samples[NUM_STAGES];
+static struct trace_qp_t* qps[TRACE_MAX_QPS];
+static struct trace_pending_t pending[TRACE_MAX_PENDING];
+static uint32_t pending_next = 0;
+
+static struct option const long_opts[] = {
+  {"file"  , required_argument, NULL, 'f'},
+  {"help"  , no_argument      , NULL, 'h'},
+  {0       , 0                , 0   ,  0 }
+};
+
+static void usage(const char *name)
+{
+  int i = 0;
+
+  fprintf(stdout, "usage: %s [OPTIONS]\n\n", name);
+
+  fprintf(stdout, "  -%c (--%s) trace file written by rn_trace_dump()\n",
+    long_opts[i].val, long_opts[i].name);
+  i++;
+  fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
+    long_opts[i].val, long_opts[i].name);
+  fprintf(stdout, "\nTrace points are only recorded by a library built with 'make TRACE=1'.\n");
+}
+
+static void add_sample(trace_stage_t stage, uint64_t start, uint64_t end) {
+  struct trace_samples_t* s = &samples[stage];
+  uint64_t* values;
+
+  if((start == 0) || (end < start)) {
+    return;
+  }
+
+  if(s->num == s->cap) {
+    s->cap = (s->cap == 0) ? 4096 : (s->cap * 2);
+    values = (uint64_t* ) realloc(s->values, s->cap * sizeof(uint64_t));
+    if(values == NULL) {
+      fprintf(stderr, "Error: failed to allocate %ld samples\n", s->cap);
+      exit(1);
+    }
+    s->values = values;
+  }
+  s->values[s->num++] = end - start;
+}
+
+static struct trace_qp_t* get_qp(uint16_t qpid) {
+  if(qps[qpid] == NULL) {
+    qps[qpid] = (struct trace_qp_t* ) calloc(1, sizeof(struct trace_qp_t));
+    if(qps[qpid] != NULL) {
+      qps[qpid]->build    = (uint64_t* ) calloc(TRACE_MAX_SLOTS, sizeof(uint64_t));
+      qps[qpid]->doorbell = (uint64_t* ) calloc(TRACE_MAX_SLOTS, sizeof(uint64_t));
+    }
+    if((qps[qpid] == NULL) || (qps[qpid]->build == NULL) || (qps[qpid]->doorbell == NULL)) {
+      fprintf(stderr, "Error: failed to allocate the state of QP%d\n", qpid);
+      exit(1);
+    }
+  }
+  return qps[qpid];
+}
+
+static uint32_t ring_dist(uint32_t to, uint32_t from, uint32_t qdepth) {
+  if(qdepth == 0) {
+    return 0;
+  }
+  return (to + qdepth - from) % qdepth;
+}
+
+// Start event of a DMA transfer or request, the oldest entry is reused when all are taken
+static void pending_start(const struct rn_trace_rec_t* rec) {
+  struct trace_pending_t* p = &pending[pending_next];
+
+  pending_next = (pending_next + 1) % TRACE_MAX_PENDING;
+  p->tsc   = rec->tsc;
+  p->event = rec->event;
+  p->id    = rec->id;
+  p->arg   = rec->arg;
+}
+
+// End event of a DMA transfer or request, matched against the latest start with the same tag
+static uint64_t pending_end(const struct rn_trace_rec_t* rec, uint16_t start_event) {
+  uint32_t i;
+  uint32_t idx;
+  uint64_t tsc;
+
+  for(i=1; i<=TRACE_MAX_PENDING; i++) {
+    idx = (pending_next + TRACE_MAX_PENDING - i) % TRACE_MAX_PENDING;
+    if((pending[idx].tsc != 0) && (pending[idx].event == start_event) &&
+       (pending[idx].id == rec->id) && (pending[idx].arg == rec->arg)) {
+      tsc = pending[idx].tsc;
+      pending[idx].tsc = 0;
+      return tsc;
+    }
+  }
+  return 0;
+}
+
+static void process(const struct rn_trace_rec_t* rec) {
+  struct trace_qp_t* qp;
+  uint32_t qdepth;
+  uint32_t idx;
+  uint32_t num;
+  uint32_t slot;
+  uint32_t i;
+
+  switch(rec->event) {
+  case RN_TRACE_WQE_BUILD:
+    qp = get_qp(rec->id);
+    slot = rec->arg % TRACE_MAX_SLOTS;
+    qp->build[slot]    = rec->tsc;
+    qp->doorbell[slot] = 0;
+    break;
+  case RN_TRACE_SQ_DOORBELL:
+    qp = get_qp(rec->id);
+    qdepth = rec->arg >> 16;
+    idx    = rec->arg & 0xffff;
+    num    = ring_dist(idx, qp->sq_pidb, qdepth);
+    for(i=0; i<num; i++) {
+      slot = (qp->sq_pidb + i) % qdepth;
+      qp->doorbell[slot] = rec->tsc;
+      add_sample(STAGE_BUILD_TO_DOORBELL, qp->build[slot], rec->tsc);
+    }
+    qp->sq_pidb = idx;
+    break;
+  case RN_TRACE_CQ_OBSERVED:
+    qp = get_qp(rec->id);
+    qdepth = rec->arg >> 16;
+    idx    = rec->arg & 0xffff;
+    num    = ring_dist(idx, qp->sq_cidb, qdepth);
+    for(i=0; i<num; i++) {
+      slot = (qp->sq_cidb + i) % qdepth;
+      add_sample(STAGE_DOORBELL_TO_CQ, qp->doorbell[slot], rec->tsc);
+      add_sample(STAGE_BUILD_TO_CQ, qp->build[slot], rec->tsc);
+      qp->build[slot]    = 0;
+      qp->doorbell[slot] = 0;
+    }
+    qp->sq_cidb = idx;
+    break;
+  case RN_TRACE_RQ_OBSERVED:
+    qp = get_qp(rec->id);
+    add_sample(STAGE_RQ_GAP, qp->last_rq, rec->tsc);
+    qp->last_rq = rec->tsc;
+    break;
+  case RN_TRACE_DMA_SUBMIT:
+  case RN_TRACE_DMA_QUEUED:
+    pending_start(rec);
+    break;
+  case RN_TRACE_DMA_COMPLETE:
+    add_sample((rec->id == RN_DMA_H2C) ? STAGE_DMA_H2C : STAGE_DMA_C2H,
+               pending_end(rec, RN_TRACE_DMA_SUBMIT), rec->tsc);
+    break;
+  case RN_TRACE_DMA_DONE:
+    add_sample((rec->id == RN_DMA_H2C) ? STAGE_DMA_REQ_H2C : STAGE_DMA_REQ_C2H,
+               pending_end(rec, RN_TRACE_DMA_QUEUED), rec->tsc);
+    break;
+  default:
+    break;
+  }
+}
+
+static int compare_rec(const void* a, const void* b) {
+  const struct rn_trace_rec_t* ra = (const struct rn_trace_rec_t* ) a;
+  const struct rn_trace_rec_t* rb = (const struct rn_trace_rec_t* ) b;
+
+  return (ra->tsc > rb->tsc) - (ra->tsc < rb->tsc);
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t va = *(const uint64_t* ) a;
+  uint64_t vb = *(const uint64_t* ) b;
+
+  return (va > vb) - (va < vb);
+}
+
+static double to_ns(uint64_t ticks, uint64_t tsc_hz) {
+  return ((double) ticks * NSEC_DIV) / (double) tsc_hz;
+}
+
+static uint64_t percentile(const struct trace_samples_t* s, double p) {
+  uint64_t idx = (uint64_t) (p * (double) (s->num - 1) + 0.5);
+
+  return s->values[idx];
+}
+
+static void report(uint64_t tsc_hz) {
+  struct trace_samples_t* s;
+  double sum;
+  uint64_t i;
+  int stage;
+
+  fprintf(stdout, "%-20s %10s %12s %12s %12s %12s %12s\n",
+          "stage", "count", "mean_ns", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+  for(stage=0; stage<NUM_STAGES; stage++) {
+    s = &samples[stage];
+    if(s->num == 0) {
+      continue;
+    }
+
+    qsort(s->values, s->num, sizeof(uint64_t), compare_u64);
+    sum = 0;
+    for(i=0; i<s->num; i++) {
+      sum += (double) s->values[i];
+    }
+    fprintf(stdout, "%-20s %10ld %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+            stage_names[stage], s->num,
+            to_ns((uint64_t) (sum / (double) s->num), tsc_hz),
+            to_ns(percentile(s, 0.50), tsc_hz),
+            to_ns(percentile(s, 0.99), tsc_hz),
+            to_ns(percentile(s, 0.999), tsc_hz),
+            to_ns(s->values[s->num - 1], tsc_hz));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int cmd_opt;
+  char *file = NULL;
+  FILE *fp;
+  struct rn_trace_file_hdr_t file_hdr;
+  struct rn_trace_ring_hdr_t ring_hdr;
+  struct rn_trace_rec_t* recs = NULL;
+  struct rn_trace_rec_t* more;
+  uint64_t num_recs = 0;
+  uint64_t dropped = 0;
+  uint64_t i;
+  uint32_t r;
+
+  while ((cmd_opt = getopt_long(argc, argv, "f:h", long_opts, NULL)) != -1) {
+    switch (cmd_opt) {
+    case 'f':
+      file = optarg;
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      exit(0);
+      break;
+    }
+  }
+
+  if(file == NULL) {
+    fprintf(stderr, "Error: a trace file is required\n");
+    usage(argv[0]);
+    exit(1);
+  }
+
+  fp = fopen(file, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "Error: failed to open trace file %s\n", file);
+    exit(1);
+  }
+
+  if((fread(&file_hdr, sizeof(file_hdr), 1, fp) != 1) || (file_hdr.magic != RN_TRACE_MAGIC)) {
+    fprintf(stderr, "Error: %s is not a trace file\n", file);
+    exit(1);
+  }
+  if((file_hdr.version != RN_TRACE_VERSION) || (file_hdr.tsc_hz == 0)) {
+    fprintf(stderr, "Error: unsupported trace file version %d\n", file_hdr.version);
+    exit(1);
+  }
+
+  // Load the rings of all threads into one array
+  for(r=0; r<file_hdr.num_rings; r++) {
+    if(fread(&ring_hdr, sizeof(ring_hdr), 1, fp) != 1) {
+      fprintf(stderr, "Error: trace file %s is truncated\n", file);
+      exit(1);
+    }
+    if(ring_hdr.num_recs > 0) {
+      more = (struct rn_trace_rec_t* ) realloc(recs, (num_recs + ring_hdr.num_recs) * sizeof(struct rn_trace_rec_t));
+      if(more == NULL) {
+        fprintf(stderr, "Error: failed to allocate %ld trace records\n", num_recs + ring_hdr.num_recs);
+        exit(1);
+      }
+      recs = more;
+      if(fread(&recs[num_recs], sizeof(struct rn_trace_rec_t), ring_hdr.num_recs, fp) != ring_hdr.num_recs) {
+        fprintf(stderr, "Error: trace file %s is truncated\n", file);
+        exit(1);
+      }
+    }
+    fprintf(stdout, "Info: thread %d: %ld records, %ld dropped\n", ring_hdr.tid, ring_hdr.num_recs, ring_hdr.dropped);
+    num_recs += ring_hdr.num_recs;
+    dropped  += ring_hdr.dropped;
+  }
+  fclose(fp);
+
+  fprintf(stdout, "Info: %ld records of %d threads, timestamp counter at %.3f MHz\n",
+          num_recs, file_hdr.num_rings, (double) file_hdr.tsc_hz / 1000000);
+  if(dropped > 0) {
+    fprintf(stdout, "Warning: %ld records were overwritten, stages at the start of the trace may be missing\n", dropped);
+  }
+
+  qsort(recs, num_recs, sizeof(struct rn_trace_rec_t), compare_rec);
+  for(i=0; i<num_recs; i++) {
+    process(&recs[i]);
+  }
+  report(file_hdr.tsc_hz);
+
+  free(recs);
+  return 0;
+}
@@ -10,6 +10,10 @@
 
 #include "auxiliary.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /* Subtract timespec t2 from t1
  *
  * Both t1 and t2 must already be normalized
@@ -45,3 +49,458 @@ void timespec_sub(struct timespec *t1, struct timespec *t2)
 		t1->tv_nsec += 1000000000;
 	}
 }
+
+/* SIMD verification and reference kernels
+ *
+ * Each kernel has a scalar version and, on x86, AVX2 and AVX-512 versions built 
+ * with target attributes, so the library needs no -m flags. The widest version the 
+ * CPU supports is picked at run time.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RN_SIMD_X86
+#endif
+
+#define RN_GEMM_REF_BLOCK_K 128
+#define RN_GEMM_REF_BLOCK_N 256
+
+static int rn_simd = -1;
+
+int rn_simd_level(void)
+{
+	int level = __atomic_load_n(&rn_simd, __ATOMIC_RELAXED);
+
+	if (level >= 0)
+		return level;
+
+	level = RN_SIMD_SCALAR;
+#ifdef RN_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		level = RN_SIMD_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		level = RN_SIMD_AVX2;
+#endif
+	__atomic_store_n(&rn_simd, level, __ATOMIC_RELAXED);
+	return level;
+}
+
+static int64_t mem_mismatch_scalar(const uint8_t *a, const uint8_t *b,
+				   uint64_t i, uint64_t size)
+{
+	for (; i < size; i++) {
+		if (a[i] != b[i])
+			return (int64_t)i;
+	}
+	return -1;
+}
+
+/* Sum of the 32-bit words weighted by their index, the tail is zero-padded */
+static uint64_t checksum_scalar(const uint8_t *buf, uint64_t i, uint64_t size,
+				uint64_t sum)
+{
+	uint32_t word;
+
+	for (; i + 4 <= size; i += 4) {
+		memcpy(&word, buf + i, 4);
+		sum += (uint64_t)word * (uint32_t)((i >> 2) + 1);
+	}
+	if (i < size) {
+		word = 0;
+		memcpy(&word, buf + i, size - i);
+		sum += (uint64_t)word * (uint32_t)((i >> 2) + 1);
+	}
+	return sum;
+}
+
+static void gemm_ref_scalar(const int32_t *a, const int32_t *b, int32_t *c,
+			    uint32_t k, uint32_t n, uint32_t i0, uint32_t i1,
+			    uint32_t j0, uint32_t j1, uint32_t k0, uint32_t k1)
+{
+	uint32_t i, j, p;
+	int32_t aik;
+
+	for (i = i0; i < i1; i++) {
+		for (p = k0; p < k1; p++) {
+			aik = a[(uint64_t)i * k + p];
+			for (j = j0; j < j1; j++)
+				c[(uint64_t)i * n + j] += (int32_t)((uint32_t)aik *
+					(uint32_t)b[(uint64_t)p * n + j]);
+		}
+	}
+}
+
+#ifdef RN_SIMD_X86
+__attribute__((target("avx2")))
+static int64_t mem_mismatch_avx2(const uint8_t *a, const uint8_t *b, uint64_t size)
+{
+	uint64_t i = 0;
+	uint32_t mask;
+	__m256i va, vb;
+
+	for (; i + 32 <= size; i += 32) {
+		va = _mm256_loadu_si256((const __m256i *)(a + i));
+		vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != 0xffffffff)
+			return (int64_t)(i + __builtin_ctz(~mask));
+	}
+	return mem_mismatch_scalar(a, b, i, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int64_t mem_mismatch_avx512(const uint8_t *a, const uint8_t *b, uint64_t size)
+{
+	uint64_t i = 0;
+	__mmask64 mask;
+	__m512i va, vb;
+
+	for (; i + 64 <= size; i += 64) {
+		va = _mm512_loadu_si512((const void *)(a + i));
+		vb = _mm512_loadu_si512((const void *)(b + i));
+		mask = _mm512_cmpneq_epi8_mask(va, vb);
+		if (mask)
+			return (int64_t)(i + __builtin_ctzll(mask));
+	}
+	return mem_mismatch_scalar(a, b, i, size);
+}
+
+__attribute__((target("avx2")))
+static void fill_seq8_avx2(uint8_t *buf, uint64_t size, uint8_t seed)
+{
+	const __m256i step = _mm256_set1_epi8(32);
+	__m256i v = _mm256_add_epi8(_mm256_set1_epi8((char)seed),
+		_mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+				 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31));
+	uint64_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		_mm256_storeu_si256((__m256i *)(buf + i), v);
+		v = _mm256_add_epi8(v, step);
+	}
+	for (; i < size; i++)
+		buf[i] = (uint8_t)(seed + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fill_seq8_avx512(uint8_t *buf, uint64_t size, uint8_t seed)
+{
+	const __m512i step = _mm512_set1_epi8(64);
+	__m512i v = _mm512_add_epi8(_mm512_set1_epi8((char)seed),
+		_mm512_set_epi8(63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48,
+				47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32,
+				31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16,
+				15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+	uint64_t i = 0;
+
+	for (; i + 64 <= size; i += 64) {
+		_mm512_storeu_si512((void *)(buf + i), v);
+		v = _mm512_add_epi8(v, step);
+	}
+	for (; i < size; i++)
+		buf[i] = (uint8_t)(seed + i);
+}
+
+/* Lanes hold i % mod and advance by 8 % mod, wrapping once with an unsigned min:
+ * v - mod is below v only if v >= mod. mod is below 2^31 so v + step can't overflow.
+ */
+__attribute__((target("avx2")))
+static void fill_mod32_avx2(uint32_t *buf, uint64_t count, uint32_t mod)
+{
+	const __m256i vmod = _mm256_set1_epi32((int)mod);
+	const __m256i step = _mm256_set1_epi32((int)(8 % mod));
+	__m256i v = _mm256_setr_epi32(0 % mod, 1 % mod, 2 % mod, 3 % mod,
+				      4 % mod, 5 % mod, 6 % mod, 7 % mod);
+	uint64_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_si256((__m256i *)(buf + i), v);
+		v = _mm256_add_epi32(v, step);
+		v = _mm256_min_epu32(v, _mm256_sub_epi32(v, vmod));
+	}
+	for (; i < count; i++)
+		buf[i] = (uint32_t)(i % mod);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fill_mod32_avx512(uint32_t *buf, uint64_t count, uint32_t mod)
+{
+	const __m512i vmod = _mm512_set1_epi32((int)mod);
+	const __m512i step = _mm512_set1_epi32((int)(16 % mod));
+	__m512i v = _mm512_setr_epi32(0 % mod, 1 % mod, 2 % mod, 3 % mod,
+				      4 % mod, 5 % mod, 6 % mod, 7 % mod,
+				      8 % mod, 9 % mod, 10 % mod, 11 % mod,
+				      12 % mod, 13 % mod, 14 % mod, 15 % mod);
+	uint64_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_si512((void *)(buf + i), v);
+		v = _mm512_add_epi32(v, step);
+		v = _mm512_min_epu32(v, _mm512_sub_epi32(v, vmod));
+	}
+	for (; i < count; i++)
+		buf[i] = (uint32_t)(i % mod);
+}
+
+/* _mm256_mul_epu32 multiplies the low 32 bits of each 64-bit lane, so the even words
+ * and the odd words shifted down are weighted separately.
+ */
+__attribute__((target("avx2")))
+static uint64_t checksum_avx2(const uint8_t *buf, uint64_t size)
+{
+	const __m256i step = _mm256_set1_epi64x(8);
+	__m256i w_even = _mm256_setr_epi64x(1, 3, 5, 7);
+	__m256i w_odd = _mm256_setr_epi64x(2, 4, 6, 8);
+	__m256i acc = _mm256_setzero_si256();
+	__m256i v;
+	uint64_t lanes[4];
+	uint64_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(v, w_even));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(_mm256_srli_epi64(v, 32), w_odd));
+		w_even = _mm256_add_epi64(w_even, step);
+		w_odd = _mm256_add_epi64(w_odd, step);
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	return checksum_scalar(buf, i, size, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t checksum_avx512(const uint8_t *buf, uint64_t size)
+{
+	const __m512i step = _mm512_set1_epi64(16);
+	__m512i w_even = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+	__m512i w_odd = _mm512_setr_epi64(2, 4, 6, 8, 10, 12, 14, 16);
+	__m512i acc = _mm512_setzero_si512();
+	__m512i v;
+	uint64_t i = 0;
+
+	for (; i + 64 <= size; i += 64) {
+		v = _mm512_loadu_si512((const void *)(buf + i));
+		acc = _mm512_add_epi64(acc, _mm512_mul_epu32(v, w_even));
+		acc = _mm512_add_epi64(acc, _mm512_mul_epu32(_mm512_srli_epi64(v, 32), w_odd));
+		w_even = _mm512_add_epi64(w_even, step);
+		w_odd = _mm512_add_epi64(w_odd, step);
+	}
+	return checksum_scalar(buf, i, size, (uint64_t)_mm512_reduce_add_epi64(acc));
+}
+
+/* 4 x 16 register block of C, the rest of the block is done by the scalar kernel */
+__attribute__((target("avx2")))
+static void gemm_ref_avx2(const int32_t *a, const int32_t *b, int32_t *c,
+			  uint32_t m, uint32_t k, uint32_t n, uint32_t j0,
+			  uint32_t j1, uint32_t k0, uint32_t k1)
+{
+	__m256i c00, c01, c10, c11, c20, c21, c30, c31;
+	__m256i b0, b1, va;
+	const int32_t *ap;
+	const int32_t *bp;
+	int32_t *cp;
+	uint32_t i, j, p;
+	uint32_t jv = j0 + ((j1 - j0) & ~15U);
+	uint32_t iv = m & ~3U;
+
+	for (i = 0; i < iv; i += 4) {
+		ap = a + (uint64_t)i * k;
+		for (j = j0; j < jv; j += 16) {
+			cp = c + (uint64_t)i * n + j;
+			c00 = _mm256_loadu_si256((const __m256i *)(cp));
+			c01 = _mm256_loadu_si256((const __m256i *)(cp + 8));
+			c10 = _mm256_loadu_si256((const __m256i *)(cp + n));
+			c11 = _mm256_loadu_si256((const __m256i *)(cp + n + 8));
+			c20 = _mm256_loadu_si256((const __m256i *)(cp + 2 * (uint64_t)n));
+			c21 = _mm256_loadu_si256((const __m256i *)(cp + 2 * (uint64_t)n + 8));
+			c30 = _mm256_loadu_si256((const __m256i *)(cp + 3 * (uint64_t)n));
+			c31 = _mm256_loadu_si256((const __m256i *)(cp + 3 * (uint64_t)n + 8));
+			for (p = k0; p < k1; p++) {
+				bp = b + (uint64_t)p * n + j;
+				b0 = _mm256_loadu_si256((const __m256i *)(bp));
+				b1 = _mm256_loadu_si256((const __m256i *)(bp + 8));
+				va = _mm256_set1_epi32(ap[p]);
+				c00 = _mm256_add_epi32(c00, _mm256_mullo_epi32(va, b0));
+				c01 = _mm256_add_epi32(c01, _mm256_mullo_epi32(va, b1));
+				va = _mm256_set1_epi32(ap[k + p]);
+				c10 = _mm256_add_epi32(c10, _mm256_mullo_epi32(va, b0));
+				c11 = _mm256_add_epi32(c11, _mm256_mullo_epi32(va, b1));
+				va = _mm256_set1_epi32(ap[2 * (uint64_t)k + p]);
+				c20 = _mm256_add_epi32(c20, _mm256_mullo_epi32(va, b0));
+				c21 = _mm256_add_epi32(c21, _mm256_mullo_epi32(va, b1));
+				va = _mm256_set1_epi32(ap[3 * (uint64_t)k + p]);
+				c30 = _mm256_add_epi32(c30, _mm256_mullo_epi32(va, b0));
+				c31 = _mm256_add_epi32(c31, _mm256_mullo_epi32(va, b1));
+			}
+			_mm256_storeu_si256((__m256i *)(cp), c00);
+			_mm256_storeu_si256((__m256i *)(cp + 8), c01);
+			_mm256_storeu_si256((__m256i *)(cp + n), c10);
+			_mm256_storeu_si256((__m256i *)(cp + n + 8), c11);
+			_mm256_storeu_si256((__m256i *)(cp + 2 * (uint64_t)n), c20);
+			_mm256_storeu_si256((__m256i *)(cp + 2 * (uint64_t)n + 8), c21);
+			_mm256_storeu_si256((__m256i *)(cp + 3 * (uint64_t)n), c30);
+			_mm256_storeu_si256((__m256i *)(cp + 3 * (uint64_t)n + 8), c31);
+		}
+	}
+	gemm_ref_scalar(a, b, c, k, n, 0, iv, jv, j1, k0, k1);
+	gemm_ref_scalar(a, b, c, k, n, iv, m, j0, j1, k0, k1);
+}
+
+/* 4 x 32 register block of C */
+__attribute__((target("avx512f,avx512bw")))
+static void gemm_ref_avx512(const int32_t *a, const int32_t *b, int32_t *c,
+			    uint32_t m, uint32_t k, uint32_t n, uint32_t j0,
+			    uint32_t j1, uint32_t k0, uint32_t k1)
+{
+	__m512i c00, c01, c10, c11, c20, c21, c30, c31;
+	__m512i b0, b1, va;
+	const int32_t *ap;
+	const int32_t *bp;
+	int32_t *cp;
+	uint32_t i, j, p;
+	uint32_t jv = j0 + ((j1 - j0) & ~31U);
+	uint32_t iv = m & ~3U;
+
+	for (i = 0; i < iv; i += 4) {
+		ap = a + (uint64_t)i * k;
+		for (j = j0; j < jv; j += 32) {
+			cp = c + (uint64_t)i * n + j;
+			c00 = _mm512_loadu_si512((const void *)(cp));
+			c01 = _mm512_loadu_si512((const void *)(cp + 16));
+			c10 = _mm512_loadu_si512((const void *)(cp + n));
+			c11 = _mm512_loadu_si512((const void *)(cp + n + 16));
+			c20 = _mm512_loadu_si512((const void *)(cp + 2 * (uint64_t)n));
+			c21 = _mm512_loadu_si512((const void *)(cp + 2 * (uint64_t)n + 16));
+			c30 = _mm512_loadu_si512((const void *)(cp + 3 * (uint64_t)n));
+			c31 = _mm512_loadu_si512((const void *)(cp + 3 * (uint64_t)n + 16));
+			for (p = k0; p < k1; p++) {
+				bp = b + (uint64_t)p * n + j;
+				b0 = _mm512_loadu_si512((const void *)(bp));
+				b1 = _mm512_loadu_si512((const void *)(bp + 16));
+				va = _mm512_set1_epi32(ap[p]);
+				c00 = _mm512_add_epi32(c00, _mm512_mullo_epi32(va, b0));
+				c01 = _mm512_add_epi32(c01, _mm512_mullo_epi32(va, b1));
+				va = _mm512_set1_epi32(ap[k + p]);
+				c10 = _mm512_add_epi32(c10, _mm512_mullo_epi32(va, b0));
+				c11 = _mm512_add_epi32(c11, _mm512_mullo_epi32(va, b1));
+				va = _mm512_set1_epi32(ap[2 * (uint64_t)k + p]);
+				c20 = _mm512_add_epi32(c20, _mm512_mullo_epi32(va, b0));
+				c21 = _mm512_add_epi32(c21, _mm512_mullo_epi32(va, b1));
+				va = _mm512_set1_epi32(ap[3 * (uint64_t)k + p]);
+				c30 = _mm512_add_epi32(c30, _mm512_mullo_epi32(va, b0));
+				c31 = _mm512_add_epi32(c31, _mm512_mullo_epi32(va, b1));
+			}
+			_mm512_storeu_si512((void *)(cp), c00);
+			_mm512_storeu_si512((void *)(cp + 16), c01);
+			_mm512_storeu_si512((void *)(cp + n), c10);
+			_mm512_storeu_si512((void *)(cp + n + 16), c11);
+			_mm512_storeu_si512((void *)(cp + 2 * (uint64_t)n), c20);
+			_mm512_storeu_si512((void *)(cp + 2 * (uint64_t)n + 16), c21);
+			_mm512_storeu_si512((void *)(cp + 3 * (uint64_t)n), c30);
+			_mm512_storeu_si512((void *)(cp + 3 * (uint64_t)n + 16), c31);
+		}
+	}
+	gemm_ref_scalar(a, b, c, k, n, 0, iv, jv, j1, k0, k1);
+	gemm_ref_scalar(a, b, c, k, n, iv, m, j0, j1, k0, k1);
+}
+#endif /* RN_SIMD_X86 */
+
+int64_t rn_mem_mismatch(const void *a, const void *b, uint64_t size)
+{
+#ifdef RN_SIMD_X86
+	switch (rn_simd_level()) {
+	case RN_SIMD_AVX512:
+		return mem_mismatch_avx512(a, b, size);
+	case RN_SIMD_AVX2:
+		return mem_mismatch_avx2(a, b, size);
+	}
+#endif
+	return mem_mismatch_scalar(a, b, 0, size);
+}
+
+void rn_fill_seq8(void *buf, uint64_t size, uint8_t seed)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint64_t i;
+
+#ifdef RN_SIMD_X86
+	switch (rn_simd_level()) {
+	case RN_SIMD_AVX512:
+		fill_seq8_avx512(p, size, seed);
+		return;
+	case RN_SIMD_AVX2:
+		fill_seq8_avx2(p, size, seed);
+		return;
+	}
+#endif
+	for (i = 0; i < size; i++)
+		p[i] = (uint8_t)(seed + i);
+}
+
+void rn_fill_mod32(uint32_t *buf, uint64_t count, uint32_t mod)
+{
+	uint64_t i;
+
+	if (mod == 0) {
+		for (i = 0; i < count; i++)
+			buf[i] = (uint32_t)i;
+		return;
+	}
+#ifdef RN_SIMD_X86
+	if (mod < 0x80000000) {
+		switch (rn_simd_level()) {
+		case RN_SIMD_AVX512:
+			fill_mod32_avx512(buf, count, mod);
+			return;
+		case RN_SIMD_AVX2:
+			fill_mod32_avx2(buf, count, mod);
+			return;
+		}
+	}
+#endif
+	for (i = 0; i < count; i++)
+		buf[i] = (uint32_t)(i % mod);
+}
+
+uint64_t rn_checksum(const void *buf, uint64_t size)
+{
+#ifdef RN_SIMD_X86
+	switch (rn_simd_level()) {
+	case RN_SIMD_AVX512:
+		return checksum_avx512(buf, size);
+	case RN_SIMD_AVX2:
+		return checksum_avx2(buf, size);
+	}
+#endif
+	return checksum_scalar(buf, 0, size, 0);
+}
+
+void rn_gemm_ref(const int32_t *a, const int32_t *b, int32_t *c,
+		 uint32_t m, uint32_t k, uint32_t n)
+{
+	int level = rn_simd_level();
+	uint32_t k0, k1, j0, j1;
+
+	memset(c, 0, (uint64_t)m * n * sizeof(int32_t));
+
+	/* A block of RN_GEMM_REF_BLOCK_K rows of B stays in cache while every row of
+	 * A is multiplied with it.
+	 */
+	for (k0 = 0; k0 < k; k0 += RN_GEMM_REF_BLOCK_K) {
+		k1 = (k - k0 < RN_GEMM_REF_BLOCK_K) ? k : k0 + RN_GEMM_REF_BLOCK_K;
+		for (j0 = 0; j0 < n; j0 += RN_GEMM_REF_BLOCK_N) {
+			j1 = (n - j0 < RN_GEMM_REF_BLOCK_N) ? n : j0 + RN_GEMM_REF_BLOCK_N;
+#ifdef RN_SIMD_X86
+			if (level == RN_SIMD_AVX512) {
+				gemm_ref_avx512(a, b, c, m, k, n, j0, j1, k0, k1);
+				continue;
+			}
+			if (level == RN_SIMD_AVX2) {
+				gemm_ref_avx2(a, b, c, m, k, n, j0, j1, k0, k1);
+				continue;
+			}
+#endif
+			(void)level;
+			gemm_ref_scalar(a, b, c, k, n, 0, m, j0, j1, k0, k1);
+		}
+	}
+}
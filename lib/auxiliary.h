@@ -48,12 +48,27 @@ extern int debug;
 
 /*! \def Debug(fmt, ...)
     \brief Define a debug message format.
+
+    Debug messages are only compiled in when the library is built with RN_DEBUG defined
+    (make DEBUG=1), and then printed when the global debug flag is set. Otherwise the 
+    arguments are type-checked but never evaluated.
 */
+#ifdef RN_DEBUG
+#define Debug(fmt, ...) \
+    do { \
+      if(debug == 1) { \
+          fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
+              __LINE__, __func__, ##__VA_ARGS__); \
+      } \
+    } while(0)
+#else
 #define Debug(fmt, ...) \
-    if(debug == 1) { \
-        fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-            __LINE__, __func__, ##__VA_ARGS__); \
-    }
+    do { \
+      if(0) { \
+          fprintf(stderr, fmt, ##__VA_ARGS__); \
+      } \
+    } while(0)
+#endif
 
 /*
 #define Debug(fmt, ...) \
@@ -63,6 +78,17 @@ extern int debug;
    }
 */
 
+/*! \def cpu_relax()
+    \brief Hint the CPU that the caller is in a spin-wait loop.
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 /*! \def htonll(x)
     \brief Conversion from host byte order to network byte order.
 */
@@ -80,4 +106,65 @@ extern int debug;
  */
 void timespec_sub(struct timespec *t1, struct timespec *t2);
 
+/*! \enum rn_simd_t
+    \brief Instruction sets used by the verification and reference kernels.
+*/
+typedef enum {
+  RN_SIMD_SCALAR = 0, /*!< Portable C. */
+  RN_SIMD_AVX2,       /*!< AVX2. */
+  RN_SIMD_AVX512      /*!< AVX-512F and AVX-512BW. */
+} rn_simd_t;
+
+/** @brief Get the instruction set used by the verification and reference kernels, the
+ *         widest one supported by the CPU. Detected on first use.
+ *  @return one of rn_simd_t.
+ */
+int rn_simd_level(void);
+
+/** @brief Find the first byte where two buffers differ.
+ *  @param a first buffer.
+ *  @param b second buffer.
+ *  @param size size of both buffers in bytes.
+ *  @return offset of the first differing byte, or -1 if the buffers are equal.
+ */
+int64_t rn_mem_mismatch(const void *a, const void *b, uint64_t size);
+
+/** @brief Fill a buffer with an incrementing byte pattern: buf[i] = (uint8_t) (seed + i).
+ *  @param buf buffer to fill.
+ *  @param size size of the buffer in bytes.
+ *  @param seed value of the first byte.
+ *  @return void.
+ */
+void rn_fill_seq8(void *buf, uint64_t size, uint8_t seed);
+
+/** @brief Fill a buffer with a repeating word pattern: buf[i] = i % mod.
+ *  @param buf buffer to fill.
+ *  @param count number of 32-bit words.
+ *  @param mod period of the pattern, 0 for buf[i] = i.
+ *  @return void.
+ */
+void rn_fill_mod32(uint32_t *buf, uint64_t count, uint32_t mod);
+
+/** @brief Compute a position-dependent checksum of a buffer: the sum of its 32-bit words
+ *         multiplied by (uint32_t) (index + 1), modulo 2^64. A partial last word is 
+ *         zero-padded. Equal buffers always give equal checksums on every instruction set.
+ *  @param buf buffer.
+ *  @param size size of the buffer in bytes.
+ *  @return checksum.
+ */
+uint64_t rn_checksum(const void *buf, uint64_t size);
+
+/** @brief Reference integer matrix multiplication C = A x B, blocked for the cache and 
+ *         vectorized. Products wrap around like the accelerator's 32-bit arithmetic.
+ *  @param a row-major m x k matrix A.
+ *  @param b row-major k x n matrix B.
+ *  @param c row-major m x n matrix C, overwritten.
+ *  @param m rows of A and C.
+ *  @param k columns of A and rows of B.
+ *  @param n columns of B and C.
+ *  @return void.
+ */
+void rn_gemm_ref(const int32_t *a, const int32_t *b, int32_t *c,
+                 uint32_t m, uint32_t k, uint32_t n);
+
 #endif /* __AUXILIARY_H__ */
\ No newline at end of file
@@ -0,0 +1,305 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file buffer_pool.c
+ *  @brief Implementation of the RDMA buffer allocator.
+ */
+
+#include "buffer_pool.h"
+
+#define RN_POOL_NIL       0xffffffff
+#define RN_POOL_PAGE_BUSY 0xff
+#define RN_POOL_PAGE_SIZE (1UL << RN_POOL_PAGE_SHIFT)
+
+// Largest order whose block starts at page and fits in num_pages pages
+static uint32_t rn_pool_fit_order(uint32_t page, uint64_t num_pages, uint32_t max_order) {
+  uint32_t order = 0;
+
+  while((order < max_order) && (((page >> order) & 1) == 0) && ((2UL << order) <= num_pages)) {
+    order++;
+  }
+  return order;
+}
+
+static void rn_pool_list_add(struct rn_pool_t* pool, uint32_t page, uint32_t order) {
+  pool->prev[page] = RN_POOL_NIL;
+  pool->next[page] = pool->free_head[order];
+  if(pool->free_head[order] != RN_POOL_NIL) {
+    pool->prev[pool->free_head[order]] = page;
+  }
+  pool->free_head[order] = page;
+  pool->page_state[page] = (uint8_t) order;
+}
+
+static void rn_pool_list_del(struct rn_pool_t* pool, uint32_t page, uint32_t order) {
+  if(pool->prev[page] != RN_POOL_NIL) {
+    pool->next[pool->prev[page]] = pool->next[page];
+  } else {
+    pool->free_head[order] = pool->next[page];
+  }
+  if(pool->next[page] != RN_POOL_NIL) {
+    pool->prev[pool->next[page]] = pool->prev[page];
+  }
+  pool->page_state[page] = RN_POOL_PAGE_BUSY;
+}
+
+// Free one aligned block and merge it with its free buddies
+static void rn_pool_free_block(struct rn_pool_t* pool, uint32_t page, uint32_t order) {
+  uint32_t buddy;
+
+  while(order < pool->max_order) {
+    buddy = page ^ (1U << order);
+    if(((uint64_t) buddy + (1UL << order) > pool->num_pages) || (pool->page_state[buddy] != order)) {
+      break;
+    }
+    rn_pool_list_del(pool, buddy, order);
+    page = (page < buddy) ? page : buddy;
+    order++;
+  }
+  rn_pool_list_add(pool, page, order);
+}
+
+// Free num_pages pages starting at page as a run of aligned blocks
+static void rn_pool_free_pages(struct rn_pool_t* pool, uint32_t page, uint64_t num_pages) {
+  uint32_t order;
+
+  while(num_pages > 0) {
+    order = rn_pool_fit_order(page, num_pages, pool->max_order);
+    rn_pool_free_block(pool, page, order);
+    page += (1U << order);
+    num_pages -= (1UL << order);
+  }
+}
+
+static int rn_pool_alloc_pages(struct rn_pool_t* pool, uint64_t num_pages, uint32_t* page) {
+  uint32_t order = 0;
+  uint32_t i;
+  uint32_t block;
+
+  while((1UL << order) < num_pages) {
+    order++;
+  }
+
+  for(i=order; i<=pool->max_order; i++) {
+    if(pool->free_head[i] != RN_POOL_NIL) {
+      break;
+    }
+  }
+  if(i > pool->max_order) {
+    return -1;
+  }
+
+  block = pool->free_head[i];
+  rn_pool_list_del(pool, block, i);
+  // Split down to the requested order, the upper halves go back to the free lists
+  while(i > order) {
+    i--;
+    rn_pool_list_add(pool, block + (1U << i), i);
+  }
+  // Give back the pages of the block past the request
+  if(num_pages < (1UL << order)) {
+    rn_pool_free_pages(pool, block + (uint32_t) num_pages, (1UL << order) - num_pages);
+  }
+
+  *page = block;
+  return 0;
+}
+
+static uint32_t rn_pool_slab_class(uint64_t size) {
+  uint32_t class_idx = 0;
+
+  while((RN_POOL_MIN_SLAB_SIZE << class_idx) < size) {
+    class_idx++;
+  }
+  return class_idx;
+}
+
+static void rn_pool_slab_link(struct rn_pool_t* pool, struct rn_slab_t* slab, uint32_t class_idx) {
+  slab->prev = NULL;
+  slab->next = pool->slabs[class_idx];
+  if(pool->slabs[class_idx] != NULL) {
+    pool->slabs[class_idx]->prev = slab;
+  }
+  pool->slabs[class_idx] = slab;
+}
+
+static void rn_pool_slab_unlink(struct rn_pool_t* pool, struct rn_slab_t* slab, uint32_t class_idx) {
+  if(slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    pool->slabs[class_idx] = slab->next;
+  }
+  if(slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+// Give the pages of empty cached slabs back to the buddy lists. Returns the number released.
+static uint32_t rn_pool_reclaim_slabs(struct rn_pool_t* pool) {
+  uint32_t i;
+  uint32_t num_released = 0;
+  struct rn_slab_t* slab;
+  struct rn_slab_t* next_slab;
+
+  for(i=0; i<RN_POOL_NUM_SLAB_CLASSES; i++) {
+    for(slab = pool->slabs[i]; slab != NULL; slab = next_slab) {
+      next_slab = slab->next;
+      if(slab->num_free == RN_POOL_PAGE_SIZE / slab->obj_size) {
+        rn_pool_slab_unlink(pool, slab, i);
+        rn_pool_free_pages(pool, (uint32_t) (slab->offset >> RN_POOL_PAGE_SHIFT), 1);
+        free(slab);
+        num_released++;
+      }
+    }
+  }
+  return num_released;
+}
+
+int rn_pool_init(struct rn_pool_t* pool, uint64_t size) {
+  uint32_t i;
+
+  pool->num_pages = (uint32_t) (size >> RN_POOL_PAGE_SHIFT);
+  pool->size = ((uint64_t) pool->num_pages) << RN_POOL_PAGE_SHIFT;
+  pool->free_bytes = 0;
+  pool->max_order = 0;
+  while((pool->max_order < RN_POOL_MAX_ORDER) && ((2UL << pool->max_order) <= pool->num_pages)) {
+    pool->max_order++;
+  }
+
+  for(i=0; i<=RN_POOL_MAX_ORDER; i++) {
+    pool->free_head[i] = RN_POOL_NIL;
+  }
+  for(i=0; i<RN_POOL_NUM_SLAB_CLASSES; i++) {
+    pool->slabs[i] = NULL;
+  }
+
+  pool->next = (uint32_t* ) malloc(((uint64_t) pool->num_pages) * sizeof(uint32_t));
+  pool->prev = (uint32_t* ) malloc(((uint64_t) pool->num_pages) * sizeof(uint32_t));
+  pool->page_state = (uint8_t* ) malloc(pool->num_pages);
+  if((pool->next == NULL) || (pool->prev == NULL) || (pool->page_state == NULL)) {
+    fprintf(stderr, "Error: failed to allocate buffer pool bookkeeping for %d pages\n", pool->num_pages);
+    rn_pool_destroy(pool);
+    return -1;
+  }
+  memset(pool->page_state, RN_POOL_PAGE_BUSY, pool->num_pages);
+
+  pthread_mutex_init(&(pool->lock), NULL);
+  rn_pool_free_pages(pool, 0, pool->num_pages);
+  pool->free_bytes = pool->size;
+
+  return 0;
+}
+
+void rn_pool_destroy(struct rn_pool_t* pool) {
+  uint32_t i;
+  struct rn_slab_t* slab;
+
+  for(i=0; i<RN_POOL_NUM_SLAB_CLASSES; i++) {
+    while(pool->slabs[i] != NULL) {
+      slab = pool->slabs[i];
+      pool->slabs[i] = slab->next;
+      free(slab);
+    }
+  }
+  free(pool->next);
+  free(pool->prev);
+  free(pool->page_state);
+  pool->next = NULL;
+  pool->prev = NULL;
+  pool->page_state = NULL;
+}
+
+int rn_pool_alloc(struct rn_pool_t* pool, uint64_t size, uint64_t* offset, 
+                  struct rn_slab_t** slab) {
+  uint32_t page;
+  uint32_t class_idx;
+  uint32_t obj_idx;
+  uint64_t num_pages;
+  struct rn_slab_t* cur_slab;
+
+  pthread_mutex_lock(&(pool->lock));
+
+  if(size <= RN_POOL_MAX_SLAB_SIZE) {
+    class_idx = rn_pool_slab_class(size);
+    cur_slab = pool->slabs[class_idx];
+    if(cur_slab == NULL) {
+      // No partial slab left in this class, start a new one
+      cur_slab = (struct rn_slab_t* ) malloc(sizeof(struct rn_slab_t));
+      if((cur_slab == NULL) || (rn_pool_alloc_pages(pool, 1, &page) < 0)) {
+        pthread_mutex_unlock(&(pool->lock));
+        free(cur_slab);
+        return -1;
+      }
+      cur_slab->offset   = ((uint64_t) page) << RN_POOL_PAGE_SHIFT;
+      cur_slab->obj_size = RN_POOL_MIN_SLAB_SIZE << class_idx;
+      cur_slab->num_free = RN_POOL_PAGE_SIZE / cur_slab->obj_size;
+      cur_slab->free_mask = (cur_slab->num_free == 64) ? ~0UL : ((1UL << cur_slab->num_free) - 1);
+      rn_pool_slab_link(pool, cur_slab, class_idx);
+    }
+
+    obj_idx = __builtin_ctzll(cur_slab->free_mask);
+    cur_slab->free_mask &= ~(1UL << obj_idx);
+    cur_slab->num_free--;
+    if(cur_slab->num_free == 0) {
+      rn_pool_slab_unlink(pool, cur_slab, class_idx);
+    }
+
+    *offset = cur_slab->offset + ((uint64_t) obj_idx) * cur_slab->obj_size;
+    *slab = cur_slab;
+    pool->free_bytes -= cur_slab->obj_size;
+  } else {
+    num_pages = (size + RN_POOL_PAGE_SIZE - 1) >> RN_POOL_PAGE_SHIFT;
+    // Cached empty slabs may split the block needed, retry once after reclaiming them
+    if((num_pages > pool->num_pages) || 
+       ((rn_pool_alloc_pages(pool, num_pages, &page) < 0) && 
+        ((rn_pool_reclaim_slabs(pool) == 0) || (rn_pool_alloc_pages(pool, num_pages, &page) < 0)))) {
+      pthread_mutex_unlock(&(pool->lock));
+      return -1;
+    }
+    *offset = ((uint64_t) page) << RN_POOL_PAGE_SHIFT;
+    *slab = NULL;
+    pool->free_bytes -= num_pages << RN_POOL_PAGE_SHIFT;
+  }
+
+  pthread_mutex_unlock(&(pool->lock));
+  return 0;
+}
+
+void rn_pool_free(struct rn_pool_t* pool, uint64_t offset, uint64_t size, 
+                  struct rn_slab_t* slab) {
+  uint32_t class_idx;
+  uint32_t obj_idx;
+  uint64_t num_pages;
+
+  pthread_mutex_lock(&(pool->lock));
+
+  if(slab != NULL) {
+    class_idx = rn_pool_slab_class(slab->obj_size);
+    obj_idx = (uint32_t) ((offset - slab->offset) / slab->obj_size);
+    if(slab->num_free == 0) {
+      rn_pool_slab_link(pool, slab, class_idx);
+    }
+    slab->free_mask |= (1UL << obj_idx);
+    slab->num_free++;
+    pool->free_bytes += slab->obj_size;
+
+    // Release an empty slab unless it is the only one left in its class
+    if((slab->num_free == RN_POOL_PAGE_SIZE / slab->obj_size) && 
+       ((slab->prev != NULL) || (slab->next != NULL))) {
+      rn_pool_slab_unlink(pool, slab, class_idx);
+      rn_pool_free_pages(pool, (uint32_t) (slab->offset >> RN_POOL_PAGE_SHIFT), 1);
+      free(slab);
+    }
+  } else {
+    num_pages = (size + RN_POOL_PAGE_SIZE - 1) >> RN_POOL_PAGE_SHIFT;
+    rn_pool_free_pages(pool, (uint32_t) (offset >> RN_POOL_PAGE_SHIFT), num_pages);
+    pool->free_bytes += num_pages << RN_POOL_PAGE_SHIFT;
+  }
+
+  pthread_mutex_unlock(&(pool->lock));
+}
@@ -0,0 +1,112 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file buffer_pool.h
+ *  @brief Header file of the RDMA buffer allocator.
+ *
+ *  A buffer pool manages one contiguous region (the hugepage host buffer or the device
+ *  memory) in units of HARDWARE_PAGE_SIZE. Requests larger than RN_POOL_MAX_SLAB_SIZE are
+ *  served by a buddy allocator that returns the unused tail of a block to the free lists, so
+ *  a request only takes the 4KB pages it covers. Smaller requests are carved from 4KB slabs
+ *  of fixed size classes and never cross a 4KB boundary. Freed pages coalesce with their
+ *  buddies, so the pool does not fragment over time.
+ */
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <pthread.h>
+#include "auxiliary.h"
+
+/*! \def RN_POOL_PAGE_SHIFT
+    \brief Shift of the pool page size, the pool page is HARDWARE_PAGE_SIZE (4KB).
+*/
+#define RN_POOL_PAGE_SHIFT 12
+
+/*! \def RN_POOL_MIN_SLAB_SIZE
+    \brief Object size of the smallest slab class.
+*/
+#define RN_POOL_MIN_SLAB_SIZE 64
+
+/*! \def RN_POOL_MAX_SLAB_SIZE
+    \brief Object size of the largest slab class. Larger requests take whole pages.
+*/
+#define RN_POOL_MAX_SLAB_SIZE 2048
+
+/*! \def RN_POOL_NUM_SLAB_CLASSES
+    \brief Number of slab classes, from RN_POOL_MIN_SLAB_SIZE to RN_POOL_MAX_SLAB_SIZE.
+*/
+#define RN_POOL_NUM_SLAB_CLASSES 6
+
+/*! \def RN_POOL_MAX_ORDER
+    \brief Largest buddy block order, a block of order n has (1 << n) pages.
+*/
+#define RN_POOL_MAX_ORDER 31
+
+/*! \struct rn_slab_t
+    \brief A 4KB page split into equal-size objects.
+*/
+struct rn_slab_t {
+  uint64_t offset;        /*!< offset pool offset of the slab page. */
+  uint64_t free_mask;     /*!< free_mask bit i is set when object i is free. */
+  uint32_t obj_size;      /*!< obj_size object size of the slab class. */
+  uint32_t num_free;      /*!< num_free number of free objects. */
+  struct rn_slab_t* next; /*!< next next partial slab of the class. */
+  struct rn_slab_t* prev; /*!< prev previous partial slab of the class. */
+};
+
+/*! \struct rn_pool_t
+    \brief Buffer pool over a contiguous memory region.
+*/
+struct rn_pool_t {
+  pthread_mutex_t lock;  /*!< lock protects the whole pool. */
+  uint64_t size;         /*!< size managed size in bytes, a multiple of the pool page. */
+  uint32_t num_pages;    /*!< num_pages number of pool pages. */
+  uint32_t max_order;    /*!< max_order largest block order of the pool. */
+  uint64_t free_bytes;   /*!< free_bytes bytes not handed out, including free slab objects. */
+  uint32_t free_head[RN_POOL_MAX_ORDER+1]; /*!< free_head first free block of each order. */
+  uint32_t* next;        /*!< next free list link of each page. */
+  uint32_t* prev;        /*!< prev free list back link of each page. */
+  uint8_t* page_state;   /*!< page_state order of the free block starting at each page, 
+                            0xff if no free block starts there. */
+  struct rn_slab_t* slabs[RN_POOL_NUM_SLAB_CLASSES]; /*!< slabs partial slabs of each class. */
+};
+
+/** @brief Initialize a buffer pool.
+ *  @param pool A pointer to the pool.
+ *  @param size Size of the managed region, rounded down to a multiple of 4KB.
+ *  @return Success (0) or Failure (-1).
+ */
+int rn_pool_init(struct rn_pool_t* pool, uint64_t size);
+
+/** @brief Release the bookkeeping of a buffer pool.
+ *  @param pool A pointer to the pool.
+ *  @return void.
+ */
+void rn_pool_destroy(struct rn_pool_t* pool);
+
+/** @brief Allocate a range from a buffer pool. Ranges of up to RN_POOL_MAX_SLAB_SIZE bytes
+ *         come from a slab and don't cross a 4KB boundary, larger ranges are 4KB aligned.
+ *  @param pool A pointer to the pool.
+ *  @param size Requested size in bytes.
+ *  @param offset Returns the offset of the range in the pool.
+ *  @param slab Returns the slab of the range, or NULL for a page range.
+ *  @return Success (0) or Failure (-1) when the pool is exhausted.
+ */
+int rn_pool_alloc(struct rn_pool_t* pool, uint64_t size, uint64_t* offset, 
+                  struct rn_slab_t** slab);
+
+/** @brief Return a range to a buffer pool.
+ *  @param pool A pointer to the pool.
+ *  @param offset Offset returned by rn_pool_alloc().
+ *  @param size Size passed to rn_pool_alloc().
+ *  @param slab Slab returned by rn_pool_alloc().
+ *  @return void.
+ */
+void rn_pool_free(struct rn_pool_t* pool, uint64_t offset, uint64_t size, 
+                  struct rn_slab_t* slab);
+
+#endif /* __BUFFER_POOL_H__ */
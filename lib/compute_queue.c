@@ -0,0 +1,193 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file compute_queue.c
+ *  @brief Implementation of the asynchronous compute job queue.
+ */
+
+#include "compute_queue.h"
+
+struct rn_compute_queue_t* rn_cq_create(void* axil_base, uint32_t depth) {
+  struct rn_compute_queue_t* queue = NULL;
+
+  if(depth == 0) {
+    depth = RN_CQ_DEFAULT_DEPTH;
+  }
+
+  if((axil_base == NULL) || (depth > RN_CQ_MAX_DEPTH)) {
+    fprintf(stderr, "Error: invalid argument to rn_cq_create, depth = %d\n", depth);
+    return NULL;
+  }
+
+  queue = (struct rn_compute_queue_t* ) calloc(1, sizeof(struct rn_compute_queue_t));
+  if(queue == NULL) {
+    fprintf(stderr, "Error: failed to allocate the compute queue\n");
+    return NULL;
+  }
+
+  queue->jobs = (struct rn_job_t* ) calloc(depth, sizeof(struct rn_job_t));
+  if(queue->jobs == NULL) {
+    fprintf(stderr, "Error: failed to allocate the compute queue slots\n");
+    free(queue);
+    return NULL;
+  }
+
+  queue->axil_base  = axil_base;
+  queue->cmd_offset = RN_CLR_CTL_CMD;
+  queue->sts_offset = RN_CLR_KER_STS;
+  queue->cnt_offset = RN_CLR_JOB_COMPLETED_NOT_READ;
+  queue->depth      = depth;
+
+  return queue;
+}
+
+void rn_cq_destroy(struct rn_compute_queue_t* queue) {
+  if(queue == NULL) {
+    return;
+  }
+
+  if(queue->num_pending != 0) {
+    fprintf(stderr, "Warning: destroying a compute queue with %d jobs in flight\n", queue->num_pending);
+  }
+
+  free(queue->jobs);
+  free(queue);
+}
+
+int rn_cq_submit(struct rn_compute_queue_t* queue, ctl_cmd_t* ctl_cmd, void* user_data) {
+  uint32_t i;
+  uint32_t slot = queue->depth;
+
+  if((queue->num_pending + queue->num_done) == queue->depth) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  for(i=0; i<queue->depth; i++) {
+    if(queue->jobs[(queue->next_slot + i) % queue->depth].state == RN_JOB_FREE) {
+      slot = (queue->next_slot + i) % queue->depth;
+      break;
+    }
+  }
+  if(slot == queue->depth) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  queue->jobs[slot].state     = RN_JOB_PENDING;
+  queue->jobs[slot].user_data = user_data;
+  queue->next_slot = (slot + 1) % queue->depth;
+  queue->num_pending++;
+
+  ctl_cmd->work_id = (uint16_t) slot;
+  issue_ctl_cmd(queue->axil_base, queue->cmd_offset, ctl_cmd);
+
+  Debug("DEBUG: Submitted compute job %d, %d jobs pending\n", slot, queue->num_pending);
+  return (int) slot;
+}
+
+uint32_t rn_cq_progress(struct rn_compute_queue_t* queue) {
+  uint32_t num_completed;
+  uint32_t work_id;
+  uint32_t i;
+
+  if(queue->num_pending == 0) {
+    return 0;
+  }
+
+  num_completed = read32_data((uint32_t* ) queue->axil_base, queue->cnt_offset);
+  for(i=0; i<num_completed; i++) {
+    // Each read pops one entry of the kernel status FIFO
+    work_id = read32_data((uint32_t* ) queue->axil_base, queue->sts_offset) & RN_CQ_WORK_ID_MASK;
+    if((work_id >= queue->depth) || (queue->jobs[work_id].state != RN_JOB_PENDING)) {
+      fprintf(stderr, "Warning: unexpected completion of compute job %d\n", work_id);
+      continue;
+    }
+
+    queue->jobs[work_id].state = RN_JOB_DONE;
+    queue->num_pending--;
+    queue->num_done++;
+  }
+
+  return num_completed;
+}
+
+// Release the slot of a completed job
+static void rn_cq_release(struct rn_compute_queue_t* queue, uint32_t work_id, void** user_data) {
+  if(user_data != NULL) {
+    *user_data = queue->jobs[work_id].user_data;
+  }
+  queue->jobs[work_id].state     = RN_JOB_FREE;
+  queue->jobs[work_id].user_data = NULL;
+  queue->num_done--;
+}
+
+int rn_cq_test(struct rn_compute_queue_t* queue, uint32_t work_id, void** user_data) {
+  if((work_id >= queue->depth) || (queue->jobs[work_id].state == RN_JOB_FREE)) {
+    return -1;
+  }
+
+  if(queue->jobs[work_id].state == RN_JOB_PENDING) {
+    rn_cq_progress(queue);
+    if(queue->jobs[work_id].state == RN_JOB_PENDING) {
+      return 0;
+    }
+  }
+
+  rn_cq_release(queue, work_id, user_data);
+  return 1;
+}
+
+int rn_cq_wait(struct rn_compute_queue_t* queue, uint32_t work_id, 
+               const rn_wait_policy_t* policy, void** user_data) {
+  volatile uint32_t* completed;
+  int rc;
+
+  if((work_id >= queue->depth) || (queue->jobs[work_id].state == RN_JOB_FREE)) {
+    fprintf(stderr, "Error: compute job %d is not outstanding\n", work_id);
+    return -1;
+  }
+
+  completed = (volatile uint32_t* ) ((uintptr_t) queue->axil_base + queue->cnt_offset);
+  while(queue->jobs[work_id].state == RN_JOB_PENDING) {
+    rc = rn_wait_value_change(completed, 0, policy, NULL);
+    if(rc < 0) {
+      fprintf(stderr, "Error: timeout waiting for compute job %d\n", work_id);
+      return -1;
+    }
+    rn_cq_progress(queue);
+  }
+
+  rn_cq_release(queue, work_id, user_data);
+  return 0;
+}
+
+uint32_t rn_cq_reap(struct rn_compute_queue_t* queue, uint32_t* work_ids, void** user_data, 
+                    uint32_t max_jobs) {
+  uint32_t i;
+  uint32_t slot;
+  uint32_t num_reaped = 0;
+
+  rn_cq_progress(queue);
+
+  for(i=0; (i<queue->depth) && (queue->num_done > 0) && (num_reaped < max_jobs); i++) {
+    slot = (queue->reap_slot + i) % queue->depth;
+    if(queue->jobs[slot].state != RN_JOB_DONE) {
+      continue;
+    }
+
+    work_ids[num_reaped] = slot;
+    rn_cq_release(queue, slot, (user_data != NULL) ? &user_data[num_reaped] : NULL);
+    num_reaped++;
+    queue->reap_slot = (slot + 1) % queue->depth;
+  }
+
+  return num_reaped;
+}
+
+uint32_t rn_cq_outstanding(struct rn_compute_queue_t* queue) {
+  return queue->num_pending + queue->num_done;
+}
@@ -0,0 +1,135 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file compute_queue.h
+ *  @brief Header file of the asynchronous compute job queue.
+ *
+ *  The job queue keeps several compute control commands in flight on an accelerator. 
+ *  Each submitted job gets a work ID, which is its slot in the queue, and completions 
+ *  read from the kernel status FIFO are matched to jobs by work ID. Jobs can then be 
+ *  waited for or reaped in any order. A job queue is not thread-safe, it is driven by one 
+ *  thread at a time.
+ */
+
+#ifndef __COMPUTE_QUEUE_H__
+#define __COMPUTE_QUEUE_H__
+
+#include "control_api.h"
+
+/*! \def RN_CQ_DEFAULT_DEPTH
+    \brief Default number of jobs a compute queue keeps in flight.
+*/
+#define RN_CQ_DEFAULT_DEPTH 16
+
+/*! \def RN_CQ_MAX_DEPTH
+    \brief Largest compute queue depth, bounded by the 16-bit work ID.
+*/
+#define RN_CQ_MAX_DEPTH 65536
+
+/*! \def RN_CQ_WORK_ID_MASK
+    \brief Mask of the work ID in a kernel status FIFO entry.
+*/
+#define RN_CQ_WORK_ID_MASK 0x0000ffff
+
+/*! \enum rn_job_state_t
+    \brief State of a compute queue slot.
+*/
+typedef enum {
+  RN_JOB_FREE = 0, /*!< RN_JOB_FREE slot is free. */
+  RN_JOB_PENDING,  /*!< RN_JOB_PENDING job issued, completion not seen yet. */
+  RN_JOB_DONE      /*!< RN_JOB_DONE job completed, not reaped yet. */
+} rn_job_state_t;
+
+/*! \struct rn_job_t
+    \brief A job slot of a compute queue.
+*/
+struct rn_job_t {
+  rn_job_state_t state; /*!< state state of the slot. */
+  void* user_data;      /*!< user_data caller data passed at submission. */
+};
+
+/*! \struct rn_compute_queue_t
+    \brief Asynchronous job queue of an accelerator.
+*/
+struct rn_compute_queue_t {
+  void* axil_base;       /*!< axil_base AXIL base address of the PCIe device. */
+  uint32_t cmd_offset;   /*!< cmd_offset offset of the control command FIFO. */
+  uint32_t sts_offset;   /*!< sts_offset offset of the kernel status FIFO. */
+  uint32_t cnt_offset;   /*!< cnt_offset offset of the completed-not-read counter. */
+  struct rn_job_t* jobs; /*!< jobs job slots indexed by work ID. */
+  uint32_t depth;        /*!< depth number of job slots. */
+  uint32_t num_pending;  /*!< num_pending jobs issued and not completed. */
+  uint32_t num_done;     /*!< num_done jobs completed and not reaped. */
+  uint32_t next_slot;    /*!< next_slot slot searched first by the next submission. */
+  uint32_t reap_slot;    /*!< reap_slot slot searched first by the next reap. */
+};
+
+/** @brief Create a job queue for the systolic accelerator of the compute logic region.
+ *  @param axil_base AXIL base address of a PCIe device.
+ *  @param depth maximum number of jobs in flight, at most the depth of the accelerator 
+ *               command FIFO. 0 uses RN_CQ_DEFAULT_DEPTH.
+ *  @return a pointer to the job queue, or NULL on failure.
+ */
+struct rn_compute_queue_t* rn_cq_create(void* axil_base, uint32_t depth);
+
+/** @brief Destroy a job queue. Jobs still in flight are abandoned.
+ *  @param queue the job queue.
+ *  @return void.
+ */
+void rn_cq_destroy(struct rn_compute_queue_t* queue);
+
+/** @brief Submit a compute control command. The work ID of the command is set to the 
+ *         slot assigned to the job.
+ *  @param queue the job queue.
+ *  @param ctl_cmd compute control command.
+ *  @param user_data caller data returned when the job is reaped.
+ *  @return the work ID of the job, or -1 with errno set to EAGAIN if the queue is full.
+ */
+int rn_cq_submit(struct rn_compute_queue_t* queue, ctl_cmd_t* ctl_cmd, void* user_data);
+
+/** @brief Read the completions available in the kernel status FIFO and mark their jobs 
+ *         as done. Does not wait.
+ *  @param queue the job queue.
+ *  @return number of completions read.
+ */
+uint32_t rn_cq_progress(struct rn_compute_queue_t* queue);
+
+/** @brief Check whether a job has completed, releasing its slot if it has.
+ *  @param queue the job queue.
+ *  @param work_id work ID returned by rn_cq_submit().
+ *  @param user_data set to the caller data of the job if it completed. Can be NULL.
+ *  @return 1 - completed; 0 - still pending; -1 - work_id is not an outstanding job.
+ */
+int rn_cq_test(struct rn_compute_queue_t* queue, uint32_t work_id, void** user_data);
+
+/** @brief Wait for a job to complete and release its slot. Completions of other jobs seen 
+ *         meanwhile are kept for later rn_cq_test(), rn_cq_wait() or rn_cq_reap() calls.
+ *  @param queue the job queue.
+ *  @param work_id work ID returned by rn_cq_submit().
+ *  @param policy wait policy applied to each wait for a completion. NULL spins forever.
+ *  @param user_data set to the caller data of the job. Can be NULL.
+ *  @return Success (0) or Failure (-1) on timeout or if work_id is not an outstanding job.
+ */
+int rn_cq_wait(struct rn_compute_queue_t* queue, uint32_t work_id, 
+               const rn_wait_policy_t* policy, void** user_data);
+
+/** @brief Reap completed jobs in any order and release their slots. Does not wait.
+ *  @param queue the job queue.
+ *  @param work_ids filled with the work IDs of the reaped jobs.
+ *  @param user_data filled with the caller data of the reaped jobs. Can be NULL.
+ *  @param max_jobs capacity of work_ids and user_data.
+ *  @return number of jobs reaped.
+ */
+uint32_t rn_cq_reap(struct rn_compute_queue_t* queue, uint32_t* work_ids, void** user_data, 
+                    uint32_t max_jobs);
+
+/** @brief Get the number of jobs issued and not reaped.
+ *  @param queue the job queue.
+ *  @return number of outstanding jobs.
+ */
+uint32_t rn_cq_outstanding(struct rn_compute_queue_t* queue);
+
+#endif /* __COMPUTE_QUEUE_H__ */
@@ -13,6 +13,7 @@
  */
 
 #include "control_api.h"
+#include <poll.h>
 
 void write32_data(uint32_t* pcie_axil_base, off_t offset, uint32_t value) {
   uint32_t* config_addr;
@@ -31,6 +32,20 @@ uint32_t read32_data(uint32_t* pcie_axil_base, off_t offset) {
   return value;
 }
 
+void rn_reg_batch_begin(struct rn_reg_batch_t* batch, uint32_t* pcie_axil_base) {
+  batch->base       = pcie_axil_base;
+  batch->num_writes = 0;
+}
+
+void rn_reg_batch_fence(void) {
+  __sync_synchronize();
+}
+
+uint32_t rn_reg_batch_commit(struct rn_reg_batch_t* batch) {
+  rn_reg_batch_fence();
+  return batch->num_writes;
+}
+
 void gen_ctl_cmd(ctl_cmd_t* ctl_cmd, uint32_t a_baseaddr, uint32_t b_baseaddr, \
 									uint32_t c_baseaddr, uint32_t ctl_cmd_size, uint16_t a_row, \
 									uint16_t a_col, uint16_t b_col, uint16_t work_id) {
@@ -58,8 +73,95 @@ void issue_ctl_cmd(void* axil_base, uint32_t offset, ctl_cmd_t* ctl_cmd) {
 
 uint32_t wait_compute(void* axil_base, uint32_t offset) {
   uint32_t compute_done = 0;
-	while(compute_done == 0) {
-			compute_done = read32_data((uint32_t*) axil_base, offset);
-	}
+	wait_compute_timeout(axil_base, offset, NULL, &compute_done);
   return compute_done;
+}
+
+int wait_compute_timeout(void* axil_base, uint32_t offset, const rn_wait_policy_t* policy, 
+                         uint32_t* work_id) {
+	volatile uint32_t* status = (volatile uint32_t* ) ((uintptr_t) axil_base + offset);
+	return rn_wait_value_change(status, 0, policy, work_id);
+}
+
+void rn_wait_policy_init(rn_wait_policy_t* policy) {
+	policy->mode           = RN_WAIT_BACKOFF;
+	policy->spin_count     = RN_WAIT_DEFAULT_SPIN_COUNT;
+	policy->max_backoff_us = RN_WAIT_DEFAULT_MAX_BACKOFF_US;
+	policy->timeout_us     = RN_WAIT_DEFAULT_TIMEOUT_US;
+	policy->irq_fd         = -1;
+}
+
+static uint64_t rn_wait_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000000 + ((uint64_t) ts.tv_nsec) / 1000;
+}
+
+int rn_wait_value_change(volatile uint32_t* addr, uint32_t old_value, 
+                         const rn_wait_policy_t* policy, uint32_t* new_value) {
+	uint32_t value;
+	uint64_t polls = 0;
+	uint64_t deadline = 0;
+	uint64_t now;
+	uint32_t backoff_us = 1;
+	struct timespec ts;
+	struct pollfd pfd;
+	uint64_t irq_count;
+	int poll_ms;
+
+	value = *addr;
+	if((value != old_value) || (policy == NULL)) {
+		while(value == old_value) {
+			value = *addr;
+		}
+		goto done;
+	}
+
+	if(policy->timeout_us != 0) {
+		deadline = rn_wait_now_us() + policy->timeout_us;
+	}
+
+	while(value == old_value) {
+		polls++;
+		if(polls > policy->spin_count) {
+			now = rn_wait_now_us();
+			if((deadline != 0) && (now >= deadline)) {
+				if(new_value != NULL) {
+					*new_value = value;
+				}
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			if((policy->mode == RN_WAIT_INTERRUPT) && (policy->irq_fd >= 0)) {
+				// Block until the device signals an interrupt, then re-check the value
+				pfd.fd = policy->irq_fd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				poll_ms = (deadline != 0) ? (int) ((deadline - now + 999) / 1000) : -1;
+				if((poll(&pfd, 1, poll_ms) > 0) && (pfd.revents & POLLIN)) {
+					if(read(policy->irq_fd, &irq_count, sizeof(irq_count)) < 0) {
+						Debug("DEBUG: failed to read interrupt count, errno = %d\n", errno);
+					}
+				}
+			} else if(policy->mode != RN_WAIT_SPIN) {
+				// Exponential backoff, bounded by max_backoff_us
+				ts.tv_sec  = 0;
+				ts.tv_nsec = ((long) backoff_us) * 1000;
+				nanosleep(&ts, NULL);
+				if(backoff_us < policy->max_backoff_us) {
+					backoff_us = backoff_us << 1;
+				}
+			}
+		} else if(policy->mode != RN_WAIT_SPIN) {
+			cpu_relax();
+		}
+		value = *addr;
+	}
+
+done:
+	if(new_value != NULL) {
+		*new_value = value;
+	}
+	return 0;
 }
\ No newline at end of file
@@ -18,6 +18,44 @@
 #include "auxiliary.h"
 #include "reconic_reg.h"
 
+/*! \def RN_WAIT_DEFAULT_TIMEOUT_US
+    \brief Default timeout in microseconds when waiting for a completion.
+*/
+#define RN_WAIT_DEFAULT_TIMEOUT_US 1000000
+
+/*! \def RN_WAIT_DEFAULT_SPIN_COUNT
+    \brief Default number of polls before a backoff wait starts to sleep.
+*/
+#define RN_WAIT_DEFAULT_SPIN_COUNT 256
+
+/*! \def RN_WAIT_DEFAULT_MAX_BACKOFF_US
+    \brief Default upper bound in microseconds of a backoff sleep.
+*/
+#define RN_WAIT_DEFAULT_MAX_BACKOFF_US 64
+
+/*! \enum rn_wait_mode_t
+    \brief Strategy used to wait for a register or doorbell value to change.
+*/
+typedef enum {
+	RN_WAIT_SPIN = 0,  /*!< RN_WAIT_SPIN busy-spin on the value. */
+	RN_WAIT_BACKOFF,   /*!< RN_WAIT_BACKOFF spin with a pause hint, then sleep with 
+	                        exponential backoff. */
+	RN_WAIT_INTERRUPT  /*!< RN_WAIT_INTERRUPT block on an interrupt file descriptor. */
+} rn_wait_mode_t;
+
+/*! \struct rn_wait_policy_t
+    \brief Wait policy used by completion and doorbell polling.
+*/
+typedef struct {
+	rn_wait_mode_t mode;     /*!< mode wait strategy. */
+	uint32_t spin_count;     /*!< spin_count number of polls before backing off or blocking. */
+	uint32_t max_backoff_us; /*!< max_backoff_us upper bound of a backoff sleep in us. */
+	uint64_t timeout_us;     /*!< timeout_us timeout in us, 0 waits forever. */
+	int irq_fd;              /*!< irq_fd file descriptor that becomes readable when the 
+	                              device raises an interrupt (e.g. UIO or eventfd), -1 if 
+	                              none. Without it RN_WAIT_INTERRUPT falls back to backoff. */
+} rn_wait_policy_t;
+
 /*! \struct ctl_cmd_t
     \brief Compute control command structure.
 */
@@ -47,6 +85,47 @@ void write32_data(uint32_t* pcie_axil_base, off_t offset, uint32_t value);
  */
 uint32_t read32_data(uint32_t* pcie_axil_base, off_t offset);
 
+/*! \struct rn_reg_batch_t
+    \brief Batch of register writes. Writes of a batch go through the uncached mapping
+           of the register BAR, CSRs must never be programmed through a write-combined one.
+*/
+struct rn_reg_batch_t {
+	uint32_t* base;      /*!< base uncached mapping the writes go through. */
+	uint32_t num_writes; /*!< num_writes number of writes issued since the batch began. */
+};
+
+/** @brief Register control API: Begin a batch of register writes.
+ *  @param batch the batch.
+ *  @param pcie_axil_base AXIL base address of a PCIe device, uncached.
+ *  @return void.
+ */
+void rn_reg_batch_begin(struct rn_reg_batch_t* batch, uint32_t* pcie_axil_base);
+
+/** @brief Register control API: Add a register write to a batch.
+ *  @param batch the batch.
+ *  @param offset Register offset.
+ *  @param value data to be configured in the register.
+ *  @return void.
+ */
+static inline void rn_reg_batch_write(struct rn_reg_batch_t* batch, off_t offset, uint32_t value) {
+	*((volatile uint32_t* ) ((uintptr_t) batch->base + offset)) = value;
+	batch->num_writes++;
+}
+
+/** @brief Register control API: Make every write issued so far, to registers or to host
+ *         memory, visible before any later one. Used ahead of writes that enable what the 
+ *         earlier writes configured.
+ *  @return void.
+ */
+void rn_reg_batch_fence(void);
+
+/** @brief Register control API: End a batch of register writes. Every write of the 
+ *         batch is issued to the device before the call returns.
+ *  @param batch the batch.
+ *  @return number of writes in the batch.
+ */
+uint32_t rn_reg_batch_commit(struct rn_reg_batch_t* batch);
+
 /** @brief Compute control API: A function used to construct a compute control command.
  *  @param ctl_cmd A compute control command pointer.
  *  @param a_baseaddr baseaddress of array A.
@@ -86,4 +165,34 @@ void issue_ctl_cmd(void* axil_base, uint32_t offset, ctl_cmd_t* ctl_cmd);
  */
 uint32_t wait_compute(void* axil_base, uint32_t offset);
 
+/** @brief Wait policy API: Initialize a wait policy with the default settings, i.e. 
+ *         spin for RN_WAIT_DEFAULT_SPIN_COUNT polls, then back off, and give up after 
+ *         RN_WAIT_DEFAULT_TIMEOUT_US.
+ *  @param policy wait policy to be initialized.
+ *  @return void.
+ */
+void rn_wait_policy_init(rn_wait_policy_t* policy);
+
+/** @brief Wait policy API: Wait until a 32-bit value differs from old_value. The value
+ *         can be an MMIO register or a doorbell location in host memory.
+ *  @param addr address of the value to be polled.
+ *  @param old_value value to wait away from.
+ *  @param policy wait policy. NULL spins forever.
+ *  @param new_value the new value read. Can be NULL.
+ *  @return Success (0) or Failure (-1) on timeout with errno set to ETIMEDOUT.
+ */
+int rn_wait_value_change(volatile uint32_t* addr, uint32_t old_value, 
+                         const rn_wait_policy_t* policy, uint32_t* new_value);
+
+/** @brief Compute control API: Wait for a compute request to be served with a wait 
+ *         policy.
+ *  @param axil_base AXIL base address of a PCIe device.
+ *  @param offset address offset of a status FIFO associated to the target accelerator.
+ *  @param policy wait policy. NULL spins forever.
+ *  @param work_id the work ID read.
+ *  @return Success (0) or Failure (-1) on timeout.
+ */
+int wait_compute_timeout(void* axil_base, uint32_t offset, const rn_wait_policy_t* policy, 
+                         uint32_t* work_id);
+
 #endif /* __CONTROL_API_H__ */
\ No newline at end of file
@@ -14,6 +14,8 @@
  */
 
 #include "memory_api.h"
+#include "reconic.h"
+#include "rn_trace.h"
 
 ssize_t read_to_buffer(char *char_device, int fd, char *buffer, uint64_t size,
 			uint64_t dev_offset)
@@ -23,30 +25,17 @@ ssize_t read_to_buffer(char *char_device, int fd, char *buffer, uint64_t size,
 	char *buf = buffer;
 	off_t offset = dev_offset & DEVICE_MEMORY_ADDRESS_MASK;
 
+	RN_TRACE_EVENT(RN_TRACE_DMA_SUBMIT, RN_DMA_C2H, dev_offset);
 	do { /* Support zero byte transfer */
 		uint64_t bytes = size - count;
 
 		if (bytes > RW_MAX_SIZE)
 			bytes = RW_MAX_SIZE;
 
-    rc = lseek(fd, offset, SEEK_SET);
-    if (rc < 0) {
-      fprintf(stderr,
-        "%s, seek off 0x%lx failed %zd.\n",
-        char_device, offset, rc);
-      perror("seek file");
-      return -EIO;
-    }
-    if (rc != offset) {
-      fprintf(stderr,
-        "%s, seek off 0x%lx != 0x%lx.\n",
-        char_device, rc, offset);
-      return -EIO;
-    }
-		
-
-		/* read data from file into memory buffer */
-		rc = read(fd, buf, bytes);
+
+		/* read data from file into memory buffer. pread() leaves the file
+		 * offset untouched, so the fd can be shared by several threads. */
+		rc = pread(fd, buf, bytes, offset);
 		if (rc < 0) {
 			fprintf(stderr,
 				"%s, read off 0x%lx + 0x%lx failed %zd.\n",
@@ -71,6 +60,7 @@ ssize_t read_to_buffer(char *char_device, int fd, char *buffer, uint64_t size,
 				char_device, count, size);
 		return -EIO;
 	}
+	RN_TRACE_EVENT(RN_TRACE_DMA_COMPLETE, RN_DMA_C2H, dev_offset);
 	return count;
 }
 
@@ -82,29 +72,15 @@ ssize_t write_from_buffer(char *char_device, int fd, char *buffer, uint64_t size
 	char *buf = buffer;
 	off_t offset = dev_offset & DEVICE_MEMORY_ADDRESS_MASK;
 
+	RN_TRACE_EVENT(RN_TRACE_DMA_SUBMIT, RN_DMA_H2C, dev_offset);
 	do { /* Support zero byte transfer */
 		uint64_t bytes = size - count;
 
 		if (bytes > RW_MAX_SIZE)
 			bytes = RW_MAX_SIZE;
 
-    rc = lseek(fd, offset, SEEK_SET);
-    if (rc < 0) {
-      fprintf(stderr,
-        "%s, seek off 0x%lx failed %zd.\n",
-        char_device, offset, rc);
-      perror("seek file");
-      return -EIO;
-    }
-    if (rc != offset) {
-      fprintf(stderr,
-        "%s, seek off 0x%lx != 0x%lx.\n",
-        char_device, rc, offset);
-      return -EIO;
-    }
-
 		/* write data to file from memory buffer */
-		rc = write(fd, buf, bytes);
+		rc = pwrite(fd, buf, bytes, offset);
 		if (rc < 0) {
 			fprintf(stderr, "%s, W off 0x%lx, 0x%lx failed %zd.\n",
 				char_device, offset, bytes, rc);
@@ -127,5 +103,608 @@ ssize_t write_from_buffer(char *char_device, int fd, char *buffer, uint64_t size
 				char_device, count, size);
 		return -EIO;
 	}
+	RN_TRACE_EVENT(RN_TRACE_DMA_COMPLETE, RN_DMA_H2C, dev_offset);
 	return count;
-}
\ No newline at end of file
+}
+
+struct rn_dma_work_t {
+	struct rn_dma_req_t *req;
+	int dir;
+	char *host_buf;
+	uint64_t dev_offset;
+	uint64_t len;
+	struct rn_dma_work_t *next;
+};
+
+static void rn_dma_complete(struct rn_dma_work_t *work, ssize_t rc)
+{
+	struct rn_dma_req_t *req = work->req;
+
+	pthread_mutex_lock(&req->lock);
+	if (rc < 0) {
+		if (req->error == 0)
+			req->error = (int)rc;
+	} else {
+		req->bytes_done += rc;
+	}
+	req->num_pending--;
+	if (req->num_pending == 0) {
+		RN_TRACE_EVENT(RN_TRACE_DMA_DONE, work->dir, (uintptr_t)req);
+		pthread_cond_broadcast(&req->done_cond);
+	}
+	pthread_mutex_unlock(&req->lock);
+}
+
+static void *rn_dma_worker(void *arg)
+{
+	struct rn_dma_ctx_t *ctx = (struct rn_dma_ctx_t *)arg;
+	struct rn_dma_work_t *work;
+	ssize_t rc;
+	int fd = ctx->fd;
+	uint32_t idx;
+
+	/* A striped context gives every worker its own file, hence its own MM queue */
+	idx = __atomic_fetch_add(&ctx->next_worker, 1, __ATOMIC_RELAXED);
+	if (ctx->fds != NULL)
+		fd = ctx->fds[idx];
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		while ((ctx->head == NULL) && !ctx->stop)
+			pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+		work = ctx->head;
+		if (work == NULL) {
+			/* stop requested and the queue is drained */
+			pthread_mutex_unlock(&ctx->lock);
+			return NULL;
+		}
+		ctx->head = work->next;
+		if (ctx->head == NULL)
+			ctx->tail = NULL;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (work->dir == RN_DMA_H2C)
+			rc = write_from_buffer(ctx->char_device, fd,
+					work->host_buf, work->len, work->dev_offset);
+		else
+			rc = read_to_buffer(ctx->char_device, fd,
+					work->host_buf, work->len, work->dev_offset);
+		rn_dma_complete(work, rc);
+	}
+}
+
+struct rn_dma_ctx_t *rn_dma_ctx_create(char *char_device, int fd, uint32_t num_threads)
+{
+	struct rn_dma_ctx_t *ctx;
+	uint32_t i;
+
+	if (num_threads == 0) {
+		fprintf(stderr, "Error: rn_dma_ctx_create needs at least one thread\n");
+		return NULL;
+	}
+
+	ctx = (struct rn_dma_ctx_t *)calloc(1, sizeof(struct rn_dma_ctx_t));
+	if (ctx == NULL) {
+		fprintf(stderr, "Error: failed to allocate the DMA context\n");
+		return NULL;
+	}
+	ctx->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+	if (ctx->threads == NULL) {
+		fprintf(stderr, "Error: failed to allocate the DMA worker threads\n");
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->char_device = char_device;
+	ctx->fd = fd;
+	ctx->chunk_size = RN_DMA_CHUNK_SIZE;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->work_cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&ctx->threads[i], NULL, rn_dma_worker, ctx) != 0) {
+			fprintf(stderr, "Error: failed to start DMA worker %d\n", i);
+			break;
+		}
+		ctx->num_threads++;
+	}
+
+	if (ctx->num_threads == 0) {
+		rn_dma_ctx_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void rn_dma_ctx_destroy(struct rn_dma_ctx_t *ctx)
+{
+	uint32_t i;
+
+	if (ctx == NULL)
+		return;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = 1;
+	pthread_cond_broadcast(&ctx->work_cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (i = 0; i < ctx->num_threads; i++)
+		pthread_join(ctx->threads[i], NULL);
+
+	pthread_cond_destroy(&ctx->work_cond);
+	pthread_mutex_destroy(&ctx->lock);
+	if (ctx->fds != NULL) {
+		for (i = 0; i < ctx->num_threads; i++)
+			close(ctx->fds[i]);
+		free(ctx->fds);
+	}
+	free(ctx->threads);
+	free(ctx);
+}
+
+int rn_dma_num_queues(int fd)
+{
+	struct onic_ioc_info info;
+
+	memset(&info, 0, sizeof(info));
+	if (ioctl(fd, ONIC_IOC_GET_INFO, &info) < 0)
+		return -errno;
+	return (int)info.mm_queues;
+}
+
+int rn_dma_bind_queue(int fd, uint32_t queue)
+{
+	if (ioctl(fd, ONIC_IOC_BIND_QUEUE, &queue) < 0)
+		return -errno;
+	return 0;
+}
+
+struct rn_dma_ctx_t *rn_dma_ctx_create_striped(char *char_device, int fd, uint32_t num_queues)
+{
+	struct onic_ioc_info info;
+	struct rn_dma_ctx_t *ctx;
+	int *fds;
+	uint32_t i;
+	int rc;
+
+	memset(&info, 0, sizeof(info));
+	if (ioctl(fd, ONIC_IOC_GET_INFO, &info) < 0 || info.mm_queues == 0) {
+		fprintf(stderr, "Error: failed to query the MM queues of %s\n", char_device);
+		return NULL;
+	}
+	if (num_queues == 0)
+		num_queues = info.mm_queues;
+	if (info.mm_queue_binding != 1)
+		fprintf(stderr, "Warning: %s does not bind files to MM queues (mode %u), "
+			"the driver picks the queue of every chunk\n", char_device, info.mm_queue_binding);
+
+	fds = (int *)calloc(num_queues, sizeof(int));
+	if (fds == NULL) {
+		fprintf(stderr, "Error: failed to allocate %d file descriptors\n", num_queues);
+		return NULL;
+	}
+	for (i = 0; i < num_queues; i++) {
+		fds[i] = open(char_device, O_RDWR);
+		if (fds[i] < 0) {
+			fprintf(stderr, "Error: failed to open %s for MM queue %d\n", char_device, i);
+			perror("open device");
+			while (i > 0)
+				close(fds[--i]);
+			free(fds);
+			return NULL;
+		}
+	}
+
+	/* Bind each file to its own queue, opens of other processes may interleave */
+	for (i = 0; i < num_queues && info.mm_queue_binding == 1; i++) {
+		rc = rn_dma_bind_queue(fds[i], i % info.mm_queues);
+		if (rc < 0) {
+			fprintf(stderr, "Error: failed to bind %s to MM queue %d: %s\n", char_device,
+				i % info.mm_queues, strerror(-rc));
+			goto err_close;
+		}
+	}
+
+	/* Workers pick their file by start order, so fds must be set before they run */
+	ctx = (struct rn_dma_ctx_t *)calloc(1, sizeof(struct rn_dma_ctx_t));
+	if (ctx == NULL) {
+		fprintf(stderr, "Error: failed to allocate the DMA context\n");
+		goto err_close;
+	}
+	ctx->threads = (pthread_t *)calloc(num_queues, sizeof(pthread_t));
+	if (ctx->threads == NULL) {
+		fprintf(stderr, "Error: failed to allocate the DMA worker threads\n");
+		free(ctx);
+		goto err_close;
+	}
+
+	ctx->char_device = char_device;
+	ctx->fd = fd;
+	ctx->fds = fds;
+	ctx->chunk_size = RN_DMA_CHUNK_SIZE;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->work_cond, NULL);
+
+	for (i = 0; i < num_queues; i++) {
+		if (pthread_create(&ctx->threads[i], NULL, rn_dma_worker, ctx) != 0) {
+			fprintf(stderr, "Error: failed to start DMA worker %d\n", i);
+			break;
+		}
+		ctx->num_threads++;
+	}
+
+	/* Files no worker was started for are not closed by rn_dma_ctx_destroy */
+	for (i = ctx->num_threads; i < num_queues; i++)
+		close(fds[i]);
+
+	if (ctx->num_threads == 0) {
+		rn_dma_ctx_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+
+err_close:
+	for (i = 0; i < num_queues; i++)
+		close(fds[i]);
+	free(fds);
+	return NULL;
+}
+
+/* Split the segments into chunk_size chunks and queue them to the workers */
+static struct rn_dma_req_t *rn_dma_submit_chunked(struct rn_dma_ctx_t *ctx, int dir,
+						  const struct rn_dma_seg_t *segs,
+						  uint32_t num_segs, uint64_t chunk_size)
+{
+	struct rn_dma_req_t *req;
+	struct rn_dma_work_t *work;
+	uint32_t num_works = 0;
+	uint32_t i;
+	uint64_t done;
+	uint64_t bytes;
+
+	for (i = 0; i < num_segs; i++)
+		num_works += (segs[i].len + chunk_size - 1) / chunk_size;
+
+	req = (struct rn_dma_req_t *)calloc(1, sizeof(struct rn_dma_req_t));
+	if (req == NULL) {
+		fprintf(stderr, "Error: failed to allocate the DMA request\n");
+		return NULL;
+	}
+	if (num_works > 0) {
+		req->works = (struct rn_dma_work_t *)calloc(num_works, sizeof(struct rn_dma_work_t));
+		if (req->works == NULL) {
+			fprintf(stderr, "Error: failed to allocate %d DMA chunks\n", num_works);
+			free(req);
+			return NULL;
+		}
+	}
+	pthread_mutex_init(&req->lock, NULL);
+	pthread_cond_init(&req->done_cond, NULL);
+	req->num_pending = num_works;
+	RN_TRACE_EVENT(RN_TRACE_DMA_QUEUED, dir, (uintptr_t)req);
+
+	/* Chain the chunks of all segments in order */
+	work = req->works;
+	for (i = 0; i < num_segs; i++) {
+		for (done = 0; done < segs[i].len; done += bytes) {
+			bytes = segs[i].len - done;
+			if (bytes > chunk_size)
+				bytes = chunk_size;
+			work->req = req;
+			work->dir = dir;
+			work->host_buf = (char *)segs[i].host_buf + done;
+			work->dev_offset = segs[i].dev_offset + done;
+			work->len = bytes;
+			work->next = work + 1;
+			work++;
+		}
+	}
+
+	if (num_works > 0) {
+		req->works[num_works - 1].next = NULL;
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx->tail != NULL)
+			ctx->tail->next = req->works;
+		else
+			ctx->head = req->works;
+		ctx->tail = &req->works[num_works - 1];
+		pthread_cond_broadcast(&ctx->work_cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return req;
+}
+
+struct rn_dma_req_t *rn_dma_submit(struct rn_dma_ctx_t *ctx, int dir,
+				   const struct rn_dma_seg_t *segs, uint32_t num_segs)
+{
+	uint64_t chunk_size;
+
+	if ((ctx == NULL) || ((dir != RN_DMA_H2C) && (dir != RN_DMA_C2H)) ||
+	    ((segs == NULL) && (num_segs > 0))) {
+		fprintf(stderr, "Error: invalid asynchronous DMA request\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	chunk_size = ctx->chunk_size;
+	pthread_mutex_unlock(&ctx->lock);
+	return rn_dma_submit_chunked(ctx, dir, segs, num_segs, chunk_size);
+}
+
+int rn_dma_poll(struct rn_dma_req_t *req)
+{
+	int rc;
+
+	pthread_mutex_lock(&req->lock);
+	if (req->num_pending > 0)
+		rc = 0;
+	else
+		rc = (req->error < 0) ? req->error : 1;
+	pthread_mutex_unlock(&req->lock);
+
+	return rc;
+}
+
+int rn_dma_wait(struct rn_dma_req_t *req)
+{
+	int rc;
+
+	pthread_mutex_lock(&req->lock);
+	while (req->num_pending > 0)
+		pthread_cond_wait(&req->done_cond, &req->lock);
+	rc = req->error;
+	pthread_mutex_unlock(&req->lock);
+
+	return rc;
+}
+
+void rn_dma_req_free(struct rn_dma_req_t *req)
+{
+	if (req == NULL)
+		return;
+
+	rn_dma_wait(req);
+	pthread_cond_destroy(&req->done_cond);
+	pthread_mutex_destroy(&req->lock);
+	free(req->works);
+	free(req);
+}
+
+/* Wait for a request, returns the bytes transferred or the error of the request */
+static ssize_t rn_dma_finish(struct rn_dma_req_t *req)
+{
+	ssize_t rc;
+
+	if (req == NULL)
+		return -EINVAL;
+
+	rc = rn_dma_wait(req);
+	if (rc == 0)
+		rc = (ssize_t)req->bytes_done;
+	rn_dma_req_free(req);
+
+	return rc;
+}
+
+ssize_t rn_dma_stripe(struct rn_dma_ctx_t *ctx, int dir, void *buffer, uint64_t size,
+		      uint64_t dev_offset)
+{
+	struct rn_dma_seg_t seg;
+
+	seg.host_buf = buffer;
+	seg.dev_offset = dev_offset;
+	seg.len = size;
+	return rn_dma_finish(rn_dma_submit(ctx, dir, &seg, 1));
+}
+
+/* Chunk sizes tried by rn_dma_tune() */
+static const uint64_t rn_dma_tune_chunks[] = {
+	0x40000, 0x100000, 0x400000, 0x1000000
+};
+
+/* Chunk sizes measured by rn_dma_transfer(), by number of workers */
+#define RN_DMA_TUNE_CACHE_SIZE 8
+
+static struct {
+	uint32_t num_threads;
+	uint64_t chunk_size;
+} rn_dma_tune_cache[RN_DMA_TUNE_CACHE_SIZE];
+static uint32_t rn_dma_tune_cache_len;
+static pthread_mutex_t rn_dma_tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t rn_dma_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * NSEC_DIV) + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t rn_dma_tune(struct rn_dma_ctx_t *ctx, uint64_t dev_offset, uint64_t size)
+{
+	struct rn_dma_seg_t seg;
+	uint64_t best = 0;
+	uint64_t best_ns = UINT64_MAX;
+	uint64_t elapsed;
+	uint64_t t0;
+	uint32_t i;
+	char *scratch;
+	ssize_t rc;
+
+	if (size > RN_DMA_TUNE_SIZE)
+		size = RN_DMA_TUNE_SIZE;
+	scratch = (char *)malloc(size);
+	if (scratch == NULL) {
+		fprintf(stderr, "Error: failed to allocate the %ld byte DMA tuning buffer\n", size);
+		return 0;
+	}
+
+	/* Warm up the pages of the scratch buffer so they are not faulted in while timed */
+	memset(scratch, 0, size);
+	seg.host_buf = scratch;
+	seg.dev_offset = dev_offset;
+	seg.len = size;
+	/* The sweep uses its own chunk sizes, requests of other threads keep the current one */
+	for (i = 0; i < sizeof(rn_dma_tune_chunks) / sizeof(rn_dma_tune_chunks[0]); i++) {
+		if ((i > 0) && (rn_dma_tune_chunks[i] > size))
+			break;
+		t0 = rn_dma_now_ns();
+		rc = rn_dma_finish(rn_dma_submit_chunked(ctx, RN_DMA_C2H, &seg, 1, rn_dma_tune_chunks[i]));
+		elapsed = rn_dma_now_ns() - t0;
+		if (rc < 0) {
+			fprintf(stderr, "Error: DMA tuning failed with %ld byte chunks\n",
+				rn_dma_tune_chunks[i]);
+			best = 0;
+			break;
+		}
+		Debug("DEBUG: %ld byte chunks: %ld bytes in %ld ns\n", rn_dma_tune_chunks[i], size, elapsed);
+		if (elapsed < best_ns) {
+			best_ns = elapsed;
+			best = rn_dma_tune_chunks[i];
+		}
+	}
+	free(scratch);
+
+	if (best == 0)
+		return 0;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->chunk_size = best;
+	ctx->tuned = 1;
+	pthread_mutex_unlock(&ctx->lock);
+	fprintf(stderr, "Info: DMA chunk size tuned to 0x%lx bytes with %d workers\n", best, ctx->num_threads);
+	return best;
+}
+
+/* Set the chunk size of a context from the cache, or measure it and add it to the cache.
+ * Called with rn_dma_tune_lock held. */
+static void rn_dma_tune_cached(struct rn_dma_ctx_t *ctx, uint64_t dev_offset, uint64_t size)
+{
+	uint64_t chunk_size;
+	uint32_t i;
+
+	for (i = 0; i < rn_dma_tune_cache_len; i++) {
+		if (rn_dma_tune_cache[i].num_threads == ctx->num_threads) {
+			pthread_mutex_lock(&ctx->lock);
+			ctx->chunk_size = rn_dma_tune_cache[i].chunk_size;
+			ctx->tuned = 1;
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+	}
+
+	chunk_size = rn_dma_tune(ctx, dev_offset, size);
+	if ((chunk_size != 0) && (rn_dma_tune_cache_len < RN_DMA_TUNE_CACHE_SIZE)) {
+		rn_dma_tune_cache[rn_dma_tune_cache_len].num_threads = ctx->num_threads;
+		rn_dma_tune_cache[rn_dma_tune_cache_len].chunk_size = chunk_size;
+		rn_dma_tune_cache_len++;
+	}
+	/* Do not retry a failed sweep on every transfer */
+	ctx->tuned = 1;
+}
+
+ssize_t rn_dma_transfer(struct rn_dma_ctx_t *ctx, struct rn_dev_t *rn_dev, int dir,
+			void *buffer, uint64_t size, uint64_t dev_offset)
+{
+	void *win;
+
+	if ((ctx == NULL) || ((dir != RN_DMA_H2C) && (dir != RN_DMA_C2H))) {
+		fprintf(stderr, "Error: invalid DMA transfer\n");
+		return -EINVAL;
+	}
+
+	/* Tiny: loads and stores through the device memory window, no system call */
+	if (size <= RN_DMA_TINY_MAX) {
+		win = get_dev_mem_vaddr(rn_dev, dev_offset, size);
+		if (win != NULL) {
+			if (dir == RN_DMA_H2C) {
+				memcpy(win, buffer, size);
+				/* Drain the write-combining buffers */
+				__sync_synchronize();
+			} else {
+				memcpy(buffer, win, size);
+			}
+			return size;
+		}
+	}
+
+	/* Medium: one pread or pwrite on the character device */
+	if ((size < RN_DMA_SPLIT_MIN) || (ctx->num_threads < 2)) {
+		if (dir == RN_DMA_H2C)
+			return write_from_buffer(ctx->char_device, ctx->fd, buffer, size, dev_offset);
+		return read_to_buffer(ctx->char_device, ctx->fd, buffer, size, dev_offset);
+	}
+
+	/* Large: split across the workers, the chunk size is measured once per worker count */
+	pthread_mutex_lock(&rn_dma_tune_lock);
+	if (!ctx->tuned)
+		rn_dma_tune_cached(ctx, dev_offset, size);
+	pthread_mutex_unlock(&rn_dma_tune_lock);
+	return rn_dma_stripe(ctx, dir, buffer, size, dev_offset);
+}
+
+int rn_dma_register(int fd, void *buffer, uint64_t size, uint32_t *handle)
+{
+	struct onic_ioc_reg_buf reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t)buffer;
+	reg.len = size;
+	if (ioctl(fd, ONIC_IOC_REG_BUF, &reg) < 0) {
+		perror("register buffer");
+		return -errno;
+	}
+
+	*handle = reg.handle;
+	return 0;
+}
+
+int rn_dma_unregister(int fd, uint32_t handle)
+{
+	if (ioctl(fd, ONIC_IOC_UNREG_BUF, &handle) < 0) {
+		perror("unregister buffer");
+		return -errno;
+	}
+	return 0;
+}
+
+ssize_t rn_dma_xfer(int fd, uint32_t handle, uint64_t buf_offset, uint64_t size,
+		    uint64_t dev_offset, int dir)
+{
+	struct onic_ioc_xfer xfer;
+	uint64_t count = 0;
+	long rc;
+
+	/* the driver rejects zero length transfers */
+	if (size == 0)
+		return 0;
+
+	while (count < size) {
+		uint64_t bytes = size - count;
+
+		if (bytes > RW_MAX_SIZE)
+			bytes = RW_MAX_SIZE;
+
+		xfer.handle = handle;
+		xfer.write = (dir == RN_DMA_H2C) ? 1 : 0;
+		xfer.buf_offset = buf_offset + count;
+		xfer.len = bytes;
+		xfer.dev_addr = (dev_offset + count) & DEVICE_MEMORY_ADDRESS_MASK;
+		rc = ioctl(fd, ONIC_IOC_XFER, &xfer);
+		if (rc < 0) {
+			fprintf(stderr, "handle %u, off 0x%lx, 0x%lx bytes, %s failed.\n",
+				handle, (uint64_t)xfer.buf_offset, bytes, xfer.write ? "H2C" : "C2H");
+			perror("transfer registered buffer");
+			return -EIO;
+		}
+		if (rc != bytes) {
+			fprintf(stderr, "handle %u, off 0x%lx, 0x%lx != 0x%lx.\n",
+				handle, (uint64_t)xfer.buf_offset, rc, bytes);
+			return -EIO;
+		}
+
+		count += bytes;
+	}
+
+	return count;
+}
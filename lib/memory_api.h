@@ -15,7 +15,9 @@
 #ifndef __MEMORY_API_H__
 #define __MEMORY_API_H__
 
+#include <pthread.h>
 #include "auxiliary.h"
+#include "reconic_ioctl.h"
 
 /*! \def DEVICE_MEMORY_ADDRESS_MASK
     \brief Device memory address mask.
@@ -31,6 +33,83 @@
 */
 #define RW_MAX_SIZE	0x7ffff000
 
+/*! \def RN_DMA_H2C
+    \brief Asynchronous DMA direction: host buffer to device memory.
+*/
+#define RN_DMA_H2C 0
+
+/*! \def RN_DMA_C2H
+    \brief Asynchronous DMA direction: device memory to host buffer.
+*/
+#define RN_DMA_C2H 1
+
+/*! \def RN_DMA_CHUNK_SIZE
+    \brief Default chunk size of a DMA context. Segments are split into chunks, so that 
+           one large segment is spread over several QDMA MM queues.
+*/
+#define RN_DMA_CHUNK_SIZE 0x400000
+
+/*! \def RN_DMA_TINY_MAX
+    \brief rn_dma_transfer() does transfers up to this size with loads and stores when 
+           the range is in the mapped device memory window.
+*/
+#define RN_DMA_TINY_MAX 256
+
+/*! \def RN_DMA_SPLIT_MIN
+    \brief rn_dma_transfer() splits transfers from this size across the workers of the
+           DMA context, smaller ones are issued as one read or write.
+*/
+#define RN_DMA_SPLIT_MIN 0x1000000
+
+/*! \def RN_DMA_TUNE_SIZE
+    \brief Bytes read from the device for each chunk size tried by rn_dma_tune().
+*/
+#define RN_DMA_TUNE_SIZE 0x2000000
+
+struct rn_dev_t;
+
+/*! \struct rn_dma_seg_t
+    \brief A segment of an asynchronous DMA request.
+*/
+struct rn_dma_seg_t {
+  void *host_buf;      /*!< host_buf host buffer of the segment. */
+  uint64_t dev_offset; /*!< dev_offset device memory address of the segment. */
+  uint64_t len;        /*!< len length of the segment in bytes. */
+};
+
+struct rn_dma_work_t;
+
+/*! \struct rn_dma_req_t
+    \brief Completion handle of an asynchronous DMA request.
+*/
+struct rn_dma_req_t {
+  pthread_mutex_t lock;        /*!< lock protects the completion state. */
+  pthread_cond_t done_cond;    /*!< done_cond signalled when the last chunk completes. */
+  uint32_t num_pending;        /*!< num_pending number of chunks not completed yet. */
+  int error;                   /*!< error first error of the request, 0 if none. */
+  uint64_t bytes_done;         /*!< bytes_done bytes transferred successfully. */
+  struct rn_dma_work_t *works; /*!< works chunks of the request. */
+};
+
+/*! \struct rn_dma_ctx_t
+    \brief Asynchronous DMA context: worker threads issuing transfers on a char device.
+*/
+struct rn_dma_ctx_t {
+  char *char_device;           /*!< char_device name of the character device. */
+  int fd;                      /*!< fd file descriptor of the character device. */
+  pthread_t *threads;          /*!< threads worker threads. */
+  uint32_t num_threads;        /*!< num_threads number of worker threads. */
+  pthread_mutex_t lock;        /*!< lock protects the work queue. */
+  pthread_cond_t work_cond;    /*!< work_cond signalled when work is queued or on stop. */
+  struct rn_dma_work_t *head;  /*!< head first queued chunk. */
+  struct rn_dma_work_t *tail;  /*!< tail last queued chunk. */
+  int stop;                    /*!< stop set when the workers are asked to exit. */
+  int *fds;                    /*!< fds per-worker file descriptors of a striped context, NULL otherwise. */
+  uint32_t next_worker;        /*!< next_worker index handed to the next starting worker. */
+  uint64_t chunk_size;         /*!< chunk_size size of the chunks requests are split into. */
+  int tuned;                   /*!< tuned set once chunk_size is measured or taken from the cache. */
+};
+
 /** @brief A function used to read data from the device memory to the host buffer.
  *  @param char_device Name of the character device used to interact with the FPGA 
  *                     for memory access.
@@ -53,4 +132,145 @@ ssize_t read_to_buffer(char *char_device, int fd, char *buffer, uint64_t size, u
  */
 ssize_t write_from_buffer(char *char_device, int fd, char *buffer, uint64_t size, uint64_t base);
 
+/** @brief Create an asynchronous DMA context. Each worker thread keeps one transfer in 
+ *         flight, so up to num_threads QDMA MM queues are busy at once.
+ *  @param char_device Name of the character device used to interact with the FPGA 
+ *                     for memory access.
+ *  @param fd File descriptor of the char_device.
+ *  @param num_threads Number of worker threads.
+ *  @return a pointer to the context, or NULL on failure.
+ */
+struct rn_dma_ctx_t *rn_dma_ctx_create(char *char_device, int fd, uint32_t num_threads);
+
+/** @brief Create a striped DMA context: one worker per QDMA MM queue, each with its own
+ *         file descriptor bound to its queue with rn_dma_bind_queue(), so the chunks of 
+ *         a request are issued in parallel on all queues. If the driver does not bind 
+ *         files to queues, a warning is printed and the driver picks the queues.
+ *  @param char_device Name of the character device used to interact with the FPGA 
+ *                     for memory access.
+ *  @param fd File descriptor of the char_device, used to query the number of MM queues.
+ *  @param num_queues Number of MM queues to stripe over, 0 uses all queues of the device.
+ *  @return a pointer to the context, or NULL on failure.
+ */
+struct rn_dma_ctx_t *rn_dma_ctx_create_striped(char *char_device, int fd, uint32_t num_queues);
+
+/** @brief Destroy an asynchronous DMA context. Queued transfers are completed first.
+ *  @param ctx A pointer to the context.
+ *  @return void.
+ */
+void rn_dma_ctx_destroy(struct rn_dma_ctx_t *ctx);
+
+/** @brief Submit a vectored DMA request. The call returns once the request is queued.
+ *  @param ctx A pointer to the context.
+ *  @param dir RN_DMA_H2C or RN_DMA_C2H.
+ *  @param segs Array of segments, copied by the call.
+ *  @param num_segs Number of segments.
+ *  @return a completion handle, or NULL on failure.
+ */
+struct rn_dma_req_t *rn_dma_submit(struct rn_dma_ctx_t *ctx, int dir, 
+                                   const struct rn_dma_seg_t *segs, uint32_t num_segs);
+
+/** @brief Check whether a DMA request has completed, without blocking.
+ *  @param req A completion handle.
+ *  @return 1 - completed successfully; 0 - in progress; negative error code - completed 
+ *          with an error.
+ */
+int rn_dma_poll(struct rn_dma_req_t *req);
+
+/** @brief Wait for a DMA request to complete.
+ *  @param req A completion handle.
+ *  @return 0 on success or a negative error code.
+ */
+int rn_dma_wait(struct rn_dma_req_t *req);
+
+/** @brief Release a completion handle, waiting for the request first if needed.
+ *  @param req A completion handle.
+ *  @return void.
+ */
+void rn_dma_req_free(struct rn_dma_req_t *req);
+
+/** @brief Transfer one buffer through a DMA context and wait for it. The buffer is split 
+ *         into chunks of the context's chunk size issued in parallel by the workers, so a
+ *         striped context spreads a single large transfer over all MM queues.
+ *  @param ctx A pointer to the context.
+ *  @param dir RN_DMA_H2C or RN_DMA_C2H.
+ *  @param buffer a host buffer.
+ *  @param size size of data.
+ *  @param dev_offset address offset of the device memory.
+ *  @return Return size of data transferred, or a negative error code.
+ */
+ssize_t rn_dma_stripe(struct rn_dma_ctx_t *ctx, int dir, void *buffer, uint64_t size, 
+                      uint64_t dev_offset);
+
+/** @brief Measure the chunk size giving the highest throughput on a DMA context. Chunk 
+ *         sizes from 256KB to 16MB are tried with RN_DMA_TUNE_SIZE byte reads of device
+ *         memory into a scratch buffer, so device memory is left untouched. The result 
+ *         becomes the chunk size of the context. Requests submitted meanwhile keep the 
+ *         previous chunk size, but they compete with the sweep and skew the measurement.
+ *  @param ctx A pointer to the context.
+ *  @param dev_offset address offset of the device memory range read.
+ *  @param size size of the device memory range read, at most RN_DMA_TUNE_SIZE is used.
+ *  @return the chunk size chosen, or 0 if the sweep failed and the chunk size is unchanged.
+ */
+uint64_t rn_dma_tune(struct rn_dma_ctx_t *ctx, uint64_t dev_offset, uint64_t size);
+
+/** @brief Transfer data between a host buffer and the device memory with a strategy chosen
+ *         from the size. Up to RN_DMA_TINY_MAX bytes in the mapped device memory window 
+ *         are copied with loads and stores. Below RN_DMA_SPLIT_MIN the transfer is one 
+ *         read or write on the character device. Larger transfers are split across the
+ *         workers of the context; the first one measures the chunk size with rn_dma_tune(),
+ *         which is cached for later contexts with the same number of workers.
+ *  @param ctx A pointer to the context.
+ *  @param rn_dev A pointer to the RecoNIC device holding the device memory window, or NULL.
+ *  @param dir RN_DMA_H2C or RN_DMA_C2H.
+ *  @param buffer a host buffer.
+ *  @param size size of data.
+ *  @param dev_offset address offset of the device memory.
+ *  @return Return size of data transferred, or a negative error code.
+ */
+ssize_t rn_dma_transfer(struct rn_dma_ctx_t *ctx, struct rn_dev_t *rn_dev, int dir, 
+                        void *buffer, uint64_t size, uint64_t dev_offset);
+
+/** @brief Query the number of QDMA MM queues serving the character device.
+ *  @param fd File descriptor of the character device.
+ *  @return number of MM queues, or a negative error code.
+ */
+int rn_dma_num_queues(int fd);
+
+/** @brief Bind the file descriptor to an MM queue, requires mm_queue_binding=1.
+ *  @param fd File descriptor of the character device.
+ *  @param queue MM queue used by the requests on fd.
+ *  @return 0 on success, or a negative error code.
+ */
+int rn_dma_bind_queue(int fd, uint32_t queue);
+
+/** @brief Register a host buffer with the character device. The driver pins and DMA-maps
+ *         it once, later transfers through rn_dma_xfer() skip the per-call page pinning.
+ *  @param fd File descriptor of the character device.
+ *  @param buffer a host buffer.
+ *  @param size size of the buffer.
+ *  @param handle Returns the handle of the registered buffer.
+ *  @return 0 on success or a negative error code.
+ */
+int rn_dma_register(int fd, void *buffer, uint64_t size, uint32_t *handle);
+
+/** @brief Unregister a buffer registered with rn_dma_register().
+ *  @param fd File descriptor of the character device.
+ *  @param handle handle of the registered buffer.
+ *  @return 0 on success or a negative error code.
+ */
+int rn_dma_unregister(int fd, uint32_t handle);
+
+/** @brief Transfer data between a registered buffer and the device memory.
+ *  @param fd File descriptor of the character device.
+ *  @param handle handle of the registered buffer.
+ *  @param buf_offset offset in the registered buffer.
+ *  @param size size of data.
+ *  @param dev_offset address offset of the device memory.
+ *  @param dir RN_DMA_H2C or RN_DMA_C2H.
+ *  @return Return size of data transferred, or a negative error code.
+ */
+ssize_t rn_dma_xfer(int fd, uint32_t handle, uint64_t buf_offset, uint64_t size, 
+                    uint64_t dev_offset, int dir);
+
 #endif /* __MEMORY_API_H__ */
\ No newline at end of file
@@ -9,6 +9,7 @@
  */
 
 #include "rdma_api.h"
+#include "rn_trace.h"
 
 struct rdma_dev_t* create_rdma_dev(struct rn_dev_t* rn_dev) {
     int i;
@@ -16,8 +17,8 @@ struct rdma_dev_t* create_rdma_dev(struct rn_dev_t* rn_dev) {
     struct rdma_dev_t* rdma_dev = NULL;
     num_qp = rn_dev->num_qp;
 
-    rdma_dev = (struct rdma_dev_t*) malloc(sizeof(struct rdma_dev_t));
-    rdma_dev->glb_csr = (struct rdma_glb_csr_t*) malloc(sizeof(struct rdma_glb_csr_t));
+    rdma_dev = (struct rdma_dev_t*) calloc(1, sizeof(struct rdma_dev_t));
+    rdma_dev->glb_csr = (struct rdma_glb_csr_t*) calloc(1, sizeof(struct rdma_glb_csr_t));
     rdma_dev->qps_ptr = (struct rdma_qp_t**) malloc(num_qp * (sizeof(struct rdma_qp_t*)));
     rdma_dev->axil_ctl = rn_dev->axil_ctl;
 
@@ -27,11 +28,68 @@ struct rdma_dev_t* create_rdma_dev(struct rn_dev_t* rn_dev) {
     rdma_dev->winSize = rn_dev->winSize;
     rdma_dev->rn_dev = rn_dev;
     rdma_dev->num_qp = rn_dev->num_qp;
+    pthread_mutex_init(&(rdma_dev->csr_lock), NULL);
+    rdma_dev->rq_pool = NULL;
+
+    // Completions time out, receives wait for the peer forever
+    rn_wait_policy_init(&(rdma_dev->cq_wait));
+    rn_wait_policy_init(&(rdma_dev->rq_wait));
+    rdma_dev->rq_wait.timeout_us = 0;
     rn_dev->rdma_dev = (void* ) rdma_dev;
 
     return rdma_dev;
 }
 
+// RDMA doorbells have no interrupt source to block on
+static int check_rdma_wait_policy(const rn_wait_policy_t* cq_wait, const rn_wait_policy_t* rq_wait) {
+  if(((cq_wait != NULL) && (cq_wait->mode == RN_WAIT_INTERRUPT)) ||
+     ((rq_wait != NULL) && (rq_wait->mode == RN_WAIT_INTERRUPT))) {
+    fprintf(stderr, "Error: RN_WAIT_INTERRUPT is not supported for RDMA completions and receives\n");
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_set_wait_policy(struct rdma_dev_t* rdma_dev, const rn_wait_policy_t* cq_wait, 
+                         const rn_wait_policy_t* rq_wait) {
+  int i;
+
+  if(check_rdma_wait_policy(cq_wait, rq_wait) < 0) {
+    return -1;
+  }
+
+  if(cq_wait != NULL) {
+    rdma_dev->cq_wait = *cq_wait;
+  }
+  if(rq_wait != NULL) {
+    rdma_dev->rq_wait = *rq_wait;
+  }
+
+  for(i=0; i<rdma_dev->num_qp; i++) {
+    if(rdma_dev->qps_ptr[i] != NULL) {
+      rdma_qp_set_wait_policy(rdma_dev->qps_ptr[i], cq_wait, rq_wait);
+    }
+  }
+
+  return 0;
+}
+
+int rdma_qp_set_wait_policy(struct rdma_qp_t* qp, const rn_wait_policy_t* cq_wait, 
+                            const rn_wait_policy_t* rq_wait) {
+  if(check_rdma_wait_policy(cq_wait, rq_wait) < 0) {
+    return -1;
+  }
+
+  if(cq_wait != NULL) {
+    qp->cq_wait = *cq_wait;
+  }
+  if(rq_wait != NULL) {
+    qp->rq_wait = *rq_wait;
+  }
+
+  return 0;
+}
+
 void open_rdma_dev(struct rdma_dev_t* rdma_dev, struct mac_addr_t local_mac, 
                    uint32_t local_ip, uint32_t udp_sport, uint16_t num_data_buf, 
                    uint16_t per_data_buf_size, uint64_t data_buf_baseaddr,
@@ -122,6 +180,11 @@ void open_rdma_dev(struct rdma_dev_t* rdma_dev, struct mac_addr_t local_mac,
   fprintf(stderr, "Info: rdma_dev opened\n");
 }
 
+// Begin a batch of writes to the RDMA registers
+static void rdma_reg_batch_begin(struct rdma_dev_t* rdma_dev, struct rn_reg_batch_t* batch) {
+  rn_reg_batch_begin(batch, rdma_dev->axil_ctl);
+}
+
 void config_rdma_global_csr (struct rdma_dev_t* rdma_dev) {
   uint32_t data_buf_baseaddr_lsb;
   uint32_t data_buf_baseaddr_msb;
@@ -134,11 +197,24 @@ void config_rdma_global_csr (struct rdma_dev_t* rdma_dev) {
   uint32_t resp_err_pkt_buf_baseaddr_msb;
   uint32_t resp_err_pkt_buf_size_lsb;
   uint32_t resp_err_pkt_buf_size_msb;
+  struct rn_reg_batch_t batch;
 
   struct rdma_glb_csr_t* global_csr = rdma_dev->glb_csr;
+  struct rn_persist_desc_t* persist = rdma_dev->rn_dev->persist;
   uint32_t win_size_low  = rdma_dev->winSize->win_size_lsb;
   uint32_t win_size_high = rdma_dev->winSize->win_size_msb;
 
+  _Static_assert(sizeof(struct rdma_glb_csr_t) <= RN_PERSIST_GLB_CSR_SIZE, 
+                 "RN_PERSIST_GLB_CSR_SIZE is too small for struct rdma_glb_csr_t");
+
+  // A persistent context keeps the global CSRs if the RNIC is still enabled with them
+  if((persist != NULL) && persist->glb_csr_valid && 
+     (memcmp(persist->glb_csr, global_csr, sizeof(struct rdma_glb_csr_t)) == 0) &&
+     (read32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICCONF) == global_csr->xrnic_conf)) {
+    fprintf(stderr, "Info: RDMA global control status registers are unchanged.\n");
+    return;
+  }
+
   if(is_device_address(global_csr->data_buf_baseaddr)) {
     // Device memory address
     data_buf_baseaddr_lsb = ((uint32_t) ((global_csr->data_buf_baseaddr) & 0x00000000ffffffff));
@@ -182,56 +258,66 @@ void config_rdma_global_csr (struct rdma_dev_t* rdma_dev) {
   resp_err_pkt_buf_size_lsb = ((uint32_t) ((global_csr->resp_err_pkt_buf_size) & 0x00000000ffffffff));;
   resp_err_pkt_buf_size_msb = ((uint32_t) ((global_csr->resp_err_pkt_buf_size >> 32) & 0x00000000ffffffff));;
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_DATBUFBA, data_buf_baseaddr_lsb);
+  rdma_reg_batch_begin(rdma_dev, &batch);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_DATBUFBA, data_buf_baseaddr_lsb);
   Debug("[Register] RN_RDMA_GCSR_DATBUFBA=0x%x, value=0x%x\n", RN_RDMA_GCSR_DATBUFBA, data_buf_baseaddr_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_DATBUFBAMSB, data_buf_baseaddr_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_DATBUFBAMSB, data_buf_baseaddr_msb);
   Debug("[Register] RN_RDMA_GCSR_DATBUFBAMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_DATBUFBAMSB, data_buf_baseaddr_msb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_DATBUFSZ, global_csr->data_buf_size);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_DATBUFSZ, global_csr->data_buf_size);
   Debug("[Register] RN_RDMA_GCSR_DATBUFSZ=0x%x, value=0x%x\n", RN_RDMA_GCSR_DATBUFSZ, global_csr->data_buf_size);
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_IPKTERRQBA, ipkt_err_stat_q_baseaddr_lsb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_IPKTERRQBA, ipkt_err_stat_q_baseaddr_lsb);
   Debug("[Register] RN_RDMA_GCSR_IPKTERRQBA=0x%x, value=0x%x\n", RN_RDMA_GCSR_IPKTERRQBA, ipkt_err_stat_q_baseaddr_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_IPKTERRQBAMSB, ipkt_err_stat_q_baseaddr_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_IPKTERRQBAMSB, ipkt_err_stat_q_baseaddr_msb);
   Debug("[Register] RN_RDMA_GCSR_IPKTERRQBAMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_IPKTERRQBAMSB, ipkt_err_stat_q_baseaddr_msb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_IPKTERRQSZ, ipkt_err_stat_q_size);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_IPKTERRQSZ, ipkt_err_stat_q_size);
   Debug("[Register] RN_RDMA_GCSR_ERRBUFSZ=0x%x, value=0x%x\n", RN_RDMA_GCSR_IPKTERRQSZ, ipkt_err_stat_q_size);
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_ERRBUFBA, err_buf_baseaddr_lsb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_ERRBUFBA, err_buf_baseaddr_lsb);
   Debug("[Register] RN_RDMA_GCSR_ERRBUFBA=0x%x, value=0x%x\n", RN_RDMA_GCSR_ERRBUFBA, err_buf_baseaddr_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_ERRBUFBAMSB, err_buf_baseaddr_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_ERRBUFBAMSB, err_buf_baseaddr_msb);
   Debug("[Register] RN_RDMA_GCSR_ERRBUFBAMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_ERRBUFBAMSB, err_buf_baseaddr_msb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_ERRBUFSZ, global_csr->err_buf_size);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_ERRBUFSZ, global_csr->err_buf_size);
   Debug("[Register] RN_RDMA_GCSR_ERRBUFSZ=0x%x, value=0x%x\n", RN_RDMA_GCSR_ERRBUFSZ, global_csr->err_buf_size);
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_RESPERRPKTBA, resp_err_pkt_buf_baseaddr_lsb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_RESPERRPKTBA, resp_err_pkt_buf_baseaddr_lsb);
   Debug("[Register] RN_RDMA_GCSR_RESPERRPKTBA=0x%x, value=0x%x\n", RN_RDMA_GCSR_RESPERRPKTBA, resp_err_pkt_buf_baseaddr_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_RESPERRPKTBAMSB, resp_err_pkt_buf_baseaddr_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_RESPERRPKTBAMSB, resp_err_pkt_buf_baseaddr_msb);
   Debug("[Register] RN_RDMA_GCSR_RESPERRPKTBAMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_RESPERRPKTBAMSB, resp_err_pkt_buf_baseaddr_msb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_RESPERRSZ, resp_err_pkt_buf_size_lsb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_RESPERRSZ, resp_err_pkt_buf_size_lsb);
   Debug("[Register] RN_RDMA_GCSR_RESPERRSZ=0x%x, value=0x%x\n", RN_RDMA_GCSR_RESPERRSZ, resp_err_pkt_buf_size_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_RESPERRSZMSB, resp_err_pkt_buf_size_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_RESPERRSZMSB, resp_err_pkt_buf_size_msb);
   Debug("[Register] RN_RDMA_GCSR_RESPERRSZMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_RESPERRSZMSB, resp_err_pkt_buf_size_msb);
 
   // configure interrupt - enable all interrupt except for CNP scheduling
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_INTEN, global_csr->interrupt_enable);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_INTEN, global_csr->interrupt_enable);
   Debug("[Register] RN_RDMA_GCSR_INTEN=0x%x, value=0x%x\n", RN_RDMA_GCSR_INTEN, global_csr->interrupt_enable);
 
   // configure local MAC address
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_MACXADDLSB, global_csr->src_mac.mac_lsb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_MACXADDLSB, global_csr->src_mac.mac_lsb);
   Debug("[Register] RN_RDMA_GCSR_MACXADDLSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_MACXADDLSB, global_csr->src_mac.mac_lsb);
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_MACXADDMSB, global_csr->src_mac.mac_msb);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_MACXADDMSB, global_csr->src_mac.mac_msb);
   Debug("[Register] RN_RDMA_GCSR_MACXADDMSB=0x%x, value=0x%x\n", RN_RDMA_GCSR_MACXADDMSB, global_csr->src_mac.mac_msb);
 
   // configure local IPv4 address
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_IPV4XADD, global_csr->src_ip);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_IPV4XADD, global_csr->src_ip);
   Debug("[Register] RN_RDMA_GCSR_IPV4XADD=0x%x, value=0x%x\n", RN_RDMA_GCSR_IPV4XADD, global_csr->src_ip);
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICCONF, global_csr->xrnic_conf);
+  // XRNICCONF enables the RNIC, the configuration above has to land first
+  rn_reg_batch_fence();
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_XRNICCONF, global_csr->xrnic_conf);
   Debug("[Register] RN_RDMA_GCSR_XRNICCONF=0x%x, value=0x%x\n", RN_RDMA_GCSR_XRNICCONF, global_csr->xrnic_conf);
 
-  write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF, global_csr->xrnic_advanced_conf);
+  rn_reg_batch_write(&batch, RN_RDMA_GCSR_XRNICADCONF, global_csr->xrnic_advanced_conf);
   Debug("[Register] RN_RDMA_GCSR_XRNICADCONF=0x%x, value=0x%x\n", RN_RDMA_GCSR_XRNICADCONF, global_csr->xrnic_advanced_conf);
 
+  rn_reg_batch_commit(&batch);
+
+  if(persist != NULL) {
+    memcpy(persist->glb_csr, global_csr, sizeof(struct rdma_glb_csr_t));
+    persist->glb_csr_valid = 1;
+  }
+
   fprintf(stderr, "Info: RDMA global control status registers are configured.\n");
 }
 
@@ -267,6 +353,7 @@ void rdma_register_memory_region(struct rdma_dev_t* rdma_dev, struct rdma_pd_t*
   uint32_t pd_num;
   uint64_t buffer_size;
   uint32_t access_config;
+  struct rn_reg_batch_t batch;
 
   uint32_t win_size_low  = rdma_dev->winSize->win_size_lsb;
   uint32_t win_size_high = rdma_dev->winSize->win_size_msb;
@@ -312,23 +399,26 @@ void rdma_register_memory_region(struct rdma_dev_t* rdma_dev, struct rdma_pd_t*
     exit(EXIT_FAILURE);
   }
 
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRLSB, pd_num), rdma_pd->virtual_addr_lsb);
+  rdma_reg_batch_begin(rdma_dev, &batch);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRLSB, pd_num), rdma_pd->virtual_addr_lsb);
   Debug("[Register] RN_RDMA_PDT_VIRTADDRLSB=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRLSB, pd_num), pd_num, rdma_pd->virtual_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRMSB, pd_num), rdma_pd->virtual_addr_msb);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRMSB, pd_num), rdma_pd->virtual_addr_msb);
   Debug("[Register] RN_RDMA_PDT_VIRTADDRMSB=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRMSB, pd_num), pd_num, rdma_pd->virtual_addr_msb);
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRLSB, pd_num), rdma_pd->dma_addr_lsb);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRLSB, pd_num), rdma_pd->dma_addr_lsb);
   Debug("[Register] RN_RDMA_PDT_BUFBASEADDRLSB=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRLSB, pd_num), pd_num, rdma_pd->dma_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRMSB, pd_num), rdma_pd->dma_addr_msb);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRMSB, pd_num), rdma_pd->dma_addr_msb);
   Debug("[Register] RN_RDMA_PDT_BUFBASEADDRMSB=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRMSB, pd_num), pd_num, rdma_pd->dma_addr_msb);
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFRKEY, pd_num), r_key);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFRKEY, pd_num), r_key);
   Debug("[Register] RN_RDMA_PDT_BUFRKEY=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_BUFRKEY, pd_num), pd_num, r_key);
 
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_WRRDBUFLEN, pd_num), buffer_size);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_WRRDBUFLEN, pd_num), buffer_size);
   Debug("[Register] RN_RDMA_PDT_WRRDBUFLEN=0x%x, pd_num=%d, value=0x%lx B\n", get_rdma_pd_config_addr(RN_RDMA_PDT_WRRDBUFLEN, pd_num), pd_num, buffer_size);
   access_config = ((rdma_pd->buffer_size_msb<<16) | rdma_pd->pd_access_type);
-  write32_data(rdma_dev->axil_ctl, get_rdma_pd_config_addr(RN_RDMA_PDT_ACCESSDESC, pd_num), access_config);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_ACCESSDESC, pd_num), access_config);
   Debug("[Register] RN_RDMA_PDT_ACCESSDESC=0x%x, pd_num=%d, value=0x%x\n", get_rdma_pd_config_addr(RN_RDMA_PDT_ACCESSDESC, pd_num), pd_num, access_config);
 
+  rn_reg_batch_commit(&batch);
+
   fprintf(stderr, "Info: memory region for the %d-th PD is registered\n", pd_num);
 }
 
@@ -357,6 +447,9 @@ struct rdma_buff_t* allocate_hugepages_buffer(uint32_t num_hugepages) {
   }
 
   rdma_buffer->dma_addr = get_buffer_paddr(rdma_buffer->buffer);
+  rdma_buffer->buf_size = num_hugepages * (1 << HUGE_PAGE_SHIFT);
+  rdma_buffer->pool = NULL;
+  rdma_buffer->slab = NULL;
 
   return rdma_buffer;
 }
@@ -387,18 +480,261 @@ void config_sq_psn(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t sq_psn){
   rdma_dev->qps_ptr[qpid]->sq_psn = sq_psn;
 }
 
-struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
-                                   uint32_t qpid,
-                                   uint32_t dst_qpid,
-                                   struct rdma_pd_t* pd_entry,
-                                   uint64_t cq_cidb_addr,
-                                   uint64_t rq_cidb_addr,
-                                   uint32_t qdepth,
-                                   char*    buf_location,
-                                   struct mac_addr_t* dst_mac,
-                                   uint32_t dst_ip,
-                                   uint32_t partion_key,
-                                   uint32_t r_key) {
+// Get a buffer descriptor for size bytes at offset in mem. The descriptor does not own 
+// memory, freeing it leaves mem untouched.
+static struct rdma_buff_t* rdma_buffer_slice(struct rdma_buff_t* mem, uint64_t offset, uint32_t size) {
+  struct rdma_buff_t* slice;
+
+  slice = (struct rdma_buff_t* ) calloc(1, sizeof(struct rdma_buff_t));
+  if(slice == NULL) {
+    return NULL;
+  }
+
+  slice->buffer   = (mem->buffer != NULL) ? (void* ) ((char* ) mem->buffer + offset) : NULL;
+  slice->dma_addr = mem->dma_addr + offset;
+  slice->buf_size = size;
+  return slice;
+}
+
+// Take a free ring from a shared RQ buffer. The returned buffer describes the ring only
+// and does not own memory.
+static struct rdma_buff_t* rdma_rq_pool_get(struct rdma_rq_pool_t* pool, uint32_t qdepth, 
+                                            uint32_t* ring) {
+  struct rdma_buff_t* rq;
+
+  if(qdepth > pool->ring_depth) {
+    fprintf(stderr, "Error: qdepth %d exceeds the RQ pool ring depth %d\n", qdepth, pool->ring_depth);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(pool->lock));
+  if(pool->num_free == 0) {
+    pthread_mutex_unlock(&(pool->lock));
+    fprintf(stderr, "Error: no free ring left in the RQ pool\n");
+    return NULL;
+  }
+  pool->num_free--;
+  *ring = pool->free_rings[pool->num_free];
+  pthread_mutex_unlock(&(pool->lock));
+
+  rq = rdma_buffer_slice(pool->buffer, (uint64_t) (*ring) * pool->ring_depth * RQE_SIZE, 
+                         pool->ring_depth * RQE_SIZE);
+  if(rq == NULL) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->free_rings[pool->num_free] = *ring;
+    pool->num_free++;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  return rq;
+}
+
+// Give the RQ ring of a queue pair back to its shared RQ buffer
+static void rdma_rq_pool_put(struct rdma_qp_t* qp) {
+  struct rdma_rq_pool_t* pool = qp->rq_pool;
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->free_rings[pool->num_free] = qp->rq_ring;
+  pool->num_free++;
+  pthread_mutex_unlock(&(pool->lock));
+
+  // The ring buffer has no pool of its own, so only its descriptor is freed
+  free_rdma_buffer(qp->rq);
+  qp->rq = NULL;
+  qp->rq_pool = NULL;
+}
+
+struct rdma_rq_pool_t* rdma_create_rq_pool(struct rdma_dev_t* rdma_dev, uint32_t num_rings, 
+                                           uint32_t ring_depth, char* buf_location) {
+  uint32_t i;
+  uint64_t pool_size;
+  struct rdma_rq_pool_t* pool;
+
+  if((rdma_dev == NULL) || (num_rings == 0) || (ring_depth == 0)) {
+    fprintf(stderr, "Error: rdma_create_rq_pool needs an RDMA device, rings and a ring depth\n");
+    return NULL;
+  }
+
+  if(rdma_dev->rq_pool != NULL) {
+    fprintf(stderr, "Error: the RDMA device already has an RQ pool\n");
+    return NULL;
+  }
+
+  pool_size = (uint64_t) num_rings * ring_depth * RQE_SIZE;
+  if(pool_size > 0xffffffff) {
+    fprintf(stderr, "Error: RQ pool of %ld bytes is too large\n", pool_size);
+    return NULL;
+  }
+
+  pool = (struct rdma_rq_pool_t* ) calloc(1, sizeof(struct rdma_rq_pool_t));
+  if(pool == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RQ pool\n");
+    return NULL;
+  }
+
+  pool->free_rings = (uint32_t* ) malloc(num_rings * sizeof(uint32_t));
+  if(pool->free_rings == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RQ pool ring table\n");
+    free(pool);
+    return NULL;
+  }
+
+  pool->buffer = allocate_rdma_buffer(rdma_dev->rn_dev, pool_size, buf_location);
+  if(pool->buffer == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RQ pool buffer\n");
+    free(pool->free_rings);
+    free(pool);
+    return NULL;
+  }
+
+  // Hand out rings from the start of the buffer first
+  for(i=0; i<num_rings; i++) {
+    pool->free_rings[i] = num_rings - 1 - i;
+  }
+  pool->num_rings  = num_rings;
+  pool->num_free   = num_rings;
+  pool->ring_depth = ring_depth;
+  pthread_mutex_init(&(pool->lock), NULL);
+
+  rdma_dev->rq_pool = pool;
+  Debug("DEBUG: RQ pool with %d rings of %d RQEs, dma_addr = 0x%lx\n", num_rings, ring_depth, 
+        pool->buffer->dma_addr);
+  return pool;
+}
+
+int rdma_destroy_rq_pool(struct rdma_dev_t* rdma_dev) {
+  struct rdma_rq_pool_t* pool;
+
+  if((rdma_dev == NULL) || (rdma_dev->rq_pool == NULL)) {
+    return 0;
+  }
+
+  pool = rdma_dev->rq_pool;
+  if(pool->num_free != pool->num_rings) {
+    fprintf(stderr, "Error: %d rings of the RQ pool are still in use\n", pool->num_rings - pool->num_free);
+    return -1;
+  }
+
+  rdma_dev->rq_pool = NULL;
+  free_rdma_buffer(pool->buffer);
+  pthread_mutex_destroy(&(pool->lock));
+  free(pool->free_rings);
+  free(pool);
+  return 0;
+}
+
+// Free the host memory of a queue pair and remove it from its RDMA device. The QP's CSRs
+// are left alone, destroy_rdma_qp() resets them first.
+static void rdma_qp_free(struct rdma_qp_t* qp) {
+  int i;
+
+  if(qp->rdma_dev->qps_ptr[qp->qpid] == qp) {
+    qp->rdma_dev->qps_ptr[qp->qpid] = NULL;
+  }
+
+  free_rdma_buffer(qp->sq);
+  qp->sq = NULL;
+  if(qp->rq_pool != NULL) {
+    rdma_rq_pool_put(qp);
+  } else {
+    free_rdma_buffer(qp->rq);
+    qp->rq = NULL;
+  }
+  free_rdma_buffer(qp->cq);
+  qp->cq = NULL;
+  for(i=0; i<RDMA_QP_NUM_RINGS; i++) {
+    free_rdma_buffer(qp->ring_mem[i]);
+    qp->ring_mem[i] = NULL;
+  }
+  free(qp->sq_wrid);
+  qp->sq_wrid = NULL;
+  free(qp->sq_shadow);
+  qp->sq_shadow = NULL;
+  free(qp->wqe_tmpl);
+  qp->wqe_tmpl = NULL;
+  free(qp);
+}
+
+// Allocate the CQ, SQ and RQ of a queue pair, each sized by the QP's own qdepth. Rings 
+// with the same location are packed into one buffer in CQ, SQ, RQ order, so the entries
+// the host polls and writes for a QP share neighbouring cache lines and pages.
+static int rdma_qp_alloc_rings(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t qdepth,
+                               const struct rdma_qp_placement_t* placement) {
+  struct rdma_buff_t** ring[RDMA_QP_NUM_RINGS] = {&(qp->cq), &(qp->sq), &(qp->rq)};
+  char* location[RDMA_QP_NUM_RINGS];
+  uint64_t ring_size[RDMA_QP_NUM_RINGS];
+  uint64_t offset[RDMA_QP_NUM_RINGS];
+  uint64_t mem_size[RDMA_QP_NUM_RINGS];
+  int owner[RDMA_QP_NUM_RINGS];
+  int num_rings;
+  int i;
+  int j;
+
+  location[0] = placement->cq_location;
+  location[1] = placement->sq_location;
+  location[2] = placement->rq_location;
+  // Each CQE has 4 bytes, each WQE has 64 bytes
+  ring_size[0] = (uint64_t) qdepth * 4;
+  ring_size[1] = (uint64_t) qdepth * 64;
+  ring_size[2] = (uint64_t) qdepth * RQE_SIZE;
+
+  // A pooled RQ is carved from the shared RQ buffer instead
+  num_rings = (qp->rq_pool != NULL) ? (RDMA_QP_NUM_RINGS - 1) : RDMA_QP_NUM_RINGS;
+
+  for(i=0; i<RDMA_QP_NUM_RINGS; i++) {
+    qp->ring_mem[i] = NULL;
+    mem_size[i] = 0;
+  }
+
+  // Rings follow the first ring with the same location in its buffer
+  for(i=0; i<num_rings; i++) {
+    for(j=0; (j < i) && strcmp(location[j], location[i]); j++);
+    owner[i]  = j;
+    offset[i] = mem_size[j];
+    mem_size[j] += (ring_size[i] + RDMA_QP_RING_ALIGN - 1) & ~((uint64_t) RDMA_QP_RING_ALIGN - 1);
+  }
+
+  for(i=0; i<num_rings; i++) {
+    if(owner[i] != i) {
+      continue;
+    }
+
+    if(!strcmp(location[i], DEVICE_MEM)) {
+      qp->ring_mem[i] = allocate_rdma_dev_buffer(rdma_dev->rn_dev, mem_size[i], placement->dev_channel);
+    } else {
+      qp->ring_mem[i] = allocate_rdma_buffer(rdma_dev->rn_dev, mem_size[i], location[i]);
+    }
+    if(qp->ring_mem[i] == NULL) {
+      return -1;
+    }
+    Debug("DEBUG: QP%d ring buffer %d, size = %ld, location = %s\n", qp->qpid, i, mem_size[i], location[i]);
+  }
+
+  for(i=0; i<num_rings; i++) {
+    *(ring[i]) = rdma_buffer_slice(qp->ring_mem[owner[i]], offset[i], (uint32_t) ring_size[i]);
+    if(*(ring[i]) == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Allocate a queue pair and add the writes of its per-queue CSRs to a register batch. 
+// The QP can't be used before the batch is committed. Returns NULL, with nothing written
+// to the batch, if the QP's memory can't be allocated.
+static struct rdma_qp_t* rdma_qp_create(struct rdma_dev_t* rdma_dev,
+                                        uint32_t qpid,
+                                        uint32_t dst_qpid,
+                                        struct rdma_pd_t* pd_entry,
+                                        uint64_t cq_cidb_addr,
+                                        uint64_t rq_cidb_addr,
+                                        uint32_t qdepth,
+                                        const struct rdma_qp_placement_t* placement,
+                                        struct mac_addr_t* dst_mac,
+                                        uint32_t dst_ip,
+                                        uint32_t partion_key,
+                                        uint32_t r_key,
+                                        struct rn_reg_batch_t* batch) {
   uint32_t sq_addr_lsb;
   uint32_t sq_addr_msb;
   uint32_t cq_addr_lsb;
@@ -418,30 +754,68 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
   uint32_t time_to_live;
   uint32_t qp_adv_conf;
   uint32_t rq_buffer_entry_size;
-  uint32_t cq_size;
-  uint32_t rq_size;
-  uint32_t sq_size;
   uint32_t win_size_low  = rdma_dev->winSize->win_size_lsb;
   uint32_t win_size_high = rdma_dev->winSize->win_size_msb;
 
-  qp = (struct rdma_qp_t* ) malloc(sizeof(struct rdma_qp_t));
+  if(rdma_dev->axil_ctl == 0) {
+    fprintf(stderr, "Error: rdma_dev->axil_ctl=0x%lx is not valid!\n", 
+                    (uint64_t) rdma_dev->axil_ctl);
+    return NULL;
+  }
+
+  // Fields left NULL are skipped by rdma_qp_free() when a later allocation fails
+  qp = (struct rdma_qp_t* ) calloc(1, sizeof(struct rdma_qp_t));
+  if(qp == NULL) {
+    fprintf(stderr, "Error: failed to allocate QP%d\n", qpid);
+    return NULL;
+  }
   qp->rdma_dev = rdma_dev;
   qp->qpid = qpid;
   qp->dst_qpid = dst_qpid;
-  fprintf(stderr, "Allocating qp->sq\n");
-  // Each WQE has 64 bytes
-  sq_size = rdma_dev->num_qp * qdepth * 64;
-  cq_size = rdma_dev->num_qp * qdepth * 4;
-  rq_size = rdma_dev->num_qp * qdepth * RQE_SIZE;
-
-  Debug("sq_size = %d, cq_size = %d, rq_size %d, buf_location = %s\n", sq_size, cq_size, rq_size, buf_location);
-  qp->sq = allocate_rdma_buffer(rdma_dev->rn_dev, (uint64_t) sq_size, buf_location);
+  fprintf(stderr, "Allocating qp->sq, qp->cq and qp->rq\n");
+  qp->rq_pool = rdma_dev->rq_pool;
+  qp->rq = NULL;
+  if(qp->rq_pool != NULL) {
+    qp->rq = rdma_rq_pool_get(qp->rq_pool, qdepth, &(qp->rq_ring));
+    if(qp->rq == NULL) {
+      fprintf(stderr, "Error: failed to allocate the RQ of QP%d\n", qpid);
+      qp->rq_pool = NULL;
+      goto err_free;
+    }
+  }
+
+  Debug("qdepth = %d, sq_location = %s, cq_location = %s, rq_location = %s\n", qdepth, 
+        placement->sq_location, placement->cq_location, placement->rq_location);
+  if(rdma_qp_alloc_rings(rdma_dev, qp, qdepth, placement) < 0) {
+    fprintf(stderr, "Error: failed to allocate the rings of QP%d\n", qpid);
+    goto err_free;
+  }
   qp->sq_pidb = 0;
   qp->sq_cidb = 0;
+  qp->sq_wrid = (uint16_t* ) calloc(qdepth, sizeof(uint16_t));
+  if(qp->sq_wrid == NULL) {
+    fprintf(stderr, "Error: failed to allocate SQ work request ID table\n");
+    goto err_free;
+  }
+
+  qp->wqe_tmpl = (struct rdma_wqe_t* ) calloc(1, sizeof(struct rdma_wqe_t));
+  if(qp->wqe_tmpl == NULL) {
+    fprintf(stderr, "Error: failed to allocate WQE template\n");
+    goto err_free;
+  }
+  qp->laddr_mask = (((uint64_t) win_size_high) << 32) | ((uint64_t) win_size_low);
+  qp->sq_staged = 0;
+
+  qp->sq_shadow = NULL;
+  if(is_device_address(qp->sq->dma_addr)) {
+    // WQEs of a device SQ are staged in host memory and flushed in batches
+    qp->sq_shadow = (struct rdma_wqe_t* ) calloc(qdepth, sizeof(struct rdma_wqe_t));
+    if(qp->sq_shadow == NULL) {
+      fprintf(stderr, "Error: failed to allocate SQ shadow ring\n");
+      goto err_free;
+    }
+  }
 
-  fprintf(stderr, "Allocating qp->cq\n");
-  // Each CQE has 4 bytes
-  qp->cq = allocate_rdma_buffer(rdma_dev->rn_dev, (uint64_t) cq_size, buf_location);
   qp->cq_cidb = 0;
 
   if(is_device_address(cq_cidb_addr)) {
@@ -455,10 +829,9 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
   }
 
   qp->cq_cidb_addr = cq_cidb_addr;
-  fprintf(stderr, "Allocating qp->rq\n");
+  qp->cq_db_shadow = (volatile uint32_t* ) get_host_vaddr(rdma_dev->rn_dev, cq_cidb_addr);
+  qp->cq_db_idle = 0;
 
-  // Each RQE is 256B
-  qp->rq = allocate_rdma_buffer(rdma_dev->rn_dev, (uint64_t) rq_size, buf_location);
   //rdma_register_memory_region(rdma_dev, pd_entry, r_key, qp->rq);
   qp->rq_cidb = 0;
   qp->rq_pidb = 0;
@@ -473,10 +846,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
     rq_cidb_addr_msb = ((uint32_t) ((rq_cidb_addr >> 32) & 0x00000000ffffffff)) & win_size_high;
   }
   qp->rq_cidb_addr = rq_cidb_addr;
+  qp->rq_db_shadow = (volatile uint32_t* ) get_host_vaddr(rdma_dev->rn_dev, rq_cidb_addr);
   
   qp->pd_entry = pd_entry;
   
   qp->qdepth   = qdepth;
+  qp->cq_wait  = rdma_dev->cq_wait;
+  qp->rq_wait  = rdma_dev->rq_wait;
+  qp->owner    = -1;
   qp->dst_mac = dst_mac;
   qp->dst_ip  = dst_ip;
   rdma_dev->qps_ptr[qpid] = qp;
@@ -486,28 +863,22 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                   (uint64_t) rdma_dev->rn_dev->axil_ctl, 
                   (uint64_t) rdma_dev->axil_ctl);
 
-  if(rdma_dev->axil_ctl == 0) {
-    fprintf(stderr, "Error: rdma_dev->axil_ctl=0x%lx is not valid!\n", 
-                    (uint64_t) rdma_dev->axil_ctl);
-    exit(EXIT_FAILURE);
-  }
-
   // Configure RDMA per-queue CSR registers
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_IPDESADDR1i, qpid), 
               dst_ip);
   Debug("[Register] RN_RDMA_QCSR_IPDESADDR1i=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_IPDESADDR1i, qpid),  
                     qpid, 
                     dst_ip);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_MACDESADDLSBi, qpid), 
                 dst_mac->mac_lsb);
   Debug("[Register] RN_RDMA_QCSR_MACDESADDLSBi=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_MACDESADDLSBi, qpid), 
                     qpid, 
                     dst_mac->mac_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_MACDESADDMSBi, qpid), 
               dst_mac->mac_msb);
   Debug("[Register] RN_RDMA_QCSR_MACDESADDMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -530,14 +901,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
     sq_addr_msb = ((uint32_t) ((qp->sq->dma_addr >> 32) & 0x00000000ffffffff)) & win_size_high;
   }
 
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQBAi, qpid),  
                 sq_addr_lsb);
   Debug("[Register] RN_RDMA_QCSR_SQBAi=0x%x, qpid=%d, value=0x%x\n", 
                   get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQBAi, qpid), 
                   qpid, 
                   sq_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQBAMSBi, qpid), 
                 sq_addr_msb);
   Debug("[Register] RN_RDMA_QCSR_SQBAMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -559,14 +930,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
     cq_addr_msb = ((uint32_t) ((qp->cq->dma_addr >> 32) & 0x00000000ffffffff)) & win_size_high;
   }
 
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQBAi, qpid), 
               cq_addr_lsb);
   Debug("[Register] RN_RDMA_QCSR_CQBAi=0x%x, qpid=%d, value=0x%x\n", 
                   get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQBAi, qpid), 
                   qpid, 
                   cq_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQBAMSBi, qpid), 
                 cq_addr_msb);
   Debug("[Register] RN_RDMA_QCSR_CQBAMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -588,14 +959,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
     rq_addr_msb = ((uint32_t) ((qp->rq->dma_addr >> 32) & 0x00000000ffffffff)) & win_size_high;
   }
 
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQBAi, qpid), 
                 rq_addr_lsb);
   Debug("[Register] RN_RDMA_QCSR_RQBAi=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQBAi, qpid), 
                     qpid, 
                     rq_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQBAMSBi, qpid), 
                 rq_addr_msb);
   Debug("[Register] RN_RDMA_QCSR_RQBAMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -608,14 +979,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                     rq_addr_lsb);
 
   // CQ DB address
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQDBADDi, qpid), 
               cq_cidb_addr_lsb);
   Debug("[Register] RN_RDMA_QCSR_CQDBADDi=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQDBADDi, qpid), 
                     qpid, 
                     cq_cidb_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQDBADDMSBi, qpid), 
                 cq_cidb_addr_msb);
   Debug("[Register] RN_RDMA_QCSR_CQDBADDMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -625,14 +996,14 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
   Debug("DEBUG: cq_cidb_addr = 0x%lx\n", cq_cidb_addr);
 
   // RQ DB address
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQWPTRDBADDi, qpid), 
               rq_cidb_addr_lsb);
   Debug("[Register] RN_RDMA_QCSR_RQWPTRDBADDi=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQWPTRDBADDi, qpid), 
                     qpid, 
                     rq_cidb_addr_lsb);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQWPTRDBADDMSBi, qpid), 
               rq_cidb_addr_msb);
   Debug("[Register] RN_RDMA_QCSR_RQWPTRDBADDMSBi=0x%x, qpid=%d, value=0x%x\n", 
@@ -642,7 +1013,7 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
   Debug("DEBUG: rq_cidb_addr = 0x%lx\n", rq_cidb_addr);
   
   // Destination QP configuration
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
               get_rdma_per_q_config_addr(RN_RDMA_QCSR_DESTQPCONFi, qpid), 
               dst_qpid);
   Debug("[Register] RN_RDMA_QCSR_DESTQPCONFi=0x%x, qpid=%d, value=0x%x\n", 
@@ -651,7 +1022,7 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                     dst_qpid);
 
   // Queue depth configuration
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_QDEPTHi, qpid), 
                 (qdepth | qdepth << 16));
   Debug("[Register] RN_RDMA_QCSR_QDEPTHi=0x%x, qpid=%d, value=0x%x\n", 
@@ -698,7 +1069,9 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                 (0x30 & 0x000000f0) | 
                 ((mtu_config<<8) & 0x0000ff00) | 
                 ((rq_buffer_entry_size<<16) & 0xffff0000);
-  write32_data(rdma_dev->axil_ctl, 
+  // QPCONFi enables the QP, its configuration above has to land first
+  rn_reg_batch_fence();
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid), 
                 qp_config);
   Debug("[Register] RN_RDMA_QCSR_QPCONFi=0x%x, qpid=%d, value=0x%x\n", 
@@ -712,7 +1085,7 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
   qp_adv_conf = ((partion_key<<16) & 0xffff0000) | 
                 ((time_to_live<<8) & 0x0000ff00) | 
                 (traffic_class & 0x000000ff);
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPADVCONFi, qpid), 
                 qp_adv_conf);
   Debug("[Register] RN_RDMA_QCSR_QPADVCONFi=0x%x, qpid=%d, value=0x%x\n", 
@@ -721,7 +1094,7 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                     qp_adv_conf);
 
   // PD number configuration
-  write32_data(rdma_dev->axil_ctl, 
+  rn_reg_batch_write(batch, 
                 get_rdma_per_q_config_addr(RN_RDMA_QCSR_PDi, qpid), 
                 pd_entry->pd_num);
   Debug("[Register] RN_RDMA_QCSR_PDi=0x%x, qpid=%d, value=0x%x\n", 
@@ -729,10 +1102,126 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                     qpid, 
                     pd_entry->pd_num);
 
+  return qp;
+
+err_free:
+  rdma_qp_free(qp);
+  return NULL;
+}
+
+// Start the doorbell shadows of a queue pair from the current hardware indices
+static void rdma_qp_init_db_shadows(struct rdma_qp_t* qp) {
+  if(qp->cq_db_shadow != NULL) {
+    *(qp->cq_db_shadow) = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
+  }
+  if(qp->rq_db_shadow != NULL) {
+    *(qp->rq_db_shadow) = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid));
+  }
+}
+
+struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
+                                   uint32_t qpid,
+                                   uint32_t dst_qpid,
+                                   struct rdma_pd_t* pd_entry,
+                                   uint64_t cq_cidb_addr,
+                                   uint64_t rq_cidb_addr,
+                                   uint32_t qdepth,
+                                   char*    buf_location,
+                                   struct mac_addr_t* dst_mac,
+                                   uint32_t dst_ip,
+                                   uint32_t partion_key,
+                                   uint32_t r_key) {
+  struct rdma_qp_placement_t placement = {buf_location, buf_location, buf_location, RN_DEV_PLACE_AUTO};
+
+  return allocate_rdma_qp_placed(rdma_dev, qpid, dst_qpid, pd_entry, cq_cidb_addr, rq_cidb_addr, 
+                                 qdepth, &placement, dst_mac, dst_ip, partion_key, r_key);
+}
+
+struct rdma_qp_t* allocate_rdma_qp_placed(struct rdma_dev_t* rdma_dev,
+                                          uint32_t qpid,
+                                          uint32_t dst_qpid,
+                                          struct rdma_pd_t* pd_entry,
+                                          uint64_t cq_cidb_addr,
+                                          uint64_t rq_cidb_addr,
+                                          uint32_t qdepth,
+                                          const struct rdma_qp_placement_t* placement,
+                                          struct mac_addr_t* dst_mac,
+                                          uint32_t dst_ip,
+                                          uint32_t partion_key,
+                                          uint32_t r_key) {
+  struct rdma_qp_t* qp;
+  struct rn_reg_batch_t batch;
+
+  rdma_reg_batch_begin(rdma_dev, &batch);
+  qp = rdma_qp_create(rdma_dev, qpid, dst_qpid, pd_entry, cq_cidb_addr, rq_cidb_addr, qdepth, 
+                      placement, dst_mac, dst_ip, partion_key, r_key, &batch);
+  rn_reg_batch_commit(&batch);
+  if(qp == NULL) {
+    fprintf(stderr, "Error: allocate_rdma_qp - failed to allocate QP%d\n", qpid);
+    return NULL;
+  }
+  rdma_qp_init_db_shadows(qp);
+
   fprintf(stderr, "Info: allocate_rdma_qp - Successfully allocated a rdma qp\n");
   return qp;
 }
 
+int allocate_rdma_qps(struct rdma_dev_t* rdma_dev,
+                      uint32_t first_qpid,
+                      uint32_t num_qps,
+                      uint32_t first_dst_qpid,
+                      struct rdma_pd_t* pd_entry,
+                      uint64_t cq_cidb_addr,
+                      uint64_t rq_cidb_addr,
+                      uint32_t qdepth,
+                      char*    buf_location,
+                      struct mac_addr_t* dst_mac,
+                      uint32_t dst_ip,
+                      uint32_t partion_key,
+                      uint32_t r_key,
+                      struct rdma_qp_t** qps) {
+  struct rdma_qp_placement_t placement = {buf_location, buf_location, buf_location, RN_DEV_PLACE_AUTO};
+  struct rn_reg_batch_t batch;
+  uint32_t i;
+
+  if((rdma_dev == NULL) || (first_qpid + num_qps > rdma_dev->num_qp)) {
+    fprintf(stderr, "Error: allocate_rdma_qps - QP%d to QP%d are out of range\n", first_qpid, first_qpid + num_qps - 1);
+    return -1;
+  }
+
+  // The CSRs of all queue pairs are programmed in one batch
+  rdma_reg_batch_begin(rdma_dev, &batch);
+  for(i=0; i<num_qps; i++) {
+    if(rdma_qp_create(rdma_dev, first_qpid + i, first_dst_qpid + i, pd_entry, 
+                      cq_cidb_addr + ((uint64_t) i << 2), rq_cidb_addr + ((uint64_t) i << 2), 
+                      qdepth, &placement, dst_mac, dst_ip, partion_key, r_key, &batch) == NULL) {
+      break;
+    }
+  }
+  rn_reg_batch_commit(&batch);
+
+  if(i < num_qps) {
+    // The QPs created so far are already programmed, reset them before freeing them
+    fprintf(stderr, "Error: allocate_rdma_qps - failed to allocate QP%d\n", first_qpid + i);
+    while(i > 0) {
+      i--;
+      rdma_qp_init_db_shadows(rdma_dev->qps_ptr[first_qpid + i]);
+      rdma_qp_release(rdma_dev->qps_ptr[first_qpid + i]);
+    }
+    return -1;
+  }
+
+  for(i=0; i<num_qps; i++) {
+    rdma_qp_init_db_shadows(rdma_dev->qps_ptr[first_qpid + i]);
+    if(qps != NULL) {
+      qps[i] = rdma_dev->qps_ptr[first_qpid + i];
+    }
+  }
+
+  fprintf(stderr, "Info: allocate_rdma_qps - Successfully allocated %d rdma qps with %d register writes\n", num_qps, batch.num_writes);
+  return (int) num_qps;
+}
+
 void create_a_wqe(struct rdma_dev_t* rdma_dev, 
                   uint32_t qpid, 
                   uint16_t wrid, 
@@ -768,13 +1257,14 @@ void create_a_wqe(struct rdma_dev_t* rdma_dev,
   masked_buf_addr = (((uint64_t) high_addr) << 32) | ((uint64_t) low_addr);
   Debug("Info: WQE mem_buffer = 0x%lx, masked_mem_buffer = 0x%lx\n", laddr, masked_buf_addr);
 
-  struct rdma_buff_t* sq = rdma_dev->qps_ptr[qpid]->sq;
-  if(is_device_address(sq->dma_addr)) {
-    // SQ is allocated at device memory
-    wqe = (struct rdma_wqe_t* ) malloc(sizeof(struct rdma_wqe_t));
+  struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
+  qp->sq_wrid[wqe_idx % qp->qdepth] = wrid;
+  if(qp->sq_shadow != NULL) {
+    // SQ is allocated at device memory, stage the WQE in the shadow ring
+    wqe = &(qp->sq_shadow[wqe_idx % qp->qdepth]);
   } else {
     // SQ is allocated at host memory
-    wqe = &(((struct rdma_wqe_t*) sq->buffer)[wqe_idx]);
+    wqe = &(((struct rdma_wqe_t*) qp->sq->buffer)[wqe_idx % qp->qdepth]);
   }
   memset(wqe, 0, sizeof(struct rdma_wqe_t));
 
@@ -806,56 +1296,141 @@ void create_a_wqe(struct rdma_dev_t* rdma_dev,
   Debug("[WQE] send_small_payload2=0x%x\n", wqe->send_small_payload2);
   Debug("[WQE] send_small_payload3=0x%x\n", wqe->send_small_payload3);
   Debug("[WQE] immdt_data=0x%x\n", wqe->immdt_data);
-  if(is_device_address(sq->dma_addr)) {
-    // Write WQE to SQ in the device memory
-    Debug("DEBUG: Write WQE to the device memory\n");
-    ssize_t rc = write_from_buffer(device, fpga_fd, (char* ) wqe, sizeof(struct rdma_wqe_t), (sq->dma_addr + (wqe_idx*sizeof(struct rdma_wqe_t))));
-    if (rc < 0){
-      fprintf(stderr, "Error: Failed to write WQE to the device memory!\n");
-      exit(EXIT_FAILURE);
-    } else {
-      Debug("DEBUG: successfully write WQE to the device memory!\n");
+  RN_TRACE_EVENT(RN_TRACE_WQE_BUILD, qpid, wqe_idx % qp->qdepth);
+}
+
+void rdma_wqe_prepare(struct rdma_qp_t* qp, uint32_t r_key, uint32_t opcode) {
+  memset(qp->wqe_tmpl, 0, sizeof(struct rdma_wqe_t));
+  qp->wqe_tmpl->opcode = opcode & 0x000000ff;
+  qp->wqe_tmpl->r_key  = r_key;
+}
+
+int rdma_wqe_post_fast(struct rdma_qp_t* qp, uint64_t laddr, uint32_t length, 
+                       uint64_t remote_offset) {
+  uint32_t slot;
+  struct rdma_wqe_t* wqe;
+
+  if(qp->sq_staged >= rdma_sq_credits(qp)) {
+    return -1;
+  }
+
+  slot = rdma_ring_add(qp->sq_pidb, qp->sq_staged, qp->qdepth);
+  if(qp->sq_shadow != NULL) {
+    wqe = &(qp->sq_shadow[slot]);
+  } else {
+    wqe = &(((struct rdma_wqe_t*) qp->sq->buffer)[slot]);
+  }
+
+  if((laddr & DEVICE_MEM_MASK) != DEVICE_MEM_OFFSET) {
+    // Host memory address
+    laddr &= qp->laddr_mask;
+  }
+
+  *wqe = *(qp->wqe_tmpl);
+  wqe->wrid = (uint16_t) slot;
+  wqe->laddr_low  = (uint32_t) (laddr & 0x00000000ffffffff);
+  wqe->laddr_high = (uint32_t) ((laddr & 0xffffffff00000000) >> 32);
+  wqe->length = length;
+  wqe->remote_offset_low  = (uint32_t) (remote_offset & 0x00000000ffffffff);
+  wqe->remote_offset_high = (uint32_t) ((remote_offset & 0xffffffff00000000) >> 32);
+
+  qp->sq_wrid[slot] = (uint16_t) slot;
+  qp->sq_staged++;
+  RN_TRACE_EVENT(RN_TRACE_WQE_BUILD, qp->qpid, slot);
+
+  return (int) slot;
+}
+
+int rdma_post_staged(struct rdma_qp_t* qp) {
+  uint32_t num_wqe = qp->sq_staged;
+
+  if(rdma_post_send_async(qp->rdma_dev, qp->qpid, num_wqe) < 0) {
+    return -1;
+  }
+  qp->sq_staged = 0;
+
+  return 0;
+}
+
+// Wait for a doorbell index to move away from old_value. The doorbell shadow in host 
+// memory is polled first; the hardware register is only read every 
+// RDMA_DB_SHADOW_SLICE_US to cross-check it. If hardware has moved on while the shadow has
+// not, the shadow is dropped and the register is polled from then on.
+static int rdma_wait_doorbell(struct rdma_qp_t* qp, volatile uint32_t** shadow, 
+                              volatile uint32_t* reg, uint32_t old_value, 
+                              const rn_wait_policy_t* policy, uint32_t* new_value) {
+  rn_wait_policy_t slice;
+  uint64_t waited_us = 0;
+
+  if(*shadow == NULL) {
+    return rn_wait_value_change(reg, old_value, policy, new_value);
+  }
+
+  slice = *policy;
+  slice.timeout_us = RDMA_DB_SHADOW_SLICE_US;
+  while(1) {
+    if(rn_wait_value_change(*shadow, old_value, &slice, new_value) == 0) {
+      return 0;
+    }
+
+    *new_value = *reg;
+    if(*new_value != old_value) {
+      fprintf(stderr, "Warning: doorbell shadow of QP%d is not updated by hardware, polling registers instead\n", qp->qpid);
+      *shadow = NULL;
+      return 0;
+    }
+
+    waited_us += RDMA_DB_SHADOW_SLICE_US;
+    if((policy->timeout_us != 0) && (waited_us >= policy->timeout_us)) {
+      errno = ETIMEDOUT;
+      return -1;
     }
-    free(wqe);
   }
 }
 
 int poll_rq_pidb(struct rdma_dev_t* rdma_dev, uint32_t qpid) {
   struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
-  int rq_pidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qpid));
+  volatile uint32_t* rq_pidb_reg = (volatile uint32_t* ) ((uintptr_t) rdma_dev->axil_ctl + 
+                                   get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qpid));
+  uint32_t rq_pidb = (qp->rq_db_shadow != NULL) ? *(qp->rq_db_shadow) : *rq_pidb_reg;
 
   // If poll, read until greater than what we previously have read
   Debug("DEBUG: Polling on RQ PIDB. Count: 0x%x\n", rq_pidb);
-  if(getenv("DEBUG") && atoi(getenv("DEBUG")) == 1) {
+#ifdef RN_DEBUG
+  if(debug == 1) {
     dump_registers(rdma_dev, 0, qpid);
   }
-  while(rq_pidb == qp->rq_pidb) {
-      rq_pidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qpid));
+#endif
+  while(rdma_ring_dist(rq_pidb, qp->rq_pidb, qp->qdepth) == 0) {
+    if(rdma_wait_doorbell(qp, &qp->rq_db_shadow, rq_pidb_reg, rq_pidb, &qp->rq_wait, &rq_pidb) < 0) {
+      fprintf(stderr, "Error: poll_rq_pidb timeout! rq_pidb = %d\n", qp->rq_pidb);
+      return -1;
+    }
   }
 
-  qp->rq_pidb = rq_pidb;        
+  qp->rq_pidb = rq_pidb % qp->qdepth;
+  RN_TRACE_EVENT(RN_TRACE_RQ_OBSERVED, qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->rq_pidb));
   return qp->rq_pidb;
 }
 
 int poll_cq_cidb(struct rdma_dev_t* rdma_dev, uint32_t qpid, int sq_cidb) {
-  int cq_cidb;
-  uint32_t timeout_cnt = 0;
-  cq_cidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid));
+  struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
+  uint32_t qdepth = qp->qdepth;
+  volatile uint32_t* cq_head_reg = (volatile uint32_t* ) ((uintptr_t) rdma_dev->axil_ctl + 
+                                   get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid));
+  uint32_t cq_cidb = (qp->cq_db_shadow != NULL) ? *(qp->cq_db_shadow) : *cq_head_reg;
   Debug("[Register] RN_RDMA_QCSR_CQHEADi=0x%x, qpid=%d, value=0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid), qpid, cq_cidb);
 
   Debug("DEBUG: before polling: sq_cidb = %d; Polling CQ CIDB = %d\n", sq_cidb, cq_cidb);
-  // dump_registers(rdma_dev, 1, qpid);
-  while(cq_cidb == sq_cidb) {
-    cq_cidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid));
-    timeout_cnt += 1;
-    if(timeout_cnt > TIMEOUT_THRESHOLD) {
+  while(rdma_ring_dist(cq_cidb, sq_cidb, qdepth) == 0) {
+    if(rdma_wait_doorbell(qp, &qp->cq_db_shadow, cq_head_reg, cq_cidb, &qp->cq_wait, &cq_cidb) < 0) {
       goto timeout_action;
     }
-    //fprintf(stderr, "Waiting for completion doorbell index update\n");
   }
 
   Debug("DEBUG: after polling: sq_cidb = %d; Polling CQ CIDB = %d\n", sq_cidb, cq_cidb);
-  return cq_cidb;
+  RN_TRACE_EVENT(RN_TRACE_CQ_OBSERVED, qpid, RN_TRACE_RING_ARG(qdepth, cq_cidb % qdepth));
+  return cq_cidb % qdepth;
 
 timeout_action:
   fprintf(stderr, "ERROR: poll_cq_cidb timeout! sq_cidb = %d; Polling CQ CIDB = %d\n", sq_cidb, cq_cidb);
@@ -863,6 +1438,50 @@ timeout_action:
   return -1;
 }
 
+// Write the num_wqe WQEs staged from the current SQ producer index onwards to a device 
+// SQ. The range is written with one DMA, or two if it wraps around the ring. If the SQ is 
+// in the mapped device memory window, the WQEs are stored directly instead.
+static int rdma_sq_flush(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t num_wqe) {
+  uint32_t first;
+  uint32_t count;
+  uint64_t dev_addr;
+  void* win;
+  ssize_t rc;
+
+  if(qp->sq_shadow == NULL) {
+    return 0;
+  }
+
+  first = qp->sq_pidb;
+  while(num_wqe > 0) {
+    count = num_wqe;
+    if(first + count > qp->qdepth) {
+      count = qp->qdepth - first;
+    }
+
+    Debug("DEBUG: Write %d WQEs from slot %d to the device memory\n", count, first);
+    dev_addr = qp->sq->dma_addr + (first * sizeof(struct rdma_wqe_t));
+    win = get_dev_mem_vaddr(rdma_dev->rn_dev, dev_addr, count * sizeof(struct rdma_wqe_t));
+    if(win != NULL) {
+      memcpy(win, &(qp->sq_shadow[first]), count * sizeof(struct rdma_wqe_t));
+    } else {
+      rc = write_from_buffer(device, fpga_fd, (char* ) &(qp->sq_shadow[first]), 
+                             count * sizeof(struct rdma_wqe_t), dev_addr);
+      if(rc < 0) {
+        fprintf(stderr, "Error: Failed to write WQEs to the device memory!\n");
+        return -1;
+      }
+    }
+
+    first = rdma_ring_add(first, count, qp->qdepth);
+    num_wqe -= count;
+  }
+
+  // Drain the write-combining buffers before the SQ doorbell is rung
+  __sync_synchronize();
+  return 0;
+}
+
 int rdma_post_send(struct rdma_dev_t* rdma_dev, uint32_t qpid) {
   if(rdma_dev == NULL) {
     fprintf(stderr, "Error: rdma_dev is NULL\n");  
@@ -871,27 +1490,42 @@ int rdma_post_send(struct rdma_dev_t* rdma_dev, uint32_t qpid) {
 
   struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
 
+  // Wait for a free SQ entry if earlier asynchronous posts are still in flight
+  while(rdma_sq_credits(qp) == 0) {
+    qp->cq_cidb = poll_cq_cidb(rdma_dev, qpid, qp->sq_cidb);
+    if(qp->cq_cidb < 0) {
+      return -1;
+    }
+    qp->sq_cidb = qp->cq_cidb;
+  }
+
   // Increase send queue producer index doorbell
   Debug("DEBUG: Reading hardware SQPIi (0x%x) = 0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid)));
   Debug("DEBUG: original qp->sq_pidb = 0x%x\n", qp->sq_pidb);
+
+  if(rdma_sq_flush(rdma_dev, qp, 1) < 0) {
+    return -1;
+  }
   
-  qp->sq_pidb++;
+  qp->sq_pidb = rdma_ring_add(qp->sq_pidb, 1, qp->qdepth);
 
   // Update sq_pidb to hardware
   write32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qp->sq_pidb);
+  RN_TRACE_EVENT(RN_TRACE_SQ_DOORBELL, qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->sq_pidb));
   Debug("[Register] RN_RDMA_QCSR_SQPIi=0x%x, qpid=%d, value=0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qpid, qp->sq_pidb);
   Debug("DEBUG: Update hardware sq db idx from software = %d\n", qp->sq_pidb);
   Debug("DEBUG: Reading hardware SQPIi (0x%x) = 0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid)));
 
   // polling on completion, by checking CQ doorbell
-  qp->cq_cidb = poll_cq_cidb(rdma_dev, qpid, qp->sq_cidb);
-  qp->sq_cidb++;
-
-  if(qp->cq_cidb < 0) {
-    return -1;
-  } else {
-    return 0;
+  while(qp->sq_cidb != qp->sq_pidb) {
+    qp->cq_cidb = poll_cq_cidb(rdma_dev, qpid, qp->sq_cidb);
+    if(qp->cq_cidb < 0) {
+      return -1;
+    }
+    qp->sq_cidb = qp->cq_cidb;
   }
+
+  return 0;
 }
 
 int rdma_post_batch_send(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t batch_size) {
@@ -902,35 +1536,131 @@ int rdma_post_batch_send(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t ba
 
   struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
 
+  if(batch_size >= qp->qdepth) {
+    fprintf(stderr, "Error: batch size %d does not fit in a SQ of depth %d\n", batch_size, qp->qdepth);
+    return -1;
+  }
+
+  // Backpressure: wait until earlier WQEs free enough SQ entries for the batch
+  while(rdma_sq_credits(qp) < batch_size) {
+    qp->cq_cidb = poll_cq_cidb(rdma_dev, qpid, qp->sq_cidb);
+    if(qp->cq_cidb < 0) {
+      return -1;
+    }
+    qp->sq_cidb = qp->cq_cidb;
+  }
+
   // Increase send queue producer index doorbell
   Debug("DEBUG: Reading hardware SQPIi (0x%x) = 0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid)));
   Debug("DEBUG: original qp->sq_pidb = 0x%x\n", qp->sq_pidb);
-  
-  qp->sq_pidb += batch_size;
 
-    if((qp->qdepth < batch_size) || ((qp->sq_pidb > qp->qdepth))) {
-    fprintf(stderr, "Error: SQ overflow\n");
-    exit(EXIT_FAILURE);
+  if(rdma_sq_flush(rdma_dev, qp, batch_size) < 0) {
+    return -1;
   }
+  
+  qp->sq_pidb = rdma_ring_add(qp->sq_pidb, batch_size, qp->qdepth);
 
   // Update sq_pidb to hardware
   write32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qp->sq_pidb);
+  RN_TRACE_EVENT(RN_TRACE_SQ_DOORBELL, qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->sq_pidb));
   Debug("[Register] RN_RDMA_QCSR_SQPIi=0x%x, qpid=%d, value=0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qpid, qp->sq_pidb);
   Debug("DEBUG: Update hardware sq db idx from software = %d\n", qp->sq_pidb);
   Debug("DEBUG: Reading hardware SQPIi (0x%x) = 0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid)));
   Debug("[Register] RN_RDMA_QCSR_CQHEADi=0x%x, qpid=%d, value=0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid), qpid, qp->cq_cidb);
   // polling on completion, by checking CQ doorbell
-  while(qp->cq_cidb < qp->sq_pidb) {
+  while(qp->sq_cidb != qp->sq_pidb) {
     // Wait for all WQE to be completed
     qp->cq_cidb = poll_cq_cidb(rdma_dev, qpid, qp->sq_cidb);
+    if(qp->cq_cidb < 0) {
+      return -1;
+    }
     qp->sq_cidb = qp->cq_cidb;
   }
 
-  if(qp->cq_cidb < 0) {
+  return 0;
+}
+
+uint32_t rdma_sq_credits(struct rdma_qp_t* qp) {
+  return qp->qdepth - 1 - rdma_ring_dist(qp->sq_pidb, qp->sq_cidb, qp->qdepth);
+}
+
+int rdma_post_send_async(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t num_wqe) {
+  if(rdma_dev == NULL) {
+    fprintf(stderr, "Error: rdma_dev is NULL\n");  
+    exit(EXIT_FAILURE);
+  }
+
+  struct rdma_qp_t* qp = rdma_dev->qps_ptr[qpid];
+
+  if(num_wqe == 0) {
+    return 0;
+  }
+
+  if(num_wqe > rdma_sq_credits(qp)) {
+    Debug("DEBUG: not enough SQ credits, requested = %d, available = %d\n", num_wqe, rdma_sq_credits(qp));
+    return -1;
+  }
+
+  if(rdma_sq_flush(rdma_dev, qp, num_wqe) < 0) {
     return -1;
+  }
+
+  qp->sq_pidb = rdma_ring_add(qp->sq_pidb, num_wqe, qp->qdepth);
+
+  // Ring the SQ doorbell once for the whole batch
+  write32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qp->sq_pidb);
+  RN_TRACE_EVENT(RN_TRACE_SQ_DOORBELL, qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->sq_pidb));
+  Debug("[Register] RN_RDMA_QCSR_SQPIi=0x%x, qpid=%d, value=0x%x\n", get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid), qpid, qp->sq_pidb);
+
+  return 0;
+}
+
+int rdma_poll_cq(struct rdma_qp_t* qp, uint32_t max, uint16_t* out_wrids) {
+  int cq_head;
+  int num_done;
+  int i;
+
+  if(qp->cq_db_shadow != NULL) {
+    cq_head = *(qp->cq_db_shadow);
+    if(rdma_ring_dist(cq_head, qp->sq_cidb, qp->qdepth) == 0) {
+      qp->cq_db_idle++;
+      if(qp->cq_db_idle < RDMA_DB_SHADOW_IDLE_POLLS) {
+        return 0;
+      }
+      // Cross-check the shadow against hardware once in a while
+      qp->cq_db_idle = 0;
+      cq_head = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
+      if(rdma_ring_dist(cq_head, qp->sq_cidb, qp->qdepth) != 0) {
+        fprintf(stderr, "Warning: doorbell shadow of QP%d is not updated by hardware, polling registers instead\n", qp->qpid);
+        qp->cq_db_shadow = NULL;
+      }
+    } else {
+      qp->cq_db_idle = 0;
+    }
   } else {
+    cq_head = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
+  }
+  num_done = rdma_ring_dist(cq_head, qp->sq_cidb, qp->qdepth);
+  if(num_done == 0) {
     return 0;
   }
+
+  if(num_done > max) {
+    num_done = max;
+  }
+
+  if(out_wrids != NULL) {
+    for(i=0; i<num_done; i++) {
+      out_wrids[i] = qp->sq_wrid[rdma_ring_add(qp->sq_cidb, i, qp->qdepth)];
+    }
+  }
+
+  qp->sq_cidb = rdma_ring_add(qp->sq_cidb, num_done, qp->qdepth);
+  qp->cq_cidb = qp->sq_cidb;
+  RN_TRACE_EVENT(RN_TRACE_CQ_OBSERVED, qp->qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->sq_cidb));
+  Debug("DEBUG: reaped %d completions, CQHEADi = %d, sq_cidb = %d\n", num_done, cq_head, qp->sq_cidb);
+
+  return num_done;
 }
 
 void write_rq_cidb(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t db_val) {
@@ -959,16 +1689,12 @@ void* rdma_post_receive(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp) {
   int rq_pidb = poll_rq_pidb(rdma_dev, qp->qpid);
   if(rq_pidb == -1) {
     fprintf(stderr, "Error: rdma_post_receive failed\n");
-    exit(EXIT_FAILURE);
+    return NULL;
   }
 
-  // Pointing to the RQE
-  if(rq_pidb == 0) {
-    rqe = (void* ) ((uint64_t) qp->rq->buffer + (uint64_t) ((qp->qdepth - 1) * RQE_SIZE));
-  }
-  else {
-    rqe = (void* ) ((uint64_t) qp->rq->buffer + (uint64_t) ((rq_pidb - 1) * RQE_SIZE));
-  }
+  // Pointing to the RQE, which is the entry right before the producer index
+  rqe = (void* ) ((uint64_t) qp->rq->buffer + 
+                  (uint64_t) (rdma_ring_add(rq_pidb, qp->qdepth - 1, qp->qdepth) * RQE_SIZE));
 
   return rqe;
 }
@@ -978,9 +1704,13 @@ uint8_t rdma_release_rq_consumed (struct rdma_dev_t* rdma_dev, struct rdma_qp_t*
   uint8_t rc = 0;
 
   // Check whether all RQ requests are received
-  rq_pidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid));
+  if(qp->rq_db_shadow != NULL) {
+    rq_pidb = *(qp->rq_db_shadow);
+  } else {
+    rq_pidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid));
+  }
 
-  if (rq_pidb != qp->rq_pidb) {
+  if (rdma_ring_dist(rq_pidb, qp->rq_pidb, qp->qdepth) != 0) {
     // We still have RQ requests pending.
     rc = 1;
   }
@@ -992,11 +1722,76 @@ uint8_t rdma_release_rq_consumed (struct rdma_dev_t* rdma_dev, struct rdma_qp_t*
   return rc;
 }
 
+int rdma_post_receive_batch(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, void** rqes, 
+                            uint32_t max_rqes, int block) {
+  uint32_t i;
+  uint32_t first;
+  uint32_t rq_pidb;
+  uint32_t num_rqes;
+
+  if((rdma_dev == NULL) || (qp == NULL) || (rqes == NULL)) {
+    fprintf(stderr, "Error: rdma_post_receive_batch needs an RDMA device, a QP and an RQE array\n");
+    return -1;
+  }
+
+  // RQEs from the last producer index seen up to the new one have not been returned yet
+  first = (uint32_t) qp->rq_pidb;
+  if(block) {
+    if(poll_rq_pidb(rdma_dev, qp->qpid) < 0) {
+      fprintf(stderr, "Error: rdma_post_receive_batch failed\n");
+      return -1;
+    }
+    rq_pidb = (uint32_t) qp->rq_pidb;
+  } else if(qp->rq_db_shadow != NULL) {
+    rq_pidb = *(qp->rq_db_shadow);
+  } else {
+    rq_pidb = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid));
+  }
+
+  num_rqes = rdma_ring_dist(rq_pidb, first, qp->qdepth);
+  if(num_rqes > max_rqes) {
+    num_rqes = max_rqes;
+  }
+
+  for(i=0; i<num_rqes; i++) {
+    rqes[i] = (void* ) ((uint64_t) qp->rq->buffer + 
+                        (uint64_t) rdma_ring_add(first, i, qp->qdepth) * RQE_SIZE);
+  }
+
+  // RQEs beyond max_rqes are returned by the next call
+  qp->rq_pidb = rdma_ring_add(first, num_rqes, qp->qdepth);
+  if(!block && (num_rqes > 0)) {
+    RN_TRACE_EVENT(RN_TRACE_RQ_OBSERVED, qp->qpid, RN_TRACE_RING_ARG(qp->qdepth, qp->rq_pidb));
+  }
+  return (int) num_rqes;
+}
+
+int rdma_release_rq_batch(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t num_rqes) {
+  if((rdma_dev == NULL) || (qp == NULL)) {
+    return -1;
+  }
+
+  if(num_rqes > rdma_ring_dist(qp->rq_pidb, qp->rq_cidb, qp->qdepth)) {
+    fprintf(stderr, "Error: QP%d can't release %d RQEs, only %d were received\n", qp->qpid, 
+            num_rqes, rdma_ring_dist(qp->rq_pidb, qp->rq_cidb, qp->qdepth));
+    return -1;
+  }
+
+  if(num_rqes == 0) {
+    return 0;
+  }
+
+  write_rq_cidb(rdma_dev, qp, rdma_ring_add(qp->rq_cidb, num_rqes, qp->qdepth));
+  return 0;
+}
+
 void rdma_qp_fatal_recovery(struct rdma_dev_t* rdma_dev, uint32_t qpid) {
   fprintf(stderr, "\n\n***** QP%d FATAL RECOVERY *****\n", qpid);
   // Steps to clear traffic on QP:
   uint32_t rt_value;
   uint32_t timeout_cnt = 0;
+  uint32_t sq_pi;
+  uint32_t cq_head;
 
   /* 1. Wait till SQ/OSQ are empty */
   while(1) {
@@ -1010,30 +1805,27 @@ void rdma_qp_fatal_recovery(struct rdma_dev_t* rdma_dev, uint32_t qpid) {
 			break;
   }
 
-  /* 2. Check SQ PI == CQ Head */
+  /* 2. Check SQ PI == CQ Head. SQPIi does not change while we wait, only CQHEADi is polled */
   timeout_cnt = 0;
-  while(read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid)) 
-        != read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid))) {
+  sq_pi = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid));
+  while((cq_head = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid))) != sq_pi) {
     timeout_cnt += 1;
     if (timeout_cnt > 100000){
-      fprintf(stderr, "TIMEOUT: CQHEADi:0x%x and SQPIi:0x%x are different\n", 
-                      read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid)),
-                      read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid)));
+      fprintf(stderr, "TIMEOUT: CQHEADi:0x%x and SQPIi:0x%x are different\n", cq_head, sq_pi);
       exit(EXIT_FAILURE);
     }
+    cpu_relax();
   }
   
   /* Disable the QP */
   rt_value = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid));
   write32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid), 
               (rt_value & ~(BIT(0)))); // set bit [0] to 0
-  rt_value = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid));
   write32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid), 
-              (rt_value | BIT(6))); // set bit [6] to 1
-  rt_value = read32_data(rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid));
+              ((rt_value & ~(BIT(0))) | BIT(6))); // set bit [6] to 1
   Debug("[Register] RN_RDMA_QCSR_QPCONFi=0x%x, qpid=%d, value=0x%x\n", 
                     get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qpid), 
-                    qpid, rt_value);
+                    qpid, (uint32_t) ((rt_value & ~(BIT(0))) | BIT(6)));
 }
 
 void destroy_rdma_pd_entry(struct rdma_pd_t* pd) {
@@ -1043,8 +1835,11 @@ void destroy_rdma_pd_entry(struct rdma_pd_t* pd) {
   }
 }
 
-int destroy_rdma_qp(struct rdma_qp_t* qp) {
+int rdma_qp_release(struct rdma_qp_t* qp) {
   uint32_t rt_value;
+  uint32_t adv_conf;
+  uint32_t qp_conf;
+  struct rn_reg_batch_t batch;
 
   if(qp != NULL) {
     // Read STATQPi to make sure STATQPi[7:0] = 8'd0 and STATQPi[10:9] = 2'b11;
@@ -1055,58 +1850,77 @@ int destroy_rdma_qp(struct rdma_qp_t* qp) {
       rdma_qp_fatal_recovery(qp->rdma_dev, qp->qpid);
     }
 
-    // Check whether SQPIi and CQHEADi have the same value
+    // Check whether SQPIi and CQHEADi have the same value. SQPIi is only written by 
+    // software, its value is qp->sq_pidb.
     rt_value = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
-    if (rt_value != read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qp->qpid))) {
+    if (rt_value != (uint32_t) qp->sq_pidb) {
       fprintf(stderr, "Warning: CQHEADi and SQPIi for QP%d are mismatched\n", qp->qpid);
       // call rdma_qp_fatal_recovery()
       rdma_qp_fatal_recovery(qp->rdma_dev, qp->qpid);
     }
 
-    // Enable software override mode (1'b1) in XRNICADCONF[0] and disable QP (1'b0) in QPCONFi[0]
-    rt_value = read32_data(qp->rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF);
-    write32_data(qp->rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF, (rt_value | 0x00000001));
-    rt_value = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid));
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid),  (rt_value & 0xfffffffe));
+    // Enable software override mode (1'b1) in XRNICADCONF[0] and disable QP (1'b0) in QPCONFi[0].
+    // XRNICADCONF is shared by all QPs, hold csr_lock until the override is turned off again.
+    // Both registers are read once, the following writes are derived from those values.
+    pthread_mutex_lock(&(qp->rdma_dev->csr_lock));
+    adv_conf = read32_data(qp->rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF);
+    qp_conf  = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid));
+    rdma_reg_batch_begin(qp->rdma_dev, &batch);
+    rn_reg_batch_write(&batch, RN_RDMA_GCSR_XRNICADCONF, (adv_conf | 0x00000001));
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid), (qp_conf & 0xfffffffe));
+    rn_reg_batch_fence();
 
     // Reset RQWPTRDBADDi, SQPIi, CQHEADi, RQCIi, STATRQPIDBi, STATCURSQPTRi, SQPSNi, LSTRQREQi 
     // and STATMSNi by 0; Configure QP under recovery in QPCONFi[6]
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQWPTRDBADDi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), 0);
-    
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQCIi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATCURSQPTRi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPSNi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_LSTRQREQi, qp->qpid), 0);
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATMSNi, qp->qpid), 0);
-    rt_value = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid));
-    
-    uint32_t test = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
-    Debug("[DEBUG] Destroying dev: %p, RN_RDMA_QCSR_CQHEADi=0x%x, qpid=%d, value=0x%x\n", qp->rdma_dev->axil_ctl,
-                            get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), qp->qpid, test);
-    
-    write32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid),  (rt_value | 0x00000040));
-    test = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
-    Debug("[DEBUG] Destroying dev: %p, RN_RDMA_QCSR_CQHEADi=0x%x, qpid=%d, value=0x%x\n", qp->rdma_dev->axil_ctl,
-                            get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), qp->qpid, test);
-    
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQWPTRDBADDi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_RQCIi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATCURSQPTRi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPSNi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_LSTRQREQi, qp->qpid), 0);
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATMSNi, qp->qpid), 0);
+    rn_reg_batch_fence();
+    rn_reg_batch_write(&batch, get_rdma_per_q_config_addr(RN_RDMA_QCSR_QPCONFi, qp->qpid), ((qp_conf & 0xfffffffe) | 0x00000040));
+    rn_reg_batch_fence();
+
     // Disable software override mode (1'b0) in XRNICADCONF[0]
-    rt_value = read32_data(qp->rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF);
-    write32_data(qp->rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICADCONF, (rt_value & 0xfffffffe));
-  
-    test = read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid));
+    rn_reg_batch_write(&batch, RN_RDMA_GCSR_XRNICADCONF, (adv_conf & 0xfffffffe));
+    rn_reg_batch_commit(&batch);
+    pthread_mutex_unlock(&(qp->rdma_dev->csr_lock));
     Debug("[DEBUG] Destroying dev: %p, RN_RDMA_QCSR_CQHEADi=0x%x, qpid=%d, value=0x%x\n", qp->rdma_dev->axil_ctl,
-                            get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), qp->qpid, test);
+                            get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid), qp->qpid, 
+                            read32_data(qp->rdma_dev->axil_ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qp->qpid)));
   
-    // Free memory allocated for SQ, RQ and CQ
-    free(qp->sq);
-    free(qp->rq); 
-    free(qp->cq);
-    
-    destroy_rdma_pd_entry(qp->pd_entry);
-    qp = NULL;
+    // Free memory allocated for SQ, RQ and CQ, and the QP itself
+    rdma_qp_free(qp);
+  }
+
+  return 0;
+}
+
+int destroy_rdma_qp(struct rdma_qp_t* qp) {
+  struct rdma_dev_t* rdma_dev;
+  struct rdma_pd_t* pd;
+  uint32_t i;
+
+  if(qp == NULL) {
+    return 0;
+  }
+
+  rdma_dev = qp->rdma_dev;
+  pd = qp->pd_entry;
+  rdma_qp_release(qp);
+
+  // The PD goes with the last QP using it
+  for(i=0; i<rdma_dev->num_qp; i++) {
+    if((rdma_dev->qps_ptr[i] != NULL) && (rdma_dev->qps_ptr[i]->pd_entry == pd)) {
+      break;
+    }
+  }
+  if(i == rdma_dev->num_qp) {
+    destroy_rdma_pd_entry(pd);
   }
 
   return 0;
@@ -1121,11 +1935,14 @@ int destroy_rdma_dev(struct rdma_dev_t* rdma_dev) {
     for(i=0; i<rdma_dev->num_qp; i++) {
       destroy_rdma_qp(rdma_dev->qps_ptr[i]);
     }
+    rdma_destroy_rq_pool(rdma_dev);
 
-    // Disable RNIC hardware
-    rnic_enable = 0;
-    rnic_config = rnic_enable & 0xffffffff;
-    write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICCONF, rnic_config);
+    // Disable RNIC hardware, a persistent context leaves it enabled for the next process
+    if(rdma_dev->rn_dev->persist == NULL) {
+      rnic_enable = 0;
+      rnic_config = rnic_enable & 0xffffffff;
+      write32_data(rdma_dev->axil_ctl, RN_RDMA_GCSR_XRNICCONF, rnic_config);
+    }
     rdma_dev = NULL;
   }
 
@@ -1134,8 +1951,11 @@ int destroy_rdma_dev(struct rdma_dev_t* rdma_dev) {
 
 int destroy_rn_dev(struct rn_dev_t* rn_dev) {
   if(rn_dev != NULL) {
-    free(rn_dev->base_buf);
+    rn_unmap_device_memory(rn_dev);
     destroy_rdma_dev((struct rdma_dev_t* ) rn_dev->rdma_dev);
+    detach_rn_dev(rn_dev);
+    destroy_rn_dev_pools(rn_dev);
+    free(rn_dev->base_buf);
     rn_dev = NULL;
   }
 
@@ -1200,3 +2020,47 @@ void dump_registers(struct rdma_dev_t* rdma_dev, uint8_t is_sender, uint32_t qpi
   fprintf(stderr, "\n");
 
 }
+
+int rdma_get_stats(struct rdma_dev_t* rdma_dev, uint32_t qpid, struct rdma_stats_t* stats) {
+  uint32_t* ctl;
+
+  if((rdma_dev == NULL) || (stats == NULL) || (qpid >= rdma_dev->num_qp)) {
+    fprintf(stderr, "Error: invalid argument to rdma_get_stats\n");
+    return -1;
+  }
+
+  ctl = rdma_dev->axil_ctl;
+  stats->in_rdma_pkts      = read32_data(ctl, RN_RDMA_GCSR_INSRRPKTCNT);
+  stats->in_ack_pkts       = read32_data(ctl, RN_RDMA_GCSR_INAMPKTCNT);
+  stats->out_io_pkts       = read32_data(ctl, RN_RDMA_GCSR_OUTIOPKTCNT);
+  stats->out_ack_pkts      = read32_data(ctl, RN_RDMA_GCSR_OUTAMPKTCNT);
+  stats->out_rd_rsp_pkts   = read32_data(ctl, RN_RDMA_GCSR_OUTRDRSPPKTCNT);
+  stats->in_inv_dup_pkts   = read32_data(ctl, RN_RDMA_GCSR_ININVDUPCNT);
+  stats->in_nak_pkts       = read32_data(ctl, RN_RDMA_GCSR_INNAKPKTCNT);
+  stats->out_nak_pkts      = read32_data(ctl, RN_RDMA_GCSR_OUTNAKPKTCNT);
+  stats->in_all_drop_pkts  = read32_data(ctl, RN_RDMA_GCSR_INALLDRPPKTCNT);
+  stats->in_cnp_pkts       = read32_data(ctl, RN_RDMA_GCSR_INCNPPKTCNT);
+  stats->out_cnp_pkts      = read32_data(ctl, RN_RDMA_GCSR_OUTCNPPKTCNT);
+  stats->in_rnr_nak_status = read32_data(ctl, RN_RDMA_GCSR_INNCKPKTSTS);
+  stats->out_rnr_status    = read32_data(ctl, RN_RDMA_GCSR_OUTRNRPKTSTS);
+  stats->retry_cnt_status  = read32_data(ctl, RN_RDMA_GCSR_RETRYCNTSTS);
+  stats->resp_hnd_status   = read32_data(ctl, RN_RDMA_GCSR_RESPHNDSTS);
+  stats->wqe_proc_status   = read32_data(ctl, RN_RDMA_GCSR_WQEPROCSTS);
+  stats->qp_mgr_status     = read32_data(ctl, RN_RDMA_GCSR_QPMSTS);
+  stats->err_buf_wptr      = read32_data(ctl, RN_RDMA_GCSR_ERRBUFWPTR);
+  stats->ipkt_err_q_wptr   = read32_data(ctl, RN_RDMA_GCSR_IPKTERRQWPTR);
+
+  stats->qp_sq_pidb    = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_SQPIi, qpid));
+  stats->qp_cq_head    = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_CQHEADi, qpid));
+  stats->qp_rq_pidb    = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQPIDBi, qpid));
+  stats->qp_ssn        = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATSSNi, qpid));
+  stats->qp_msn        = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATMSNi, qpid));
+  stats->qp_status     = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATQPi, qpid));
+  stats->qp_cur_sq_ptr = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATCURSQPTRi, qpid));
+  stats->qp_resp_psn   = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRESPSNi, qpid));
+  stats->qp_stat_wqe   = read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATWQEi, qpid));
+  stats->qp_rq_buf_ca  = (((uint64_t) read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQBUFCAMSBi, qpid))) << 32) |
+                         read32_data(ctl, get_rdma_per_q_config_addr(RN_RDMA_QCSR_STATRQBUFCAi, qpid));
+
+  return 0;
+}
@@ -11,6 +11,7 @@
 #ifndef __RDMA_API_H__
 #define __RDMA_API_H__
 
+#include <pthread.h>
 #include "auxiliary.h"
 #include "reconic.h"
 #include "reconic_reg.h"
@@ -24,6 +25,49 @@
 */
 #define RQE_SIZE 512
 
+/*! \def RDMA_QP_RING_ALIGN
+    \brief Alignment in bytes of the SQ, CQ and RQ of a queue pair packed in one buffer.
+*/
+#define RDMA_QP_RING_ALIGN 256
+
+/*! \def RDMA_QP_NUM_RINGS
+    \brief Number of rings of a queue pair: CQ, SQ and RQ.
+*/
+#define RDMA_QP_NUM_RINGS 3
+
+/** @brief Advance a ring index by n entries, wrapping at the queue depth.
+ *  @param idx current ring index.
+ *  @param n number of entries to advance.
+ *  @param qdepth queue depth of the ring.
+ *  @return the advanced ring index.
+ */
+static inline uint32_t rdma_ring_add(uint32_t idx, uint32_t n, uint32_t qdepth) {
+  return (idx + n) % qdepth;
+}
+
+/** @brief Get the number of entries between a consumer and a producer ring index. 
+ *         Indices read back from hardware are wrapped before comparison.
+ *  @param head producer ring index.
+ *  @param tail consumer ring index.
+ *  @param qdepth queue depth of the ring.
+ *  @return number of ring entries from tail to head.
+ */
+static inline uint32_t rdma_ring_dist(uint32_t head, uint32_t tail, uint32_t qdepth) {
+  return ((head % qdepth) + qdepth - (tail % qdepth)) % qdepth;
+}
+
+/*! \def RDMA_DB_SHADOW_SLICE_US
+    \brief Time in microseconds a doorbell shadow in host memory is polled before the 
+           corresponding hardware register is read to cross-check it.
+*/
+#define RDMA_DB_SHADOW_SLICE_US 100
+
+/*! \def RDMA_DB_SHADOW_IDLE_POLLS
+    \brief Number of consecutive empty non-blocking polls of a CQ doorbell shadow before the
+           CQHEADi register is read to cross-check it.
+*/
+#define RDMA_DB_SHADOW_IDLE_POLLS 1024
+
 /*! \struct rdma_glb_csr_t
     \brief Structure used to store RDMA global control status registers.
 */
@@ -66,6 +110,26 @@ struct rdma_dev_t {
   uint32_t* axil_ctl; /*!< axil_ctl a pointer to PCIe register control interface. */
   uint32_t num_qp;    /*!< num_qp number of queue pair enabled. */
   struct win_size_t* winSize;    /*!< Window size mask for PCIe BDF address conversion. */
+  rn_wait_policy_t cq_wait; /*!< cq_wait default policy of new QPs for waiting on completions. */
+  rn_wait_policy_t rq_wait; /*!< rq_wait default policy of new QPs for waiting on receives. */
+  pthread_mutex_t csr_lock; /*!< csr_lock serializes read-modify-write accesses to global CSRs. */
+  struct rdma_rq_pool_t* rq_pool; /*!< rq_pool shared RQ buffer new QPs take their RQ ring from, 
+                                       NULL if each QP allocates its own RQ. */
+};
+
+/*! \struct rdma_rq_pool_t
+    \brief Receive queue buffer shared by the queue pairs of a device. The buffer is 
+           allocated once and carved into fixed-depth RQ rings handed out to QPs as they 
+           are created, so RQ memory is sized by the number of rings instead of growing 
+           with qdepth * RQE_SIZE * num_qp for every QP.
+*/
+struct rdma_rq_pool_t {
+  struct rdma_buff_t* buffer; /*!< buffer backing buffer of all RQ rings. */
+  uint32_t ring_depth;  /*!< ring_depth number of RQEs of a ring. */
+  uint32_t num_rings;   /*!< num_rings number of rings carved from the buffer. */
+  uint32_t* free_rings; /*!< free_rings stack of free ring indices. */
+  uint32_t num_free;    /*!< num_free number of free rings. */
+  pthread_mutex_t lock; /*!< lock protects the free ring stack. */
 };
 
 /*! \struct rdma_pd_t
@@ -90,6 +154,19 @@ struct rdma_pd_t {
   struct rdma_buff_t* mr_buffer; /*!< mr_buffer a pointer to the allocated buffer. */
 };
 
+/*! \struct rdma_qp_placement_t
+    \brief Memory placement of the rings of a queue pair. Each location is HOST_MEM or
+           DEVICE_MEM. Rings with the same location are packed into one buffer.
+*/
+struct rdma_qp_placement_t {
+  char* sq_location; /*!< sq_location location of the send queue. */
+  char* cq_location; /*!< cq_location location of the completion queue. */
+  char* rq_location; /*!< rq_location location of the receive queue, ignored when the RQ is
+                          taken from the RQ pool of the device. */
+  int dev_channel;   /*!< dev_channel DDR channel of rings in device memory: a channel number,
+                          RN_DEV_PLACE_AUTO or RN_DEV_PLACE_SPREAD. */
+};
+
 /*! \struct rdma_qp_t
     \brief RDMA queue pair structure.
 */
@@ -98,18 +175,39 @@ struct rdma_qp_t {
   uint32_t qpid;               /*!< qpid A queue pair ID. */
   struct rdma_buff_t* sq; /*!< sq a pointer to a send queue buffer. */
   uint32_t sq_psn;        /*!< sq_psn Packet sequence number for a sq request. */
-  int sq_pidb;            /*!< sq_pidb SQ producer index doorbell. */
-  int sq_cidb;            /*!< sq_cidb SQ consumer index doorbell. */
+  int sq_pidb;            /*!< sq_pidb SQ producer index doorbell, wraps at qdepth. */
+  int sq_cidb;            /*!< sq_cidb SQ consumer index doorbell, wraps at qdepth. */
+  uint16_t* sq_wrid;      /*!< sq_wrid work request IDs of the WQEs in the SQ, indexed by WQE slot. */
+  struct rdma_wqe_t* wqe_tmpl; /*!< wqe_tmpl WQE template set up by rdma_wqe_prepare(). */
+  uint64_t laddr_mask;    /*!< laddr_mask window mask applied to host payload addresses. */
+  uint32_t sq_staged;     /*!< sq_staged number of WQEs staged by rdma_wqe_post_fast() and 
+                               not yet posted. */
+  struct rdma_wqe_t* sq_shadow; /*!< sq_shadow host-side staging ring for a SQ allocated in device
+                                     memory. WQEs are built here and flushed to the device with 
+                                     one DMA when the SQ doorbell is rung. NULL for a host SQ. */
 
   struct rdma_buff_t* cq; /*!< cq a pointer to a completion queue buffer. */
   uint64_t cq_cidb_addr;  /*!< cq_cidb_addr completion queue consumer index doorbell address. */
-  int cq_cidb;            /*!< cq_cidb completion queue consumer index doorbell. */
+  int cq_cidb;            /*!< cq_cidb completion queue consumer index doorbell, wraps at qdepth. */
+  volatile uint32_t* cq_db_shadow; /*!< cq_db_shadow host mapping of cq_cidb_addr written by
+                                        hardware, polled instead of CQHEADi. NULL if the 
+                                        doorbell is not in the hugepage buffer. */
+  uint32_t cq_db_idle;    /*!< cq_db_idle consecutive empty polls of cq_db_shadow. */
 
   // Receive queue and its doorbell
   struct rdma_buff_t* rq; /*!< rq a pointer to a receive queue buffer. */
   uint64_t rq_cidb_addr;  /*!< rq_cidb_addr receive queue consumer index doorbell address. */
-  int rq_cidb;            /*!< rq_cidb receive queue consumer index doorbell. */
-  int rq_pidb;            /*!< rq_cidb receive queue producer index doorbell. */
+  int rq_cidb;            /*!< rq_cidb receive queue consumer index doorbell, wraps at qdepth. */
+  int rq_pidb;            /*!< rq_cidb receive queue producer index doorbell, wraps at qdepth. */
+  volatile uint32_t* rq_db_shadow; /*!< rq_db_shadow host mapping of rq_cidb_addr written by
+                                        hardware, polled instead of STATRQPIDBi. NULL if the 
+                                        doorbell is not in the hugepage buffer. */
+  struct rdma_rq_pool_t* rq_pool; /*!< rq_pool shared RQ buffer the RQ ring is carved from, 
+                                       NULL if the RQ was allocated for this QP only. */
+  uint32_t rq_ring;       /*!< rq_ring index of the RQ ring in rq_pool. */
+  struct rdma_buff_t* ring_mem[RDMA_QP_NUM_RINGS]; /*!< ring_mem buffers holding the packed 
+                                                        rings, one per location used. sq, cq
+                                                        and rq point into them. */
   uint32_t pd_num;        /*!< pd_num protection domain number associated. */
   struct rdma_pd_t* pd_entry; /*!< pd_entry protection domain entry associated. */
   uint32_t dst_qpid; /*!< dst_qpid destination queue pair ID. */
@@ -117,6 +215,45 @@ struct rdma_qp_t {
   uint32_t last_rq_psn; /*!< last_rq_psn Last RQ request PSN associated. */
   struct mac_addr_t* dst_mac; /*!< dst_mac destination MAC address. */
   uint32_t dst_ip; /*!< dst_ip destination IP address. */
+  rn_wait_policy_t cq_wait; /*!< cq_wait policy used when waiting for SQ completions. */
+  rn_wait_policy_t rq_wait; /*!< rq_wait policy used when waiting for incoming RQ entries. */
+  int owner;         /*!< owner index of the engine worker owning the QP, -1 if not owned. 
+                          Only the owner may post to and poll the QP. */
+};
+
+/*! \struct rdma_stats_t
+    \brief Snapshot of the ERNIC hardware counters of the device and of one QP.
+*/
+struct rdma_stats_t {
+  uint32_t in_rdma_pkts;      /*!< in_rdma_pkts incoming send, RDMA write and RDMA read response packets. */
+  uint32_t in_ack_pkts;       /*!< in_ack_pkts incoming acknowledge packets. */
+  uint32_t out_io_pkts;       /*!< out_io_pkts outgoing send, RDMA write and RDMA read packets. */
+  uint32_t out_ack_pkts;      /*!< out_ack_pkts outgoing acknowledge packets. */
+  uint32_t out_rd_rsp_pkts;   /*!< out_rd_rsp_pkts outgoing RDMA read response packets. */
+  uint32_t in_inv_dup_pkts;   /*!< in_inv_dup_pkts incoming invalid or duplicate packets. */
+  uint32_t in_nak_pkts;       /*!< in_nak_pkts incoming NAK packets. */
+  uint32_t out_nak_pkts;      /*!< out_nak_pkts outgoing NAK packets. */
+  uint32_t in_all_drop_pkts;  /*!< in_all_drop_pkts incoming packets dropped. */
+  uint32_t in_cnp_pkts;       /*!< in_cnp_pkts incoming congestion notification packets. */
+  uint32_t out_cnp_pkts;      /*!< out_cnp_pkts outgoing congestion notification packets. */
+  uint32_t in_rnr_nak_status; /*!< in_rnr_nak_status incoming NAK and RNR packet status. */
+  uint32_t out_rnr_status;    /*!< out_rnr_status outgoing RNR packet status. */
+  uint32_t retry_cnt_status;  /*!< retry_cnt_status retry count status. */
+  uint32_t resp_hnd_status;   /*!< resp_hnd_status response handler status. */
+  uint32_t wqe_proc_status;   /*!< wqe_proc_status WQE processing status. */
+  uint32_t qp_mgr_status;     /*!< qp_mgr_status QP manager status. */
+  uint32_t err_buf_wptr;      /*!< err_buf_wptr error buffer write pointer. */
+  uint32_t ipkt_err_q_wptr;   /*!< ipkt_err_q_wptr incoming packet error status queue write pointer. */
+  uint32_t qp_sq_pidb;        /*!< qp_sq_pidb SQ producer index of the QP. */
+  uint32_t qp_cq_head;        /*!< qp_cq_head CQ head of the QP. */
+  uint32_t qp_rq_pidb;        /*!< qp_rq_pidb RQ producer index of the QP. */
+  uint32_t qp_ssn;            /*!< qp_ssn send sequence number of the QP. */
+  uint32_t qp_msn;            /*!< qp_msn message sequence number of the QP. */
+  uint32_t qp_status;         /*!< qp_status QP status. */
+  uint32_t qp_cur_sq_ptr;     /*!< qp_cur_sq_ptr SQ entry being processed by the QP. */
+  uint32_t qp_resp_psn;       /*!< qp_resp_psn response PSN of the QP. */
+  uint32_t qp_stat_wqe;       /*!< qp_stat_wqe WQE status of the QP. */
+  uint64_t qp_rq_buf_ca;      /*!< qp_rq_buf_ca RQ buffer current address of the QP. */
 };
 
 /*! \struct rdma_wqe_t
@@ -150,6 +287,28 @@ struct rdma_wqe_t {
  */
 struct rdma_dev_t* create_rdma_dev(struct rn_dev_t* rn_dev);
 
+/** @brief Set the wait policies of an RDMA device. The policies are applied to all QPs
+ *         already allocated and used as defaults for QPs allocated later. By default
+ *         completions are waited for with backoff and a timeout of 
+ *         RN_WAIT_DEFAULT_TIMEOUT_US, and receives are waited for with backoff forever.
+ *         RN_WAIT_INTERRUPT is rejected, as the RDMA doorbells have no interrupt source.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param cq_wait policy for waiting on SQ completions. NULL keeps the current one.
+ *  @param rq_wait policy for waiting on incoming RQ entries. NULL keeps the current one.
+ *  @return 0 on success, -1 if a policy uses RN_WAIT_INTERRUPT.
+ */
+int rdma_set_wait_policy(struct rdma_dev_t* rdma_dev, const rn_wait_policy_t* cq_wait, 
+                         const rn_wait_policy_t* rq_wait);
+
+/** @brief Set the wait policies of a queue pair. RN_WAIT_INTERRUPT is rejected.
+ *  @param qp a pointer to a queue pair.
+ *  @param cq_wait policy for waiting on SQ completions. NULL keeps the current one.
+ *  @param rq_wait policy for waiting on incoming RQ entries. NULL keeps the current one.
+ *  @return 0 on success, -1 if a policy uses RN_WAIT_INTERRUPT.
+ */
+int rdma_qp_set_wait_policy(struct rdma_qp_t* qp, const rn_wait_policy_t* cq_wait, 
+                            const rn_wait_policy_t* rq_wait);
+
 /** @brief Configure an RDMA device.
  *  @param rdma_dev a pointer to the RDMA deivce created.
  *  @param local_mac local MAC address.
@@ -186,6 +345,20 @@ void open_rdma_dev(struct rdma_dev_t* rdma_dev, struct mac_addr_t local_mac, uin
  */
 void config_rdma_global_csr (struct rdma_dev_t* rdma_dev);
 
+/** @brief Get the address of a per-queue control status register.
+ *  @param offset Register offset of the first QP.
+ *  @param qpid The target QP ID.
+ *  @return the register offset for the QP.
+ */
+uint32_t get_rdma_per_q_config_addr(uint32_t offset, uint32_t qpid);
+
+/** @brief Get the address of a protection domain table register.
+ *  @param offset Register offset of the first table entry.
+ *  @param pd_num The target table entry.
+ *  @return the register offset for the entry.
+ */
+uint32_t get_rdma_pd_config_addr(uint32_t offset, uint32_t pd_num);
+
 /** @brief Allocate an RDMA protection domain entry.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param pd_num protection domain number.
@@ -230,19 +403,24 @@ void config_sq_psn(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t sq_psn);
  *  @param qpid A QP ID.
  *  @param dst_qpid A destination QP ID.
  *  @param pd_entry Pointer to a protection domain entry.
- *  @param cq_cidb_addr Base address of the CQ consumer index doorbell.
- *  @param rq_cidb_addr Base address of the RQ consumer index doorbell.
+ *  @param cq_cidb_addr Base address of the CQ consumer index doorbell. When it is in the
+ *                      hugepage buffer, completions are detected by polling this 
+ *                      location in host memory. Each QP needs its own doorbell word.
+ *  @param rq_cidb_addr Base address of the RQ consumer index doorbell. When it is in the
+ *                      hugepage buffer, receives are detected by polling this location
+ *                      in host memory. Each QP needs its own doorbell word.
  *  @param qdepth Queue depth used to allocate SQ, CQ and RQ. Each WQE has 64B,
- *                each CQE has 4B and each RQE has 256B. 
- *                Total size of SQ is calculated by num_qp * depth * WQE
- *                Total size of CQ is calculated by num_qp * depth * CQE
- *                Total size of RQ is calculated by num_qp * depth * RQE
- *  @param buf_location Location to allocate a buffer: "host_mem" or "dev_mem".
+ *                each CQE has 4B and each RQE has RQE_SIZE bytes. 
+ *                Total size of SQ is calculated by depth * WQE
+ *                Total size of CQ is calculated by depth * CQE
+ *                Total size of RQ is calculated by depth * RQE
+ *  @param buf_location Location to allocate a buffer: "host_mem" or "dev_mem". SQ, CQ and
+ *                      RQ are packed into one buffer.
  *  @param dst_mac Destination MAC address.
  *  @param dst_ip Destination IP address.
  *  @param partion_key Partion key.
  *  @param r_key RDMA security key or remote tag.
- *  @return a pointer to the allocated RDMA queue pair.
+ *  @return a pointer to the allocated RDMA queue pair, or NULL if its memory can't be allocated.
  */
 struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                                    uint32_t qpid,
@@ -257,11 +435,81 @@ struct rdma_qp_t* allocate_rdma_qp(struct rdma_dev_t* rdma_dev,
                                    uint32_t partion_key,
                                    uint32_t r_key);
 
-/** @brief Create an RDMA work queue element.
+/** @brief Allocate an RDMA queue pair with a memory placement per ring, for example the CQ
+ *         in host memory, where it is polled, and the SQ in device memory.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param qpid A QP ID.
+ *  @param dst_qpid A destination QP ID.
+ *  @param pd_entry Pointer to a protection domain entry.
+ *  @param cq_cidb_addr Base address of the CQ consumer index doorbell, as in allocate_rdma_qp().
+ *  @param rq_cidb_addr Base address of the RQ consumer index doorbell, as in allocate_rdma_qp().
+ *  @param qdepth Queue depth used to allocate SQ, CQ and RQ, as in allocate_rdma_qp().
+ *  @param placement Location of each ring.
+ *  @param dst_mac Destination MAC address.
+ *  @param dst_ip Destination IP address.
+ *  @param partion_key Partion key.
+ *  @param r_key RDMA security key or remote tag.
+ *  @return a pointer to the allocated RDMA queue pair, or NULL if its memory can't be allocated.
+ */
+struct rdma_qp_t* allocate_rdma_qp_placed(struct rdma_dev_t* rdma_dev,
+                                          uint32_t qpid,
+                                          uint32_t dst_qpid,
+                                          struct rdma_pd_t* pd_entry,
+                                          uint64_t cq_cidb_addr,
+                                          uint64_t rq_cidb_addr,
+                                          uint32_t qdepth,
+                                          const struct rdma_qp_placement_t* placement,
+                                          struct mac_addr_t* dst_mac,
+                                          uint32_t dst_ip,
+                                          uint32_t partion_key,
+                                          uint32_t r_key);
+
+/** @brief Allocate a range of RDMA queue pairs. The per-queue CSRs of all of them are 
+ *         programmed in a single register batch.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param first_qpid ID of the first QP, QPs first_qpid to first_qpid + num_qps - 1 are 
+ *                    allocated.
+ *  @param num_qps Number of QPs to allocate.
+ *  @param first_dst_qpid Destination QP ID of the first QP, the i-th QP is connected to
+ *                        first_dst_qpid + i.
+ *  @param pd_entry Pointer to a protection domain entry shared by the QPs.
+ *  @param cq_cidb_addr Address of the CQ consumer index doorbell of the first QP, the i-th
+ *                      QP uses cq_cidb_addr + 4 * i.
+ *  @param rq_cidb_addr Address of the RQ consumer index doorbell of the first QP, the i-th
+ *                      QP uses rq_cidb_addr + 4 * i.
+ *  @param qdepth Queue depth of each QP, as in allocate_rdma_qp().
+ *  @param buf_location Location to allocate a buffer: "host_mem" or "dev_mem".
+ *  @param dst_mac Destination MAC address.
+ *  @param dst_ip Destination IP address.
+ *  @param partion_key Partion key.
+ *  @param r_key RDMA security key or remote tag.
+ *  @param qps Filled with the allocated QPs, can be NULL.
+ *  @return number of QPs allocated, or -1 if the range exceeds the QPs of the device or a
+ *          QP can't be allocated. No QP of the range is left allocated on failure, the
+ *          protection domain entry stays with the caller.
+ */
+int allocate_rdma_qps(struct rdma_dev_t* rdma_dev,
+                      uint32_t first_qpid,
+                      uint32_t num_qps,
+                      uint32_t first_dst_qpid,
+                      struct rdma_pd_t* pd_entry,
+                      uint64_t cq_cidb_addr,
+                      uint64_t rq_cidb_addr,
+                      uint32_t qdepth,
+                      char*    buf_location,
+                      struct mac_addr_t* dst_mac,
+                      uint32_t dst_ip,
+                      uint32_t partion_key,
+                      uint32_t r_key,
+                      struct rdma_qp_t** qps);
+
+/** @brief Create an RDMA work queue element. If the SQ is allocated in device memory, 
+ *         the WQE is staged in the host-side shadow ring and only written to the device
+ *         when it is posted.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qpid A QP ID.
  *  @param wrid A work request ID.
- *  @param wqe_idx WQE index.
+ *  @param wqe_idx WQE index. The SQ slot used is wqe_idx modulo the queue depth.
  *  @param laddr Physical base address for the payload to be exchanged.
  *  @param length Payload size to be exchanged.
  *  @param qdepth Queue depth used to allocate RQ.
@@ -285,12 +533,41 @@ void create_a_wqe(struct rdma_dev_t* rdma_dev,
                   uint32_t send_small_payload3,
                   uint32_t immdt_data);
 
+/** @brief Set up the WQE template of a queue pair used by rdma_wqe_post_fast(). Fields
+ *         other than the payload address, length and remote offset are taken from the
+ *         template.
+ *  @param qp a pointer to a queue pair.
+ *  @param r_key RDMA security key or remote tag.
+ *  @param opcode RDMA operation, one of RNIC_OP_*.
+ *  @return void.
+ */
+void rdma_wqe_prepare(struct rdma_qp_t* qp, uint32_t r_key, uint32_t opcode);
+
+/** @brief Stage a WQE built from the queue pair template in the next free SQ slot. The 
+ *         staged WQEs are posted together by rdma_post_staged().
+ *  @param qp a pointer to a queue pair.
+ *  @param laddr Physical base address for the payload to be exchanged.
+ *  @param length Payload size to be exchanged.
+ *  @param remote_offset Remote memory address offset.
+ *  @return the work request ID assigned to the WQE, or -1 if the SQ is full.
+ */
+int rdma_wqe_post_fast(struct rdma_qp_t* qp, uint64_t laddr, uint32_t length, 
+                       uint64_t remote_offset);
+
+/** @brief Post all WQEs staged by rdma_wqe_post_fast() with a single SQ doorbell, without
+ *         waiting for their completion.
+ *  @param qp a pointer to a queue pair.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_post_staged(struct rdma_qp_t* qp);
+
 /** @brief Poll CQ consumer index doorbell to check whether RDMA read/write is completed 
  *         and get its value.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qpid The target queue pair ID.
  *  @param sq_cidb value of SQ consumer index doorbell.
- *  @return value of RDMA CQ consumer index doorbel register.
+ *  @return value of RDMA CQ consumer index doorbel register, or -1 if the QP completion
+ *          wait policy timed out.
  */
 int poll_cq_cidb(struct rdma_dev_t* rdma_dev, uint32_t qpid, int sq_cidb);
 
@@ -305,7 +582,8 @@ void write_rq_cidb(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t d
 /** @brief Poll RQ producer index doorbell register and get its value.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qpid The target QP ID.
- *  @return value of RQ producer index doorbell register of the the qpid-th QP.
+ *  @return value of RQ producer index doorbell register of the the qpid-th QP, or -1 if 
+ *          the QP receive wait policy timed out.
  */
 int poll_rq_pidb(struct rdma_dev_t* rdma_dev, uint32_t qpid);
 
@@ -316,18 +594,47 @@ int poll_rq_pidb(struct rdma_dev_t* rdma_dev, uint32_t qpid);
  */
 int rdma_post_send(struct rdma_dev_t* rdma_dev, uint32_t qpid);
 
-/** @brief Post a batch of RDMA operations.
+/** @brief Post a batch of RDMA operations and wait for their completion. If the SQ 
+ *         still has outstanding WQEs, the call waits for enough of them to complete
+ *         before ringing the doorbell.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qpid The target QP ID.
- *  @param batch_size batch size.
+ *  @param batch_size batch size, at most qdepth - 1.
  *  @return Success (0) or Failure (-1).
  */
 int rdma_post_batch_send(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t batch_size);
 
+/** @brief Get the number of SQ entries that can still be posted without waiting for a
+ *         completion. One ring entry is always kept free so that a full SQ can be told 
+ *         apart from an empty one.
+ *  @param qp a pointer to a queue pair.
+ *  @return Number of free SQ entries.
+ */
+uint32_t rdma_sq_credits(struct rdma_qp_t* qp);
+
+/** @brief Post WQEs created in the SQ without waiting for their completion. The SQ 
+ *         producer index doorbell is rung once for the whole batch. WQEs are expected to 
+ *         be created at the slots following the current SQ producer index.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param qpid The target QP ID.
+ *  @param num_wqe Number of WQEs to post.
+ *  @return Success (0) or Failure (-1) if the SQ does not have enough credits.
+ */
+int rdma_post_send_async(struct rdma_dev_t* rdma_dev, uint32_t qpid, uint32_t num_wqe);
+
+/** @brief Reap completed WQEs of a queue pair without blocking.
+ *  @param qp a pointer to a queue pair.
+ *  @param max Maximum number of completions to reap.
+ *  @param out_wrids Array of at least max entries filled with the work request IDs of 
+ *                   the completed WQEs, in completion order. Can be NULL.
+ *  @return Number of completions reaped (0 if none is available).
+ */
+int rdma_poll_cq(struct rdma_qp_t* qp, uint32_t max, uint16_t* out_wrids);
+
 /** @brief Post an RDMA receive request.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qp a pointer to a queue pair.
- *  @return void.
+ *  @return a pointer to the RQE received, or NULL on failure.
  */
 void* rdma_post_receive(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp);
 
@@ -338,6 +645,50 @@ void* rdma_post_receive(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp);
  */
 uint8_t rdma_release_rq_consumed(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp);
 
+/** @brief Get every RQE that arrived since the last receive, up to max_rqes. RQEs are 
+ *         returned in arrival order and stay valid until they are released with 
+ *         rdma_release_rq_batch() or rdma_release_rq_consumed().
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param qp a pointer to a queue pair.
+ *  @param rqes Array of at least max_rqes entries filled with pointers to the RQEs received.
+ *  @param max_rqes Maximum number of RQEs to return.
+ *  @param block '1' waits with the QP receive wait policy until at least one RQE arrived, 
+ *               '0' returns immediately.
+ *  @return Number of RQEs returned (0 if none is available and block is '0'), or -1 on 
+ *          failure or timeout.
+ */
+int rdma_post_receive_batch(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, void** rqes, 
+                            uint32_t max_rqes, int block);
+
+/** @brief Release the oldest consumed RQEs with a single RQ consumer index doorbell write.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param qp a pointer to a queue pair.
+ *  @param num_rqes Number of RQEs to release, at most the number of RQEs received and not
+ *                  yet released.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_release_rq_batch(struct rdma_dev_t* rdma_dev, struct rdma_qp_t* qp, uint32_t num_rqes);
+
+/** @brief Create a receive queue buffer shared by the QPs allocated afterwards. Each QP
+ *         takes one ring of ring_depth RQEs from it instead of allocating its own RQ, and 
+ *         gives it back when it is destroyed.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param num_rings Number of RQ rings, i.e. the number of QPs that can use the pool at
+ *                   the same time.
+ *  @param ring_depth Number of RQEs of a ring, at least the qdepth of the QPs using it.
+ *  @param buf_location Location of the buffer: HOST_MEM or DEVICE_MEM.
+ *  @return a pointer to the RQ pool, or NULL on failure.
+ */
+struct rdma_rq_pool_t* rdma_create_rq_pool(struct rdma_dev_t* rdma_dev, uint32_t num_rings, 
+                                           uint32_t ring_depth, char* buf_location);
+
+/** @brief Destroy the shared receive queue buffer of a device. QPs allocated afterwards 
+ *         allocate their own RQ again.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @return Success (0) or Failure (-1) if a QP still uses a ring of the pool.
+ */
+int rdma_destroy_rq_pool(struct rdma_dev_t* rdma_dev);
+
 /** @brief Reset RDMA device when encountering fatal error.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @param qpid the QP ID that has the fatal issues.
@@ -351,12 +702,20 @@ void rdma_qp_fatal_recovery(struct rdma_dev_t* rdma_dev, uint32_t qpid);
  */
 void destroy_rdma_pd_entry(struct rdma_pd_t* pd);
 
-/** @brief Destroy the RDMA queue pair generated.
+/** @brief Destroy the RDMA queue pair generated. The QP is removed from its RDMA device
+ *         and freed, its protection domain entry is freed with the last QP using it.
  *  @param qp a pointer to a queue pair.
  *  @return Success (0).
  */
 int destroy_rdma_qp(struct rdma_qp_t* qp);
 
+/** @brief Reset and free an RDMA queue pair like destroy_rdma_qp(), but leave its 
+ *         protection domain entry to the caller, e.g. to undo a partial bring-up.
+ *  @param qp a pointer to a queue pair.
+ *  @return Success (0).
+ */
+int rdma_qp_release(struct rdma_qp_t* qp);
+
 /** @brief Destroy the RDMA device.
  *  @param rdma_dev A pointer to the RDMA device.
  *  @return Success (0).
@@ -377,4 +736,12 @@ int destroy_rn_dev(struct rn_dev_t* rn_dev);
  */
 void dump_registers(struct rdma_dev_t* rdma_dev, uint8_t is_sender, uint32_t qpid);
 
+/** @brief Read the RDMA global counters and the status registers of one QP.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param qpid the target QP ID.
+ *  @param stats filled with the counter values.
+ *  @return 0 - success; -1 - invalid argument.
+ */
+int rdma_get_stats(struct rdma_dev_t* rdma_dev, uint32_t qpid, struct rdma_stats_t* stats);
+
 #endif /* __RDMA_API_H__ */
\ No newline at end of file
@@ -0,0 +1,360 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_cm.c
+ *  @brief Implementation of the RDMA connection manager.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "rdma_cm.h"
+
+// Header of the message exchanged by rdma_cm_exchange(), followed by num_qps
+// rdma_cm_qp_attr_t and priv_len bytes of private data. All fields are in network 
+// byte order.
+struct rdma_cm_msg_hdr_t {
+  uint32_t magic;
+  uint32_t num_qps;
+  uint32_t ip;
+  uint32_t mac_lsb;
+  uint32_t mac_msb;
+  uint32_t priv_len;
+};
+
+struct rdma_cm_conn_t* rdma_cm_create(uint32_t num_qps) {
+  struct rdma_cm_conn_t* conn = NULL;
+
+  if((num_qps == 0) || (num_qps > RDMA_CM_MAX_QPS)) {
+    fprintf(stderr, "Error: a connection needs 1 to %d queue pairs\n", RDMA_CM_MAX_QPS);
+    return NULL;
+  }
+
+  conn = (struct rdma_cm_conn_t* ) calloc(1, sizeof(struct rdma_cm_conn_t));
+  if(conn == NULL) {
+    fprintf(stderr, "Error: failed to allocate the connection\n");
+    return NULL;
+  }
+
+  conn->sockfd  = -1;
+  conn->num_qps = num_qps;
+  conn->local   = (struct rdma_cm_qp_attr_t* ) calloc(num_qps, sizeof(struct rdma_cm_qp_attr_t));
+  conn->remote  = (struct rdma_cm_qp_attr_t* ) calloc(num_qps, sizeof(struct rdma_cm_qp_attr_t));
+  conn->qps     = (struct rdma_qp_t** ) calloc(num_qps, sizeof(struct rdma_qp_t*));
+  if((conn->local == NULL) || (conn->remote == NULL) || (conn->qps == NULL)) {
+    fprintf(stderr, "Error: failed to allocate the queue pair descriptions\n");
+    rdma_cm_destroy(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+void rdma_cm_destroy(struct rdma_cm_conn_t* conn) {
+  if(conn == NULL) {
+    return;
+  }
+
+  if(conn->sockfd >= 0) {
+    shutdown(conn->sockfd, SHUT_RDWR);
+    close(conn->sockfd);
+  }
+  free(conn->local);
+  free(conn->remote);
+  free(conn->qps);
+  free(conn);
+}
+
+int rdma_cm_set_local_qp(struct rdma_cm_conn_t* conn, uint32_t idx, uint32_t qpid, 
+                         uint32_t sq_psn, uint32_t r_key, uint64_t buf_offset, uint64_t buf_size) {
+  if((conn == NULL) || (idx >= conn->num_qps)) {
+    fprintf(stderr, "Error: invalid connection or queue pair index\n");
+    return -1;
+  }
+
+  conn->local[idx].qpid       = qpid;
+  conn->local[idx].sq_psn     = sq_psn & RDMA_CM_PSN_MASK;
+  conn->local[idx].r_key      = r_key;
+  conn->local[idx].reserved   = 0;
+  conn->local[idx].buf_offset = buf_offset;
+  conn->local[idx].buf_size   = buf_size;
+  return 0;
+}
+
+int rdma_cm_set_private_data(struct rdma_cm_conn_t* conn, const void* data, uint32_t len) {
+  if((conn == NULL) || (len > RDMA_CM_MAX_PRIV_DATA) || ((data == NULL) && (len != 0))) {
+    fprintf(stderr, "Error: private data must be at most %d bytes\n", RDMA_CM_MAX_PRIV_DATA);
+    return -1;
+  }
+
+  if(len != 0) {
+    memcpy(conn->local_priv, data, len);
+  }
+  conn->local_priv_len = len;
+  return 0;
+}
+
+// Disable Nagle so that the single exchange message is sent right away
+static void rdma_cm_set_nodelay(int sockfd) {
+  int one = 1;
+
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int rdma_cm_listen(char* ip_str, uint16_t port) {
+  struct sockaddr_in addr;
+  int listen_fd;
+  int one = 1;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listen_fd < 0) {
+    fprintf(stderr, "Error: failed to create a socket - %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = (ip_str != NULL) ? inet_addr(ip_str) : htonl(INADDR_ANY);
+
+  if((bind(listen_fd, (struct sockaddr* ) &addr, sizeof(struct sockaddr_in)) < 0) || 
+     (listen(listen_fd, SOMAXCONN) < 0)) {
+    fprintf(stderr, "Error: failed to listen on port %d - %s\n", port, strerror(errno));
+    close(listen_fd);
+    return -1;
+  }
+
+  return listen_fd;
+}
+
+int rdma_cm_accept(struct rdma_cm_conn_t* conn, int listen_fd) {
+  struct sockaddr_in addr;
+  socklen_t addr_size = sizeof(struct sockaddr_in);
+
+  conn->sockfd = accept(listen_fd, (struct sockaddr* ) &addr, &addr_size);
+  if(conn->sockfd < 0) {
+    fprintf(stderr, "Error: failed to accept a connection - %s\n", strerror(errno));
+    return -1;
+  }
+  rdma_cm_set_nodelay(conn->sockfd);
+
+  fprintf(stderr, "Info: accepted a connection from %s\n", inet_ntoa(addr.sin_addr));
+  return 0;
+}
+
+int rdma_cm_connect(struct rdma_cm_conn_t* conn, char* ip_str, uint16_t port, uint32_t timeout_ms) {
+  struct sockaddr_in addr;
+  uint32_t waited_ms = 0;
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = inet_addr(ip_str);
+
+  while(1) {
+    conn->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->sockfd < 0) {
+      fprintf(stderr, "Error: failed to create a socket - %s\n", strerror(errno));
+      return -1;
+    }
+    if(connect(conn->sockfd, (struct sockaddr* ) &addr, sizeof(struct sockaddr_in)) == 0) {
+      break;
+    }
+    close(conn->sockfd);
+    conn->sockfd = -1;
+
+    // The peer may not listen yet
+    if(waited_ms >= timeout_ms) {
+      fprintf(stderr, "Error: failed to connect to %s:%d - %s\n", ip_str, port, strerror(errno));
+      return -1;
+    }
+    usleep(10000);
+    waited_ms += 10;
+  }
+  rdma_cm_set_nodelay(conn->sockfd);
+
+  fprintf(stderr, "Info: connected to %s:%d\n", ip_str, port);
+  return 0;
+}
+
+// Send or receive exactly size bytes
+static int rdma_cm_xfer(int sockfd, void* buf, size_t size, int is_send) {
+  size_t done = 0;
+  ssize_t rc;
+
+  while(done < size) {
+    if(is_send) {
+      rc = write(sockfd, (char* ) buf + done, size - done);
+    } else {
+      rc = read(sockfd, (char* ) buf + done, size - done);
+    }
+    if(rc < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: connection manager socket failed - %s\n", strerror(errno));
+      return -1;
+    }
+    if(rc == 0) {
+      fprintf(stderr, "Error: the peer closed the connection\n");
+      return -1;
+    }
+    done += (size_t) rc;
+  }
+
+  return 0;
+}
+
+int rdma_cm_exchange(struct rdma_cm_conn_t* conn, struct rdma_dev_t* rdma_dev) {
+  size_t attr_size;
+  size_t msg_size;
+  struct rdma_cm_msg_hdr_t* hdr;
+  struct rdma_cm_qp_attr_t* attr;
+  char* msg;
+  uint32_t i;
+  int rc = -1;
+
+  if((conn == NULL) || (conn->sockfd < 0) || (rdma_dev == NULL)) {
+    fprintf(stderr, "Error: rdma_cm_exchange needs a connected peer and an RDMA device\n");
+    return -1;
+  }
+
+  attr_size = conn->num_qps * sizeof(struct rdma_cm_qp_attr_t);
+  msg_size  = sizeof(struct rdma_cm_msg_hdr_t) + attr_size + RDMA_CM_MAX_PRIV_DATA;
+  msg = (char* ) malloc(msg_size);
+  if(msg == NULL) {
+    fprintf(stderr, "Error: failed to allocate the connection manager message\n");
+    return -1;
+  }
+
+  hdr  = (struct rdma_cm_msg_hdr_t* ) msg;
+  attr = (struct rdma_cm_qp_attr_t* ) (msg + sizeof(struct rdma_cm_msg_hdr_t));
+  hdr->magic    = htonl(RDMA_CM_MAGIC);
+  hdr->num_qps  = htonl(conn->num_qps);
+  hdr->ip       = htonl(rdma_dev->glb_csr->src_ip);
+  hdr->mac_lsb  = htonl(rdma_dev->glb_csr->src_mac.mac_lsb);
+  hdr->mac_msb  = htonl(rdma_dev->glb_csr->src_mac.mac_msb);
+  hdr->priv_len = htonl(conn->local_priv_len);
+  for(i=0; i<conn->num_qps; i++) {
+    attr[i].qpid       = htonl(conn->local[i].qpid);
+    attr[i].sq_psn     = htonl(conn->local[i].sq_psn);
+    attr[i].r_key      = htonl(conn->local[i].r_key);
+    attr[i].reserved   = 0;
+    attr[i].buf_offset = htonll(conn->local[i].buf_offset);
+    attr[i].buf_size   = htonll(conn->local[i].buf_size);
+  }
+  memcpy((char* ) attr + attr_size, conn->local_priv, conn->local_priv_len);
+
+  // Both peers send first, the socket buffers hold the whole message
+  if(rdma_cm_xfer(conn->sockfd, msg, sizeof(struct rdma_cm_msg_hdr_t) + attr_size + conn->local_priv_len, 1) < 0) {
+    goto out;
+  }
+  if(rdma_cm_xfer(conn->sockfd, msg, sizeof(struct rdma_cm_msg_hdr_t), 0) < 0) {
+    goto out;
+  }
+  if((ntohl(hdr->magic) != RDMA_CM_MAGIC) || (ntohl(hdr->num_qps) != conn->num_qps)) {
+    fprintf(stderr, "Error: the peer has %d queue pairs instead of %d\n", ntohl(hdr->num_qps), conn->num_qps);
+    goto out;
+  }
+  if(ntohl(hdr->priv_len) > RDMA_CM_MAX_PRIV_DATA) {
+    fprintf(stderr, "Error: the peer sent %d bytes of private data\n", ntohl(hdr->priv_len));
+    goto out;
+  }
+  if(rdma_cm_xfer(conn->sockfd, attr, attr_size + ntohl(hdr->priv_len), 0) < 0) {
+    goto out;
+  }
+
+  conn->remote_ip          = ntohl(hdr->ip);
+  conn->remote_mac.mac_lsb = ntohl(hdr->mac_lsb);
+  conn->remote_mac.mac_msb = ntohl(hdr->mac_msb);
+  for(i=0; i<conn->num_qps; i++) {
+    conn->remote[i].qpid       = ntohl(attr[i].qpid);
+    conn->remote[i].sq_psn     = ntohl(attr[i].sq_psn);
+    conn->remote[i].r_key      = ntohl(attr[i].r_key);
+    conn->remote[i].reserved   = 0;
+    conn->remote[i].buf_offset = ntohll(attr[i].buf_offset);
+    conn->remote[i].buf_size   = ntohll(attr[i].buf_size);
+  }
+  conn->remote_priv_len = ntohl(hdr->priv_len);
+  memcpy(conn->remote_priv, (char* ) attr + attr_size, conn->remote_priv_len);
+
+  Debug("DEBUG: exchanged %d queue pair descriptions, remote ip = 0x%x\n", conn->num_qps, conn->remote_ip);
+  rc = 0;
+
+out:
+  free(msg);
+  return rc;
+}
+
+int rdma_cm_sync(struct rdma_cm_conn_t* conn) {
+  char token = 'r';
+
+  if(rdma_cm_xfer(conn->sockfd, &token, 1, 1) < 0) {
+    return -1;
+  }
+  return rdma_cm_xfer(conn->sockfd, &token, 1, 0);
+}
+
+int rdma_cm_bring_up(struct rdma_cm_conn_t* conn, struct rdma_dev_t* rdma_dev, 
+                     struct rdma_pd_t* pd_entry, uint64_t cq_cidb_addr, uint64_t rq_cidb_addr, 
+                     uint32_t qdepth, char* buf_location, uint32_t partion_key) {
+  struct rdma_cm_qp_attr_t* local  = conn->local;
+  struct rdma_cm_qp_attr_t* remote = conn->remote;
+  int contiguous = 1;
+  uint32_t i;
+
+  for(i=0; i<conn->num_qps; i++) {
+    if(local[i].qpid >= rdma_dev->num_qp) {
+      fprintf(stderr, "Error: QP%d is out of range\n", local[i].qpid);
+      return -1;
+    }
+    if((local[i].qpid != local[0].qpid + i) || (remote[i].qpid != remote[0].qpid + i)) {
+      contiguous = 0;
+    }
+  }
+
+  if(contiguous) {
+    // The common case: all queue pairs are programmed in one register batch
+    if(allocate_rdma_qps(rdma_dev, local[0].qpid, conn->num_qps, remote[0].qpid, pd_entry, 
+                         cq_cidb_addr + ((uint64_t) local[0].qpid << 2), 
+                         rq_cidb_addr + ((uint64_t) local[0].qpid << 2), qdepth, buf_location, 
+                         &conn->remote_mac, conn->remote_ip, partion_key, local[0].r_key, 
+                         conn->qps) < 0) {
+      return -1;
+    }
+  } else {
+    for(i=0; i<conn->num_qps; i++) {
+      conn->qps[i] = allocate_rdma_qp(rdma_dev, local[i].qpid, remote[i].qpid, pd_entry, 
+                                      cq_cidb_addr + ((uint64_t) local[i].qpid << 2), 
+                                      rq_cidb_addr + ((uint64_t) local[i].qpid << 2), qdepth, 
+                                      buf_location, &conn->remote_mac, conn->remote_ip, 
+                                      partion_key, local[i].r_key);
+      if(conn->qps[i] == NULL) {
+        // Tear down the QPs created so far, like allocate_rdma_qps() does
+        while(i > 0) {
+          i--;
+          rdma_qp_release(conn->qps[i]);
+          conn->qps[i] = NULL;
+        }
+        return -1;
+      }
+    }
+  }
+
+  // The peer's first request carries its initial SQ PSN
+  for(i=0; i<conn->num_qps; i++) {
+    config_sq_psn(rdma_dev, local[i].qpid, local[i].sq_psn);
+    config_last_rq_psn(rdma_dev, local[i].qpid, (remote[i].sq_psn - 1) & RDMA_CM_PSN_MASK);
+  }
+
+  // Neither side posts before the queue pairs of the peer are up
+  if(rdma_cm_sync(conn) < 0) {
+    return -1;
+  }
+
+  fprintf(stderr, "Info: %d queue pairs connected to the peer\n", conn->num_qps);
+  return 0;
+}
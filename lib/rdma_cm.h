@@ -0,0 +1,168 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_cm.h
+ *  @brief Header file of the RDMA connection manager.
+ *
+ *  The connection manager brings up a set of queue pairs with a remote peer over a TCP
+ *  connection. Each side describes its queue pairs (QP ID, initial PSN, remote key and 
+ *  the buffer exposed on the QP) and both descriptions, with the MAC and IP addresses 
+ *  of the nodes, are exchanged in a single round trip, optionally with application 
+ *  private data such as the offsets of further buffers. The queue pairs are then 
+ *  allocated and connected in one register batch.
+ */
+
+#ifndef __RDMA_CM_H__
+#define __RDMA_CM_H__
+
+#include "rdma_api.h"
+
+/*! \def RDMA_CM_MAGIC
+    \brief Magic number at the beginning of a connection manager message.
+*/
+#define RDMA_CM_MAGIC 0x52434d31
+
+/*! \def RDMA_CM_MAX_QPS
+    \brief Maximum number of queue pairs of a connection.
+*/
+#define RDMA_CM_MAX_QPS 256
+
+/*! \def RDMA_CM_PSN_MASK
+    \brief Mask of a 24-bit packet sequence number.
+*/
+#define RDMA_CM_PSN_MASK 0x00ffffff
+
+/*! \def RDMA_CM_MAX_PRIV_DATA
+    \brief Maximum size of the private data exchanged with the peer in bytes.
+*/
+#define RDMA_CM_MAX_PRIV_DATA 256
+
+/*! \struct rdma_cm_qp_attr_t
+    \brief Description of a queue pair exchanged with the peer.
+*/
+struct rdma_cm_qp_attr_t {
+  uint32_t qpid;       /*!< qpid QP ID. */
+  uint32_t sq_psn;     /*!< sq_psn initial SQ packet sequence number. */
+  uint32_t r_key;      /*!< r_key remote key of the buffer exposed on the QP. */
+  uint32_t reserved;   /*!< reserved padding, 0. */
+  uint64_t buf_offset; /*!< buf_offset remote offset of the buffer used by the peer in 
+                            its RDMA READ and WRITE WQEs. */
+  uint64_t buf_size;   /*!< buf_size size of the buffer, 0 if none is exposed. */
+};
+
+/*! \struct rdma_cm_conn_t
+    \brief A connection with a remote peer.
+*/
+struct rdma_cm_conn_t {
+  int sockfd;                        /*!< sockfd TCP socket connected to the peer, -1 if none. */
+  uint32_t num_qps;                  /*!< num_qps number of queue pairs of the connection. */
+  struct rdma_cm_qp_attr_t* local;   /*!< local description of the local queue pairs. */
+  struct rdma_cm_qp_attr_t* remote;  /*!< remote description of the remote queue pairs, 
+                                          filled by rdma_cm_exchange(). */
+  struct mac_addr_t remote_mac;      /*!< remote_mac MAC address of the peer. */
+  uint32_t remote_ip;                /*!< remote_ip IP address of the peer. */
+  struct rdma_qp_t** qps;            /*!< qps queue pairs allocated by rdma_cm_bring_up(). */
+  uint32_t local_priv_len;           /*!< local_priv_len size of the local private data. */
+  uint8_t local_priv[RDMA_CM_MAX_PRIV_DATA];  /*!< local_priv private data sent to the peer. */
+  uint32_t remote_priv_len;          /*!< remote_priv_len size of the private data of the peer. */
+  uint8_t remote_priv[RDMA_CM_MAX_PRIV_DATA]; /*!< remote_priv private data of the peer, 
+                                                   filled by rdma_cm_exchange(). */
+};
+
+/** @brief Create a connection with num_qps queue pairs. The local queue pairs are 
+ *         described with rdma_cm_set_local_qp() before the exchange.
+ *  @param num_qps number of queue pairs, at most RDMA_CM_MAX_QPS.
+ *  @return a pointer to the connection, or NULL on failure.
+ */
+struct rdma_cm_conn_t* rdma_cm_create(uint32_t num_qps);
+
+/** @brief Destroy a connection and close its socket. The queue pairs keep a pointer to
+ *         remote_mac, the connection must outlive them.
+ *  @param conn the connection.
+ *  @return void.
+ */
+void rdma_cm_destroy(struct rdma_cm_conn_t* conn);
+
+/** @brief Describe a local queue pair of a connection.
+ *  @param conn the connection.
+ *  @param idx index of the queue pair in the connection.
+ *  @param qpid QP ID.
+ *  @param sq_psn initial SQ packet sequence number.
+ *  @param r_key remote key the peer uses to access the buffer.
+ *  @param buf_offset remote offset of the buffer, e.g. its virtual address.
+ *  @param buf_size size of the buffer, 0 if none is exposed.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_set_local_qp(struct rdma_cm_conn_t* conn, uint32_t idx, uint32_t qpid, 
+                         uint32_t sq_psn, uint32_t r_key, uint64_t buf_offset, uint64_t buf_size);
+
+/** @brief Set the private data sent to the peer by rdma_cm_exchange(). The data is 
+ *         opaque to the connection manager, the application chooses its byte order.
+ *  @param conn the connection.
+ *  @param data private data, NULL to send none.
+ *  @param len size of the data, at most RDMA_CM_MAX_PRIV_DATA bytes.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_set_private_data(struct rdma_cm_conn_t* conn, const void* data, uint32_t len);
+
+/** @brief Create a TCP socket listening for connections.
+ *  @param ip_str local IP address to listen on, NULL listens on all addresses.
+ *  @param port TCP port.
+ *  @return the listening socket, or -1 on failure.
+ */
+int rdma_cm_listen(char* ip_str, uint16_t port);
+
+/** @brief Accept a connection from a peer on a listening socket.
+ *  @param conn the connection.
+ *  @param listen_fd socket returned by rdma_cm_listen().
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_accept(struct rdma_cm_conn_t* conn, int listen_fd);
+
+/** @brief Connect to a peer listening with rdma_cm_listen(). The connection is retried 
+ *         until the peer listens or the timeout expires.
+ *  @param conn the connection.
+ *  @param ip_str IP address of the peer.
+ *  @param port TCP port of the peer.
+ *  @param timeout_ms time to keep retrying in milliseconds.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_connect(struct rdma_cm_conn_t* conn, char* ip_str, uint16_t port, uint32_t timeout_ms);
+
+/** @brief Exchange the descriptions of the queue pairs, the addresses of both nodes 
+ *         and the private data with the peer in a single round trip.
+ *  @param conn the connection.
+ *  @param rdma_dev A pointer to the opened RDMA device, its MAC and IP addresses are sent.
+ *  @return Success (0) or Failure (-1) if the peer is unreachable or its description 
+ *          does not match the connection.
+ */
+int rdma_cm_exchange(struct rdma_cm_conn_t* conn, struct rdma_dev_t* rdma_dev);
+
+/** @brief Allocate and connect the queue pairs of a connection after rdma_cm_exchange().
+ *         The i-th local QP is connected to the i-th remote QP; SQ PSNs are configured
+ *         from the local description and last RQ PSNs from the remote one. Returns once
+ *         both peers have their queue pairs ready.
+ *  @param conn the connection.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param pd_entry Pointer to a protection domain entry shared by the QPs.
+ *  @param cq_cidb_addr Address of the CQ consumer index doorbell array, indexed by QP ID.
+ *  @param rq_cidb_addr Address of the RQ consumer index doorbell array, indexed by QP ID.
+ *  @param qdepth Queue depth of each QP.
+ *  @param buf_location Location to allocate the queues: "host_mem" or "dev_mem".
+ *  @param partion_key Partion key.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_bring_up(struct rdma_cm_conn_t* conn, struct rdma_dev_t* rdma_dev, 
+                     struct rdma_pd_t* pd_entry, uint64_t cq_cidb_addr, uint64_t rq_cidb_addr, 
+                     uint32_t qdepth, char* buf_location, uint32_t partion_key);
+
+/** @brief Wait until the peer calls rdma_cm_sync() as well.
+ *  @param conn the connection.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_cm_sync(struct rdma_cm_conn_t* conn);
+
+#endif /* __RDMA_CM_H__ */
@@ -0,0 +1,211 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_engine.c
+ *  @brief Implementation of the multi-threaded RDMA engine.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "rdma_engine.h"
+
+struct rdma_engine_t* create_rdma_engine(struct rdma_dev_t* rdma_dev, uint32_t num_workers, 
+                                         const int* cpus) {
+  uint32_t i;
+  struct rdma_engine_t* engine = NULL;
+
+  if((rdma_dev == NULL) || (num_workers == 0)) {
+    fprintf(stderr, "Error: create_rdma_engine needs an RDMA device and at least one worker\n");
+    return NULL;
+  }
+
+  engine = (struct rdma_engine_t* ) calloc(1, sizeof(struct rdma_engine_t));
+  if(engine == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RDMA engine\n");
+    return NULL;
+  }
+
+  engine->workers = (struct rdma_worker_t* ) calloc(num_workers, sizeof(struct rdma_worker_t));
+  if(engine->workers == NULL) {
+    fprintf(stderr, "Error: failed to allocate the RDMA engine workers\n");
+    free(engine);
+    return NULL;
+  }
+
+  engine->rdma_dev    = rdma_dev;
+  engine->num_workers = num_workers;
+  engine->stop        = 0;
+  engine->running     = 0;
+
+  for(i=0; i<num_workers; i++) {
+    engine->workers[i].engine  = engine;
+    engine->workers[i].index   = i;
+    engine->workers[i].cpu     = (cpus != NULL) ? cpus[i] : -1;
+    engine->workers[i].qps     = (struct rdma_qp_t** ) calloc(rdma_dev->num_qp, sizeof(struct rdma_qp_t*));
+    engine->workers[i].num_qps = 0;
+    if(engine->workers[i].qps == NULL) {
+      fprintf(stderr, "Error: failed to allocate the QP table of worker %d\n", i);
+      destroy_rdma_engine(engine);
+      return NULL;
+    }
+  }
+
+  return engine;
+}
+
+int rdma_engine_assign_qp(struct rdma_engine_t* engine, uint32_t worker_idx, 
+                          struct rdma_qp_t* qp) {
+  struct rdma_worker_t* worker;
+
+  if((engine == NULL) || (qp == NULL) || (worker_idx >= engine->num_workers)) {
+    fprintf(stderr, "Error: invalid engine, worker or queue pair\n");
+    return -1;
+  }
+
+  if(engine->running) {
+    fprintf(stderr, "Error: queue pairs can't be assigned while the engine is running\n");
+    return -1;
+  }
+
+  if(qp->owner >= 0) {
+    fprintf(stderr, "Error: QP%d is already owned by worker %d\n", qp->qpid, qp->owner);
+    return -1;
+  }
+
+  worker = &(engine->workers[worker_idx]);
+  if(worker->num_qps >= engine->rdma_dev->num_qp) {
+    fprintf(stderr, "Error: worker %d can't own more queue pairs\n", worker_idx);
+    return -1;
+  }
+
+  worker->qps[worker->num_qps] = qp;
+  worker->num_qps++;
+  qp->owner = (int) worker_idx;
+
+  return 0;
+}
+
+int rdma_engine_assign_all_qps(struct rdma_engine_t* engine) {
+  uint32_t i;
+  uint32_t next_worker = 0;
+  int num_assigned = 0;
+  struct rdma_qp_t* qp;
+
+  if(engine == NULL) {
+    return -1;
+  }
+
+  for(i=0; i<engine->rdma_dev->num_qp; i++) {
+    qp = engine->rdma_dev->qps_ptr[i];
+    if((qp == NULL) || (qp->owner >= 0)) {
+      continue;
+    }
+
+    if(rdma_engine_assign_qp(engine, next_worker, qp) < 0) {
+      return -1;
+    }
+    next_worker = (next_worker + 1) % engine->num_workers;
+    num_assigned++;
+  }
+
+  return num_assigned;
+}
+
+static void* rdma_worker_main(void* data) {
+  struct rdma_worker_t* worker = (struct rdma_worker_t* ) data;
+  cpu_set_t cpuset;
+
+  if(worker->cpu >= 0) {
+    CPU_ZERO(&cpuset);
+    CPU_SET(worker->cpu, &cpuset);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+      fprintf(stderr, "Warning: failed to pin worker %d to CPU %d\n", worker->index, worker->cpu);
+    }
+  }
+
+  worker->result = worker->fn(worker, worker->arg);
+  return worker->result;
+}
+
+int rdma_engine_start(struct rdma_engine_t* engine, rdma_worker_fn fn, void* arg) {
+  uint32_t i;
+  uint32_t j;
+
+  if((engine == NULL) || (fn == NULL)) {
+    fprintf(stderr, "Error: rdma_engine_start needs an engine and a worker function\n");
+    return -1;
+  }
+
+  if(engine->running) {
+    fprintf(stderr, "Error: the RDMA engine is already running\n");
+    return -1;
+  }
+
+  engine->stop = 0;
+  for(i=0; i<engine->num_workers; i++) {
+    engine->workers[i].fn     = fn;
+    engine->workers[i].arg    = arg;
+    engine->workers[i].result = NULL;
+    if(pthread_create(&(engine->workers[i].thread), NULL, rdma_worker_main, &(engine->workers[i])) != 0) {
+      fprintf(stderr, "Error: failed to start worker %d\n", i);
+      engine->stop = 1;
+      for(j=0; j<i; j++) {
+        pthread_join(engine->workers[j].thread, NULL);
+      }
+      return -1;
+    }
+  }
+  engine->running = 1;
+
+  fprintf(stderr, "Info: RDMA engine started with %d workers\n", engine->num_workers);
+  return 0;
+}
+
+int rdma_worker_should_stop(struct rdma_worker_t* worker) {
+  return __atomic_load_n(&(worker->engine->stop), __ATOMIC_ACQUIRE);
+}
+
+int rdma_engine_join(struct rdma_engine_t* engine, int stop) {
+  uint32_t i;
+
+  if(engine == NULL) {
+    return -1;
+  }
+
+  if(!engine->running) {
+    return 0;
+  }
+
+  if(stop) {
+    __atomic_store_n(&(engine->stop), 1, __ATOMIC_RELEASE);
+  }
+
+  for(i=0; i<engine->num_workers; i++) {
+    pthread_join(engine->workers[i].thread, NULL);
+  }
+  engine->running = 0;
+
+  return 0;
+}
+
+int destroy_rdma_engine(struct rdma_engine_t* engine) {
+  uint32_t i;
+  uint32_t j;
+
+  if(engine != NULL) {
+    rdma_engine_join(engine, 1);
+    for(i=0; i<engine->num_workers; i++) {
+      for(j=0; j<engine->workers[i].num_qps; j++) {
+        engine->workers[i].qps[j]->owner = -1;
+      }
+      free(engine->workers[i].qps);
+    }
+    free(engine->workers);
+    free(engine);
+  }
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_engine.h
+ *  @brief Header file of the multi-threaded RDMA engine.
+ *
+ *  The engine runs one worker thread per CPU core. Each worker owns a set of RDMA queue
+ *  pairs and is the only thread posting to and polling them, so the per-QP SQ/CQ state
+ *  needs no locking. Buffer allocation and global CSR accesses of the library are safe to
+ *  call from several workers at once.
+ */
+
+#ifndef __RDMA_ENGINE_H__
+#define __RDMA_ENGINE_H__
+
+#include <pthread.h>
+#include "rdma_api.h"
+
+struct rdma_worker_t;
+
+/*! \typedef rdma_worker_fn
+    \brief Function run by each engine worker thread.
+*/
+typedef void* (*rdma_worker_fn)(struct rdma_worker_t* worker, void* arg);
+
+/*! \struct rdma_worker_t
+    \brief An engine worker thread and the queue pairs it owns.
+*/
+struct rdma_worker_t {
+  struct rdma_engine_t* engine; /*!< engine the engine the worker belongs to. */
+  uint32_t index;               /*!< index worker index in the engine. */
+  int cpu;                      /*!< cpu CPU core the worker is pinned to, -1 if not pinned. */
+  pthread_t thread;             /*!< thread worker thread. */
+  struct rdma_qp_t** qps;       /*!< qps queue pairs owned by the worker. */
+  uint32_t num_qps;             /*!< num_qps number of queue pairs owned by the worker. */
+  rdma_worker_fn fn;            /*!< fn function run by the worker. */
+  void* arg;                    /*!< arg argument passed to fn. */
+  void* result;                 /*!< result value returned by fn. */
+};
+
+/*! \struct rdma_engine_t
+    \brief Multi-threaded RDMA engine.
+*/
+struct rdma_engine_t {
+  struct rdma_dev_t* rdma_dev;   /*!< rdma_dev the RDMA device driven by the engine. */
+  struct rdma_worker_t* workers; /*!< workers array of worker threads. */
+  uint32_t num_workers;          /*!< num_workers number of worker threads. */
+  volatile int stop;             /*!< stop set when the workers are asked to stop. */
+  int running;                   /*!< running set while the worker threads are running. */
+};
+
+/** @brief Create an RDMA engine.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param num_workers Number of worker threads.
+ *  @param cpus Array of num_workers CPU cores to pin the workers to. NULL or a negative
+ *              entry leaves the corresponding worker unpinned.
+ *  @return a pointer to the engine created.
+ */
+struct rdma_engine_t* create_rdma_engine(struct rdma_dev_t* rdma_dev, uint32_t num_workers, 
+                                         const int* cpus);
+
+/** @brief Give the ownership of a queue pair to an engine worker. A queue pair can only be
+ *         owned by one worker and must be assigned before the engine is started.
+ *  @param engine A pointer to the RDMA engine.
+ *  @param worker_idx Index of the worker.
+ *  @param qp a pointer to a queue pair.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_engine_assign_qp(struct rdma_engine_t* engine, uint32_t worker_idx, 
+                          struct rdma_qp_t* qp);
+
+/** @brief Spread all allocated queue pairs of the RDMA device across the engine workers
+ *         in round-robin order.
+ *  @param engine A pointer to the RDMA engine.
+ *  @return Number of queue pairs assigned, or -1 on failure.
+ */
+int rdma_engine_assign_all_qps(struct rdma_engine_t* engine);
+
+/** @brief Start the engine workers.
+ *  @param engine A pointer to the RDMA engine.
+ *  @param fn Function run by every worker.
+ *  @param arg Argument passed to fn.
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_engine_start(struct rdma_engine_t* engine, rdma_worker_fn fn, void* arg);
+
+/** @brief Check whether the worker has been asked to stop. Meant to be polled by 
+ *         long-running worker functions.
+ *  @param worker A pointer to the engine worker.
+ *  @return 1 if the worker should return, 0 otherwise.
+ */
+int rdma_worker_should_stop(struct rdma_worker_t* worker);
+
+/** @brief Wait for all engine workers to return.
+ *  @param engine A pointer to the RDMA engine.
+ *  @param stop Ask the workers to stop before waiting (1) or let them finish (0).
+ *  @return Success (0) or Failure (-1).
+ */
+int rdma_engine_join(struct rdma_engine_t* engine, int stop);
+
+/** @brief Destroy an RDMA engine. Running workers are stopped first. The queue pairs 
+ *         owned by the workers are not destroyed.
+ *  @param engine A pointer to the RDMA engine.
+ *  @return Success (0).
+ */
+int destroy_rdma_engine(struct rdma_engine_t* engine);
+
+#endif /* __RDMA_ENGINE_H__ */
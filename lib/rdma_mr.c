@@ -0,0 +1,347 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_mr.c
+ *  @brief Implementation of the RDMA memory region registry.
+ */
+
+#include "rdma_mr.h"
+
+// Index of the first registered region starting after vaddr. Called with the registry
+// lock held.
+static uint32_t mr_upper_bound(struct rdma_mr_registry_t* reg, void* vaddr) {
+  uint32_t low  = 0;
+  uint32_t high = reg->num_sorted;
+  uint32_t mid;
+
+  while(low < high) {
+    mid = low + (high - low) / 2;
+    if((uintptr_t) reg->sorted[mid]->vaddr <= (uintptr_t) vaddr) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Check that a region covers the len bytes at vaddr
+static int mr_covers(struct rdma_mr_t* mr, void* vaddr, uint64_t len) {
+  uintptr_t start = (uintptr_t) mr->vaddr;
+  uintptr_t addr  = (uintptr_t) vaddr;
+
+  return (start <= addr) && (addr - start <= mr->size) && (len <= mr->size - (addr - start));
+}
+
+// Program a protection domain table entry with the region, or invalidate it if the
+// region size is 0
+static void mr_program_entry(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr) {
+  struct rdma_dev_t* rdma_dev = reg->rdma_dev;
+  struct rn_reg_batch_t batch;
+  uint32_t win_size_low  = rdma_dev->winSize->win_size_lsb;
+  uint32_t win_size_high = rdma_dev->winSize->win_size_msb;
+  uint32_t dma_addr_lsb;
+  uint32_t dma_addr_msb;
+
+  rn_reg_batch_begin(&batch, rdma_dev->axil_ctl);
+
+  if(mr->size == 0) {
+    // An entry with a zero length and key 0 matches no access. The key goes first, so the
+    // entry stops matching before its length and access rights change.
+    rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFRKEY, mr->entry), 0);
+    rn_reg_batch_fence();
+    rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_WRRDBUFLEN, mr->entry), 0);
+    rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_ACCESSDESC, mr->entry), 0);
+    rn_reg_batch_commit(&batch);
+    Debug("DEBUG: PD table entry %d invalidated\n", mr->entry);
+    return;
+  }
+
+  if(is_device_address(mr->dma_addr)) {
+    // Device memory address
+    dma_addr_lsb = (uint32_t) (mr->dma_addr & 0x00000000ffffffff);
+    dma_addr_msb = (uint32_t) ((mr->dma_addr >> 32) & 0x00000000ffffffff);
+  } else {
+    // Host memory address
+    dma_addr_lsb = (uint32_t) (mr->dma_addr & 0x00000000ffffffff & win_size_low);
+    dma_addr_msb = (uint32_t) ((mr->dma_addr >> 32) & 0x00000000ffffffff & win_size_high);
+  }
+
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_PDPDNUM, mr->entry), mr->pd->pd_num);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRLSB, mr->entry), (uint32_t) ((uint64_t) (uintptr_t) mr->vaddr & 0x00000000ffffffff));
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_VIRTADDRMSB, mr->entry), (uint32_t) (((uint64_t) (uintptr_t) mr->vaddr >> 32) & 0x00000000ffffffff));
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRLSB, mr->entry), dma_addr_lsb);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFBASEADDRMSB, mr->entry), dma_addr_msb);
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_WRRDBUFLEN, mr->entry), (uint32_t) (mr->size & 0x00000000ffffffff));
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_ACCESSDESC, mr->entry), 
+                     (uint32_t) ((((mr->size >> 32) & 0x0000ffff) << 16) | mr->access));
+  // The key makes the entry usable, the rest of it has to land first
+  rn_reg_batch_fence();
+  rn_reg_batch_write(&batch, get_rdma_pd_config_addr(RN_RDMA_PDT_BUFRKEY, mr->entry), mr->r_key);
+  rn_reg_batch_commit(&batch);
+
+  Debug("DEBUG: PD table entry %d registered, vaddr = %p, dma_addr = 0x%lx, size = 0x%lx, r_key = %d\n", 
+        mr->entry, mr->vaddr, mr->dma_addr, mr->size, mr->r_key);
+}
+
+struct rdma_mr_registry_t* rdma_mr_registry_create(struct rdma_dev_t* rdma_dev, uint32_t first_entry, 
+                                                   uint32_t num_entries, uint32_t first_key) {
+  struct rdma_mr_registry_t* reg = NULL;
+  uint32_t i;
+
+  if((rdma_dev == NULL) || (num_entries == 0) || (first_entry + num_entries > RDMA_MR_TABLE_SIZE) || 
+     (first_key == 0) || (first_key + num_entries > RDMA_MR_NUM_KEYS)) {
+    fprintf(stderr, "Error: invalid protection domain table entries or remote keys for the MR registry\n");
+    return NULL;
+  }
+
+  reg = (struct rdma_mr_registry_t* ) calloc(1, sizeof(struct rdma_mr_registry_t));
+  if(reg == NULL) {
+    fprintf(stderr, "Error: failed to allocate the MR registry\n");
+    return NULL;
+  }
+
+  reg->mrs          = (struct rdma_mr_t* ) calloc(num_entries, sizeof(struct rdma_mr_t));
+  reg->free_entries = (uint32_t* ) calloc(num_entries, sizeof(uint32_t));
+  reg->sorted       = (struct rdma_mr_t** ) calloc(num_entries, sizeof(struct rdma_mr_t* ));
+  if((reg->mrs == NULL) || (reg->free_entries == NULL) || (reg->sorted == NULL)) {
+    fprintf(stderr, "Error: failed to allocate the MR registry entries\n");
+    free(reg->mrs);
+    free(reg->free_entries);
+    free(reg->sorted);
+    free(reg);
+    return NULL;
+  }
+
+  reg->rdma_dev    = rdma_dev;
+  reg->first_entry = first_entry;
+  reg->num_entries = num_entries;
+  for(i=0; i<num_entries; i++) {
+    reg->mrs[i].entry = first_entry + i;
+    // Lowest entries are handed out first
+    reg->free_entries[i] = num_entries - 1 - i;
+    reg->keys[i] = (uint8_t) (first_key + i);
+  }
+  reg->num_free_entries = num_entries;
+  reg->key_head         = 0;
+  reg->num_free_keys    = num_entries;
+  pthread_mutex_init(&(reg->lock), NULL);
+
+  return reg;
+}
+
+// Unlink a region from the cached list
+static void mr_lru_remove(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr) {
+  if(mr->lru_prev != NULL) {
+    mr->lru_prev->lru_next = mr->lru_next;
+  } else {
+    reg->lru_oldest = mr->lru_next;
+  }
+  if(mr->lru_next != NULL) {
+    mr->lru_next->lru_prev = mr->lru_prev;
+  } else {
+    reg->lru_newest = mr->lru_prev;
+  }
+  mr->lru_prev = NULL;
+  mr->lru_next = NULL;
+}
+
+// Deregister a region that is not used: invalidate its entry, recycle its key and entry
+static void mr_release(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr) {
+  uint32_t i = mr_upper_bound(reg, mr->vaddr);
+
+  // Regions with the same start address sit right before the upper bound
+  do {
+    i--;
+  } while(reg->sorted[i] != mr);
+  memmove(&(reg->sorted[i]), &(reg->sorted[i + 1]), (reg->num_sorted - i - 1) * sizeof(struct rdma_mr_t* ));
+  reg->num_sorted--;
+
+  mr->size = 0;
+  mr_program_entry(reg, mr);
+
+  // Freed keys go to the back of the FIFO, so a stale key of a peer hits a free entry
+  reg->keys[(reg->key_head + reg->num_free_keys) % RDMA_MR_NUM_KEYS] = (uint8_t) mr->r_key;
+  reg->num_free_keys++;
+  reg->free_entries[reg->num_free_entries] = mr->entry - reg->first_entry;
+  reg->num_free_entries++;
+}
+
+void rdma_mr_registry_destroy(struct rdma_mr_registry_t* reg) {
+  uint32_t i;
+
+  if(reg == NULL) {
+    return;
+  }
+
+  for(i=0; i<reg->num_entries; i++) {
+    if(reg->mrs[i].size > 0) {
+      reg->mrs[i].size = 0;
+      mr_program_entry(reg, &(reg->mrs[i]));
+    }
+  }
+  pthread_mutex_destroy(&(reg->lock));
+  free(reg->mrs);
+  free(reg->free_entries);
+  free(reg->sorted);
+  free(reg);
+}
+
+// Find a registered region that covers the len bytes at vaddr, with the given PD, access
+// and DMA address of vaddr unless pd is NULL. Regions starting at or before vaddr are
+// searched from the closest one down. Called with the registry lock held.
+static struct rdma_mr_t* mr_find(struct rdma_mr_registry_t* reg, void* vaddr, uint64_t len,
+                                 struct rdma_pd_t* pd, uint64_t dma_addr, uint16_t access) {
+  struct rdma_mr_t* mr;
+  uint32_t i = mr_upper_bound(reg, vaddr);
+
+  while(i > 0) {
+    i--;
+    mr = reg->sorted[i];
+    if(!mr_covers(mr, vaddr, len)) {
+      continue;
+    }
+    if((pd == NULL) || ((mr->pd == pd) && (mr->access == access) && 
+       (mr->dma_addr + ((uintptr_t) vaddr - (uintptr_t) mr->vaddr) == dma_addr))) {
+      return mr;
+    }
+  }
+  return NULL;
+}
+
+struct rdma_mr_t* rdma_mr_reg(struct rdma_mr_registry_t* reg, struct rdma_pd_t* pd, 
+                              struct rdma_buff_t* buf, uint16_t access) {
+  struct rdma_mr_t* mr;
+  uint32_t i;
+
+  if((reg == NULL) || (pd == NULL) || (buf == NULL) || (buf->buf_size == 0)) {
+    fprintf(stderr, "Error: rdma_mr_reg needs a registry, a PD and a buffer\n");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(reg->lock));
+
+  mr = mr_find(reg, buf->buffer, buf->buf_size, pd, buf->dma_addr, access);
+  if(mr != NULL) {
+    if(mr->refcnt == 0) {
+      mr_lru_remove(reg, mr);
+    }
+    mr->refcnt++;
+    reg->hits++;
+    pthread_mutex_unlock(&(reg->lock));
+    return mr;
+  }
+
+  if(reg->num_free_entries == 0) {
+    // Evict the region released the longest time ago
+    if(reg->lru_oldest == NULL) {
+      pthread_mutex_unlock(&(reg->lock));
+      fprintf(stderr, "Error: all %d memory region entries are in use\n", reg->num_entries);
+      return NULL;
+    }
+    mr = reg->lru_oldest;
+    mr_lru_remove(reg, mr);
+    mr_release(reg, mr);
+    reg->evictions++;
+  }
+
+  reg->num_free_entries--;
+  mr = &(reg->mrs[reg->free_entries[reg->num_free_entries]]);
+  mr->r_key = reg->keys[reg->key_head];
+  reg->key_head = (reg->key_head + 1) % RDMA_MR_NUM_KEYS;
+  reg->num_free_keys--;
+
+  mr->vaddr    = buf->buffer;
+  mr->dma_addr = buf->dma_addr;
+  mr->size     = buf->buf_size;
+  mr->pd       = pd;
+  mr->access   = access;
+  mr->refcnt   = 1;
+  mr_program_entry(reg, mr);
+
+  i = mr_upper_bound(reg, mr->vaddr);
+  memmove(&(reg->sorted[i + 1]), &(reg->sorted[i]), (reg->num_sorted - i) * sizeof(struct rdma_mr_t* ));
+  reg->sorted[i] = mr;
+  reg->num_sorted++;
+  reg->misses++;
+
+  pthread_mutex_unlock(&(reg->lock));
+  return mr;
+}
+
+struct rdma_mr_t* rdma_mr_lookup(struct rdma_mr_registry_t* reg, void* vaddr, uint64_t len) {
+  struct rdma_mr_t* mr;
+
+  pthread_mutex_lock(&(reg->lock));
+  mr = mr_find(reg, vaddr, len, NULL, 0, 0);
+  pthread_mutex_unlock(&(reg->lock));
+  return mr;
+}
+
+void rdma_mr_put(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr) {
+  if((reg == NULL) || (mr == NULL)) {
+    return;
+  }
+
+  pthread_mutex_lock(&(reg->lock));
+  if(mr->refcnt == 0) {
+    pthread_mutex_unlock(&(reg->lock));
+    fprintf(stderr, "Warning: memory region with r_key %d released twice\n", mr->r_key);
+    return;
+  }
+
+  mr->refcnt--;
+  if(mr->refcnt == 0) {
+    mr->lru_prev = reg->lru_newest;
+    mr->lru_next = NULL;
+    if(reg->lru_newest != NULL) {
+      reg->lru_newest->lru_next = mr;
+    } else {
+      reg->lru_oldest = mr;
+    }
+    reg->lru_newest = mr;
+  }
+  pthread_mutex_unlock(&(reg->lock));
+}
+
+void rdma_mr_dereg(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr) {
+  if((reg == NULL) || (mr == NULL)) {
+    return;
+  }
+
+  pthread_mutex_lock(&(reg->lock));
+  if(mr->refcnt == 0) {
+    pthread_mutex_unlock(&(reg->lock));
+    fprintf(stderr, "Warning: memory region with r_key %d released twice\n", mr->r_key);
+    return;
+  }
+
+  mr->refcnt--;
+  if(mr->refcnt == 0) {
+    mr_release(reg, mr);
+  }
+  pthread_mutex_unlock(&(reg->lock));
+}
+
+uint32_t rdma_mr_flush(struct rdma_mr_registry_t* reg) {
+  struct rdma_mr_t* mr;
+  uint32_t num = 0;
+
+  if(reg == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&(reg->lock));
+  while(reg->lru_oldest != NULL) {
+    mr = reg->lru_oldest;
+    mr_lru_remove(reg, mr);
+    mr_release(reg, mr);
+    num++;
+  }
+  pthread_mutex_unlock(&(reg->lock));
+
+  return num;
+}
@@ -0,0 +1,149 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rdma_mr.h
+ *  @brief Header file of the RDMA memory region registry.
+ *
+ *  The registry manages a range of entries of the ERNIC protection domain table and a 
+ *  range of remote keys. Regions are registered lazily: a region released with 
+ *  rdma_mr_put() stays programmed in hardware, and registering a buffer it covers again 
+ *  is a lookup in an array of the regions sorted by start address. When the table is 
+ *  full, the least recently released region is evicted. Remote keys of deregistered 
+ *  regions are reused as late as possible.
+ */
+
+#ifndef __RDMA_MR_H__
+#define __RDMA_MR_H__
+
+#include <pthread.h>
+#include "rdma_api.h"
+
+/*! \def RDMA_MR_TABLE_SIZE
+    \brief Number of entries of the protection domain table.
+*/
+#define RDMA_MR_TABLE_SIZE 256
+
+/*! \def RDMA_MR_NUM_KEYS
+    \brief Number of remote keys, r_key is 8-bit.
+*/
+#define RDMA_MR_NUM_KEYS 256
+
+/*! \def RDMA_MR_ACCESS_READ
+    \brief Remote peers can read the region.
+*/
+#define RDMA_MR_ACCESS_READ 0
+
+/*! \def RDMA_MR_ACCESS_WRITE
+    \brief Remote peers can write the region.
+*/
+#define RDMA_MR_ACCESS_WRITE 1
+
+/*! \def RDMA_MR_ACCESS_READ_WRITE
+    \brief Remote peers can read and write the region.
+*/
+#define RDMA_MR_ACCESS_READ_WRITE 2
+
+/*! \struct rdma_mr_t
+    \brief A registered memory region.
+*/
+struct rdma_mr_t {
+  void* vaddr;                 /*!< vaddr virtual address of the region, used by peers as
+                                    remote offset. */
+  uint64_t dma_addr;           /*!< dma_addr physical or device address of the region. */
+  uint64_t size;               /*!< size size of the region in bytes, 0 if the entry is free. */
+  struct rdma_pd_t* pd;        /*!< pd protection domain of the region. */
+  uint32_t entry;              /*!< entry protection domain table entry of the region. */
+  uint32_t r_key;              /*!< r_key remote key of the region. */
+  uint16_t access;             /*!< access one of RDMA_MR_ACCESS_*. */
+  uint32_t refcnt;             /*!< refcnt number of users, 0 if the region is only cached. */
+  struct rdma_mr_t* lru_prev;  /*!< lru_prev previous cached region, towards the oldest. */
+  struct rdma_mr_t* lru_next;  /*!< lru_next next cached region, towards the newest. */
+};
+
+/*! \struct rdma_mr_registry_t
+    \brief Memory region registry of an RDMA device.
+*/
+struct rdma_mr_registry_t {
+  struct rdma_dev_t* rdma_dev;   /*!< rdma_dev the RDMA device. */
+  uint32_t first_entry;          /*!< first_entry first table entry managed. */
+  uint32_t num_entries;          /*!< num_entries number of table entries managed. */
+  struct rdma_mr_t* mrs;         /*!< mrs regions indexed by entry - first_entry. */
+  uint32_t* free_entries;        /*!< free_entries stack of free entries. */
+  uint32_t num_free_entries;     /*!< num_free_entries number of free entries. */
+  uint8_t keys[RDMA_MR_NUM_KEYS]; /*!< keys FIFO of free remote keys. */
+  uint32_t key_head;             /*!< key_head oldest free remote key in keys. */
+  uint32_t num_free_keys;        /*!< num_free_keys number of free remote keys. */
+  struct rdma_mr_t** sorted;     /*!< sorted registered regions by start address. */
+  uint32_t num_sorted;           /*!< num_sorted number of registered regions. */
+  struct rdma_mr_t* lru_oldest;  /*!< lru_oldest cached region evicted first. */
+  struct rdma_mr_t* lru_newest;  /*!< lru_newest cached region released last. */
+  uint64_t hits;                 /*!< hits registrations served from the cache. */
+  uint64_t misses;               /*!< misses registrations programmed in hardware. */
+  uint64_t evictions;            /*!< evictions cached regions evicted to free an entry. */
+  pthread_mutex_t lock;          /*!< lock serializes registry accesses. */
+};
+
+/** @brief Create a memory region registry. Entries and keys used with 
+ *         allocate_rdma_pd() and rdma_register_memory_region() must lie outside the
+ *         ranges given to the registry.
+ *  @param rdma_dev A pointer to the RDMA device.
+ *  @param first_entry first protection domain table entry managed.
+ *  @param num_entries number of table entries managed.
+ *  @param first_key first remote key handed out, at least 1. Keys first_key to 
+ *                   first_key + num_entries - 1 are used, key 0 marks an invalid entry.
+ *  @return a pointer to the registry, or NULL on failure.
+ */
+struct rdma_mr_registry_t* rdma_mr_registry_create(struct rdma_dev_t* rdma_dev, uint32_t first_entry, 
+                                                   uint32_t num_entries, uint32_t first_key);
+
+/** @brief Destroy a memory region registry. All its regions are deregistered in hardware.
+ *  @param reg the registry.
+ *  @return void.
+ */
+void rdma_mr_registry_destroy(struct rdma_mr_registry_t* reg);
+
+/** @brief Register a buffer and take a reference on its region. A registered region 
+ *         with the same protection domain and access that covers the buffer at the 
+ *         matching DMA address is reused without touching the hardware.
+ *  @param reg the registry.
+ *  @param pd protection domain of the region.
+ *  @param buf buffer to register.
+ *  @param access one of RDMA_MR_ACCESS_*.
+ *  @return the region, or NULL if every entry is used.
+ */
+struct rdma_mr_t* rdma_mr_reg(struct rdma_mr_registry_t* reg, struct rdma_pd_t* pd, 
+                              struct rdma_buff_t* buf, uint16_t access);
+
+/** @brief Find a registered region that covers the len bytes at vaddr.
+ *  @param reg the registry.
+ *  @param vaddr start address of the range.
+ *  @param len length in bytes.
+ *  @return the region, or NULL if none is registered. No reference is taken.
+ */
+struct rdma_mr_t* rdma_mr_lookup(struct rdma_mr_registry_t* reg, void* vaddr, uint64_t len);
+
+/** @brief Release a reference on a region. The region stays registered and cached.
+ *  @param reg the registry.
+ *  @param mr the region.
+ *  @return void.
+ */
+void rdma_mr_put(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr);
+
+/** @brief Release a reference on a region and deregister it in hardware once it is 
+ *         unused. Its remote key is recycled.
+ *  @param reg the registry.
+ *  @param mr the region.
+ *  @return void.
+ */
+void rdma_mr_dereg(struct rdma_mr_registry_t* reg, struct rdma_mr_t* mr);
+
+/** @brief Deregister every cached region that is not used.
+ *  @param reg the registry.
+ *  @return number of regions deregistered.
+ */
+uint32_t rdma_mr_flush(struct rdma_mr_registry_t* reg);
+
+#endif /* __RDMA_MR_H__ */
@@ -9,6 +9,8 @@
  *
  */
 
+#include <sys/file.h>
+#include <sys/stat.h>
 #include "reconic.h"
 
 int debug = 0;
@@ -118,30 +120,36 @@ uint8_t is_device_address(uint64_t address) {
   }
 }
 
+// Read the pagemap entry of a virtual address from an open /proc/self/pagemap
+static int read_pagemap_entry(int pagemap_fd, void* addr, uint64_t* entry) {
+  off_t offset = (off_t) ((unsigned long) addr / getpagesize() * PAGEMAP_LENGTH);
+
+  if(pread(pagemap_fd, entry, PAGEMAP_LENGTH, offset) != PAGEMAP_LENGTH) {
+    return -1;
+  }
+  return 0;
+}
+
 /* Used to get the PFN of a virtual address */
 unsigned long get_page_frame_number_of_address(void *addr) {
-  size_t return_code;
+  int pagemap_fd;
+  uint64_t entry = 0;
   // Getting the pagemap file for the current process
-  FILE *pagemap = fopen("/proc/self/pagemap", "rb");
-
-  // Seek to the page that the buffer is on
-  unsigned long offset = (unsigned long)addr / getpagesize() * PAGEMAP_LENGTH;
-  if(fseek(pagemap, (unsigned long)offset, SEEK_SET) != 0) {
-    fprintf(stderr, "Error: Failed to seek pagemap to proper location\n");
+  pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap_fd < 0) {
+    fprintf(stderr, "Error: failed to open /proc/self/pagemap\n");
     exit(1);
   }
 
-  // The page frame number is in bits 0 - 54 so read the first 7 bytes and clear the 55th bit
-  unsigned long page_frame_number = 0;
-  return_code = fread(&page_frame_number, 1, PAGEMAP_LENGTH-1, pagemap);
-  if(return_code != (PAGEMAP_LENGTH-1)) {
+  if(read_pagemap_entry(pagemap_fd, addr, &entry) < 0) {
     fprintf(stderr, "Error: failed to get page frame number\n");
+    close(pagemap_fd);
     return -1;
   }
-  page_frame_number &= 0x7FFFFFFFFFFFFF;
+  close(pagemap_fd);
 
-  fclose(pagemap);
-  return page_frame_number;
+  // The page frame number is in bits 0 - 54
+  return (unsigned long) (entry & 0x7FFFFFFFFFFFFF);
 }
 
 /* This function is used to get the physical address of a buffer. */
@@ -162,22 +170,159 @@ uint64_t get_buffer_paddr(void *buffer) {
   return paddr;
 }
 
-void config_rn_dev_axib_bdf(struct rn_dev_t* rn_dev, uint32_t high_addr, uint32_t low_addr) {
-  int i;
-  uint64_t win_size = 0;
-  uint32_t bdf_addr_mask_high = 0;
-  uint32_t bdf_addr_mask_low  = 0;
+// Build the physical address table of the hugepage buffer with one pagemap read per hugepage.
+// Exits if the hugepages are not physically contiguous.
+static void build_hugepage_table(struct rn_dev_t* rn_dev) {
+  int pagemap_fd;
+  uint32_t i;
+  uint32_t num_runs = 1;
+  uint64_t entry;
+  void* page_addr;
+
+  rn_dev->hugepage_paddr = (uint64_t* ) malloc(((uint64_t) rn_dev->num_hugepages) * sizeof(uint64_t));
+  if(rn_dev->hugepage_paddr == NULL) {
+    fprintf(stderr, "Error: failed to allocate the hugepage translation table\n");
+    exit(EXIT_FAILURE);
+  }
 
-  uint32_t bdf_addr_high = 0;
-  uint32_t bdf_addr_low  = 0;
+  pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap_fd < 0) {
+    fprintf(stderr, "Error: failed to open /proc/self/pagemap\n");
+    exit(EXIT_FAILURE);
+  }
 
-  uint32_t bdf_win_config;
-  uint32_t bdf_win_size_in_4Kpage;
+  for(i=0; i<rn_dev->num_hugepages; i++) {
+    page_addr = (void* ) ((uint64_t) rn_dev->base_buf->buffer + (((uint64_t) i) << HUGE_PAGE_SHIFT));
+    if(read_pagemap_entry(pagemap_fd, page_addr, &entry) < 0) {
+      fprintf(stderr, "Error: failed to read the pagemap entry of hugepage %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+    // Bit 63 is set when the page is present, the PFN reads as 0 without CAP_SYS_ADMIN
+    if(((entry >> 63) == 0) || ((entry & 0x7FFFFFFFFFFFFF) == 0)) {
+      fprintf(stderr, "Error: no physical address for hugepage %d, is the process privileged?\n", i);
+      exit(EXIT_FAILURE);
+    }
+    rn_dev->hugepage_paddr[i] = (entry & 0x7FFFFFFFFFFFFF) << PAGE_SHIFT;
+    if((i > 0) && (rn_dev->hugepage_paddr[i] != rn_dev->hugepage_paddr[i-1] + (1UL << HUGE_PAGE_SHIFT))) {
+      num_runs++;
+    }
+  }
+  close(pagemap_fd);
 
-  if(rn_dev == NULL) {
-    fprintf(stderr, "Error: rn_dev is NULL\n");
+  // The AXI bridge BDF windows translate from the physical address of the first hugepage,
+  // so the device only reaches the whole buffer if it is one physically contiguous run
+  if(num_runs > 1) {
+    fprintf(stderr, "Error: %d hugepages are in %d physically contiguous runs, the BDF windows need one. "
+            "Reserve the hugepages at boot or request fewer of them\n", rn_dev->num_hugepages, num_runs);
     exit(EXIT_FAILURE);
   }
+}
+
+uint64_t get_host_buffer_paddr(struct rn_dev_t* rn_dev, void* vaddr) {
+  uint64_t offset = (uint64_t) vaddr - (uint64_t) rn_dev->base_buf->buffer;
+
+  if(((uint64_t) vaddr < (uint64_t) rn_dev->base_buf->buffer) || 
+     (offset >= (((uint64_t) rn_dev->num_hugepages) << HUGE_PAGE_SHIFT))) {
+    return 0;
+  }
+
+  return rn_dev->hugepage_paddr[offset >> HUGE_PAGE_SHIFT] + (offset & ((1UL << HUGE_PAGE_SHIFT) - 1));
+}
+
+int is_host_buffer_contiguous(struct rn_dev_t* rn_dev, void* vaddr, uint64_t size) {
+  uint64_t offset = (uint64_t) vaddr - (uint64_t) rn_dev->base_buf->buffer;
+  uint64_t first_page;
+  uint64_t last_page;
+  uint64_t i;
+
+  if((size == 0) || ((uint64_t) vaddr < (uint64_t) rn_dev->base_buf->buffer) || 
+     ((offset + size) > (((uint64_t) rn_dev->num_hugepages) << HUGE_PAGE_SHIFT))) {
+    return 0;
+  }
+
+  first_page = offset >> HUGE_PAGE_SHIFT;
+  last_page  = (offset + size - 1) >> HUGE_PAGE_SHIFT;
+  for(i=first_page+1; i<=last_page; i++) {
+    if(rn_dev->hugepage_paddr[i] != rn_dev->hugepage_paddr[i-1] + (1UL << HUGE_PAGE_SHIFT)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void* get_host_vaddr(struct rn_dev_t* rn_dev, uint64_t paddr) {
+  uint32_t i;
+  uint64_t page_paddr;
+
+  if((rn_dev == NULL) || (rn_dev->base_buf == NULL) || (rn_dev->hugepage_paddr == NULL) || 
+     is_device_address(paddr)) {
+    return NULL;
+  }
+
+  page_paddr = paddr & ~((1UL << HUGE_PAGE_SHIFT) - 1);
+  for(i=0; i<rn_dev->num_hugepages; i++) {
+    if(rn_dev->hugepage_paddr[i] == page_paddr) {
+      return (void* ) ((uint64_t) rn_dev->base_buf->buffer + (((uint64_t) i) << HUGE_PAGE_SHIFT) + 
+                       (paddr - page_paddr));
+    }
+  }
+
+  return NULL;
+}
+
+int rn_map_device_memory(struct rn_dev_t* rn_dev, int fd, uint64_t dev_addr, uint64_t size) {
+  void* win;
+
+  dev_addr &= DEVICE_MEMORY_ADDRESS_MASK;
+  if((size == 0) || (dev_addr & (getpagesize() - 1))) {
+    fprintf(stderr, "Error: device memory window 0x%lx,%ld is not page aligned\n", dev_addr, size);
+    return -1;
+  }
+
+  rn_unmap_device_memory(rn_dev);
+  win = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) dev_addr);
+  if(win == MAP_FAILED) {
+    fprintf(stderr, "Warning: failed to mmap device memory 0x%lx,%ld, using DMA\n", dev_addr, size);
+    return -1;
+  }
+
+  rn_dev->dev_mem_win = win;
+  rn_dev->dev_mem_win_addr = dev_addr;
+  rn_dev->dev_mem_win_size = size;
+  return 0;
+}
+
+void rn_unmap_device_memory(struct rn_dev_t* rn_dev) {
+  if(rn_dev->dev_mem_win != NULL) {
+    munmap(rn_dev->dev_mem_win, rn_dev->dev_mem_win_size);
+    rn_dev->dev_mem_win = NULL;
+    rn_dev->dev_mem_win_size = 0;
+  }
+}
+
+void* get_dev_mem_vaddr(struct rn_dev_t* rn_dev, uint64_t dev_addr, uint64_t size) {
+  if((rn_dev == NULL) || (rn_dev->dev_mem_win == NULL)) {
+    return NULL;
+  }
+
+  dev_addr &= DEVICE_MEMORY_ADDRESS_MASK;
+  if((dev_addr < rn_dev->dev_mem_win_addr) || 
+     ((dev_addr - rn_dev->dev_mem_win_addr + size) > rn_dev->dev_mem_win_size)) {
+    return NULL;
+  }
+
+  return (void* ) ((uint64_t) rn_dev->dev_mem_win + (dev_addr - rn_dev->dev_mem_win_addr));
+}
+
+// Set the window masks of rn_dev and get the values programmed into the BDF table for a
+// host buffer at high_addr:low_addr
+static void get_rn_dev_bdf_config(struct rn_dev_t* rn_dev, uint32_t high_addr, uint32_t low_addr, 
+                                  uint32_t* bdf_addr_high, uint32_t* bdf_addr_low, 
+                                  uint32_t* bdf_win_config) {
+  uint64_t win_size = 0;
+  uint32_t bdf_addr_mask_high = 0;
+  uint32_t bdf_addr_mask_low  = 0;
+  uint32_t bdf_win_size_in_4Kpage;
 
   win_size = get_win_size();
   rn_dev->winSize->win_size_msb = (uint32_t) ((win_size & 0xffffffff00000000) >> 32);
@@ -186,97 +331,191 @@ void config_rn_dev_axib_bdf(struct rn_dev_t* rn_dev, uint32_t high_addr, uint32_
   bdf_addr_mask_high = ADDR_MASK - rn_dev->winSize->win_size_msb;
   bdf_addr_mask_low  = ADDR_MASK - rn_dev->winSize->win_size_lsb;
 
-  bdf_addr_high = high_addr & bdf_addr_mask_high;
-  bdf_addr_low  = low_addr & bdf_addr_mask_low;
+  *bdf_addr_high = high_addr & bdf_addr_mask_high;
+  *bdf_addr_low  = low_addr & bdf_addr_mask_low;
 
   // 128GB mapping per window
   bdf_win_size_in_4Kpage = (uint32_t) ( (((AXI_BAR_SIZE>>3) + 1)>>12) & 0x00000000ffffffff);
-  bdf_win_config = 0xC0000000 | bdf_win_size_in_4Kpage;
+  *bdf_win_config = 0xC0000000 | bdf_win_size_in_4Kpage;
+}
+
+void config_rn_dev_axib_bdf(struct rn_dev_t* rn_dev, uint32_t high_addr, uint32_t low_addr) {
+  int i;
+  uint32_t bdf_addr_high = 0;
+  uint32_t bdf_addr_low  = 0;
+  uint32_t bdf_win_config;
+  struct rn_reg_batch_t batch;
+
+  if(rn_dev == NULL) {
+    fprintf(stderr, "Error: rn_dev is NULL\n");
+    exit(EXIT_FAILURE);
+  }
+
+  get_rn_dev_bdf_config(rn_dev, high_addr, low_addr, &bdf_addr_high, &bdf_addr_low, &bdf_win_config);
 
   fprintf(stderr, "Info: Configuring 8 windows in QDMA AXI bridge BDF, each has 128GB mapping\n");
+  rn_reg_batch_begin(&batch, rn_dev->axil_ctl);
   for(i=0; i<8; i++) {
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_ADDR_TRANSLATE_ADDR_LSB+(i*0x20), bdf_addr_low);
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_ADDR_TRANSLATE_ADDR_MSB+(i*0x20), bdf_addr_high + (i*0x20));
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_PASID_RESERVED_ADDR+(i*0x20), 0);
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_FUNCTION_NUM_ADDR  +(i*0x20), 0);
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_MAP_CONTROL_ADDR   +(i*0x20), bdf_win_config);
-    write32_data(rn_dev->axil_ctl, AXIB_BDF_RESERVED_ADDR      +(i*0x20), 0);
+    rn_reg_batch_write(&batch, AXIB_BDF_ADDR_TRANSLATE_ADDR_LSB+(i*0x20), bdf_addr_low);
+    rn_reg_batch_write(&batch, AXIB_BDF_ADDR_TRANSLATE_ADDR_MSB+(i*0x20), bdf_addr_high + (i*0x20));
+    rn_reg_batch_write(&batch, AXIB_BDF_PASID_RESERVED_ADDR+(i*0x20), 0);
+    rn_reg_batch_write(&batch, AXIB_BDF_FUNCTION_NUM_ADDR  +(i*0x20), 0);
+    rn_reg_batch_write(&batch, AXIB_BDF_MAP_CONTROL_ADDR   +(i*0x20), bdf_win_config);
+    rn_reg_batch_write(&batch, AXIB_BDF_RESERVED_ADDR      +(i*0x20), 0);
     Debug("[BDF] AXIB_BDF_ADDR_TRANSLATE_ADDR_LSB=0x%x, bdf_addr_low=0x%x\n", AXIB_BDF_ADDR_TRANSLATE_ADDR_LSB+(i*0x20), bdf_addr_low);
     Debug("[BDF] AXIB_BDF_ADDR_TRANSLATE_ADDR_MSB=0x%x, bdf_addr_high=0x%x\n", AXIB_BDF_ADDR_TRANSLATE_ADDR_MSB+(i*0x20), bdf_addr_high+(i*0x20));
     Debug("[BDF] AXIB_BDF_MAP_CONTROL_ADDR=0x%x, bdf_win_config=0x%x\n", AXIB_BDF_MAP_CONTROL_ADDR+(i*0x20), bdf_win_config);
   }
+  rn_reg_batch_commit(&batch);
 }
 
-struct rdma_buff_t* allocate_rdma_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size, char* buf_location) {
+// Pick the DDR channel for a device buffer according to the placement hint
+static int select_dev_channel(struct rn_dev_t* rn_dev, int placement) {
+  int i;
+  int channel = 0;
+
+  if(placement == RN_DEV_PLACE_SPREAD) {
+    return (int) (__atomic_fetch_add(&(rn_dev->next_dev_channel), 1, __ATOMIC_RELAXED) % rn_dev->num_dev_channels);
+  }
+
+  if(placement == RN_DEV_PLACE_AUTO) {
+    // free_bytes is read without the pool lock, an approximate value is good enough here
+    for(i=1; i<(int) rn_dev->num_dev_channels; i++) {
+      if(rn_dev->dev_pool[i]->free_bytes > rn_dev->dev_pool[channel]->free_bytes) {
+        channel = i;
+      }
+    }
+    return channel;
+  }
+
+  if((placement < 0) || (placement >= (int) rn_dev->num_dev_channels)) {
+    fprintf(stderr, "Error: invalid DDR channel %d, the design has %d channels\n", placement, rn_dev->num_dev_channels);
+    return -1;
+  }
+  return placement;
+}
+
+// Allocate a buffer from a pool. channel is the DDR channel of a device pool, -1 for the host pool.
+static struct rdma_buff_t* allocate_from_pool(struct rn_dev_t* rn_dev, struct rn_pool_t* pool, 
+                                              int channel, uint64_t buf_size) {
   struct rdma_buff_t* rdma_buffer;
+  uint64_t dev_addr;
   rdma_buffer = (struct rdma_buff_t*) malloc(sizeof(struct rdma_buff_t));
   if(rdma_buffer == NULL) {
     fprintf(stderr, "Error: failed to create rdma_buffer\n");
     exit(EXIT_FAILURE);
   }
 
-  if(!strcmp(buf_location, HOST_MEM)) {
-    // Allocate the buffer in the host memory
-    // Check the buffer_offset and buf_size whether it meets 4KB alignment or not
-    if (buf_size <= HARDWARE_PAGE_SIZE) {
-      if (((rn_dev->buffer_offset & HARDWARE_PAGE_SIZE_ADDRESS_MASK) + buf_size) > HARDWARE_PAGE_SIZE) {
-        rn_dev->buffer_offset =  (rn_dev->buffer_offset + HARDWARE_PAGE_SIZE) & HARDWARE_PAGE_SIZE_ALIGNMENT_MASK;
-      }
+  if(rn_pool_alloc(pool, buf_size, &(rdma_buffer->pool_offset), &(rdma_buffer->slab)) < 0) {
+    if(channel < 0) {
+      fprintf(stderr, "Error: out of host memory, failed to allocate %ld bytes (%ld bytes free)\n", buf_size, pool->free_bytes);
     } else {
-      // buf_size > HARDWARE_PAGE_SIZE
-      if((rn_dev->buffer_offset & HARDWARE_PAGE_SIZE_ADDRESS_MASK) != 0) {
-        // buffer_offset is not aligned with HARDWARE_PAGE_SIZE
-        rn_dev->buffer_offset =  (rn_dev->buffer_offset + HARDWARE_PAGE_SIZE) & HARDWARE_PAGE_SIZE_ALIGNMENT_MASK;
-      }
+      fprintf(stderr, "Error: out of device memory on channel %d, failed to allocate %ld bytes (%ld bytes free)\n", channel, buf_size, pool->free_bytes);
     }
-    rdma_buffer->buffer = (void*)((uint64_t) rn_dev->base_buf->buffer + rn_dev->buffer_offset);
-    rn_dev->buffer_offset += buf_size;
-    rdma_buffer->buf_size = buf_size;
+    free(rdma_buffer);
+    return NULL;
+  }
+  rdma_buffer->pool = pool;
+  rdma_buffer->alloc_size = buf_size;
+  rdma_buffer->buf_size = buf_size;
+
+  if(channel < 0) {
+    // Allocate the buffer in the host memory
+    rdma_buffer->buffer = (void*)((uint64_t) rn_dev->base_buf->buffer + rdma_buffer->pool_offset);
 
-    // Get the physical address of the buffer
-    rdma_buffer->dma_addr = get_buffer_paddr(rdma_buffer->buffer);
-    Debug("Info: allocated host buffer vir addr = %p, physical addr = %lx, rn_dev->buffer_offset = 0x%lx\n", rdma_buffer->buffer, rdma_buffer->dma_addr, rn_dev->buffer_offset);
+    // Get the physical address of the buffer from the hugepage table
+    rdma_buffer->dma_addr = get_host_buffer_paddr(rn_dev, rdma_buffer->buffer);
+    Debug("Info: allocated host buffer vir addr = %p, physical addr = %lx, pool offset = 0x%lx\n", rdma_buffer->buffer, rdma_buffer->dma_addr, rdma_buffer->pool_offset);
     Debug("Info: allocate_rdma_buffer - successfully allocated rdma host buffer\n");
   } else {
-    if (!strcmp(buf_location, DEVICE_MEM)) {
-      // Allocate the buffer in the device memory
-      // TODO: We need to implement user-space device memory management function
-      // Check the dev_buffer_offset and buf_size whether it meets 4KB alignment or not
-      if (buf_size <= HARDWARE_PAGE_SIZE) {
-        if (((rn_dev->dev_buffer_offset & HARDWARE_PAGE_SIZE_ADDRESS_MASK) + buf_size) > HARDWARE_PAGE_SIZE) {
-          rn_dev->dev_buffer_offset =  (rn_dev->dev_buffer_offset + HARDWARE_PAGE_SIZE) & HARDWARE_PAGE_SIZE_ALIGNMENT_MASK;
-        }
-      } else {
-        // buf_size > HARDWARE_PAGE_SIZE
-        if((rn_dev->dev_buffer_offset & HARDWARE_PAGE_SIZE_ADDRESS_MASK) != 0) {
-          // dev_buffer_offset is not aligned with HARDWARE_PAGE_SIZE
-          rn_dev->dev_buffer_offset =  (rn_dev->dev_buffer_offset + HARDWARE_PAGE_SIZE) & HARDWARE_PAGE_SIZE_ALIGNMENT_MASK;
-        }
-      }
-      rdma_buffer->buffer = (void*)(rn_dev->dev_buffer_offset | DEVICE_MEM_OFFSET);
-      rdma_buffer->dma_addr = (uint64_t) (rn_dev->dev_buffer_offset | DEVICE_MEM_OFFSET);
-      rn_dev->dev_buffer_offset += buf_size;
-      rdma_buffer->buf_size = buf_size;
-
-      // TODO: We need to put assert here later to make sure we won't exceed device memory.
-      Debug("Info: allocated device buffer physical addr = %lx, rn_dev->dev_buffer_offset = 0x%lx\n", rdma_buffer->dma_addr, rn_dev->dev_buffer_offset);
-      assert(rn_dev->dev_buffer_offset <= (uint64_t) DEVICE_MEM_SIZE);
+    // Allocate the buffer in the device memory
+    dev_addr = ((uint64_t) channel) * ((uint64_t) DEVICE_MEM_SIZE) + rdma_buffer->pool_offset;
+    rdma_buffer->buffer = (void*)(dev_addr | DEVICE_MEM_OFFSET);
+    rdma_buffer->dma_addr = (uint64_t) (dev_addr | DEVICE_MEM_OFFSET);
+    Debug("Info: allocated device buffer physical addr = %lx, channel = %d, pool offset = 0x%lx\n", rdma_buffer->dma_addr, channel, rdma_buffer->pool_offset);
     Debug("Info: allocate_rdma_buffer - successfully allocated rdma device buffer\n");
-    } else {
-      fprintf(stderr, "Error: please provide correct buffer location: [host_mem | dev_mem]\n");
-      exit(EXIT_FAILURE);
+  }
+
+  return rdma_buffer;
+}
+
+// Allocate a host buffer. A buffer spanning several hugepages must be physically contiguous,
+// as the hardware only gets its start address. Non-contiguous placements are held until a 
+// contiguous one is found, then given back.
+static struct rdma_buff_t* allocate_host_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size) {
+  struct rdma_buff_t* held[HOST_BUF_CONTIG_RETRIES];
+  struct rdma_buff_t* rdma_buffer;
+  int num_held = 0;
+  int i;
+
+  rdma_buffer = allocate_from_pool(rn_dev, rn_dev->host_pool, -1, buf_size);
+  while((rdma_buffer != NULL) && !is_host_buffer_contiguous(rn_dev, rdma_buffer->buffer, buf_size)) {
+    if(num_held == HOST_BUF_CONTIG_RETRIES) {
+      fprintf(stderr, "Error: no physically contiguous %ld bytes in the hugepage buffer\n", buf_size);
+      free_rdma_buffer(rdma_buffer);
+      rdma_buffer = NULL;
+      break;
     }
+    held[num_held++] = rdma_buffer;
+    rdma_buffer = allocate_from_pool(rn_dev, rn_dev->host_pool, -1, buf_size);
+  }
+
+  for(i=0; i<num_held; i++) {
+    free_rdma_buffer(held[i]);
   }
 
   return rdma_buffer;
 }
 
-struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, uint32_t num_qp) {
+struct rdma_buff_t* allocate_rdma_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size, char* buf_location) {
+  if(!strcmp(buf_location, HOST_MEM)) {
+    return allocate_host_buffer(rn_dev, buf_size);
+  }
+
+  if(!strcmp(buf_location, DEVICE_MEM)) {
+    return allocate_rdma_dev_buffer(rn_dev, buf_size, RN_DEV_PLACE_AUTO);
+  }
+
+  fprintf(stderr, "Error: please provide correct buffer location: [host_mem | dev_mem]\n");
+  exit(EXIT_FAILURE);
+}
+
+struct rdma_buff_t* allocate_rdma_dev_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size, int placement) {
+  int channel;
+
+  channel = select_dev_channel(rn_dev, placement);
+  if(channel < 0) {
+    return NULL;
+  }
+
+  return allocate_from_pool(rn_dev, rn_dev->dev_pool[channel], channel, buf_size);
+}
+
+int get_rdma_buffer_channel(struct rdma_buff_t* rdma_buffer) {
+  if(!is_device_address(rdma_buffer->dma_addr)) {
+    return -1;
+  }
+
+  return (int) ((rdma_buffer->dma_addr & ~DEVICE_MEM_MASK) / ((uint64_t) DEVICE_MEM_SIZE));
+}
+
+void free_rdma_buffer(struct rdma_buff_t* rdma_buffer) {
+  if(rdma_buffer == NULL) {
+    return;
+  }
+
+  if(rdma_buffer->pool != NULL) {
+    rn_pool_free(rdma_buffer->pool, rdma_buffer->pool_offset, rdma_buffer->alloc_size, rdma_buffer->slab);
+  }
+  free(rdma_buffer);
+}
+
+// Allocate a device and map its registers, the part of the setup shared by create_rn_dev()
+// and attach_rn_dev()
+static struct rn_dev_t* open_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, uint32_t num_qp) {
   int scr;
   // int rdma = -1;
   void* axil_scr_base;
-  uint32_t phy_addr_msb;
-  uint32_t phy_addr_lsb;
 
   struct rn_dev_t* rn_dev = NULL;
   struct win_size_t* winSize = NULL;
@@ -292,6 +531,16 @@ struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint3
   rn_dev->axil_map_size = RN_SCR_MAP_SIZE;
   rn_dev->rdma_dev = NULL;
   rn_dev->base_buf = NULL;
+  rn_dev->hugepage_paddr = NULL;
+  rn_dev->dev_mem_win = NULL;
+  rn_dev->dev_mem_win_addr = 0;
+  rn_dev->dev_mem_win_size = 0;
+  rn_dev->host_pool = NULL;
+  rn_dev->num_dev_channels = 0;
+  rn_dev->dev_pool = NULL;
+  rn_dev->persist = NULL;
+  rn_dev->persist_fd = -1;
+  rn_dev->hugetlb_fd = -1;
   //rn_dev->rdma_dev->num_qp   = num_qp;
   rn_dev->winSize = winSize;
   rn_dev->winSize->win_size_lsb = 0;
@@ -315,7 +564,9 @@ struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint3
   }
 
   rn_dev->axil_ctl = (uint32_t* ) axil_scr_base;
+
   rn_dev->num_qp = num_qp;
+  rn_dev->num_hugepages = num_hugepages_request;
 
   // Allocate 128MB memory space from HugePages
   rn_dev->base_buf = (struct rdma_buff_t*) malloc(sizeof(struct rdma_buff_t));
@@ -324,6 +575,77 @@ struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint3
     exit(EXIT_FAILURE);
   }
 
+  return rn_dev;
+}
+
+// Create the buffer pools of a device once its hugepage buffer is set up
+static void init_rn_dev_pools(struct rn_dev_t* rn_dev) {
+  int i;
+
+  rn_dev->base_buf->dma_addr = rn_dev->hugepage_paddr[0];
+  rn_dev->base_buf->buf_size = rn_dev->num_hugepages * (1 << HUGE_PAGE_SHIFT);
+  rn_dev->base_buf->pool = NULL;
+  rn_dev->base_buf->slab = NULL;
+  fprintf(stderr, "Info: pre-allocated hugepage buffer vir addr = %p, physical addr = 0x%lx\n", rn_dev->base_buf->buffer, rn_dev->base_buf->dma_addr);
+
+  rn_dev->host_pool = (struct rn_pool_t* ) malloc(sizeof(struct rn_pool_t));
+  if((rn_dev->host_pool == NULL) || 
+     (rn_pool_init(rn_dev->host_pool, ((uint64_t) rn_dev->num_hugepages) << HUGE_PAGE_SHIFT) < 0)) {
+    fprintf(stderr, "Error: failed to create the host buffer pool\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // One pool per DDR channel
+  rn_dev->num_dev_channels = DEVICE_MEM_NUM_CHANNELS;
+  rn_dev->dev_pool = (struct rn_pool_t** ) calloc(rn_dev->num_dev_channels, sizeof(struct rn_pool_t* ));
+  if(rn_dev->dev_pool == NULL) {
+    fprintf(stderr, "Error: failed to allocate the device buffer pools\n");
+    exit(EXIT_FAILURE);
+  }
+  for(i=0; i<(int) rn_dev->num_dev_channels; i++) {
+    rn_dev->dev_pool[i] = (struct rn_pool_t* ) malloc(sizeof(struct rn_pool_t));
+    if((rn_dev->dev_pool[i] == NULL) || (rn_pool_init(rn_dev->dev_pool[i], (uint64_t) DEVICE_MEM_SIZE) < 0)) {
+      fprintf(stderr, "Error: failed to create the buffer pool of DDR channel %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  rn_dev->next_dev_channel = 0;
+}
+
+void destroy_rn_dev_pools(struct rn_dev_t* rn_dev) {
+  int i;
+
+  if(rn_dev == NULL) {
+    return;
+  }
+
+  if(rn_dev->host_pool != NULL) {
+    rn_pool_destroy(rn_dev->host_pool);
+    free(rn_dev->host_pool);
+    rn_dev->host_pool = NULL;
+  }
+  if(rn_dev->dev_pool != NULL) {
+    for(i=0; i<(int) rn_dev->num_dev_channels; i++) {
+      if(rn_dev->dev_pool[i] != NULL) {
+        rn_pool_destroy(rn_dev->dev_pool[i]);
+        free(rn_dev->dev_pool[i]);
+      }
+    }
+    free(rn_dev->dev_pool);
+    rn_dev->dev_pool = NULL;
+    rn_dev->num_dev_channels = 0;
+  }
+  free(rn_dev->hugepage_paddr);
+  rn_dev->hugepage_paddr = NULL;
+}
+
+struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, uint32_t num_qp) {
+  uint32_t phy_addr_msb;
+  uint32_t phy_addr_lsb;
+  struct rn_dev_t* rn_dev;
+
+  rn_dev = open_rn_dev(pcie_resource, pcie_resource_fd, num_hugepages_request, num_qp);
+
   fprintf(stderr, "create_rn_dev - testing2\n");
   rn_dev->base_buf->buffer = mmap(NULL, num_hugepages_request * (1 << HUGE_PAGE_SHIFT),
                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS |
@@ -335,8 +657,8 @@ struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint3
     exit(EXIT_FAILURE);
   }
 
-  rn_dev->base_buf->dma_addr = get_buffer_paddr(rn_dev->base_buf->buffer);
-  fprintf(stderr, "Info: pre-allocated hugepage buffer vir addr = %p, physical addr = 0x%lx\n", rn_dev->base_buf->buffer, rn_dev->base_buf->dma_addr);
+  build_hugepage_table(rn_dev);
+  init_rn_dev_pools(rn_dev);
 
   phy_addr_msb = (uint32_t) ((rn_dev->base_buf->dma_addr & 0xffffffff00000000) >> 32);
   phy_addr_lsb = (uint32_t) ((rn_dev->base_buf->dma_addr & 0x00000000ffffffff));
@@ -344,8 +666,243 @@ struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint3
   // Configure QDMA slave AXI bridge
   config_rn_dev_axib_bdf(rn_dev, phy_addr_msb, phy_addr_lsb);
 
-  rn_dev->buffer_offset = (uint64_t) 0;
-  rn_dev->dev_buffer_offset = (uint64_t) 0;
+  return rn_dev;
+}
+
+// Open the descriptor of a persistent context and lock it for the lifetime of the device
+static struct rn_persist_desc_t* open_rn_dev_persist(struct rn_dev_t* rn_dev, const char* name) {
+  char path[RN_PERSIST_PATH_LEN];
+  struct stat st;
+  void* desc;
+
+  snprintf(path, sizeof(path), "%s/reconic-%s", RN_PERSIST_SHM_DIR, name);
+  rn_dev->persist_fd = open(path, O_RDWR | O_CREAT, 0600);
+  if(rn_dev->persist_fd < 0) {
+    fprintf(stderr, "Error: failed to open the persistent context descriptor %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // The hugepage buffer and the pools are owned by one process at a time
+  if(flock(rn_dev->persist_fd, LOCK_EX | LOCK_NB) < 0) {
+    fprintf(stderr, "Info: waiting for persistent context %s, held by another process\n", name);
+    if(flock(rn_dev->persist_fd, LOCK_EX) < 0) {
+      fprintf(stderr, "Error: failed to lock the persistent context descriptor %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if((fstat(rn_dev->persist_fd, &st) < 0) || 
+     ((st.st_size < sizeof(struct rn_persist_desc_t)) && 
+      (ftruncate(rn_dev->persist_fd, sizeof(struct rn_persist_desc_t)) < 0))) {
+    fprintf(stderr, "Error: failed to size the persistent context descriptor %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  desc = mmap(NULL, sizeof(struct rn_persist_desc_t), PROT_READ | PROT_WRITE, MAP_SHARED, 
+              rn_dev->persist_fd, 0);
+  if(desc == MAP_FAILED) {
+    fprintf(stderr, "Error: failed to map the persistent context descriptor %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  return (struct rn_persist_desc_t* ) desc;
+}
+
+// Check that every hugepage of a reused buffer is still at its recorded physical address,
+// with one pagemap read per hugepage
+static int check_hugepage_table(struct rn_dev_t* rn_dev) {
+  int pagemap_fd;
+  uint32_t i;
+  uint64_t entry;
+  void* page_addr;
+  int match = 1;
+
+  pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap_fd < 0) {
+    fprintf(stderr, "Error: failed to open /proc/self/pagemap\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i=0; (i<rn_dev->num_hugepages) && match; i++) {
+    page_addr = (void* ) ((uint64_t) rn_dev->base_buf->buffer + (((uint64_t) i) << HUGE_PAGE_SHIFT));
+    match = (read_pagemap_entry(pagemap_fd, page_addr, &entry) == 0) && ((entry >> 63) != 0) &&
+            (((entry & 0x7FFFFFFFFFFFFF) << PAGE_SHIFT) == rn_dev->hugepage_paddr[i]);
+  }
+  close(pagemap_fd);
+
+  return match;
+}
+
+// Record the identity of the hugepage file, a file recreated by another process since
+// holds other hugepages
+static void record_hugepage_file(struct rn_persist_desc_t* desc, int fd) {
+  struct stat st;
+
+  if(fstat(fd, &st) < 0) {
+    memset(&st, 0, sizeof(st));
+  }
+  desc->file_dev        = (uint64_t) st.st_dev;
+  desc->file_ino        = (uint64_t) st.st_ino;
+  desc->file_ctime_sec  = (int64_t) st.st_ctim.tv_sec;
+  desc->file_ctime_nsec = (int64_t) st.st_ctim.tv_nsec;
+}
+
+struct rn_dev_t* attach_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, 
+                               uint32_t num_qp, const char* name) {
+  char path[RN_PERSIST_PATH_LEN];
+  uint64_t size = ((uint64_t) num_hugepages_request) << HUGE_PAGE_SHIFT;
+  uint32_t phy_addr_msb;
+  uint32_t phy_addr_lsb;
+  uint32_t bdf_addr_high;
+  uint32_t bdf_addr_low;
+  uint32_t bdf_win_config;
+  struct rn_persist_desc_t* desc;
+  struct rn_dev_t* rn_dev;
+  struct stat st;
+  int reuse;
+
+  if((num_hugepages_request == 0) || (num_hugepages_request > RN_PERSIST_MAX_HUGEPAGES)) {
+    fprintf(stderr, "Error: a persistent context holds 1 to %d hugepages, %d requested\n", 
+            RN_PERSIST_MAX_HUGEPAGES, num_hugepages_request);
+    exit(EXIT_FAILURE);
+  }
+
+  rn_dev = open_rn_dev(pcie_resource, pcie_resource_fd, num_hugepages_request, num_qp);
+  desc = open_rn_dev_persist(rn_dev, name);
+  rn_dev->persist = desc;
+
+  reuse = (desc->magic == RN_PERSIST_MAGIC) && (desc->version == RN_PERSIST_VERSION) && 
+          (desc->num_hugepages == num_hugepages_request);
+  if(!reuse) {
+    fprintf(stderr, "Info: creating persistent context %s with %d hugepages\n", name, num_hugepages_request);
+    memset(desc, 0, sizeof(struct rn_persist_desc_t));
+  }
+
+  // Truncating the file first gives the hugepages of a stale context back to the kernel
+  snprintf(path, sizeof(path), "%s/reconic-%s", RN_PERSIST_HUGETLBFS_DIR, name);
+  rn_dev->hugetlb_fd = open(path, O_RDWR | O_CREAT, 0600);
+  // Sizing the file updates its ctime, so a changed ctime means another writer
+  if(reuse && ((fstat(rn_dev->hugetlb_fd, &st) < 0) || ((uint64_t) st.st_dev != desc->file_dev) || 
+               ((uint64_t) st.st_ino != desc->file_ino) || 
+               ((int64_t) st.st_ctim.tv_sec != desc->file_ctime_sec) || 
+               ((int64_t) st.st_ctim.tv_nsec != desc->file_ctime_nsec))) {
+    fprintf(stderr, "Warning: hugepage file of persistent context %s changed, rebuilding\n", name);
+    memset(desc, 0, sizeof(struct rn_persist_desc_t));
+    reuse = 0;
+  }
+  if((rn_dev->hugetlb_fd < 0) || (!reuse && (ftruncate(rn_dev->hugetlb_fd, 0) < 0)) ||
+     (ftruncate(rn_dev->hugetlb_fd, (off_t) size) < 0)) {
+    fprintf(stderr, "Error: failed to create %s, is hugetlbfs mounted at %s?\n", path, RN_PERSIST_HUGETLBFS_DIR);
+    exit(EXIT_FAILURE);
+  }
+  record_hugepage_file(desc, rn_dev->hugetlb_fd);
+
+  rn_dev->base_buf->buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rn_dev->hugetlb_fd, 0);
+  if(rn_dev->base_buf->buffer == MAP_FAILED) {
+    fprintf(stderr, "Error: failed to map the hugepage file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // Lock the buffer in physical memory, pages of a reused file are already allocated
+  if(mlock(rn_dev->base_buf->buffer, size) == -1) {
+    fprintf(stderr, "Error: failed to lock page in memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(reuse) {
+    rn_dev->hugepage_paddr = (uint64_t* ) malloc(((uint64_t) num_hugepages_request) * sizeof(uint64_t));
+    if(rn_dev->hugepage_paddr == NULL) {
+      fprintf(stderr, "Error: failed to allocate the hugepage translation table\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(rn_dev->hugepage_paddr, desc->hugepage_paddr, ((uint64_t) num_hugepages_request) * sizeof(uint64_t));
+    if(!check_hugepage_table(rn_dev)) {
+      fprintf(stderr, "Warning: hugepages of persistent context %s moved, rebuilding\n", name);
+      free(rn_dev->hugepage_paddr);
+      reuse = 0;
+    }
+  }
+  if(!reuse) {
+    build_hugepage_table(rn_dev);
+    memcpy(desc->hugepage_paddr, rn_dev->hugepage_paddr, ((uint64_t) num_hugepages_request) * sizeof(uint64_t));
+    desc->bdf_valid = 0;
+    desc->glb_csr_valid = 0;
+  }
+  init_rn_dev_pools(rn_dev);
+
+  phy_addr_msb = (uint32_t) ((rn_dev->base_buf->dma_addr & 0xffffffff00000000) >> 32);
+  phy_addr_lsb = (uint32_t) ((rn_dev->base_buf->dma_addr & 0x00000000ffffffff));
+  get_rn_dev_bdf_config(rn_dev, phy_addr_msb, phy_addr_lsb, &bdf_addr_high, &bdf_addr_low, &bdf_win_config);
+
+  // The BDF table is only left as programmed if the hardware was not reset or reconfigured 
+  // by another process since, in which case the global CSRs are kept too
+  if(desc->bdf_valid && (desc->bdf_addr_high == bdf_addr_high) && (desc->bdf_addr_low == bdf_addr_low) && 
+     (desc->bdf_win_config == bdf_win_config) &&
+     (read32_data(rn_dev->axil_ctl, AXIB_BDF_ADDR_TRANSLATE_ADDR_LSB) == bdf_addr_low) &&
+     (read32_data(rn_dev->axil_ctl, AXIB_BDF_ADDR_TRANSLATE_ADDR_MSB) == bdf_addr_high)) {
+    fprintf(stderr, "Info: QDMA AXI bridge BDF windows of persistent context %s are unchanged\n", name);
+  } else {
+    config_rn_dev_axib_bdf(rn_dev, phy_addr_msb, phy_addr_lsb);
+    desc->bdf_addr_high = bdf_addr_high;
+    desc->bdf_addr_low  = bdf_addr_low;
+    desc->bdf_win_config = bdf_win_config;
+    desc->bdf_valid     = 1;
+    desc->glb_csr_valid = 0;
+  }
+
+  desc->num_hugepages = num_hugepages_request;
+  desc->version = RN_PERSIST_VERSION;
+  desc->magic   = RN_PERSIST_MAGIC;
 
   return rn_dev;
 }
+
+void detach_rn_dev(struct rn_dev_t* rn_dev) {
+  if((rn_dev == NULL) || (rn_dev->persist == NULL)) {
+    return;
+  }
+
+  // The hugepages stay allocated in the file for the next process
+  munmap(rn_dev->base_buf->buffer, ((uint64_t) rn_dev->num_hugepages) << HUGE_PAGE_SHIFT);
+  close(rn_dev->hugetlb_fd);
+  munmap(rn_dev->persist, sizeof(struct rn_persist_desc_t));
+  flock(rn_dev->persist_fd, LOCK_UN);
+  close(rn_dev->persist_fd);
+  rn_dev->persist = NULL;
+  rn_dev->persist_fd = -1;
+  rn_dev->hugetlb_fd = -1;
+}
+
+int remove_rn_dev_persist(const char* name) {
+  char path[RN_PERSIST_PATH_LEN];
+  int fd;
+  int rc = 0;
+
+  snprintf(path, sizeof(path), "%s/reconic-%s", RN_PERSIST_SHM_DIR, name);
+  fd = open(path, O_RDWR);
+  if(fd < 0) {
+    fprintf(stderr, "Error: persistent context %s does not exist\n", name);
+    return -1;
+  }
+  if(flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    fprintf(stderr, "Error: persistent context %s is in use\n", name);
+    close(fd);
+    return -1;
+  }
+
+  // Unlink the hugepage file first, a descriptor without it is recreated on the next attach
+  snprintf(path, sizeof(path), "%s/reconic-%s", RN_PERSIST_HUGETLBFS_DIR, name);
+  if((unlink(path) < 0) && (errno != ENOENT)) {
+    fprintf(stderr, "Error: failed to remove %s\n", path);
+    rc = -1;
+  }
+  snprintf(path, sizeof(path), "%s/reconic-%s", RN_PERSIST_SHM_DIR, name);
+  if((rc == 0) && (unlink(path) < 0)) {
+    fprintf(stderr, "Error: failed to remove %s\n", path);
+    rc = -1;
+  }
+
+  close(fd);
+  return rc;
+}
+
@@ -16,6 +16,7 @@
 #include "reconic_reg.h"
 #include "memory_api.h"
 #include "control_api.h"
+#include "buffer_pool.h"
 
 /*! \var device
     \brief A global string used to represent a character device for device memory access
@@ -39,13 +40,35 @@ extern int fpga_fd;
 #define DEVICE_MEM "dev_mem"
 
 /*! \def DEVICE_MEM_SIZE
-    \brief A macro string to indicate device memory size in bytes.
+    \brief A macro string to indicate device memory size in bytes of one DDR channel.
 
     The current implement leverages only one 4GB DDR4 memory on U250. Maximum number of 
     DDR4 allowed on Alveo U250 is 4.
 */
 #define DEVICE_MEM_SIZE 4294967296
 
+/*! \def DEVICE_MEM_NUM_CHANNELS
+    \brief Number of DDR channels connected in the hardware design.
+
+    Channel n is mapped at device address n * DEVICE_MEM_SIZE. Build with 
+    -DDEVICE_MEM_NUM_CHANNELS=4 for a design using all four DDR4 channels of the U250.
+    Only the library build uses it, applications read rn_dev_t::num_dev_channels.
+*/
+#ifndef DEVICE_MEM_NUM_CHANNELS
+#define DEVICE_MEM_NUM_CHANNELS 1
+#endif
+
+/*! \def RN_DEV_PLACE_AUTO
+    \brief Device buffer placement hint: the DDR channel with the most free memory.
+*/
+#define RN_DEV_PLACE_AUTO -1
+
+/*! \def RN_DEV_PLACE_SPREAD
+    \brief Device buffer placement hint: the next DDR channel in round-robin order, so that
+           the operands of a job allocated one after another land on different channels.
+*/
+#define RN_DEV_PLACE_SPREAD -2
+
 /*! \def HARDWARE_PAGE_SIZE
     \brief HARDWARE_PAGE_SIZE is used to determine payload size per AXI4-MM transaction on hardware.
 
@@ -87,6 +110,12 @@ extern int fpga_fd;
 */
 #define HUGE_PAGE_SHIFT 21
 
+/*! \def HOST_BUF_CONTIG_RETRIES
+    \brief Number of placements tried for a host buffer larger than a hugepage before giving 
+           up on finding physically contiguous hugepages.
+*/
+#define HOST_BUF_CONTIG_RETRIES 8
+
 /*! \def DEVICE_MEM_OFFSET
     \brief Device memory address offset.
 */
@@ -97,6 +126,41 @@ extern int fpga_fd;
 */
 #define DEVICE_MEM_MASK 0xfff0000000000000
 
+/*! \def RN_PERSIST_HUGETLBFS_DIR
+    \brief hugetlbfs mount holding the hugepage file of a persistent context.
+*/
+#define RN_PERSIST_HUGETLBFS_DIR "/dev/hugepages"
+
+/*! \def RN_PERSIST_SHM_DIR
+    \brief Directory holding the descriptor file of a persistent context.
+*/
+#define RN_PERSIST_SHM_DIR "/dev/shm"
+
+/*! \def RN_PERSIST_PATH_LEN
+    \brief Maximum length of the path of a persistent context file.
+*/
+#define RN_PERSIST_PATH_LEN 256
+
+/*! \def RN_PERSIST_MAGIC
+    \brief Magic number of a persistent context descriptor.
+*/
+#define RN_PERSIST_MAGIC 0x524e5043
+
+/*! \def RN_PERSIST_VERSION
+    \brief Version of the persistent context descriptor layout.
+*/
+#define RN_PERSIST_VERSION 2
+
+/*! \def RN_PERSIST_MAX_HUGEPAGES
+    \brief Maximum number of hugepages of a persistent context (8GB).
+*/
+#define RN_PERSIST_MAX_HUGEPAGES 4096
+
+/*! \def RN_PERSIST_GLB_CSR_SIZE
+    \brief Space reserved for the cached RDMA global CSRs in a persistent context descriptor.
+*/
+#define RN_PERSIST_GLB_CSR_SIZE 128
+
 /*! \struct mac_addr_t
     \brief MAC address type.
 */
@@ -120,6 +184,35 @@ struct rdma_buff_t {
   void* buffer;      /*!< buffer virtual address of an RDMA buffer. */
   uint64_t dma_addr; /*!< physical address of an RDMA buffer. */
   uint32_t buf_size; /*!< buffer size. */
+  struct rn_pool_t* pool; /*!< pool pool the buffer is allocated from, NULL if the buffer 
+                               was not allocated by allocate_rdma_buffer(). */
+  struct rn_slab_t* slab; /*!< slab slab holding the buffer, NULL for a page allocation. */
+  uint64_t pool_offset;   /*!< pool_offset offset of the buffer in its pool. */
+  uint64_t alloc_size;    /*!< alloc_size size requested from the pool. */
+};
+
+/*! \struct rn_persist_desc_t
+    \brief Descriptor of a persistent context, shared by the processes attaching to it one 
+           after another. It records what was programmed so that a later attach only 
+           reprograms what changed.
+*/
+struct rn_persist_desc_t {
+  uint32_t magic;          /*!< magic RN_PERSIST_MAGIC once the descriptor is initialized. */
+  uint32_t version;        /*!< version RN_PERSIST_VERSION. */
+  uint32_t num_hugepages;  /*!< num_hugepages number of hugepages of the hugepage file. */
+  uint32_t bdf_valid;      /*!< bdf_valid 1 if the BDF windows hold the values below. */
+  uint32_t bdf_addr_high;  /*!< bdf_addr_high translation address MSB of window 0. */
+  uint32_t bdf_addr_low;   /*!< bdf_addr_low translation address LSB of window 0. */
+  uint32_t bdf_win_config; /*!< bdf_win_config map control value of the BDF windows. */
+  uint32_t glb_csr_valid;  /*!< glb_csr_valid 1 if the RDMA global CSRs hold glb_csr. */
+  uint64_t file_dev;       /*!< file_dev st_dev of the hugepage file. */
+  uint64_t file_ino;       /*!< file_ino st_ino of the hugepage file. */
+  int64_t  file_ctime_sec; /*!< file_ctime_sec st_ctim seconds of the hugepage file after it 
+                                was last sized. */
+  int64_t  file_ctime_nsec; /*!< file_ctime_nsec st_ctim nanoseconds of the hugepage file. */
+  uint8_t  glb_csr[RN_PERSIST_GLB_CSR_SIZE]; /*!< glb_csr last programmed struct rdma_glb_csr_t. */
+  uint64_t hugepage_paddr[RN_PERSIST_MAX_HUGEPAGES]; /*!< hugepage_paddr physical address of 
+                                                          each hugepage of the hugepage file. */
 };
 
 /*! \struct rn_dev_t
@@ -131,10 +224,24 @@ struct rn_dev_t {
   struct rdma_buff_t* base_buf; /*!< base_buf Pre-allocated host buffer. */
   void* rdma_dev;               /*!< rdma_dev A RDMA device. 
                                      type: struct rdma_dev_t* */
-  uint64_t buffer_offset;       /*!< buffer_offset offset of a free pre-allocated buffer. */
-  uint64_t dev_buffer_offset;   /*!< dev_buffer_offset offset of a free device buffer. */
+  struct rn_pool_t* host_pool;  /*!< host_pool allocator of the pre-allocated hugepage buffer. */
+  uint32_t num_dev_channels;    /*!< num_dev_channels number of DDR channels of the device memory. */
+  struct rn_pool_t** dev_pool;  /*!< dev_pool allocator of each DDR channel of the device memory, 
+                                     num_dev_channels entries. */
+  uint32_t next_dev_channel;    /*!< next_dev_channel next channel used by RN_DEV_PLACE_SPREAD. */
   unsigned char num_qp;         /*!< num_qp Number of RDMA queue pairs required. */
   struct win_size_t* winSize;   /*!< Window size mask for PCIe BDF address conversion. */
+  uint32_t num_hugepages;       /*!< num_hugepages Number of hugepages backing base_buf. */
+  uint64_t* hugepage_paddr;     /*!< hugepage_paddr physical address of each hugepage of base_buf,
+                                     read once from /proc/self/pagemap by create_rn_dev(). */
+  void* dev_mem_win;            /*!< dev_mem_win write-combined mapping of device memory set up by
+                                     rn_map_device_memory(), NULL if not mapped. */
+  uint64_t dev_mem_win_addr;    /*!< dev_mem_win_addr device memory address at dev_mem_win. */
+  uint64_t dev_mem_win_size;    /*!< dev_mem_win_size size of dev_mem_win in bytes. */
+  struct rn_persist_desc_t* persist; /*!< persist descriptor of the persistent context set up by
+                                          attach_rn_dev(), NULL for create_rn_dev(). */
+  int persist_fd;               /*!< persist_fd locked descriptor file, -1 if not attached. */
+  int hugetlb_fd;               /*!< hugetlb_fd hugepage file backing base_buf, -1 if not attached. */
 };
 
 /** @brief Convert IP address from string to unsigned int.
@@ -180,6 +287,56 @@ unsigned long get_page_frame_number_of_address(void *addr);
  */
 uint64_t get_buffer_paddr(void *buffer);
 
+/** @brief Get the physical address of a virtual address in the pre-allocated hugepage
+ *         buffer from the translation table, without reading /proc/self/pagemap.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param vaddr a virtual address in the hugepage buffer.
+ *  @return the physical address, or 0 if vaddr is not in the hugepage buffer.
+ */
+uint64_t get_host_buffer_paddr(struct rn_dev_t* rn_dev, void* vaddr);
+
+/** @brief Check whether a range of the pre-allocated hugepage buffer is physically
+ *         contiguous.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param vaddr start of the range in the hugepage buffer.
+ *  @param size size of the range in bytes.
+ *  @return 1 - contiguous; 0 - not contiguous or not in the hugepage buffer.
+ */
+int is_host_buffer_contiguous(struct rn_dev_t* rn_dev, void* vaddr, uint64_t size);
+
+/** @brief Get the virtual address of a physical address in the pre-allocated hugepage 
+ *         buffer.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param paddr a physical address.
+ *  @return the virtual address, or NULL if paddr is not in the hugepage buffer.
+ */
+void* get_host_vaddr(struct rn_dev_t* rn_dev, uint64_t paddr);
+
+/** @brief Map a window of device memory into the process through the reconic-mm character 
+ *         device. Small structures in the window are then accessed with loads and stores 
+ *         instead of a DMA per access. The driver must be loaded with ddr_mmap_bar set.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param fd file descriptor of the reconic-mm character device.
+ *  @param dev_addr device memory address of the window, aligned to a page.
+ *  @param size size of the window in bytes.
+ *  @return 0 - success; -1 - the window is not available, DMA is used instead.
+ */
+int rn_map_device_memory(struct rn_dev_t* rn_dev, int fd, uint64_t dev_addr, uint64_t size);
+
+/** @brief Unmap the device memory window set up by rn_map_device_memory().
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @return void.
+ */
+void rn_unmap_device_memory(struct rn_dev_t* rn_dev);
+
+/** @brief Get the virtual address of a device memory range in the mapped window.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param dev_addr device memory address.
+ *  @param size size of the range in bytes.
+ *  @return the virtual address, or NULL if the range is not in the mapped window.
+ */
+void* get_dev_mem_vaddr(struct rn_dev_t* rn_dev, uint64_t dev_addr, uint64_t size);
+
 /** @brief Get AXI BAR mapping window mask for calculating BDF address mask.
  *  @return Window mask.
  */
@@ -193,16 +350,39 @@ uint64_t get_win_size();
  */
 void config_rn_dev_axib_bdf(struct rn_dev_t* rn_dev, uint32_t high_addr, uint32_t low_addr);
 
-/** @brief Allocate a buffer for RDMA communication.
+/** @brief Allocate a buffer for RDMA communication. Safe to call from several threads.
+ *         Buffers of up to 4KB don't cross a 4KB boundary, larger buffers are 4KB aligned.
  *  @param rn_dev A pointer to the RecoNIC device.
  *  @param buf_size buffer size.
  *  @param buf_location buffer location, either host memory ("host_mem") 
  *                      or device memory ("dev_mem").
- *  @return a pointer to the RDMA buffer allocated.
+ *  @return a pointer to the RDMA buffer allocated, or NULL if the memory is exhausted.
  */
 struct rdma_buff_t* allocate_rdma_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size, char* buf_location);
 
-/** @brief Create a RecoNIC device.
+/** @brief Free a buffer returned by allocate_rdma_buffer(). Its memory is reused by later
+ *         allocations. Safe to call from several threads.
+ *  @param rdma_buffer A pointer to the RDMA buffer.
+ *  @return void.
+ */
+void free_rdma_buffer(struct rdma_buff_t* rdma_buffer);
+
+/** @brief Allocate a buffer in device memory on a chosen DDR channel.
+ *  @param rn_dev A pointer to the RecoNIC device.
+ *  @param buf_size buffer size.
+ *  @param placement a DDR channel number, RN_DEV_PLACE_AUTO or RN_DEV_PLACE_SPREAD.
+ *  @return a pointer to the RDMA buffer allocated, or NULL if the channel is exhausted.
+ */
+struct rdma_buff_t* allocate_rdma_dev_buffer(struct rn_dev_t* rn_dev, uint64_t buf_size, int placement);
+
+/** @brief Get the DDR channel of a device buffer.
+ *  @param rdma_buffer A pointer to the RDMA buffer.
+ *  @return DDR channel number, or -1 for a host buffer.
+ */
+int get_rdma_buffer_channel(struct rdma_buff_t* rdma_buffer);
+
+/** @brief Create a RecoNIC device. Exits if the hugepage buffer is not physically 
+ *         contiguous, the BDF windows map it from the address of its first hugepage.
  *  @param pcie_resource Path to resource2 of a PCIe device.
  *  @param rn_scr File descriptor of the PCIe device resource2 for FPGA register access.
  *  @param num_hugepages_request Pre-allocate a hugepage buffer with the size of 
@@ -212,4 +392,43 @@ struct rdma_buff_t* allocate_rdma_buffer(struct rn_dev_t* rn_dev, uint64_t buf_s
  */
 struct rn_dev_t* create_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, uint32_t num_qp);
 
+/** @brief Create a RecoNIC device on a persistent context. The hugepage buffer lives in a 
+ *         hugetlbfs file and its physical addresses, the BDF windows and the RDMA global 
+ *         CSRs are recorded in a descriptor in RN_PERSIST_SHM_DIR, so a later process 
+ *         attaching to the same name skips the pagemap walk and only reprograms the 
+ *         registers whose value changed. One process owns the context at a time, others 
+ *         block until it is detached. The context is created on first use and is rebuilt
+ *         if num_hugepages_request differs. Like create_rn_dev(), exits if the hugepage 
+ *         buffer is not physically contiguous.
+ *  @param pcie_resource Path to resource2 of a PCIe device.
+ *  @param rn_scr File descriptor of the PCIe device resource2 for FPGA register access.
+ *  @param num_hugepages_request Number of hugepages of the buffer, at most RN_PERSIST_MAX_HUGEPAGES.
+ *  @param num_qp Number of RDMA queue pairs required.
+ *  @param name name of the persistent context.
+ *  @return A RecoNIC device pointer.
+ */
+struct rn_dev_t* attach_rn_dev(char* pcie_resource, int* pcie_resource_fd, uint32_t num_hugepages_request, 
+                               uint32_t num_qp, const char* name);
+
+/** @brief Release the persistent context of a RecoNIC device created by attach_rn_dev(),
+ *         keeping its hugepages and descriptor for the next process. Called by 
+ *         destroy_rn_dev().
+ *  @param rn_dev A RecoNIC device pointer.
+ *  @return void.
+ */
+void detach_rn_dev(struct rn_dev_t* rn_dev);
+
+/** @brief Release the host and device buffer pools and the hugepage table of a 
+ *         RecoNIC device. Called by destroy_rn_dev().
+ *  @param rn_dev A RecoNIC device pointer.
+ *  @return void.
+ */
+void destroy_rn_dev_pools(struct rn_dev_t* rn_dev);
+
+/** @brief Remove a persistent context and give its hugepages back to the kernel.
+ *  @param name name of the persistent context.
+ *  @return 0 on success, -1 if it does not exist, is in use or can't be removed.
+ */
+int remove_rn_dev_persist(const char* name);
+
 #endif /* __RECONIC_H__ */
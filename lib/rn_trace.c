@@ -0,0 +1,136 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rn_trace.c
+ *  @brief Implementation of the hot-path trace log.
+ */
+
+#include <sys/syscall.h>
+#include "rn_trace.h"
+
+__thread struct rn_trace_ring_t* rn_trace_ring = NULL;
+
+// List of the rings of all threads, rings are never freed so that they can be dumped
+// after their threads exit
+static struct rn_trace_ring_t* rn_trace_rings = NULL;
+
+// Time spent measuring the timestamp counter frequency
+#define RN_TRACE_CALIBRATE_NS 20000000UL
+
+struct rn_trace_ring_t* rn_trace_ring_attach(void) {
+  struct rn_trace_ring_t* ring;
+
+  ring = (struct rn_trace_ring_t* ) calloc(1, sizeof(struct rn_trace_ring_t));
+  if(ring == NULL) {
+    return NULL;
+  }
+  ring->tid = (uint32_t) syscall(SYS_gettid);
+
+  ring->next = __atomic_load_n(&rn_trace_rings, __ATOMIC_ACQUIRE);
+  while(!__atomic_compare_exchange_n(&rn_trace_rings, &(ring->next), ring, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+  rn_trace_ring = ring;
+  return ring;
+}
+
+static uint64_t rn_trace_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * NSEC_DIV) + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t rn_trace_tsc_hz(void) {
+  uint64_t ns0;
+  uint64_t ns1;
+  uint64_t tsc0;
+  uint64_t tsc1;
+
+  ns0  = rn_trace_now_ns();
+  tsc0 = rn_trace_tsc();
+  do {
+    ns1 = rn_trace_now_ns();
+  } while(ns1 - ns0 < RN_TRACE_CALIBRATE_NS);
+  tsc1 = rn_trace_tsc();
+
+  return (uint64_t) (((double) (tsc1 - tsc0) * NSEC_DIV) / (double) (ns1 - ns0));
+}
+
+int64_t rn_trace_dump(const char* path) {
+  struct rn_trace_file_hdr_t file_hdr;
+  struct rn_trace_ring_hdr_t ring_hdr;
+  struct rn_trace_ring_t* ring;
+  struct rn_trace_ring_t* head;
+  uint64_t first;
+  uint64_t num;
+  uint64_t part;
+  int64_t total = 0;
+  FILE* fp;
+
+  fp = fopen(path, "wb");
+  if(fp == NULL) {
+    fprintf(stderr, "Error: failed to create trace file %s\n", path);
+    return -1;
+  }
+
+  head = __atomic_load_n(&rn_trace_rings, __ATOMIC_ACQUIRE);
+  memset(&file_hdr, 0, sizeof(file_hdr));
+  file_hdr.magic   = RN_TRACE_MAGIC;
+  file_hdr.version = RN_TRACE_VERSION;
+  file_hdr.tsc_hz  = rn_trace_tsc_hz();
+  for(ring = head; ring != NULL; ring = ring->next) {
+    file_hdr.num_rings++;
+  }
+  if(fwrite(&file_hdr, sizeof(file_hdr), 1, fp) != 1) {
+    goto write_error;
+  }
+
+  for(ring = head; ring != NULL; ring = ring->next) {
+    num   = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    first = (num > RN_TRACE_RING_SIZE) ? (num - RN_TRACE_RING_SIZE) : 0;
+
+    memset(&ring_hdr, 0, sizeof(ring_hdr));
+    ring_hdr.tid      = ring->tid;
+    ring_hdr.num_recs = num - first;
+    ring_hdr.dropped  = first;
+    if(fwrite(&ring_hdr, sizeof(ring_hdr), 1, fp) != 1) {
+      goto write_error;
+    }
+
+    // Oldest record first: from the write position to the end, then the start
+    first &= (RN_TRACE_RING_SIZE - 1);
+    part = (ring_hdr.num_recs < RN_TRACE_RING_SIZE) ? ring_hdr.num_recs : (RN_TRACE_RING_SIZE - first);
+    if(ring_hdr.num_recs < RN_TRACE_RING_SIZE) {
+      first = 0;
+    }
+    if(fwrite(&(ring->recs[first]), sizeof(struct rn_trace_rec_t), part, fp) != part) {
+      goto write_error;
+    }
+    if((ring_hdr.num_recs > part) &&
+       (fwrite(ring->recs, sizeof(struct rn_trace_rec_t), ring_hdr.num_recs - part, fp) != ring_hdr.num_recs - part)) {
+      goto write_error;
+    }
+    total += (int64_t) ring_hdr.num_recs;
+  }
+
+  fclose(fp);
+  fprintf(stderr, "Info: %ld trace records of %d threads written to %s\n", total, file_hdr.num_rings, path);
+  return total;
+
+write_error:
+  fprintf(stderr, "Error: failed to write trace file %s\n", path);
+  fclose(fp);
+  return -1;
+}
+
+void rn_trace_reset(void) {
+  struct rn_trace_ring_t* ring;
+
+  for(ring = __atomic_load_n(&rn_trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+    __atomic_store_n(&(ring->head), 0, __ATOMIC_RELEASE);
+  }
+}
@@ -0,0 +1,199 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file rn_trace.h
+ *  @brief Header file of the hot-path trace log.
+ *
+ *  Trace points record a timestamp counter value, an event, an ID and an argument into
+ *  a ring buffer owned by the calling thread, so recording takes no lock and no system
+ *  call. Trace points are only compiled in when the library is built with RN_TRACE
+ *  defined (make TRACE=1); otherwise RN_TRACE_EVENT() generates no code, its arguments
+ *  are still type-checked through an if(0) body but never evaluated. The rings of all
+ *  threads are written to a file with rn_trace_dump() and turned into per-stage latencies
+ *  by the trace_dump tool.
+ */
+
+#ifndef __RN_TRACE_H__
+#define __RN_TRACE_H__
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "auxiliary.h"
+
+/*! \def RN_TRACE_RING_SIZE
+    \brief Number of records of a per-thread ring, a power of two. Older records are
+           overwritten once a ring is full.
+*/
+#define RN_TRACE_RING_SIZE 65536
+
+/*! \def RN_TRACE_MAGIC
+    \brief Magic number at the start of a trace file.
+*/
+#define RN_TRACE_MAGIC 0x52545243
+
+/*! \def RN_TRACE_VERSION
+    \brief Version of the trace file format.
+*/
+#define RN_TRACE_VERSION 1
+
+/*! \def RN_TRACE_RING_ARG(qdepth, idx)
+    \brief Argument of the ring index events: queue depth in the upper 16 bits and the
+           ring index in the lower 16 bits.
+*/
+#define RN_TRACE_RING_ARG(qdepth, idx) ((((uint32_t) (qdepth) & 0xffff) << 16) | ((uint32_t) (idx) & 0xffff))
+
+/*! \enum rn_trace_event_t
+    \brief Events recorded by the trace points.
+*/
+typedef enum {
+  RN_TRACE_WQE_BUILD = 0, /*!< A WQE is written. id: QP ID, arg: SQ slot. */
+  RN_TRACE_SQ_DOORBELL,   /*!< SQPIi is written. id: QP ID, arg: RN_TRACE_RING_ARG(qdepth, sq_pidb). */
+  RN_TRACE_CQ_OBSERVED,   /*!< Completions are seen. id: QP ID, arg: RN_TRACE_RING_ARG(qdepth, sq_cidb). */
+  RN_TRACE_RQ_OBSERVED,   /*!< RQEs are seen. id: QP ID, arg: RN_TRACE_RING_ARG(qdepth, rq_pidb). */
+  RN_TRACE_DMA_SUBMIT,    /*!< A DMA transfer is issued to the character device. id: direction,
+                               arg: lower 32 bits of the device offset. */
+  RN_TRACE_DMA_COMPLETE,  /*!< A DMA transfer returned. id and arg as RN_TRACE_DMA_SUBMIT. */
+  RN_TRACE_DMA_QUEUED,    /*!< An asynchronous DMA request is queued. id: direction,
+                               arg: request tag. */
+  RN_TRACE_DMA_DONE,      /*!< The last chunk of an asynchronous DMA request completed. id and
+                               arg as RN_TRACE_DMA_QUEUED. */
+  RN_TRACE_NUM_EVENTS
+} rn_trace_event_t;
+
+/*! \struct rn_trace_rec_t
+    \brief A trace record.
+*/
+struct rn_trace_rec_t {
+  uint64_t tsc;   /*!< tsc timestamp counter value. */
+  uint16_t event; /*!< event one of rn_trace_event_t. */
+  uint16_t id;    /*!< id QP ID or DMA direction. */
+  uint32_t arg;   /*!< arg event argument. */
+};
+
+/*! \struct rn_trace_ring_t
+    \brief Trace ring of a thread. Only the owner thread writes it.
+*/
+struct rn_trace_ring_t {
+  uint64_t head;                 /*!< head number of records written since the ring was created. */
+  uint32_t tid;                  /*!< tid ID of the owner thread. */
+  struct rn_trace_ring_t* next;  /*!< next ring in the list of all rings. */
+  struct rn_trace_rec_t recs[RN_TRACE_RING_SIZE]; /*!< recs ring of records. */
+};
+
+/*! \struct rn_trace_file_hdr_t
+    \brief Header of a trace file, followed by num_rings rings.
+*/
+struct rn_trace_file_hdr_t {
+  uint32_t magic;     /*!< magic RN_TRACE_MAGIC. */
+  uint32_t version;   /*!< version RN_TRACE_VERSION. */
+  uint64_t tsc_hz;    /*!< tsc_hz timestamp counter ticks per second. */
+  uint32_t num_rings; /*!< num_rings number of rings in the file. */
+  uint32_t reserved;  /*!< reserved 0. */
+};
+
+/*! \struct rn_trace_ring_hdr_t
+    \brief Header of a ring in a trace file, followed by num_recs records, oldest first.
+*/
+struct rn_trace_ring_hdr_t {
+  uint32_t tid;      /*!< tid ID of the thread that wrote the ring. */
+  uint32_t reserved; /*!< reserved 0. */
+  uint64_t num_recs; /*!< num_recs number of records that follow. */
+  uint64_t dropped;  /*!< dropped number of older records overwritten. */
+};
+
+/*! \var rn_trace_ring
+    \brief Trace ring of the calling thread, NULL until its first trace point.
+*/
+extern __thread struct rn_trace_ring_t* rn_trace_ring;
+
+/** @brief Read the timestamp counter.
+ *  @return current timestamp counter value.
+ */
+static inline uint64_t rn_trace_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t cnt;
+
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (cnt));
+  return cnt;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * NSEC_DIV) + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/** @brief Allocate the trace ring of the calling thread and add it to the list of rings.
+ *  @return the ring, or NULL if it can't be allocated.
+ */
+struct rn_trace_ring_t* rn_trace_ring_attach(void);
+
+/** @brief Record an event in the trace ring of the calling thread.
+ *  @param event one of rn_trace_event_t.
+ *  @param id QP ID or DMA direction.
+ *  @param arg event argument.
+ *  @return void.
+ */
+static inline void rn_trace_record(uint16_t event, uint16_t id, uint32_t arg) {
+  struct rn_trace_ring_t* ring = rn_trace_ring;
+  struct rn_trace_rec_t* rec;
+  uint64_t head;
+
+  if(ring == NULL) {
+    ring = rn_trace_ring_attach();
+    if(ring == NULL) {
+      return;
+    }
+  }
+
+  head = ring->head;
+  rec = &(ring->recs[head & (RN_TRACE_RING_SIZE - 1)]);
+  rec->tsc   = rn_trace_tsc();
+  rec->event = event;
+  rec->id    = id;
+  rec->arg   = arg;
+  __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/*! \def RN_TRACE_EVENT(event, id, arg)
+    \brief Trace point. Compiled in only when the library is built with RN_TRACE defined,
+           otherwise the arguments are type-checked but never evaluated.
+*/
+#ifdef RN_TRACE
+#define RN_TRACE_EVENT(event, id, arg) \
+    rn_trace_record((uint16_t) (event), (uint16_t) (id), (uint32_t) (arg))
+#else
+#define RN_TRACE_EVENT(event, id, arg) \
+    do { \
+      if(0) { \
+        rn_trace_record((uint16_t) (event), (uint16_t) (id), (uint32_t) (arg)); \
+      } \
+    } while(0)
+#endif
+
+/** @brief Measure the frequency of the timestamp counter against CLOCK_MONOTONIC.
+ *  @return timestamp counter ticks per second.
+ */
+uint64_t rn_trace_tsc_hz(void);
+
+/** @brief Write the trace rings of all threads to a file. Rings are copied while their
+ *         threads may still record, so the dump should be taken once the traced work
+ *         is done.
+ *  @param path trace file to create.
+ *  @return number of records written, or -1 on failure.
+ */
+int64_t rn_trace_dump(const char* path);
+
+/** @brief Discard the records of all trace rings. No thread may record meanwhile.
+ *  @return void.
+ */
+void rn_trace_reset(void);
+
+#endif /* __RN_TRACE_H__ */
@@ -0,0 +1,331 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file tiled_gemm.c
+ *  @brief Implementation of the tiled GEMM engine.
+ */
+
+#include "tiled_gemm.h"
+
+#define TILES(x) (((x) + RN_GEMM_TILE_DIM - 1) / RN_GEMM_TILE_DIM)
+
+// State of one C tile whose partial products are computed or read back
+struct gemm_slot_t {
+  struct rdma_buff_t* dev_partial; // partial products of the tile in device memory
+  int32_t* partial;                // host copy of the partial products
+  uint32_t remaining;              // accelerator jobs not completed yet
+  uint32_t tile_row;
+  uint32_t tile_col;
+  int busy;
+};
+
+struct rn_gemm_t* rn_gemm_create(struct rn_dev_t* rn_dev, void* axil_base, char* char_device, 
+                                 int fd, uint32_t depth) {
+  struct rn_gemm_t* gemm = NULL;
+
+  gemm = (struct rn_gemm_t* ) calloc(1, sizeof(struct rn_gemm_t));
+  if(gemm == NULL) {
+    fprintf(stderr, "Error: failed to allocate the GEMM engine\n");
+    return NULL;
+  }
+
+  gemm->rn_dev    = rn_dev;
+  gemm->axil_base = axil_base;
+  rn_wait_policy_init(&gemm->policy);
+
+  gemm->cq = rn_cq_create(axil_base, depth);
+  if(gemm->cq == NULL) {
+    free(gemm);
+    return NULL;
+  }
+
+  gemm->dma = rn_dma_ctx_create(char_device, fd, RN_GEMM_DMA_THREADS);
+  if(gemm->dma == NULL) {
+    rn_cq_destroy(gemm->cq);
+    free(gemm);
+    return NULL;
+  }
+
+  return gemm;
+}
+
+void rn_gemm_destroy(struct rn_gemm_t* gemm) {
+  if(gemm == NULL) {
+    return;
+  }
+
+  rn_dma_ctx_destroy(gemm->dma);
+  rn_cq_destroy(gemm->cq);
+  free(gemm);
+}
+
+// Copy the tile at tile coordinates (tile_row, tile_col) of a row-major matrix into a
+// contiguous tile, padding with zeros beyond the matrix edges
+static void pack_tile(int32_t* tile, const int32_t* mat, uint32_t rows, uint32_t cols, 
+                      uint32_t tile_row, uint32_t tile_col) {
+  uint32_t r0 = tile_row * RN_GEMM_TILE_DIM;
+  uint32_t c0 = tile_col * RN_GEMM_TILE_DIM;
+  uint32_t nr = ((rows - r0) < RN_GEMM_TILE_DIM) ? (rows - r0) : RN_GEMM_TILE_DIM;
+  uint32_t nc = ((cols - c0) < RN_GEMM_TILE_DIM) ? (cols - c0) : RN_GEMM_TILE_DIM;
+  uint32_t i;
+
+  if((nr < RN_GEMM_TILE_DIM) || (nc < RN_GEMM_TILE_DIM)) {
+    memset(tile, 0, RN_GEMM_TILE_SIZE);
+  }
+  for(i=0; i<nr; i++) {
+    memcpy(&tile[i * RN_GEMM_TILE_DIM], &mat[(uint64_t) (r0 + i) * cols + c0], nc * sizeof(int32_t));
+  }
+}
+
+// Check that a device buffer is reachable with the 32-bit addresses of a control command
+static int check_dev_buffer(struct rdma_buff_t* buf, const char* name) {
+  if(buf == NULL) {
+    fprintf(stderr, "Error: failed to allocate the GEMM %s buffer in device memory\n", name);
+    return -1;
+  }
+  if(((buf->dma_addr & DEVICE_MEMORY_ADDRESS_MASK) + buf->buf_size) > 0x100000000UL) {
+    fprintf(stderr, "Error: GEMM %s buffer is above 4GB of device memory\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+// Move data between host and device memory through the asynchronous DMA context
+static struct rn_dma_req_t* gemm_dma(struct rn_gemm_t* gemm, int dir, void* host_buf, 
+                                     uint64_t dev_addr, uint64_t len) {
+  struct rn_dma_seg_t seg;
+
+  seg.host_buf   = host_buf;
+  seg.dev_offset = dev_addr;
+  seg.len        = len;
+  return rn_dma_submit(gemm->dma, dir, &seg, 1);
+}
+
+// Wait for a DMA request and release its handle
+static int gemm_dma_wait(struct rn_dma_req_t* req) {
+  int rc;
+
+  if(req == NULL) {
+    return -1;
+  }
+  rc = rn_dma_wait(req);
+  rn_dma_req_free(req);
+  if(rc < 0) {
+    fprintf(stderr, "Error: GEMM DMA failed with %d\n", rc);
+    return -1;
+  }
+  return 0;
+}
+
+// Reap accelerator completions, waiting for at least one if block is set
+static int gemm_reap(struct rn_gemm_t* gemm, int block) {
+  uint32_t work_ids[RN_CQ_DEFAULT_DEPTH];
+  void* user_data[RN_CQ_DEFAULT_DEPTH];
+  volatile uint32_t* completed;
+  uint32_t num;
+  uint32_t i;
+
+  completed = (volatile uint32_t* ) ((uintptr_t) gemm->axil_base + gemm->cq->cnt_offset);
+  do {
+    num = rn_cq_reap(gemm->cq, work_ids, user_data, RN_CQ_DEFAULT_DEPTH);
+    for(i=0; i<num; i++) {
+      ((struct gemm_slot_t* ) user_data[i])->remaining--;
+    }
+    if((num == 0) && block) {
+      if(rn_wait_value_change(completed, 0, &gemm->policy, NULL) < 0) {
+        fprintf(stderr, "Error: timeout waiting for the systolic accelerator\n");
+        return -1;
+      }
+    }
+  } while((num == 0) && block);
+
+  return 0;
+}
+
+// Read back the partial products of a C tile once its jobs are done and sum them into C
+static int gemm_finish_tile(struct rn_gemm_t* gemm, struct gemm_slot_t* slot, int32_t* c, 
+                            uint32_t m, uint32_t n, uint32_t num_k_tiles) {
+  uint32_t r0 = slot->tile_row * RN_GEMM_TILE_DIM;
+  uint32_t c0 = slot->tile_col * RN_GEMM_TILE_DIM;
+  uint32_t nr = ((m - r0) < RN_GEMM_TILE_DIM) ? (m - r0) : RN_GEMM_TILE_DIM;
+  uint32_t nc = ((n - c0) < RN_GEMM_TILE_DIM) ? (n - c0) : RN_GEMM_TILE_DIM;
+  int32_t* partial;
+  int32_t sum;
+  uint32_t i, j, t;
+
+  while(slot->remaining > 0) {
+    if(gemm_reap(gemm, 1) < 0) {
+      return -1;
+    }
+  }
+
+  if(gemm_dma_wait(gemm_dma(gemm, RN_DMA_C2H, slot->partial, slot->dev_partial->dma_addr, 
+                            (uint64_t) num_k_tiles * RN_GEMM_TILE_SIZE)) < 0) {
+    return -1;
+  }
+
+  for(i=0; i<nr; i++) {
+    for(j=0; j<nc; j++) {
+      sum = 0;
+      for(t=0; t<num_k_tiles; t++) {
+        partial = slot->partial + (uint64_t) t * RN_GEMM_TILE_DIM * RN_GEMM_TILE_DIM;
+        sum += partial[i * RN_GEMM_TILE_DIM + j];
+      }
+      c[(uint64_t) (r0 + i) * n + c0 + j] = sum;
+    }
+  }
+
+  slot->busy = 0;
+  return 0;
+}
+
+// Pack the row panel tile_row of A into a host staging buffer
+static void pack_panel(int32_t* panel, const int32_t* a, uint32_t m, uint32_t k, uint32_t tile_row) {
+  uint32_t t;
+
+  for(t=0; t<TILES(k); t++) {
+    pack_tile(panel + (uint64_t) t * RN_GEMM_TILE_DIM * RN_GEMM_TILE_DIM, a, m, k, tile_row, t);
+  }
+}
+
+int rn_gemm_run(struct rn_gemm_t* gemm, const int32_t* a, const int32_t* b, int32_t* c, 
+                uint32_t m, uint32_t n, uint32_t k) {
+  uint32_t mt = TILES(m);
+  uint32_t nt = TILES(n);
+  uint32_t kt = TILES(k);
+  uint64_t panel_size = (uint64_t) kt * RN_GEMM_TILE_SIZE;
+  struct rdma_buff_t* dev_b = NULL;
+  struct rdma_buff_t* dev_a[2] = {NULL, NULL};
+  int32_t* host_b = NULL;
+  int32_t* host_a[2] = {NULL, NULL};
+  struct gemm_slot_t slots[2];
+  struct gemm_slot_t* slot;
+  struct gemm_slot_t* prev = NULL;
+  struct rn_dma_req_t* a_req = NULL;
+  ctl_cmd_t ctl_cmd;
+  uint32_t i, j, t, s = 0;
+  uint64_t a_addr, b_addr, c_addr;
+  int rc = -1;
+
+  if((m == 0) || (n == 0) || (k == 0)) {
+    return 0;
+  }
+
+  memset(slots, 0, sizeof(slots));
+
+  // Device and host buffers: B whole, two A panels and two sets of partial C tiles
+  dev_b    = allocate_rdma_dev_buffer(gemm->rn_dev, (uint64_t) kt * nt * RN_GEMM_TILE_SIZE, 0);
+  dev_a[0] = allocate_rdma_dev_buffer(gemm->rn_dev, panel_size, 0);
+  dev_a[1] = allocate_rdma_dev_buffer(gemm->rn_dev, panel_size, 0);
+  slots[0].dev_partial = allocate_rdma_dev_buffer(gemm->rn_dev, panel_size, 0);
+  slots[1].dev_partial = allocate_rdma_dev_buffer(gemm->rn_dev, panel_size, 0);
+  if((check_dev_buffer(dev_b, "B") < 0) || (check_dev_buffer(dev_a[0], "A") < 0) || 
+     (check_dev_buffer(dev_a[1], "A") < 0) || (check_dev_buffer(slots[0].dev_partial, "C") < 0) || 
+     (check_dev_buffer(slots[1].dev_partial, "C") < 0)) {
+    goto out;
+  }
+
+  host_b          = (int32_t* ) malloc((uint64_t) kt * nt * RN_GEMM_TILE_SIZE);
+  host_a[0]       = (int32_t* ) malloc(panel_size);
+  host_a[1]       = (int32_t* ) malloc(panel_size);
+  slots[0].partial = (int32_t* ) malloc(panel_size);
+  slots[1].partial = (int32_t* ) malloc(panel_size);
+  if((host_b == NULL) || (host_a[0] == NULL) || (host_a[1] == NULL) || 
+     (slots[0].partial == NULL) || (slots[1].partial == NULL)) {
+    fprintf(stderr, "Error: failed to allocate GEMM host staging buffers\n");
+    goto out;
+  }
+
+  // B tiles are stored row of tiles after row of tiles
+  for(t=0; t<kt; t++) {
+    for(j=0; j<nt; j++) {
+      pack_tile(host_b + ((uint64_t) t * nt + j) * RN_GEMM_TILE_DIM * RN_GEMM_TILE_DIM, b, k, n, t, j);
+    }
+  }
+  a_req = gemm_dma(gemm, RN_DMA_H2C, host_b, dev_b->dma_addr, (uint64_t) kt * nt * RN_GEMM_TILE_SIZE);
+  pack_panel(host_a[0], a, m, k, 0);
+  if(gemm_dma_wait(a_req) < 0) {
+    a_req = NULL;
+    goto out;
+  }
+  a_req = gemm_dma(gemm, RN_DMA_H2C, host_a[0], dev_a[0]->dma_addr, panel_size);
+
+  for(i=0; i<mt; i++) {
+    // Panel i is needed now, panel i+1 is uploaded while panel i is computed
+    if(gemm_dma_wait(a_req) < 0) {
+      a_req = NULL;
+      goto out;
+    }
+    a_req = NULL;
+
+    for(j=0; j<nt; j++) {
+      slot = &slots[s];
+      slot->tile_row  = i;
+      slot->tile_col  = j;
+      slot->remaining = kt;
+      slot->busy      = 1;
+
+      for(t=0; t<kt; t++) {
+        a_addr = dev_a[i % 2]->dma_addr + (uint64_t) t * RN_GEMM_TILE_SIZE;
+        b_addr = dev_b->dma_addr + ((uint64_t) t * nt + j) * RN_GEMM_TILE_SIZE;
+        c_addr = slot->dev_partial->dma_addr + (uint64_t) t * RN_GEMM_TILE_SIZE;
+        gen_ctl_cmd(&ctl_cmd, (uint32_t) a_addr, (uint32_t) b_addr, (uint32_t) c_addr, 
+                    RN_GEMM_CTL_CMD_SIZE, RN_GEMM_TILE_DIM, RN_GEMM_TILE_DIM, RN_GEMM_TILE_DIM, 0);
+        while(rn_cq_submit(gemm->cq, &ctl_cmd, slot) < 0) {
+          if(gemm_reap(gemm, 1) < 0) {
+            goto out;
+          }
+        }
+        gemm->jobs++;
+      }
+
+      // The previous C tile is read back while this one is computed
+      if(prev != NULL) {
+        if(gemm_finish_tile(gemm, prev, c, m, n, kt) < 0) {
+          goto out;
+        }
+      }
+      prev = slot;
+      s ^= 1;
+
+      // Once the last tile of panel i-1 is done its A buffer can take panel i+1
+      if((j == 0) && (i + 1 < mt)) {
+        pack_panel(host_a[(i + 1) % 2], a, m, k, i + 1);
+        a_req = gemm_dma(gemm, RN_DMA_H2C, host_a[(i + 1) % 2], dev_a[(i + 1) % 2]->dma_addr, 
+                         panel_size);
+      }
+    }
+  }
+
+  if(gemm_finish_tile(gemm, prev, c, m, n, kt) < 0) {
+    goto out;
+  }
+  rc = 0;
+
+out:
+  if(a_req != NULL) {
+    gemm_dma_wait(a_req);
+  }
+  if(rc < 0) {
+    // Let jobs in flight finish before their buffers are released
+    while(rn_cq_outstanding(gemm->cq) > 0) {
+      if(gemm_reap(gemm, 1) < 0) {
+        break;
+      }
+    }
+  }
+  free(host_b);
+  free(host_a[0]);
+  free(host_a[1]);
+  free(slots[0].partial);
+  free(slots[1].partial);
+  if(dev_b != NULL) free_rdma_buffer(dev_b);
+  if(dev_a[0] != NULL) free_rdma_buffer(dev_a[0]);
+  if(dev_a[1] != NULL) free_rdma_buffer(dev_a[1]);
+  if(slots[0].dev_partial != NULL) free_rdma_buffer(slots[0].dev_partial);
+  if(slots[1].dev_partial != NULL) free_rdma_buffer(slots[1].dev_partial);
+  return rc;
+}
@@ -0,0 +1,87 @@
+//==============================================================================
+// Copyright (C) 2023, Advanced Micro Devices, Inc. All rights reserved.
+// SPDX-License-Identifier: MIT
+//
+//==============================================================================
+
+/** @file tiled_gemm.h
+ *  @brief Header file of the tiled GEMM engine.
+ *
+ *  The engine multiplies int32 matrices of any size on the systolic accelerator, which 
+ *  computes one RN_GEMM_TILE_DIM x RN_GEMM_TILE_DIM product per job. Operands are zero 
+ *  padded to whole tiles and stored tile-contiguous in device memory: B is uploaded once, 
+ *  A is streamed one row panel at a time into two alternating device buffers. Each C tile 
+ *  is the sum of one partial product per tile of the shared dimension. The partial 
+ *  products of a C tile are read back with one DMA and summed on the host while the 
+ *  accelerator works on the next C tile.
+ */
+
+#ifndef __TILED_GEMM_H__
+#define __TILED_GEMM_H__
+
+#include "reconic.h"
+#include "compute_queue.h"
+
+/*! \def RN_GEMM_TILE_DIM
+    \brief Row and column size of the tile computed by the systolic accelerator.
+*/
+#define RN_GEMM_TILE_DIM 16
+
+/*! \def RN_GEMM_TILE_SIZE
+    \brief Size in bytes of an int32 tile.
+*/
+#define RN_GEMM_TILE_SIZE (RN_GEMM_TILE_DIM * RN_GEMM_TILE_DIM * sizeof(int32_t))
+
+/*! \def RN_GEMM_CTL_CMD_SIZE
+    \brief Number of 32-bit words in an accelerator control command.
+*/
+#define RN_GEMM_CTL_CMD_SIZE 6
+
+/*! \def RN_GEMM_DMA_THREADS
+    \brief Number of asynchronous DMA worker threads used by the engine.
+*/
+#define RN_GEMM_DMA_THREADS 2
+
+/*! \struct rn_gemm_t
+    \brief Tiled GEMM engine.
+*/
+struct rn_gemm_t {
+  struct rn_dev_t* rn_dev;          /*!< rn_dev the RecoNIC device. */
+  void* axil_base;                  /*!< axil_base AXIL base address of the PCIe device. */
+  struct rn_compute_queue_t* cq;    /*!< cq job queue of the accelerator. */
+  struct rn_dma_ctx_t* dma;         /*!< dma asynchronous DMA context. */
+  rn_wait_policy_t policy;          /*!< policy wait policy for accelerator completions. */
+  uint64_t jobs;                    /*!< jobs number of accelerator jobs run. */
+};
+
+/** @brief Create a tiled GEMM engine.
+ *  @param rn_dev A pointer to the RecoNIC device, its device memory holds the tiles.
+ *  @param axil_base AXIL base address of the PCIe device.
+ *  @param char_device Name of the character device used for memory access.
+ *  @param fd File descriptor of the char_device.
+ *  @param depth number of accelerator jobs kept in flight, 0 uses RN_CQ_DEFAULT_DEPTH.
+ *  @return a pointer to the engine, or NULL on failure.
+ */
+struct rn_gemm_t* rn_gemm_create(struct rn_dev_t* rn_dev, void* axil_base, char* char_device, 
+                                 int fd, uint32_t depth);
+
+/** @brief Destroy a tiled GEMM engine.
+ *  @param gemm the engine.
+ *  @return void.
+ */
+void rn_gemm_destroy(struct rn_gemm_t* gemm);
+
+/** @brief Compute C = A * B on the accelerator. Matrices are row-major.
+ *  @param gemm the engine.
+ *  @param a matrix A of m rows and k columns.
+ *  @param b matrix B of k rows and n columns.
+ *  @param c matrix C of m rows and n columns, overwritten.
+ *  @param m number of rows of A and C.
+ *  @param n number of columns of B and C.
+ *  @param k number of columns of A and rows of B.
+ *  @return Success (0) or Failure (-1).
+ */
+int rn_gemm_run(struct rn_gemm_t* gemm, const int32_t* a, const int32_t* b, int32_t* c, 
+                uint32_t m, uint32_t n, uint32_t k);
+
+#endif /* __TILED_GEMM_H__ */
@@ -3,6 +3,7 @@
 
 #include <linux/netdevice.h>
 #include <linux/cpumask.h>
+#include <linux/version.h>
 #include "libqdma_export.h"
 #include "onic_register.h"
 #include "qdma_access/qdma_access_common.h"
@@ -13,6 +14,14 @@
 #define ONIC_RX_COPY_THRES                  (256)
 #define ONIC_RX_PULL_LEN                    (128)
 #define ONIC_NAPI_WEIGHT                    (64)
+#define ONIC_RETA_SIZE                      (128)
+#define ONIC_HASH_KEY_SIZE                  (40)
+
+/* XDP on the network RX queues, needs xdp_init_buff() and xdp_prepare_buff() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define ONIC_HAVE_XDP
+#include <net/xdp.h>
+#endif
 
 #define DRV_CDEV_NAME "reconic-mm"
 #include "onic_cdev.h"
@@ -43,6 +52,8 @@ struct qdma_fmap_ctxt {
 
 struct onic_dma_request {
   struct sk_buff *skb;
+  /* frame sent by XDP_TX, set instead of skb */
+  struct xdp_frame *xdpf;
   struct net_device *netdev;
   struct qdma_request qdma;
   struct qdma_sw_sg sgl[MAX_SKB_FRAGS];
@@ -85,6 +96,8 @@ struct onic_priv {
 
   u16 num_msix;
   u16 nb_queues;
+  /* number of network queues created, the upper bound of the channel count */
+  u16 max_channels;
 
   struct kmem_cache *dma_req;
   struct qdma_dev_conf qdma_dev_conf;
@@ -96,6 +109,16 @@ struct onic_priv {
   struct napi_struct *napi;
   struct rtnl_link_stats64 *tx_qstats, *rx_qstats;
   struct onic_cdev *onic_cdev_ptr;
+
+  /* XDP program run on the network RX queues, NULL if none is attached */
+  struct bpf_prog *xdp_prog;
+#ifdef ONIC_HAVE_XDP
+  struct xdp_rxq_info *xdp_rxq;
+#endif
 };
 
+void onic_set_qconf(struct onic_priv *xpriv);
+void onic_init_reta(struct onic_priv *xpriv);
+int onic_qdma_reconfig(struct onic_priv *xpriv);
+
 #endif /* ONIC_H */
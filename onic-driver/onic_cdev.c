@@ -17,6 +17,13 @@
 #include "onic_cdev.h"
 #include <linux/pci.h>
 #include <linux/syscalls.h>
+#include <linux/dma-mapping.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
 /**
  * sysfs class structure
  **/
@@ -38,36 +45,525 @@ static int write_read_idx;
 static int write_write_idx;
 static int *write_queue_pool;
 
+/**
+ * MM queue binding mode
+ **/
+static int mm_queue_binding = ONIC_MM_BIND_FILE;
+module_param(mm_queue_binding, int, 0644);
+MODULE_PARM_DESC(mm_queue_binding, "MM queue binding: 0 - shared pool, 1 - per open file (default), 2 - per CPU");
+
+/**
+ * Device memory window exposed through mmap, disabled unless ddr_mmap_bar is set
+ **/
+static int ddr_mmap_bar = -1;
+module_param(ddr_mmap_bar, int, 0444);
+MODULE_PARM_DESC(ddr_mmap_bar, "PCIe BAR through which device memory is mapped by mmap, -1 disables mmap (default)");
+static ulong ddr_mmap_bar_offset = 0;
+module_param(ddr_mmap_bar_offset, ulong, 0444);
+MODULE_PARM_DESC(ddr_mmap_bar_offset, "Offset of the device memory window in the BAR");
+static ulong ddr_mmap_size = 0;
+module_param(ddr_mmap_size, ulong, 0444);
+MODULE_PARM_DESC(ddr_mmap_size, "Size of the device memory window, 0 uses the rest of the BAR");
+static ulong ddr_mmap_dev_addr = 0;
+module_param(ddr_mmap_dev_addr, ulong, 0444);
+MODULE_PARM_DESC(ddr_mmap_dev_addr, "Device memory address at the start of the window");
+
 /**
  * Minor of this char device
  **/
 static int cdev_minor = 0;
 
+static void onic_reg_buf_release(struct kref *ref);
+
 /**
  * Open a character device and initialize private data
  **/
 static int onic_cdev_open(struct inode *inode, struct file *file) {
   struct onic_cdev *onic_cdev_ptr = container_of(inode->i_cdev, struct onic_cdev, mm_cdev);
-  file->private_data = onic_cdev_ptr;
+  struct onic_cdev_file *cfile;
+
+  cfile = kzalloc(sizeof(struct onic_cdev_file), GFP_KERNEL);
+  if (!cfile)
+    return -ENOMEM;
+
+  cfile->xcdev = onic_cdev_ptr;
+  cfile->bound_queue = (unsigned int) atomic_inc_return(&onic_cdev_ptr->next_bind_queue) %
+                       onic_cdev_ptr->no_mm_queues;
+  idr_init(&cfile->reg_bufs);
+  mutex_init(&cfile->reg_lock);
+  file->private_data = cfile;
   dev_dbg(&onic_cdev_ptr->qdev->pdev->dev, "%s: Open onic_cdev.\n", onic_cdev_ptr->name);
   return 0;
 }
 
+static int onic_cdev_release_reg_buf(int id, void *p, void *data)
+{
+  struct onic_reg_buf *reg = p;
+
+  kref_put(&reg->ref, onic_reg_buf_release);
+  return 0;
+}
+
 /**
- * Close a character device
+ * Close a character device, buffers still registered are released
  **/
 static int onic_cdev_close(struct inode *inode, struct file *file) {
-  // Do nothing
-  struct onic_cdev *onic_cdev_ptr = (struct onic_cdev*) file->private_data;
+  struct onic_cdev_file *cfile = (struct onic_cdev_file *) file->private_data;
+  struct onic_cdev *onic_cdev_ptr = cfile->xcdev;
+
+  idr_for_each(&cfile->reg_bufs, onic_cdev_release_reg_buf, NULL);
+  idr_destroy(&cfile->reg_bufs);
+  kfree(cfile);
   dev_info(&onic_cdev_ptr->qdev->pdev->dev, "%s: Close onic_cdev.\n", onic_cdev_ptr->name);
   return 0;
 }
 
+/**
+ * Take an MM queue from the shared pool. Blocks until one is free, or returns -1 if
+ * the pool is empty and block is false
+ **/
+static int onic_cdev_pool_get(struct onic_cdev *xcdev, bool write, bool block)
+{
+  int target_queue;
+
+  if (write) {
+    if (block)
+      down(&write_sem);
+    else if (down_trylock(&write_sem))
+      return -1;
+    down(&write_mutex);
+    target_queue = write_queue_pool[write_read_idx];
+    write_read_idx = (write_read_idx + 1) % xcdev->no_mm_queues;
+    up(&write_mutex);
+  } else {
+    if (block)
+      down(&read_sem);
+    else if (down_trylock(&read_sem))
+      return -1;
+    down(&read_mutex);
+    target_queue = read_queue_pool[read_read_idx];
+    read_read_idx = (read_read_idx + 1) % xcdev->no_mm_queues;
+    up(&read_mutex);
+  }
+
+  return target_queue;
+}
+
+/**
+ * Give an MM queue back to the shared pool
+ **/
+static void onic_cdev_pool_put(struct onic_cdev *xcdev, bool write, int target_queue)
+{
+  if (write) {
+    down(&write_mutex2);
+    write_queue_pool[write_write_idx] = target_queue;
+    write_write_idx = (write_write_idx + 1) % xcdev->no_mm_queues;
+    up(&write_mutex2);
+    up(&write_sem);
+  } else {
+    down(&read_mutex2);
+    read_queue_pool[read_write_idx] = target_queue;
+    read_write_idx = (read_write_idx + 1) % xcdev->no_mm_queues;
+    up(&read_mutex2);
+    up(&read_sem);
+  }
+}
+
+/**
+ * Get an MM queue for a request and lock it. The queue bound to the file or CPU is
+ * used when it is idle. When it is busy, a pool queue that is idle right now is the
+ * overflow path, and the request only waits for its bound queue if there is none.
+ **/
+static int onic_cdev_get_queue(struct onic_cdev_file *cfile, bool write, bool *pooled)
+{
+  struct onic_cdev *xcdev = cfile->xcdev;
+  struct mutex *q_lock = write ? xcdev->h2c_q_lock : xcdev->c2h_q_lock;
+  int target_queue = -1;
+  int pool_queue;
+  int i;
+
+  switch (mm_queue_binding) {
+  case ONIC_MM_BIND_FILE:
+    target_queue = READ_ONCE(cfile->bound_queue);
+    break;
+  case ONIC_MM_BIND_CPU:
+    target_queue = raw_smp_processor_id() % xcdev->no_mm_queues;
+    break;
+  default:
+    break;
+  }
+
+  if (target_queue >= 0 && mutex_trylock(&q_lock[target_queue])) {
+    *pooled = false;
+    return target_queue;
+  }
+
+  if (target_queue < 0) {
+    /* shared pool: the pool hands a queue to one request at a time */
+    target_queue = onic_cdev_pool_get(xcdev, write, true);
+    mutex_lock(&q_lock[target_queue]);
+    *pooled = true;
+    return target_queue;
+  }
+
+  /*
+   * Pool queues may be bound to other files, only take one whose lock is free so
+   * that the request never waits behind another file's transfer
+   */
+  for (i = 0; i < xcdev->no_mm_queues; i++) {
+    pool_queue = onic_cdev_pool_get(xcdev, write, false);
+    if (pool_queue < 0)
+      break;
+    if (mutex_trylock(&q_lock[pool_queue])) {
+      *pooled = true;
+      return pool_queue;
+    }
+    onic_cdev_pool_put(xcdev, write, pool_queue);
+  }
+
+  mutex_lock(&q_lock[target_queue]);
+  *pooled = false;
+  return target_queue;
+}
+
+/**
+ * Unlock an MM queue taken by onic_cdev_get_queue
+ **/
+static void onic_cdev_put_queue(struct onic_cdev_file *cfile, bool write, int target_queue, bool pooled)
+{
+  struct onic_cdev *xcdev = cfile->xcdev;
+
+  mutex_unlock(write ? &xcdev->h2c_q_lock[target_queue] : &xcdev->c2h_q_lock[target_queue]);
+  if (pooled)
+    onic_cdev_pool_put(xcdev, write, target_queue);
+}
+
+/**
+ * Submit a blocking request on an MM queue
+ **/
+static ssize_t onic_cdev_submit(struct onic_cdev *xcdev, int target_queue, bool write,
+        struct qdma_sw_sg *sgl, unsigned int sgcnt, bool dma_mapped, u64 ep_addr, size_t count)
+{
+  struct qdma_request req;
+  unsigned long qhndl;
+
+  qhndl = write ? xcdev->mm_h2c_q_hndl + target_queue : xcdev->mm_c2h_q_hndl + target_queue;
+
+  memset(&req, 0, sizeof(struct qdma_request));
+  req.sgcnt = sgcnt;
+  req.sgl = sgl;
+  req.write = write ? 1 : 0;
+  req.dma_mapped = dma_mapped ? 1 : 0;
+  req.udd_len = 0;
+  req.ep_addr = ep_addr;
+  req.count = count;
+  req.timeout_ms = 10 * 1000;    /* 10 seconds */
+  req.fp_done = NULL;        /* blocking */
+  req.h2c_eot = 1;        /* set to 1 for STM tests */
+
+  return xcdev->fp_rw(xcdev->dev_handle, qhndl, &req);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#define pin_user_pages_fast(start, nr_pages, gup_flags, pages) \
+  get_user_pages_fast(start, nr_pages, gup_flags, pages)
+
+static void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npages, bool make_dirty)
+{
+  unsigned long i;
+
+  for (i = 0; i < npages; i++) {
+    if (make_dirty)
+      set_page_dirty_lock(pages[i]);
+    put_page(pages[i]);
+  }
+}
+#endif
+
+/**
+ * Charge pages_nr long-term pinned pages to the mm of the caller against RLIMIT_MEMLOCK
+ **/
+static int onic_reg_buf_charge(struct onic_reg_buf *reg, unsigned int pages_nr)
+{
+  unsigned long lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+  if (atomic64_add_return(pages_nr, &current->mm->pinned_vm) > lock_limit &&
+      !capable(CAP_IPC_LOCK)) {
+    atomic64_sub(pages_nr, &current->mm->pinned_vm);
+    return -ENOMEM;
+  }
+
+  mmgrab(current->mm);
+  reg->mm = current->mm;
+  reg->page_charged = pages_nr;
+  return 0;
+}
+
+static void onic_reg_buf_release(struct kref *ref)
+{
+  struct onic_reg_buf *reg = container_of(ref, struct onic_reg_buf, ref);
+  struct device *dev = &reg->xcdev->qdev->pdev->dev;
+  unsigned int i;
+
+  for (i = 0; i < reg->page_nb; i++) {
+    if (reg->dma_addrs[i])
+      dma_unmap_page(dev, reg->dma_addrs[i], PAGE_SIZE, DMA_BIDIRECTIONAL);
+  }
+  if (reg->page_nb)
+    unpin_user_pages_dirty_lock(reg->pages, reg->page_nb, true);
+
+  if (reg->mm) {
+    atomic64_sub(reg->page_charged, &reg->mm->pinned_vm);
+    mmdrop(reg->mm);
+  }
+
+  kvfree(reg->dma_addrs);
+  kvfree(reg->pages);
+  kfree(reg);
+}
+
+/**
+ * ONIC_IOC_REG_BUF: pin and DMA-map a user buffer once and return a handle to it
+ **/
+static long onic_cdev_reg_buf(struct onic_cdev_file *cfile, void __user *uarg)
+{
+  struct onic_cdev *xcdev = cfile->xcdev;
+  struct device *dev = &xcdev->qdev->pdev->dev;
+  struct onic_ioc_reg_buf arg;
+  struct onic_reg_buf *reg;
+  unsigned int pages_nr;
+  unsigned int i;
+  int rv;
+
+  if (copy_from_user(&arg, uarg, sizeof(arg)))
+    return -EFAULT;
+
+  if (arg.len == 0 || arg.addr + arg.len < arg.addr)
+    return -EINVAL;
+
+  pages_nr = DIV_ROUND_UP(offset_in_page(arg.addr) + arg.len, PAGE_SIZE);
+
+  reg = kzalloc(sizeof(struct onic_reg_buf), GFP_KERNEL);
+  if (!reg)
+    return -ENOMEM;
+  kref_init(&reg->ref);
+  reg->xcdev = xcdev;
+  reg->addr = arg.addr;
+  reg->len = arg.len;
+  reg->pages = kvcalloc(pages_nr, sizeof(struct page *), GFP_KERNEL);
+  reg->dma_addrs = kvcalloc(pages_nr, sizeof(dma_addr_t), GFP_KERNEL);
+  if (!reg->pages || !reg->dma_addrs) {
+    rv = -ENOMEM;
+    goto err_out;
+  }
+
+  rv = onic_reg_buf_charge(reg, pages_nr);
+  if (rv < 0) {
+    pr_err("pinning %u user pages exceeds RLIMIT_MEMLOCK.\n", pages_nr);
+    goto err_out;
+  }
+
+  rv = pin_user_pages_fast(arg.addr & PAGE_MASK, pages_nr, FOLL_WRITE | FOLL_LONGTERM, reg->pages);
+  if (rv < 0) {
+    pr_err("unable to pin down %u user pages, %d.\n", pages_nr, rv);
+    goto err_out;
+  }
+  reg->page_nb = rv;
+  if (rv != pages_nr) {
+    pr_err("unable to pin down all %u user pages, %d.\n", pages_nr, rv);
+    rv = -EFAULT;
+    goto err_out;
+  }
+
+  for (i = 0; i < pages_nr; i++) {
+    flush_dcache_page(reg->pages[i]);
+    reg->dma_addrs[i] = dma_map_page(dev, reg->pages[i], 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(dev, reg->dma_addrs[i])) {
+      pr_err("unable to DMA-map page %u of %u.\n", i, pages_nr);
+      reg->dma_addrs[i] = 0;
+      rv = -ENOMEM;
+      goto err_out;
+    }
+  }
+
+  mutex_lock(&cfile->reg_lock);
+  rv = idr_alloc(&cfile->reg_bufs, reg, 1, 0, GFP_KERNEL);
+  mutex_unlock(&cfile->reg_lock);
+  if (rv < 0)
+    goto err_out;
+
+  arg.handle = rv;
+  if (copy_to_user(uarg, &arg, sizeof(arg))) {
+    mutex_lock(&cfile->reg_lock);
+    idr_remove(&cfile->reg_bufs, arg.handle);
+    mutex_unlock(&cfile->reg_lock);
+    rv = -EFAULT;
+    goto err_out;
+  }
+
+  dev_dbg(dev, "%s: registered buffer 0x%lx,%zu as handle %u, %u pages.\n",
+      xcdev->name, reg->addr, reg->len, arg.handle, pages_nr);
+  return 0;
+
+err_out:
+  kref_put(&reg->ref, onic_reg_buf_release);
+  return rv;
+}
+
+/**
+ * ONIC_IOC_UNREG_BUF: drop a handle, the buffer is unpinned once no transfer uses it
+ **/
+static long onic_cdev_unreg_buf(struct onic_cdev_file *cfile, u32 __user *uarg)
+{
+  struct onic_reg_buf *reg;
+  u32 handle;
+
+  if (get_user(handle, uarg))
+    return -EFAULT;
+
+  mutex_lock(&cfile->reg_lock);
+  reg = idr_remove(&cfile->reg_bufs, handle);
+  mutex_unlock(&cfile->reg_lock);
+  if (!reg)
+    return -EINVAL;
+
+  kref_put(&reg->ref, onic_reg_buf_release);
+  return 0;
+}
+
+/**
+ * ONIC_IOC_XFER: DMA between a registered buffer and device memory, without pinning
+ * or mapping pages again
+ **/
+static long onic_cdev_xfer(struct onic_cdev_file *cfile, void __user *uarg)
+{
+  struct onic_cdev *xcdev = cfile->xcdev;
+  struct device *dev = &xcdev->qdev->pdev->dev;
+  struct qdma_sw_sg stack_sgl[ONIC_XFER_STACK_SG];
+  struct qdma_sw_sg *sgl = stack_sgl;
+  struct onic_ioc_xfer arg;
+  struct onic_reg_buf *reg;
+  unsigned long buf_off;
+  unsigned int first_page;
+  unsigned int pg_off;
+  unsigned int pages_nr;
+  unsigned int i;
+  size_t len;
+  int target_queue;
+  bool pooled;
+  long rv;
+
+  if (copy_from_user(&arg, uarg, sizeof(arg)))
+    return -EFAULT;
+
+  mutex_lock(&cfile->reg_lock);
+  reg = idr_find(&cfile->reg_bufs, arg.handle);
+  if (reg)
+    kref_get(&reg->ref);
+  mutex_unlock(&cfile->reg_lock);
+  if (!reg)
+    return -EINVAL;
+
+  if (arg.len == 0 || arg.buf_offset + arg.len < arg.buf_offset ||
+      arg.buf_offset + arg.len > reg->len) {
+    rv = -EINVAL;
+    goto out_put;
+  }
+
+  buf_off = offset_in_page(reg->addr) + arg.buf_offset;
+  first_page = buf_off >> PAGE_SHIFT;
+  pg_off = offset_in_page(buf_off);
+  pages_nr = DIV_ROUND_UP(pg_off + arg.len, PAGE_SIZE);
+
+  if (pages_nr > ONIC_XFER_STACK_SG) {
+    sgl = kmalloc_array(pages_nr, sizeof(struct qdma_sw_sg), GFP_KERNEL);
+    if (!sgl) {
+      rv = -ENOMEM;
+      goto out_put;
+    }
+  }
+
+  len = arg.len;
+  for (i = 0; i < pages_nr; i++) {
+    sgl[i].next = &sgl[i + 1];
+    sgl[i].pg = reg->pages[first_page + i];
+    sgl[i].offset = i ? 0 : pg_off;
+    sgl[i].len = min_t(size_t, PAGE_SIZE - sgl[i].offset, len);
+    sgl[i].dma_addr = reg->dma_addrs[first_page + i] + sgl[i].offset;
+    if (arg.write)
+      dma_sync_single_for_device(dev, sgl[i].dma_addr, sgl[i].len, DMA_BIDIRECTIONAL);
+    len -= sgl[i].len;
+  }
+  sgl[pages_nr - 1].next = NULL;
+
+  target_queue = onic_cdev_get_queue(cfile, arg.write, &pooled);
+  rv = onic_cdev_submit(xcdev, target_queue, arg.write, sgl, pages_nr, true, arg.dev_addr, arg.len);
+  onic_cdev_put_queue(cfile, arg.write, target_queue, pooled);
+
+  if (!arg.write) {
+    for (i = 0; i < pages_nr; i++)
+      dma_sync_single_for_cpu(dev, sgl[i].dma_addr, sgl[i].len, DMA_BIDIRECTIONAL);
+  }
+
+  if (sgl != stack_sgl)
+    kfree(sgl);
+out_put:
+  kref_put(&reg->ref, onic_reg_buf_release);
+  return rv;
+}
+
+/**
+ * ONIC_IOC_GET_INFO: number of MM queues and how they are bound, so that user space
+ * can open one file per queue and stripe a transfer across all of them
+ **/
+static long onic_cdev_get_info(struct onic_cdev_file *cfile, void __user *uarg)
+{
+  struct onic_ioc_info info;
+
+  memset(&info, 0, sizeof(info));
+  info.mm_queues = cfile->xcdev->no_mm_queues;
+  info.mm_queue_binding = mm_queue_binding;
+  if (copy_to_user(uarg, &info, sizeof(info)))
+    return -EFAULT;
+  return 0;
+}
+
+/**
+ * ONIC_IOC_BIND_QUEUE: bind the file to a given MM queue in ONIC_MM_BIND_FILE mode,
+ * so that user space striping over several files does not depend on the open order
+ **/
+static long onic_cdev_bind_queue(struct onic_cdev_file *cfile, u32 __user *uarg)
+{
+  u32 queue;
+
+  if (get_user(queue, uarg))
+    return -EFAULT;
+  if (mm_queue_binding != ONIC_MM_BIND_FILE || queue >= cfile->xcdev->no_mm_queues)
+    return -EINVAL;
+  WRITE_ONCE(cfile->bound_queue, queue);
+  return 0;
+}
+
 static long onic_cdev_ioctl(
   struct file *file,	/* ditto */
   unsigned int ioctl_num,	/* number and param for ioctl */
   unsigned long ioctl_param){
-	return 0;
+  struct onic_cdev_file *cfile = (struct onic_cdev_file *) file->private_data;
+
+  switch (ioctl_num) {
+  case ONIC_IOC_REG_BUF:
+    return onic_cdev_reg_buf(cfile, (void __user *) ioctl_param);
+  case ONIC_IOC_UNREG_BUF:
+    return onic_cdev_unreg_buf(cfile, (u32 __user *) ioctl_param);
+  case ONIC_IOC_XFER:
+    return onic_cdev_xfer(cfile, (void __user *) ioctl_param);
+  case ONIC_IOC_GET_INFO:
+    return onic_cdev_get_info(cfile, (void __user *) ioctl_param);
+  case ONIC_IOC_BIND_QUEUE:
+    return onic_cdev_bind_queue(cfile, (u32 __user *) ioctl_param);
+  default:
+    return -ENOTTY;
+  }
 }
 
 static void unmap_user_buf(struct cdev_io_cb *iocb, bool write)
@@ -192,14 +688,15 @@ err_out:
 }
 
 static ssize_t onic_gen_read_write(struct file *file, char __user *buf,
-        size_t count, loff_t *pos, bool write, int target_queue)
+        size_t count, loff_t *pos, bool write)
 {
-  struct onic_cdev *xcdev = (struct onic_cdev *)file->private_data;
+  struct onic_cdev_file *cfile = (struct onic_cdev_file *)file->private_data;
+  struct onic_cdev *xcdev = cfile ? cfile->xcdev : NULL;
   struct cdev_io_cb iocb;
-  struct qdma_request *req = &iocb.qd_req;
   ssize_t res = 0;
   int rv;
-  unsigned long qhndl;
+  int target_queue;
+  bool pooled;
 
   if (!xcdev) {
     pr_err("file 0x%p, xcdev NULL, 0x%p,%llu, pos %llu, W %d.\n",
@@ -213,11 +710,8 @@ static ssize_t onic_gen_read_write(struct file *file, char __user *buf,
     return -EINVAL;
   }
 
-  qhndl = write ? xcdev->mm_h2c_q_hndl + target_queue : xcdev->mm_c2h_q_hndl + target_queue;
-
-  pr_debug("%s, priv 0x%lx: buf 0x%p,%llu, pos %llu, W %d.\n",
-      xcdev->name, qhndl, buf, (u64)count, (u64)*pos,
-      write);
+  pr_debug("%s: buf 0x%p,%llu, pos %llu, W %d.\n",
+      xcdev->name, buf, (u64)count, (u64)*pos, write);
 
   memset(&iocb, 0, sizeof(struct cdev_io_cb));
   iocb.buf = buf;
@@ -226,37 +720,15 @@ static ssize_t onic_gen_read_write(struct file *file, char __user *buf,
   if (rv < 0)
     return rv;
 
-  req->sgcnt = iocb.page_nb;
-  req->sgl = iocb.sgl;
-  req->write = write ? 1 : 0;
-  req->dma_mapped = 0;
-  req->udd_len = 0;
-  req->ep_addr = (u64)*pos;
-  req->count = count;
-  req->timeout_ms = 10 * 1000;    /* 10 seconds */
-  req->fp_done = NULL;        /* blocking */
-  req->h2c_eot = 1;        /* set to 1 for STM tests */
-
-  res = xcdev->fp_rw(xcdev->dev_handle, qhndl, req);
+  target_queue = onic_cdev_get_queue(cfile, write, &pooled);
+  dev_dbg(&xcdev->qdev->pdev->dev, "%s obtained queue %d%s\n", write ? "Write" : "Read", target_queue,
+          pooled ? " from the pool" : "");
+  res = onic_cdev_submit(xcdev, target_queue, write, iocb.sgl, iocb.page_nb, false, (u64)*pos, count);
+  onic_cdev_put_queue(cfile, write, target_queue, pooled);
 
   unmap_user_buf(&iocb, write);
   iocb_release(&iocb);
 
-  if(!write){
-    down(&read_mutex2);
-    read_queue_pool[read_write_idx] = target_queue;
-    read_write_idx = (read_write_idx + 1) % xcdev->no_mm_queues;
-    up(&read_mutex2);
-    up(&read_sem);
-  }
-  else{
-    down(&write_mutex2);
-    write_queue_pool[write_write_idx] = target_queue;
-    write_write_idx = (write_write_idx + 1) % xcdev->no_mm_queues;
-    up(&write_mutex2);
-    up(&write_sem);
-  }
-
   return res;
 }
 
@@ -264,37 +736,235 @@ static ssize_t onic_gen_read_write(struct file *file, char __user *buf,
  * Write operation for a character device
  **/
 static ssize_t onic_cdev_write(struct file *file, const char __user *usr_buf, size_t count, loff_t *offset) {
-  struct onic_cdev *onic_cdev_ptr = (struct onic_cdev*) file->private_data;
-  int target_queue;
-  down(&write_sem);
-  down(&write_mutex);
-  target_queue = write_queue_pool[write_read_idx];
-  write_read_idx = (write_read_idx + 1) % onic_cdev_ptr->no_mm_queues;
-  up(&write_mutex);
-  dev_dbg(&onic_cdev_ptr->qdev->pdev->dev, "Write obtained queue %d\n", target_queue);
-  return onic_gen_read_write(file, (char *) usr_buf, count, offset, 1, target_queue);
+  return onic_gen_read_write(file, (char *) usr_buf, count, offset, 1);
 }
 
 /**
  * Read operation for a character device
  **/
 static ssize_t onic_cdev_read(struct file *file, char __user *usr_buf, size_t count, loff_t *offset) {
-  struct onic_cdev *onic_cdev_ptr = (struct onic_cdev*) file->private_data;
+  return onic_gen_read_write(file, (char *) usr_buf, count, offset, 0);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+#define iter_iov(io) ((io)->iov)
+#endif
+
+/**
+ * Check for an iterator over user memory, ITER_UBUF is used by read/write and
+ * io_uring for a single buffer since 6.0
+ **/
+static bool onic_iter_user_backed(const struct iov_iter *io)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+  return user_backed_iter(io);
+#else
+  return iter_is_iovec(io);
+#endif
+}
+
+/**
+ * Segment idx of a user backed iterator, the first one starts at iov_offset and the
+ * length is clamped to the bytes left in the iterator
+ **/
+static struct iovec onic_iter_seg(const struct iov_iter *io, unsigned long idx, size_t left)
+{
+  struct iovec seg;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+  if (iter_is_ubuf(io)) {
+    seg.iov_base = io->ubuf + io->iov_offset;
+    seg.iov_len = left;
+    return seg;
+  }
+#endif
+  seg = iter_iov(io)[idx];
+  if (idx == 0) {
+    seg.iov_base += io->iov_offset;
+    seg.iov_len -= io->iov_offset;
+  }
+  seg.iov_len = min(seg.iov_len, left);
+  return seg;
+}
+
+/**
+ * Account a finished segment, the kiocb completes with the last one
+ **/
+static void onic_cdev_aio_put(struct onic_async_io *caio, ssize_t res)
+{
+  unsigned long flags;
+  ssize_t ret;
+
+  spin_lock_irqsave(&caio->lock, flags);
+  if (res < 0) {
+    if (!caio->err)
+      caio->err = res;
+  } else {
+    caio->res += res;
+  }
+  spin_unlock_irqrestore(&caio->lock, flags);
+
+  if (!atomic_dec_and_test(&caio->pending))
+    return;
+
+  ret = caio->err ? caio->err : caio->res;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+  caio->kiocb->ki_complete(caio->kiocb, ret, 0);
+#else // LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+  caio->kiocb->ki_complete(caio->kiocb, ret);
+#endif
+  kfree(caio);
+}
+
+/**
+ * fp_done callback of an asynchronous segment
+ **/
+static int onic_cdev_aio_done(struct qdma_request *req, unsigned int bytes_done, int err)
+{
+  struct cdev_io_cb *iocb = container_of(req, struct cdev_io_cb, qd_req);
+  struct onic_async_io *caio = (struct onic_async_io *) iocb->private;
+
+  unmap_user_buf(iocb, req->write);
+  iocb_release(iocb);
+  onic_cdev_aio_put(caio, err ? err : bytes_done);
+  return 0;
+}
+
+/**
+ * read_iter/write_iter: synchronous kiocbs take the blocking path, asynchronous ones
+ * (aio, io_uring) submit every segment with an fp_done callback and return -EIOCBQUEUED
+ **/
+static ssize_t onic_cdev_rw_iter(struct kiocb *kiocb, struct iov_iter *io, bool write)
+{
+  struct file *file = kiocb->ki_filp;
+  struct onic_cdev_file *cfile = (struct onic_cdev_file *) file->private_data;
+  struct onic_cdev *xcdev = cfile->xcdev;
+  struct onic_async_io *caio;
+  struct cdev_io_cb *iocb;
+  struct qdma_request *req;
+  struct iovec seg;
+  unsigned long nr_segs;
+  unsigned long qhndl;
+  unsigned long submitted = 0;
+  unsigned long i;
+  size_t left;
+  ssize_t res = 0;
+  ssize_t rv = 0;
+  loff_t pos = kiocb->ki_pos;
   int target_queue;
-  down(&read_sem);
-  down(&read_mutex);
-  target_queue = read_queue_pool[read_read_idx];
-  read_read_idx = (read_read_idx + 1) % onic_cdev_ptr->no_mm_queues;
-  up(&read_mutex);
-  dev_dbg(&onic_cdev_ptr->qdev->pdev->dev, "Read obtained queue %d\n", target_queue);
-  return onic_gen_read_write(file, (char *) usr_buf, count, offset, 0, target_queue);
+  bool pooled;
+
+  if (!onic_iter_user_backed(io))
+    return -EINVAL;
+  nr_segs = io->nr_segs;
+  left = iov_iter_count(io);
+  if (!left)
+    return 0;
+
+  if (is_sync_kiocb(kiocb)) {
+    for (i = 0; i < nr_segs && left; i++) {
+      seg = onic_iter_seg(io, i, left);
+      if (!seg.iov_len)
+        continue;
+      rv = onic_gen_read_write(file, seg.iov_base, seg.iov_len, &pos, write);
+      if (rv < 0)
+        break;
+      res += rv;
+      pos += rv;
+      left -= rv;
+    }
+    iov_iter_advance(io, res);
+    kiocb->ki_pos = pos;
+    return res ? res : rv;
+  }
+
+  caio = kzalloc(struct_size(caio, iocbs, nr_segs), GFP_KERNEL);
+  if (!caio)
+    return -ENOMEM;
+  caio->kiocb = kiocb;
+  caio->seg_cnt = nr_segs;
+  spin_lock_init(&caio->lock);
+  atomic_set(&caio->pending, nr_segs + 1);
+
+  /*
+   * The queue lock is held while the segments are submitted so that they are not
+   * interleaved with a blocking request on the same queue. It is dropped before the
+   * segments complete, libqdma keeps several requests in flight on one queue.
+   */
+  target_queue = onic_cdev_get_queue(cfile, write, &pooled);
+  qhndl = write ? xcdev->mm_h2c_q_hndl : xcdev->mm_c2h_q_hndl;
+  qhndl += target_queue;
+
+  for (i = 0; i < nr_segs && left; i++) {
+    seg = onic_iter_seg(io, i, left);
+    iocb = &caio->iocbs[i];
+    iocb->private = caio;
+    iocb->buf = seg.iov_base;
+    iocb->len = seg.iov_len;
+    if (!iocb->len) {
+      onic_cdev_aio_put(caio, 0);
+      continue;
+    }
+    rv = map_user_buf_to_sgl(iocb, write);
+    if (rv < 0)
+      break;
+
+    req = &iocb->qd_req;
+    req->sgcnt = iocb->page_nb;
+    req->sgl = iocb->sgl;
+    req->write = write ? 1 : 0;
+    req->dma_mapped = 0;
+    req->udd_len = 0;
+    req->ep_addr = (u64)pos;
+    req->count = iocb->len;
+    req->timeout_ms = 10 * 1000;    /* 10 seconds */
+    req->fp_done = onic_cdev_aio_done;
+    req->h2c_eot = 1;
+
+    rv = xcdev->fp_rw(xcdev->dev_handle, qhndl, req);
+    if (rv < 0) {
+      unmap_user_buf(iocb, write);
+      iocb_release(iocb);
+      break;
+    }
+    pos += iocb->len;
+    left -= iocb->len;
+    submitted++;
+  }
+  onic_cdev_put_queue(cfile, write, target_queue, pooled);
+
+  if (!submitted) {
+    /* nothing was submitted */
+    kfree(caio);
+    return rv;
+  }
+
+  /* segments that were never submitted fail the request, unused ones are empty */
+  for (; i < nr_segs; i++)
+    onic_cdev_aio_put(caio, rv < 0 ? rv : 0);
+
+  iov_iter_advance(io, pos - kiocb->ki_pos);
+  kiocb->ki_pos = pos;
+  /* drop the submission reference */
+  onic_cdev_aio_put(caio, 0);
+  return -EIOCBQUEUED;
+}
+
+static ssize_t onic_cdev_read_iter(struct kiocb *kiocb, struct iov_iter *io)
+{
+  return onic_cdev_rw_iter(kiocb, io, false);
+}
+
+static ssize_t onic_cdev_write_iter(struct kiocb *kiocb, struct iov_iter *io)
+{
+  return onic_cdev_rw_iter(kiocb, io, true);
 }
 
 /**
  * Set offset in the character device
  */
 static loff_t onic_cdev_llseek(struct file *file, loff_t off, int whence) {
-  struct onic_cdev *onic_cdev_ptr = (struct onic_cdev*) file->private_data;
+  struct onic_cdev *onic_cdev_ptr = ((struct onic_cdev_file *) file->private_data)->xcdev;
 
   loff_t newpos = 0;
 
@@ -320,16 +990,57 @@ static loff_t onic_cdev_llseek(struct file *file, loff_t off, int whence) {
   return newpos;
 }
 
+/**
+ * Map a range of the device memory window to user space, write-combined. The mmap
+ * offset is the device memory address.
+ **/
+static int onic_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct onic_cdev *xcdev = ((struct onic_cdev_file *) file->private_data)->xcdev;
+  struct pci_dev *pdev = xcdev->qdev->pdev;
+  unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  resource_size_t bar_len;
+  resource_size_t win_size;
+  phys_addr_t phys;
+
+  if (ddr_mmap_bar < 0 || ddr_mmap_bar >= PCI_ROM_RESOURCE)
+    return -ENODEV;
+
+  bar_len = pci_resource_len(pdev, ddr_mmap_bar);
+  if (!bar_len || ddr_mmap_bar_offset >= bar_len || !PAGE_ALIGNED(ddr_mmap_bar_offset))
+    return -ENODEV;
+  win_size = ddr_mmap_size ? ddr_mmap_size : bar_len - ddr_mmap_bar_offset;
+  if (ddr_mmap_bar_offset + win_size > bar_len)
+    return -ENODEV;
+
+  if (off < ddr_mmap_dev_addr)
+    return -EINVAL;
+  off -= ddr_mmap_dev_addr;
+  if (off + size < off || off + size > win_size)
+    return -EINVAL;
+
+  phys = pci_resource_start(pdev, ddr_mmap_bar) + ddr_mmap_bar_offset + off;
+  vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+  dev_dbg(&pdev->dev, "%s: mmap device memory 0x%lx,%lu at BAR%d 0x%llx\n", xcdev->name,
+          off + ddr_mmap_dev_addr, size, ddr_mmap_bar, (u64) phys);
+  return io_remap_pfn_range(vma, vma->vm_start, phys >> PAGE_SHIFT, size, vma->vm_page_prot);
+}
+
 /**
  * File operation registration
  **/
 static const struct file_operations onic_cdev_fops = {
   .read         = onic_cdev_read,
   .write        = onic_cdev_write,
+  .read_iter    = onic_cdev_read_iter,
+  .write_iter   = onic_cdev_write_iter,
   .unlocked_ioctl = onic_cdev_ioctl,
   .open         = onic_cdev_open,
   .release      = onic_cdev_close,
   .llseek       = onic_cdev_llseek,
+  .mmap         = onic_cdev_mmap,
 };
 
 int onic_init_cdev(struct onic_cdev *onic_cdev_ptr, int no_mm_queues) {
@@ -362,6 +1073,7 @@ int onic_create_cdev(struct onic_cdev *onic_cdev_ptr, struct onic_priv * xpriv,
   struct xlnx_dma_dev *xdev;
   dev_t dev;
   int no_mm_queues;
+  int i;
 
   onic_cdev_ptr->cdev_minor_cnt = MAX_MINOR_DEV;
 
@@ -379,6 +1091,27 @@ int onic_create_cdev(struct onic_cdev *onic_cdev_ptr, struct onic_priv * xpriv,
 
   read_queue_pool = (int*) kzalloc(sizeof(int) * no_mm_queues, GFP_KERNEL);
   write_queue_pool = (int*) kzalloc(sizeof(int) * no_mm_queues, GFP_KERNEL);
+  onic_cdev_ptr->h2c_q_lock = kcalloc(no_mm_queues, sizeof(struct mutex), GFP_KERNEL);
+  onic_cdev_ptr->c2h_q_lock = kcalloc(no_mm_queues, sizeof(struct mutex), GFP_KERNEL);
+  if (!read_queue_pool || !write_queue_pool || !onic_cdev_ptr->h2c_q_lock || !onic_cdev_ptr->c2h_q_lock) {
+    dev_err(&onic_cdev_ptr->qdev->pdev->dev, "%s: failed to allocate MM queue pools.", ONIC_CDEV_CLASS_NAME);
+    kfree(read_queue_pool);
+    kfree(write_queue_pool);
+    kfree(onic_cdev_ptr->h2c_q_lock);
+    kfree(onic_cdev_ptr->c2h_q_lock);
+    read_queue_pool = NULL;
+    write_queue_pool = NULL;
+    onic_cdev_ptr->h2c_q_lock = NULL;
+    onic_cdev_ptr->c2h_q_lock = NULL;
+    return -ENOMEM;
+  }
+
+  // The queue locks live as long as the device, while onic_init_cdev runs on every ifup
+  for(i = 0 ; i < no_mm_queues ; i++){
+    mutex_init(&onic_cdev_ptr->h2c_q_lock[i]);
+    mutex_init(&onic_cdev_ptr->c2h_q_lock[i]);
+  }
+  atomic_set(&onic_cdev_ptr->next_bind_queue, -1);
 
   // Create a cdev class
   onic_cdev_class = class_create(THIS_MODULE, ONIC_CDEV_CLASS_NAME);
@@ -470,5 +1203,7 @@ void onic_destroy_cdev(struct onic_cdev *onic_cdev_ptr) {
 
   kfree(read_queue_pool);
   kfree(write_queue_pool);
+  kfree(onic_cdev_ptr->h2c_q_lock);
+  kfree(onic_cdev_ptr->c2h_q_lock);
   kfree(onic_cdev_ptr);
 }
@@ -25,9 +25,22 @@
 #include <asm/cacheflush.h>
 #include <linux/syscalls.h>
 #include <linux/semaphore.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include "onic_cdev_ioctl.h"
 
 #define ONIC_CDEV_CLASS_NAME DRV_CDEV_NAME
 #define MAX_MINOR_DEV 64
+/* MM queue binding modes, selected with the mm_queue_binding module parameter */
+/* every request takes a queue from the shared pool */
+#define ONIC_MM_BIND_POOL 0
+/* each open file gets a dedicated queue */
+#define ONIC_MM_BIND_FILE 1
+/* each CPU gets a dedicated queue */
+#define ONIC_MM_BIND_CPU  2
+/* Transfers on a registered buffer up to this many pages build their SG list on the stack */
+#define ONIC_XFER_STACK_SG 16
 
 /**
  * Data structure for a character device
@@ -61,6 +74,12 @@ struct onic_cdev {
   int read_idx;
   int write_idx;
 
+  /* per-queue locks, a queue serves one request at a time */
+  struct mutex *h2c_q_lock;
+  struct mutex *c2h_q_lock;
+  /* next queue handed to an opened file in ONIC_MM_BIND_FILE mode */
+  atomic_t next_bind_queue;
+
 };
 
 /**
@@ -82,6 +101,64 @@ struct cdev_io_cb {
   struct qdma_request qd_req;
 };
 
+/**
+ * Data structure for an asynchronous read_iter/write_iter request, one cdev_io_cb
+ * per iovec segment
+ **/
+struct onic_async_io {
+  /* kiocb completed once all segments are done */
+  struct kiocb *kiocb;
+  /* segments not completed yet, plus one held during submission */
+  atomic_t pending;
+  /* protects res and err */
+  spinlock_t lock;
+  /* bytes transferred */
+  ssize_t res;
+  /* first error */
+  int err;
+  /* number of segments */
+  unsigned int seg_cnt;
+  struct cdev_io_cb iocbs[];
+};
+
+/**
+ * Data structure for an open file of a character device
+ **/
+struct onic_cdev_file {
+  /* character device the file belongs to */
+  struct onic_cdev *xcdev;
+  /* MM queue dedicated to the file in ONIC_MM_BIND_FILE mode */
+  int bound_queue;
+  /* buffers registered through this file, indexed by handle */
+  struct idr reg_bufs;
+  /* protects reg_bufs */
+  struct mutex reg_lock;
+};
+
+/**
+ * Data structure for a user buffer registered with ONIC_IOC_REG_BUF
+ **/
+struct onic_reg_buf {
+  /* held by the handle and by each transfer in flight */
+  struct kref ref;
+  /* character device the buffer is mapped for */
+  struct onic_cdev *xcdev;
+  /* user virtual address of the buffer */
+  unsigned long addr;
+  /* length of the buffer */
+  size_t len;
+  /* number of pages pinned */
+  unsigned int page_nb;
+  /* pinned pages */
+  struct page **pages;
+  /* DMA address of each pinned page */
+  dma_addr_t *dma_addrs;
+  /* mm the pinned pages are charged to */
+  struct mm_struct *mm;
+  /* number of pages charged to mm->pinned_vm */
+  unsigned int page_charged;
+};
+
 /**
  * qdma scatter gather request
  * @ingroup libqdma_struct
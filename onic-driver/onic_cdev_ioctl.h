@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2021 Xilinx, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ */
+#ifndef __ONIC_CDEV_IOCTL_H__
+#define __ONIC_CDEV_IOCTL_H__
+
+/*
+ * ioctl interface of the reconic-mm character device, shared with user space.
+ * lib/reconic_ioctl.h is a copy of this file and must be kept in sync.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ONIC_IOC_MAGIC 'o'
+
+/**
+ * Register a user buffer: pin and DMA-map it once, returns a handle. The pinned
+ * pages count against RLIMIT_MEMLOCK, -ENOMEM is returned above the limit
+ **/
+struct onic_ioc_reg_buf {
+  /* user virtual address of the buffer */
+  __u64 addr;
+  /* length of the buffer in bytes */
+  __u64 len;
+  /* returned handle, valid for the file it was registered on */
+  __u32 handle;
+  __u32 reserved;
+};
+
+/**
+ * Transfer between a registered buffer and device memory
+ **/
+struct onic_ioc_xfer {
+  /* handle returned by ONIC_IOC_REG_BUF */
+  __u32 handle;
+  /* 1: buffer to device (H2C), 0: device to buffer (C2H) */
+  __u32 write;
+  /* offset in the registered buffer */
+  __u64 buf_offset;
+  /* length of the transfer in bytes */
+  __u64 len;
+  /* device memory address */
+  __u64 dev_addr;
+};
+
+/**
+ * Properties of the character device
+ **/
+struct onic_ioc_info {
+  /* number of QDMA MM queues serving the device */
+  __u32 mm_queues;
+  /* MM queue binding mode, 1: each open file gets a dedicated queue */
+  __u32 mm_queue_binding;
+};
+
+#define ONIC_IOC_REG_BUF   _IOWR(ONIC_IOC_MAGIC, 1, struct onic_ioc_reg_buf)
+#define ONIC_IOC_UNREG_BUF _IOW(ONIC_IOC_MAGIC, 2, __u32)
+#define ONIC_IOC_XFER      _IOW(ONIC_IOC_MAGIC, 3, struct onic_ioc_xfer)
+#define ONIC_IOC_GET_INFO  _IOR(ONIC_IOC_MAGIC, 4, struct onic_ioc_info)
+/* bind the file to an MM queue, only with mm_queue_binding 1 */
+#define ONIC_IOC_BIND_QUEUE _IOW(ONIC_IOC_MAGIC, 5, __u32)
+
+#endif /* ifndef __ONIC_CDEV_IOCTL_H__ */
@@ -1,6 +1,7 @@
 #include <linux/pci.h>
 #include <linux/netdevice.h>
 #include <linux/ethtool.h>
+#include <linux/version.h>
 
 #include "onic.h"
 
@@ -19,9 +20,479 @@ static void onic_get_drvinfo(struct net_device *netdev,
 		sizeof(drvinfo->bus_info));
 }
 
+/* Per-queue software counters reported by ethtool -S */
+static const char onic_rx_queue_stats[][ETH_GSTRING_LEN] = {
+	"rx_queue_%u_packets",
+	"rx_queue_%u_bytes",
+};
+
+static const char onic_tx_queue_stats[][ETH_GSTRING_LEN] = {
+	"tx_queue_%u_packets",
+	"tx_queue_%u_bytes",
+	"tx_queue_%u_dropped",
+};
+
+#define ONIC_RX_QUEUE_STATS_LEN ARRAY_SIZE(onic_rx_queue_stats)
+#define ONIC_TX_QUEUE_STATS_LEN ARRAY_SIZE(onic_tx_queue_stats)
+
+static int onic_get_sset_count(struct net_device *netdev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return netdev->real_num_rx_queues * ONIC_RX_QUEUE_STATS_LEN +
+		       netdev->real_num_tx_queues * ONIC_TX_QUEUE_STATS_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void onic_get_strings(struct net_device *netdev, u32 sset, u8 *data)
+{
+	unsigned int q, i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (q = 0; q < netdev->real_num_rx_queues; q++) {
+		for (i = 0; i < ONIC_RX_QUEUE_STATS_LEN; i++) {
+			snprintf(data, ETH_GSTRING_LEN, onic_rx_queue_stats[i], q);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+	for (q = 0; q < netdev->real_num_tx_queues; q++) {
+		for (i = 0; i < ONIC_TX_QUEUE_STATS_LEN; i++) {
+			snprintf(data, ETH_GSTRING_LEN, onic_tx_queue_stats[i], q);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+}
+
+static void onic_get_ethtool_stats(struct net_device *netdev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	unsigned int q;
+
+	for (q = 0; q < netdev->real_num_rx_queues; q++) {
+		*data++ = xpriv->rx_qstats[q].rx_packets;
+		*data++ = xpriv->rx_qstats[q].rx_bytes;
+	}
+	for (q = 0; q < netdev->real_num_tx_queues; q++) {
+		*data++ = xpriv->tx_qstats[q].tx_packets;
+		*data++ = xpriv->tx_qstats[q].tx_bytes;
+		*data++ = xpriv->tx_qstats[q].tx_dropped;
+	}
+}
+
+static void onic_get_channels(struct net_device *netdev,
+			      struct ethtool_channels *ch)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+
+	ch->max_combined = xpriv->max_channels;
+	ch->combined_count = netdev->real_num_rx_queues;
+}
+
+/* The channel count only changes the number of queues seen by the stack and
+ * the default indirection table, all queues created at probe stay in place.
+ */
+static int onic_set_channels(struct net_device *netdev,
+			     struct ethtool_channels *ch)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	unsigned int old_count = netdev->real_num_tx_queues;
+	u32 offset;
+	int ret;
+	int i;
+
+	if (ch->rx_count || ch->tx_count || ch->other_count)
+		return -EINVAL;
+	if (!ch->combined_count || ch->combined_count > xpriv->max_channels)
+		return -EINVAL;
+
+	if (netif_is_rxfh_configured(netdev)) {
+		for (i = 0; i < ONIC_RETA_SIZE; i++) {
+			offset = QDMA_FUNC_OFFSET_INDIR_TABLE(xpriv->pinfo->port_id, i);
+			if ((readl(xpriv->bar_base + offset) & 0x0000FFFF) >=
+			    ch->combined_count) {
+				netdev_err(netdev,
+					   "%s: indirection table uses queues beyond %u\n",
+					   __func__, ch->combined_count);
+				return -EINVAL;
+			}
+		}
+	}
+
+	ret = netif_set_real_num_tx_queues(netdev, ch->combined_count);
+	if (ret)
+		return ret;
+	ret = netif_set_real_num_rx_queues(netdev, ch->combined_count);
+	if (ret) {
+		netif_set_real_num_tx_queues(netdev, old_count);
+		return ret;
+	}
+
+	/* the shell needs the new queue count even with a user table */
+	if (netif_is_rxfh_configured(netdev))
+		onic_set_qconf(xpriv);
+	else
+		onic_init_reta(xpriv);
+
+	return 0;
+}
+
+static int onic_get_rxnfc(struct net_device *netdev,
+			  struct ethtool_rxnfc *cmd, u32 *rule_locs)
+{
+	switch (cmd->cmd) {
+	case ETHTOOL_GRXRINGS:
+		cmd->data = netdev->real_num_rx_queues;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static u32 onic_get_rxfh_indir_size(struct net_device *netdev)
+{
+	return ONIC_RETA_SIZE;
+}
+
+static u32 onic_get_rxfh_key_size(struct net_device *netdev)
+{
+	return ONIC_HASH_KEY_SIZE;
+}
+
+/* The hash key is held in little-endian 32-bit registers */
+static void onic_read_rxfh(struct onic_priv *xpriv, u32 *indir, u8 *key)
+{
+	u8 port_id = xpriv->pinfo->port_id;
+	__le32 val;
+	int i;
+
+	if (indir) {
+		for (i = 0; i < ONIC_RETA_SIZE; i++)
+			indir[i] = readl(xpriv->bar_base +
+					 QDMA_FUNC_OFFSET_INDIR_TABLE(port_id, i)) &
+				   0x0000FFFF;
+	}
+
+	if (key) {
+		for (i = 0; i < ONIC_HASH_KEY_SIZE / 4; i++) {
+			val = cpu_to_le32(readl(xpriv->bar_base +
+						QDMA_FUNC_OFFSET_HASH_KEY(port_id, i)));
+			memcpy(key + i * 4, &val, 4);
+		}
+	}
+}
+
+static int onic_write_rxfh(struct net_device *netdev, const u32 *indir,
+			   const u8 *key, u8 hfunc)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	u8 port_id = xpriv->pinfo->port_id;
+	__le32 val;
+	int i;
+
+	if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+
+	if (indir) {
+		for (i = 0; i < ONIC_RETA_SIZE; i++) {
+			if (indir[i] >= netdev->real_num_rx_queues)
+				return -EINVAL;
+		}
+		for (i = 0; i < ONIC_RETA_SIZE; i++)
+			writel(indir[i] & 0x0000FFFF, xpriv->bar_base +
+			       QDMA_FUNC_OFFSET_INDIR_TABLE(port_id, i));
+	}
+
+	if (key) {
+		for (i = 0; i < ONIC_HASH_KEY_SIZE / 4; i++) {
+			memcpy(&val, key + i * 4, 4);
+			writel(le32_to_cpu(val), xpriv->bar_base +
+			       QDMA_FUNC_OFFSET_HASH_KEY(port_id, i));
+		}
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+static int onic_get_rxfh(struct net_device *netdev, u32 *indir, u8 *key,
+			 u8 *hfunc)
+{
+	if (hfunc)
+		*hfunc = ETH_RSS_HASH_TOP;
+	onic_read_rxfh(netdev_priv(netdev), indir, key);
+	return 0;
+}
+
+static int onic_set_rxfh(struct net_device *netdev, const u32 *indir,
+			 const u8 *key, const u8 hfunc)
+{
+	return onic_write_rxfh(netdev, indir, key, hfunc);
+}
+#else // LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+static int onic_get_rxfh(struct net_device *netdev,
+			 struct ethtool_rxfh_param *rxfh)
+{
+	rxfh->hfunc = ETH_RSS_HASH_TOP;
+	onic_read_rxfh(netdev_priv(netdev), rxfh->indir, rxfh->key);
+	return 0;
+}
+
+static int onic_set_rxfh(struct net_device *netdev,
+			 struct ethtool_rxfh_param *rxfh,
+			 struct netlink_ext_ack *extack)
+{
+	return onic_write_rxfh(netdev, rxfh->indir, rxfh->key, rxfh->hfunc);
+}
+#endif
+
+static int onic_get_csr(struct onic_priv *xpriv, struct global_csr_conf *csr)
+{
+	int ret;
+
+	ret = qdma_global_csr_get(xpriv->dev_handle, 0,
+				  QDMA_GLOBAL_CSR_ARRAY_SZ, csr);
+	if (ret != 0) {
+		netdev_err(xpriv->netdev,
+			   "%s: qdma_global_csr_get() failed with status %d\n",
+			   __func__, ret);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int onic_find_csr_index(unsigned int *arr, u32 val)
+{
+	int i;
+
+	for (i = 0; i < QDMA_GLOBAL_CSR_ARRAY_SZ; i++) {
+		if (arr[i] == val)
+			return i;
+	}
+	return -1;
+}
+
+static void onic_fill_ringparam(struct net_device *netdev,
+				struct ethtool_ringparam *ring)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	struct global_csr_conf csr;
+	u32 max_sz = 0;
+	int i;
+
+	if (onic_get_csr(xpriv, &csr) != 0)
+		return;
+
+	for (i = 0; i < QDMA_GLOBAL_CSR_ARRAY_SZ; i++)
+		max_sz = max(max_sz, csr.ring_sz[i]);
+
+	ring->rx_max_pending = max_sz;
+	ring->tx_max_pending = max_sz;
+	ring->rx_pending = csr.ring_sz[xpriv->rx_desc_rng_sz_idx];
+	ring->tx_pending = csr.ring_sz[xpriv->tx_desc_rng_sz_idx];
+}
+
+/* Ring sizes must be one of the values of the QDMA global ring size CSR. The
+ * queues are re-created, so the interface has to be down.
+ */
+static int onic_apply_ringparam(struct net_device *netdev,
+				struct ethtool_ringparam *ring)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	struct global_csr_conf csr;
+	u8 old_rx_idx = xpriv->rx_desc_rng_sz_idx;
+	u8 old_tx_idx = xpriv->tx_desc_rng_sz_idx;
+	int rx_idx, tx_idx;
+	int ret;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+	if (netif_running(netdev)) {
+		netdev_err(netdev, "%s: bring the interface down first\n",
+			   __func__);
+		return -EBUSY;
+	}
+
+	ret = onic_get_csr(xpriv, &csr);
+	if (ret != 0)
+		return ret;
+
+	rx_idx = onic_find_csr_index(csr.ring_sz, ring->rx_pending);
+	tx_idx = onic_find_csr_index(csr.ring_sz, ring->tx_pending);
+	if (rx_idx < 0 || tx_idx < 0) {
+		netdev_err(netdev, "%s: ring size is not in the QDMA ring size table\n",
+			   __func__);
+		return -EINVAL;
+	}
+	if (rx_idx == old_rx_idx && tx_idx == old_tx_idx)
+		return 0;
+
+	xpriv->rx_desc_rng_sz_idx = rx_idx;
+	xpriv->cmpl_rng_sz_idx = rx_idx;
+	xpriv->tx_desc_rng_sz_idx = tx_idx;
+	ret = onic_qdma_reconfig(xpriv);
+	if (ret != 0) {
+		xpriv->rx_desc_rng_sz_idx = old_rx_idx;
+		xpriv->cmpl_rng_sz_idx = old_rx_idx;
+		xpriv->tx_desc_rng_sz_idx = old_tx_idx;
+		onic_qdma_reconfig(xpriv);
+		return ret;
+	}
+
+	xpriv->pinfo->ring_sz = ring->rx_pending;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+static void onic_get_ringparam(struct net_device *netdev,
+			       struct ethtool_ringparam *ring)
+{
+	onic_fill_ringparam(netdev, ring);
+}
+
+static int onic_set_ringparam(struct net_device *netdev,
+			      struct ethtool_ringparam *ring)
+{
+	return onic_apply_ringparam(netdev, ring);
+}
+#else // LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static void onic_get_ringparam(struct net_device *netdev,
+			       struct ethtool_ringparam *ring,
+			       struct kernel_ethtool_ringparam *kernel_ring,
+			       struct netlink_ext_ack *extack)
+{
+	onic_fill_ringparam(netdev, ring);
+}
+
+static int onic_set_ringparam(struct net_device *netdev,
+			      struct ethtool_ringparam *ring,
+			      struct kernel_ethtool_ringparam *kernel_ring,
+			      struct netlink_ext_ack *extack)
+{
+	return onic_apply_ringparam(netdev, ring);
+}
+#endif
+
+/* rx-usecs and rx-frames map to the C2H completion timer count and count
+ * threshold, both must be values of the QDMA global CSR tables
+ */
+static int onic_fill_coalesce(struct net_device *netdev,
+			      struct ethtool_coalesce *ec)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	struct global_csr_conf csr;
+	int ret;
+
+	ret = onic_get_csr(xpriv, &csr);
+	if (ret != 0)
+		return ret;
+
+	ec->rx_coalesce_usecs = csr.c2h_timer_cnt[xpriv->rx_timer_idx];
+	ec->rx_max_coalesced_frames = csr.c2h_cnt_th[xpriv->rx_cnt_th_idx];
+	return 0;
+}
+
+static int onic_apply_coalesce(struct net_device *netdev,
+			       struct ethtool_coalesce *ec)
+{
+	struct onic_priv *xpriv = netdev_priv(netdev);
+	struct global_csr_conf csr;
+	u8 old_timer_idx = xpriv->rx_timer_idx;
+	u8 old_cnt_th_idx = xpriv->rx_cnt_th_idx;
+	int timer_idx, cnt_th_idx;
+	int ret;
+
+	if (netif_running(netdev)) {
+		netdev_err(netdev, "%s: bring the interface down first\n",
+			   __func__);
+		return -EBUSY;
+	}
+
+	ret = onic_get_csr(xpriv, &csr);
+	if (ret != 0)
+		return ret;
+
+	timer_idx = onic_find_csr_index(csr.c2h_timer_cnt, ec->rx_coalesce_usecs);
+	cnt_th_idx = onic_find_csr_index(csr.c2h_cnt_th,
+					 ec->rx_max_coalesced_frames);
+	if (timer_idx < 0 || cnt_th_idx < 0) {
+		netdev_err(netdev, "%s: value is not in the QDMA C2H timer or threshold table\n",
+			   __func__);
+		return -EINVAL;
+	}
+	if (timer_idx == old_timer_idx && cnt_th_idx == old_cnt_th_idx)
+		return 0;
+
+	xpriv->rx_timer_idx = timer_idx;
+	xpriv->rx_cnt_th_idx = cnt_th_idx;
+	ret = onic_qdma_reconfig(xpriv);
+	if (ret != 0) {
+		xpriv->rx_timer_idx = old_timer_idx;
+		xpriv->rx_cnt_th_idx = old_cnt_th_idx;
+		onic_qdma_reconfig(xpriv);
+		return ret;
+	}
+
+	xpriv->pinfo->c2h_tmr_cnt = ec->rx_coalesce_usecs;
+	xpriv->pinfo->c2h_cnt_thr = ec->rx_max_coalesced_frames;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+static int onic_get_coalesce(struct net_device *netdev,
+			     struct ethtool_coalesce *ec)
+{
+	return onic_fill_coalesce(netdev, ec);
+}
+
+static int onic_set_coalesce(struct net_device *netdev,
+			     struct ethtool_coalesce *ec)
+{
+	return onic_apply_coalesce(netdev, ec);
+}
+#else // LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int onic_get_coalesce(struct net_device *netdev,
+			     struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kernel_coal,
+			     struct netlink_ext_ack *extack)
+{
+	return onic_fill_coalesce(netdev, ec);
+}
+
+static int onic_set_coalesce(struct net_device *netdev,
+			     struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kernel_coal,
+			     struct netlink_ext_ack *extack)
+{
+	return onic_apply_coalesce(netdev, ec);
+}
+#endif
+
 static const struct ethtool_ops onic_ethtool_ops = {
 	.get_drvinfo = onic_get_drvinfo,
 	.get_link = ethtool_op_get_link,
+	.get_sset_count = onic_get_sset_count,
+	.get_strings = onic_get_strings,
+	.get_ethtool_stats = onic_get_ethtool_stats,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+				     ETHTOOL_COALESCE_RX_MAX_FRAMES,
+#endif
+	.get_channels = onic_get_channels,
+	.set_channels = onic_set_channels,
+	.get_rxnfc = onic_get_rxnfc,
+	.get_rxfh_indir_size = onic_get_rxfh_indir_size,
+	.get_rxfh_key_size = onic_get_rxfh_key_size,
+	.get_rxfh = onic_get_rxfh,
+	.set_rxfh = onic_set_rxfh,
+	.get_ringparam = onic_get_ringparam,
+	.set_ringparam = onic_set_ringparam,
+	.get_coalesce = onic_get_coalesce,
+	.set_coalesce = onic_set_coalesce,
 };
 
 void onic_set_ethtool_ops(struct net_device *netdev)
@@ -6,6 +6,9 @@
 #include <linux/etherdevice.h>
 #include <linux/netdevice.h>
 #include <net/busy_poll.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
 
 #include "onic.h"
 
@@ -68,13 +71,214 @@ static int onic_stats_alloc(struct onic_priv *xpriv)
   return 0;
 }
 
-/* This function creates skb and moves data from dma request to network domain */
+#ifdef ONIC_HAVE_XDP
+/* Largest frame an XDP program sees, the frame plus headroom and the skb
+ * shared info for XDP_PASS fit in one page
+ */
+#define ONIC_XDP_MAX_LEN (PAGE_SIZE - XDP_PACKET_HEADROOM - \
+        SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+static int onic_tx_done(struct qdma_request *req, unsigned int bytes_done,
+      int err);
+
+/* This function sends a frame back out of the port for XDP_TX. The frame is
+ * released on failure.
+ */
+static int onic_xdp_xmit_frame(struct onic_priv *xpriv, u16 q_id,
+             struct xdp_frame *xdpf)
+{
+  struct net_device *netdev = xpriv->netdev;
+  struct onic_dma_request *onic_req;
+  struct qdma_request *qdma_req;
+  struct qdma_sw_sg *qdma_sgl;
+  int count;
+
+  /* minimum Ethernet packet length is 60, the page has room for padding */
+  if (xdpf->len < ETH_ZLEN) {
+    memset(xdpf->data + xdpf->len, 0, ETH_ZLEN - xdpf->len);
+    xdpf->len = ETH_ZLEN;
+  }
+
+  onic_req = kmem_cache_zalloc(xpriv->dma_req, GFP_ATOMIC);
+  if (unlikely(!onic_req))
+    goto free_frame;
+
+  qdma_req = &onic_req->qdma;
+  qdma_sgl = &onic_req->sgl[0];
+  onic_req->xdpf = xdpf;
+  onic_req->netdev = netdev;
+
+  qdma_sgl->len = xdpf->len;
+  qdma_sgl->next = NULL;
+  qdma_sgl->dma_addr = dma_map_single(netdev->dev.parent, xdpf->data,
+              xdpf->len, DMA_TO_DEVICE);
+  if (unlikely(dma_mapping_error(netdev->dev.parent, qdma_sgl->dma_addr)))
+    goto free_req;
+
+  qdma_req->sgl = qdma_sgl;
+  qdma_req->sgcnt = 1;
+  qdma_req->count = xdpf->len;
+  qdma_req->dma_mapped = 1;
+  qdma_req->check_qstate_disabled = 1;
+  qdma_req->fp_done = onic_tx_done;
+  qdma_req->uld_data = (unsigned long)onic_req;
+
+  count = qdma_queue_packet_write(xpriv->dev_handle,
+          xpriv->base_tx_q_handle + q_id, qdma_req);
+  if (unlikely(count < 0)) {
+    dma_unmap_single(netdev->dev.parent, qdma_sgl->dma_addr,
+         qdma_sgl->len, DMA_TO_DEVICE);
+    goto free_req;
+  }
+
+  xpriv->tx_qstats[q_id].tx_packets++;
+  xpriv->tx_qstats[q_id].tx_bytes += xdpf->len;
+  return 0;
+
+free_req:
+  kmem_cache_free(xpriv->dma_req, onic_req);
+free_frame:
+  xdp_return_frame_rx_napi(xdpf);
+  xpriv->tx_qstats[q_id].tx_dropped++;
+  return -ENOMEM;
+}
+
+/* This function runs the XDP program on a received packet. libqdma owns the
+ * C2H buffers and leaves no headroom in them, so the packet is copied into a
+ * page laid out for XDP and the C2H pages are released at once. The page
+ * becomes the skb head on XDP_PASS.
+ */
+static int onic_rx_xdp(struct onic_priv *xpriv, struct bpf_prog *prog,
+           u32 q_no, unsigned int len, unsigned int sgcnt,
+           struct qdma_sw_sg *sgl)
+{
+  struct net_device *netdev = xpriv->netdev;
+  struct qdma_sw_sg *c2h_sgl = sgl;
+  struct xdp_frame *xdpf;
+  struct xdp_buff xdp;
+  struct sk_buff *skb;
+  struct page *page;
+  unsigned int copy_len, off = 0;
+  void *va;
+  u32 act;
+
+  if (unlikely(len > ONIC_XDP_MAX_LEN)) {
+    netdev_err(netdev, "%s: packet of %u bytes too large for XDP\n",
+         __func__, len);
+    return -EMSGSIZE;
+  }
+
+  page = dev_alloc_page();
+  if (unlikely(!page))
+    return -ENOMEM;
+  va = page_address(page);
+
+  while (sgcnt && c2h_sgl) {
+    copy_len = min(len - off, c2h_sgl->len);
+    memcpy(va + XDP_PACKET_HEADROOM + off,
+           page_address(c2h_sgl->pg) + c2h_sgl->offset, copy_len);
+    off += copy_len;
+    put_page(c2h_sgl->pg);
+
+    sgcnt--;
+    c2h_sgl = c2h_sgl->next;
+  }
+
+  xdp_init_buff(&xdp, PAGE_SIZE, &xpriv->xdp_rxq[q_no]);
+  xdp_prepare_buff(&xdp, va, XDP_PACKET_HEADROOM, len, false);
+
+  act = bpf_prog_run_xdp(prog, &xdp);
+  switch (act) {
+  case XDP_PASS:
+    skb = build_skb(va, PAGE_SIZE);
+    if (unlikely(!skb))
+      break;
+    skb_reserve(skb, xdp.data - xdp.data_hard_start);
+    __skb_put(skb, xdp.data_end - xdp.data);
+
+    skb->protocol = eth_type_trans(skb, netdev);
+    skb->ip_summed = CHECKSUM_NONE;
+    skb_record_rx_queue(skb, q_no);
+    skb_mark_napi_id(skb, &xpriv->napi[q_no]);
+    napi_gro_receive(&xpriv->napi[q_no], skb);
+    return 0;
+  case XDP_TX:
+    xdpf = xdp_convert_buff_to_frame(&xdp);
+    if (unlikely(!xdpf))
+      break;
+    onic_xdp_xmit_frame(xpriv, q_no % netdev->real_num_tx_queues, xdpf);
+    return 0;
+  case XDP_REDIRECT:
+    if (xdp_do_redirect(netdev, &xdp, prog) == 0)
+      return 0;
+    break;
+  default:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+    bpf_warn_invalid_xdp_action(act);
+#else // LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    bpf_warn_invalid_xdp_action(netdev, prog, act);
+#endif
+    fallthrough;
+  case XDP_ABORTED:
+    trace_xdp_exception(netdev, prog, act);
+    fallthrough;
+  case XDP_DROP:
+    break;
+  }
+
+  put_page(page);
+  xpriv->rx_qstats[q_no].rx_dropped++;
+  return 0;
+}
+
+/* This function attaches or detaches the XDP program of all RX queues */
+static int onic_xdp_setup(struct net_device *netdev, struct bpf_prog *prog,
+        struct netlink_ext_ack *extack)
+{
+  struct onic_priv *xpriv = netdev_priv(netdev);
+  struct bpf_prog *old_prog;
+
+  if (prog && netdev->mtu + ETH_HLEN + VLAN_HLEN > ONIC_XDP_MAX_LEN) {
+    NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP");
+    return -EINVAL;
+  }
+
+  old_prog = xchg(&xpriv->xdp_prog, prog);
+  if (old_prog)
+    bpf_prog_put(old_prog);
+
+  netdev_info(netdev, "%s: XDP program %s\n", __func__,
+        prog ? "attached" : "detached");
+  return 0;
+}
+
+static int onic_xdp(struct net_device *netdev, struct netdev_bpf *bpf)
+{
+  switch (bpf->command) {
+  case XDP_SETUP_PROG:
+    return onic_xdp_setup(netdev, bpf->prog, bpf->extack);
+  default:
+    return -EINVAL;
+  }
+}
+#endif /* ONIC_HAVE_XDP */
+
+/* This function creates skb and moves data from dma request to network domain.
+ * Packets up to ONIC_RX_COPY_THRES are copied into a small skb from the NAPI
+ * frag cache so the C2H page is released at once. Larger packets attach the C2H
+ * pages as frags of the NAPI frags skb without any copy; GRO pulls the headers
+ * and reuses the skb head when packets are merged.
+ */
 static int onic_rx_deliver(struct onic_priv *xpriv, u32 q_no, unsigned int len,
          unsigned int sgcnt, struct qdma_sw_sg *sgl, void *udd)
 {
   struct net_device *netdev = xpriv->netdev;
+  struct napi_struct *napi = &xpriv->napi[q_no];
   struct sk_buff *skb = NULL;
   struct qdma_sw_sg *c2h_sgl = sgl;
+#ifdef ONIC_HAVE_XDP
+  struct bpf_prog *prog;
+#endif
 
   if (!sgcnt) {
     netdev_err(netdev, "%s: SG Count is NULL\n", __func__);
@@ -85,63 +289,85 @@ static int onic_rx_deliver(struct onic_priv *xpriv, u32 q_no, unsigned int len,
     return -EINVAL;
   }
 
+#ifdef ONIC_HAVE_XDP
+  prog = READ_ONCE(xpriv->xdp_prog);
+  if (prog)
+    return onic_rx_xdp(xpriv, prog, q_no, len, sgcnt, sgl);
+#endif
+
   if (len <= ONIC_RX_COPY_THRES || !(netdev->features & NETIF_F_SG)) {
-    skb = napi_alloc_skb(&xpriv->napi[q_no], len);
+    unsigned int copy_len;
+    unsigned int left = len;
+
+    skb = napi_alloc_skb(napi, len);
     if (unlikely(!skb)) {
       netdev_err(netdev, "%s: napi_alloc_skb() failed\n",
            __func__);
       return -ENOMEM;
     }
 
-    skb_copy_to_linear_data(skb, page_address(c2h_sgl->pg) +
-          c2h_sgl->offset, len);
-    __skb_put(skb, len);
-    put_page(c2h_sgl->pg);
+    /* A packet larger than one C2H buffer spans several SG entries */
+    while (sgcnt && c2h_sgl) {
+      copy_len = min(left, c2h_sgl->len);
+      skb_put_data(skb, page_address(c2h_sgl->pg) + c2h_sgl->offset,
+             copy_len);
+      left -= copy_len;
+      put_page(c2h_sgl->pg);
+
+      sgcnt--;
+      c2h_sgl = c2h_sgl->next;
+    }
+
+    skb->protocol = eth_type_trans(skb, netdev);
+    skb->ip_summed = CHECKSUM_NONE;
+    skb_record_rx_queue(skb, q_no);
+    skb_mark_napi_id(skb, napi);
+    napi_gro_receive(napi, skb);
   } else {
     unsigned int nr_frags = 0;
-    unsigned int frag_len;
-    unsigned int frag_offset;
 
-    /* Main body length for sk_buffs used for Rx Ethernet packets
-     * with fragments. Should be >= ONIC_RX_PULL_LEN
-     */
-    skb = napi_alloc_skb(&xpriv->napi[q_no], ONIC_RX_PULL_LEN);
+    skb = napi_get_frags(napi);
     if (unlikely(!skb)) {
-      netdev_err(netdev, "%s: napi_alloc_skb() failed\n",
+      netdev_err(netdev, "%s: napi_get_frags() failed\n",
            __func__);
       return -ENOMEM;
     }
 
-    skb_copy_to_linear_data(skb,
-          page_address(c2h_sgl->pg) + c2h_sgl->offset,
-          ONIC_RX_PULL_LEN);
-    __skb_put(skb, ONIC_RX_PULL_LEN);
-
-    c2h_sgl->offset += ONIC_RX_PULL_LEN;
-    c2h_sgl->len -= ONIC_RX_PULL_LEN;
-
-    while (sgcnt && c2h_sgl) {
-      frag_len = c2h_sgl->len;
-      frag_offset = c2h_sgl->offset;
+    while (sgcnt && c2h_sgl && nr_frags < MAX_SKB_FRAGS) {
       skb_fill_page_desc(skb, nr_frags, c2h_sgl->pg,
-             frag_offset, frag_len);
+             c2h_sgl->offset, c2h_sgl->len);
 
       sgcnt--;
       c2h_sgl = c2h_sgl->next;
       nr_frags++;
     }
 
-    skb->len = len;
-    skb->data_len = len - ONIC_RX_PULL_LEN;
-    skb->truesize += skb->data_len;
-  }
+    if (unlikely(sgcnt)) {
+      /* Drop the packet: pages already attached are released
+       * with the skb, the remaining ones are put here and 0 is
+       * returned so that the caller does not release them again
+       */
+      netdev_err(netdev, "%s: packet of %u bytes exceeds the frag limit\n",
+           __func__, len);
+      napi_free_frags(napi);
+      while (sgcnt && c2h_sgl) {
+        put_page(c2h_sgl->pg);
+        sgcnt--;
+        c2h_sgl = c2h_sgl->next;
+      }
+      return 0;
+    }
 
-  skb->protocol = eth_type_trans(skb, netdev);
-  skb->ip_summed = CHECKSUM_NONE;
-  skb_record_rx_queue(skb, q_no);
+    skb->len = len;
+    skb->data_len = len;
+    skb->truesize += len;
+    skb->ip_summed = CHECKSUM_NONE;
+    skb_record_rx_queue(skb, q_no);
+    skb_mark_napi_id(skb, napi);
 
-  skb_mark_napi_id(skb, &xpriv->napi[q_no]);
-  netif_receive_skb(skb);
+    /* eth_type_trans() is done by napi_gro_frags() */
+    napi_gro_frags(napi);
+  }
 
   return 0;
 }
@@ -234,6 +460,11 @@ static int onic_rx_poll(struct napi_struct *napi, int quota)
 
   /* Call queue service for QDMA Core to service queue */
   ret = qdma_queue_service(xpriv->dev_handle, q_handle, quota, true);
+#ifdef ONIC_HAVE_XDP
+  /* Flush frames queued by XDP_REDIRECT in this poll */
+  if (READ_ONCE(xpriv->xdp_prog))
+    xdp_do_flush();
+#endif
   /* Indicate napi_complete irrespective of ret */
   napi_complete(napi);
   if (!xpriv->pinfo->poll_mode && ret < 0) {
@@ -348,8 +579,9 @@ static int onic_qdma_rx_queue_add(struct onic_priv *xpriv, u32 q_no,
   return 0;
 }
 
-/* This function releases Rx queues */
-static void onic_qdma_rx_queue_release(struct onic_priv *xpriv, int num_queues)
+/* This function releases Rx queues, the AXI-MM ones only when mm is set */
+static void onic_qdma_rx_queue_release(struct onic_priv *xpriv, int num_queues,
+                                       bool mm)
 {
   struct xlnx_dma_dev* xdev;
   struct qdma_dev *qdev;
@@ -358,6 +590,10 @@ static void onic_qdma_rx_queue_release(struct onic_priv *xpriv, int num_queues)
   int ret = 0, q_no = 0;
   char error_str[ONIC_ERROR_STR_BUF_LEN] = { '0' };
 
+  /* the AXI-MM queues follow the network queues */
+  if (!mm)
+    num_queues = min(num_queues, QDMA_NET_QUEUE);
+
   xdev = (struct xlnx_dma_dev *) xpriv->dev_handle;
   qdev = xdev_2_qdev(xdev);
 
@@ -372,25 +608,46 @@ static void onic_qdma_rx_queue_release(struct onic_priv *xpriv, int num_queues)
             __func__, q_no, ret, error_str);
       }
     }
-    if (q_no < QDMA_NET_QUEUE) {
+    if (q_no < QDMA_NET_QUEUE && xpriv->napi) {
       netif_napi_del(&xpriv->napi[q_no]);
     }
+#ifdef ONIC_HAVE_XDP
+    if (q_no < QDMA_NET_QUEUE && xpriv->xdp_rxq &&
+        xdp_rxq_info_is_reg(&xpriv->xdp_rxq[q_no]))
+      xdp_rxq_info_unreg(&xpriv->xdp_rxq[q_no]);
+#endif
   }
 
   kfree(xpriv->napi);
+  xpriv->napi = NULL;
+#ifdef ONIC_HAVE_XDP
+  kfree(xpriv->xdp_rxq);
+  xpriv->xdp_rxq = NULL;
+#endif
+  xpriv->pinfo->active_rx_queues -= num_queues;
 }
 
-/* This function sets up RX queues */
-static int onic_qdma_rx_queue_setup(struct onic_priv *xpriv)
+/* This function sets up RX queues, the AXI-MM ones only when mm is set */
+static int onic_qdma_rx_queue_setup(struct onic_priv *xpriv, bool mm)
 {
   int ret = 0, q_no = 0;
 
-  xpriv->napi = kcalloc(xpriv->netdev->real_num_rx_queues,
+  xpriv->napi = kcalloc(xpriv->max_channels,
             sizeof(struct napi_struct), GFP_KERNEL);
   if (!xpriv->napi)
     return -ENOMEM;
 
-  for (q_no = 0; q_no < xpriv->netdev->real_num_rx_queues; q_no++) {
+#ifdef ONIC_HAVE_XDP
+  xpriv->xdp_rxq = kcalloc(xpriv->max_channels,
+         sizeof(struct xdp_rxq_info), GFP_KERNEL);
+  if (!xpriv->xdp_rxq) {
+    kfree(xpriv->napi);
+    xpriv->napi = NULL;
+    return -ENOMEM;
+  }
+#endif
+
+  for (q_no = 0; q_no < xpriv->max_channels; q_no++) {
     ret = onic_qdma_rx_queue_add(xpriv, q_no, xpriv->rx_timer_idx,
                xpriv->rx_cnt_th_idx, 1);
     if (ret != 0) {
@@ -401,10 +658,23 @@ static int onic_qdma_rx_queue_setup(struct onic_priv *xpriv)
     }
     netif_napi_add(xpriv->netdev, &xpriv->napi[q_no], onic_rx_poll,
              ONIC_NAPI_WEIGHT);
+
+#ifdef ONIC_HAVE_XDP
+    ret = xdp_rxq_info_reg(&xpriv->xdp_rxq[q_no], xpriv->netdev, q_no, 0);
+    if (ret == 0)
+      ret = xdp_rxq_info_reg_mem_model(&xpriv->xdp_rxq[q_no],
+               MEM_TYPE_PAGE_SHARED, NULL);
+    if (ret != 0) {
+      netdev_err(xpriv->netdev,
+           "%s: xdp_rxq_info_reg() failed for queue %d with status %d\n",
+           __func__, q_no, ret);
+      goto release_rx_q;
+    }
+#endif
   }
 
   // Add rx queue for QDMA AXI-MM channels
-  for (q_no = QDMA_NET_QUEUE; q_no < (QDMA_NET_QUEUE + xpriv->pinfo->mm_queues); q_no++) {
+  for (q_no = QDMA_NET_QUEUE; mm && q_no < (QDMA_NET_QUEUE + xpriv->pinfo->mm_queues); q_no++) {
     ret = onic_qdma_rx_queue_add(xpriv, q_no, xpriv->rx_timer_idx,
                xpriv->rx_cnt_th_idx, 1);
     if (ret != 0) {
@@ -419,7 +689,7 @@ static int onic_qdma_rx_queue_setup(struct onic_priv *xpriv)
 
 release_rx_q:
   //onic_qdma_rx_queue_release(xpriv, q_no);
-  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues);
+  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, mm);
   return ret;
 }
 
@@ -444,8 +714,9 @@ static void onic_isr_tx_tophalf(unsigned long qhndl, unsigned long uld)
        __func__, q_no);
 }
 
-/* This function release Tx queues */
-static void onic_qdma_tx_queue_release(struct onic_priv *xpriv, int num_queues)
+/* This function release Tx queues, the AXI-MM ones only when mm is set */
+static void onic_qdma_tx_queue_release(struct onic_priv *xpriv, int num_queues,
+                                       bool mm)
 {
   struct xlnx_dma_dev* xdev;
   struct qdma_dev *qdev;
@@ -454,6 +725,10 @@ static void onic_qdma_tx_queue_release(struct onic_priv *xpriv, int num_queues)
   int ret = 0, q_no = 0;
   char error_str[ONIC_ERROR_STR_BUF_LEN] = { '0' };
 
+  /* the AXI-MM queues follow the network queues */
+  if (!mm)
+    num_queues = min(num_queues, QDMA_NET_QUEUE);
+
   xdev = (struct xlnx_dma_dev *) xpriv->dev_handle;
   qdev = xdev_2_qdev(xdev);
 
@@ -469,17 +744,19 @@ static void onic_qdma_tx_queue_release(struct onic_priv *xpriv, int num_queues)
       }
     }
   }
+
+  xpriv->pinfo->active_tx_queues -= num_queues;
 }
 
-/* This function sets up Tx queues */
-static int onic_qdma_tx_queue_setup(struct onic_priv *xpriv)
+/* This function sets up Tx queues, the AXI-MM ones only when mm is set */
+static int onic_qdma_tx_queue_setup(struct onic_priv *xpriv, bool mm)
 {
   int ret = 0, q_no = 0;
   char error_str[ONIC_ERROR_STR_BUF_LEN] = { '0' };
   unsigned long q_handle = 0;
   struct qdma_queue_conf qconf;
 
-  for (q_no = 0; q_no < (xpriv->netdev->real_num_tx_queues + xpriv->pinfo->mm_queues); q_no++) {
+  for (q_no = 0; q_no < (xpriv->max_channels + (mm ? xpriv->pinfo->mm_queues : 0)); q_no++) {
     memset(&qconf, 0, sizeof(struct qdma_queue_conf));
     qconf.st = (q_no >= QDMA_NET_QUEUE) ? 0 : 1;
     qconf.q_type = Q_H2C;
@@ -516,11 +793,43 @@ static int onic_qdma_tx_queue_setup(struct onic_priv *xpriv)
   return 0;
 
 cleanup_tx_q:
-  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues);
+  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues, mm);
   return ret;
 }
 
 
+/* This function re-creates the network QDMA queues so that a new ring size or
+ * interrupt moderation setting takes effect. The interface must be down. The
+ * AXI-MM queues of the reconic-mm device are left alone, its users only hold
+ * the per-queue locks and keep using their queue handles.
+ */
+int onic_qdma_reconfig(struct onic_priv *xpriv)
+{
+  int ret = 0;
+
+  if (netif_running(xpriv->netdev))
+    return -EBUSY;
+
+  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues, false);
+  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, false);
+
+  ret = onic_qdma_rx_queue_setup(xpriv, false);
+  if (ret != 0) {
+    netdev_err(xpriv->netdev, "%s: onic_qdma_rx_queue_setup() failed with status %d\n",
+         __func__, ret);
+    return ret;
+  }
+
+  ret = onic_qdma_tx_queue_setup(xpriv, false);
+  if (ret != 0) {
+    netdev_err(xpriv->netdev, "%s: onic_qdma_tx_queue_setup() failed with status %d\n",
+         __func__, ret);
+    onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, false);
+  }
+
+  return ret;
+}
+
 /* This function stops Tx and Rx queues operations */
 static int onic_qdma_stop(struct onic_priv *xpriv, unsigned short int txq,
         unsigned short int rxq)
@@ -630,11 +939,11 @@ int onic_open(struct net_device *netdev)
     goto release_queues;
   }
 
-  for (q_no = 0; q_no < xpriv->netdev->real_num_rx_queues; q_no++)
+  for (q_no = 0; q_no < xpriv->max_channels; q_no++)
     napi_enable(&xpriv->napi[q_no]);
 
   if (xpriv->pinfo->poll_mode)
-    for (q_no = 0; q_no < xpriv->netdev->real_num_rx_queues; q_no++)
+    for (q_no = 0; q_no < xpriv->max_channels; q_no++)
       napi_schedule(&xpriv->napi[q_no]);
 
   netif_tx_start_all_queues(netdev);
@@ -645,8 +954,8 @@ int onic_open(struct net_device *netdev)
   return 0;
 
 release_queues:
-  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues);
-  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues);
+  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues, true);
+  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, true);
   return ret;
 }
 
@@ -671,7 +980,7 @@ static int onic_stop(struct net_device *netdev)
   netif_tx_stop_all_queues(netdev);
   netif_carrier_off(netdev);
 
-  for (q_no = 0; q_no < xpriv->netdev->real_num_rx_queues; q_no++)
+  for (q_no = 0; q_no < xpriv->max_channels; q_no++)
     napi_disable(&xpriv->napi[q_no]);
 
   ret = onic_qdma_stop(xpriv, xpriv->pinfo->active_tx_queues,
@@ -719,6 +1028,16 @@ static int onic_unmap_free_pkt_data(struct qdma_request *req)
     return -EINVAL;
   }
 
+#ifdef ONIC_HAVE_XDP
+  if (onic_req->xdpf) {
+    dma_unmap_single(netdev->dev.parent, req->sgl->dma_addr,
+         req->sgl->len, DMA_TO_DEVICE);
+    xdp_return_frame(onic_req->xdpf);
+    kmem_cache_free(xpriv->dma_req, onic_req);
+    return 0;
+  }
+#endif
+
   skb = onic_req->skb;
   if (unlikely(!skb)) {
     netdev_err(netdev, "%s: skb is NULL\n", __func__);
@@ -739,7 +1058,7 @@ static int onic_unmap_free_pkt_data(struct qdma_request *req)
   while (qdma_sgl && (frag_index < nb_frags)) {
     frag = &skb_shinfo(skb)->frags[frag_index];
     qdma_sgl->len = skb_frag_size(frag);
-    dma_unmap_single(netdev->dev.parent, qdma_sgl->dma_addr,
+    dma_unmap_page(netdev->dev.parent, qdma_sgl->dma_addr,
          qdma_sgl->len, DMA_TO_DEVICE);
     qdma_sgl = qdma_sgl->next;
     frag_index++;
@@ -770,8 +1089,8 @@ static int onic_tx_done(struct qdma_request *req, unsigned int bytes_done,
   return 0;
 }
 
-/* This function is called from networking stack in order to send packet */
-static int onic_start_xmit(struct sk_buff *skb, struct net_device *netdev)
+/* This function sends one non-GSO packet */
+static int onic_xmit_one(struct sk_buff *skb, struct net_device *netdev)
 {
   u16 q_id = 0, nb_frags = 0, frag_index = 0;
   int ret = 0, count = 0;
@@ -796,11 +1115,6 @@ static int onic_start_xmit(struct sk_buff *skb, struct net_device *netdev)
     return -EINVAL;
   }
 
-  if (unlikely(skb_is_gso(skb))) {
-    netdev_err(netdev, "%s: Received GSO SKB\n", __func__);
-    return -EINVAL;
-  }
-
   /* minimum Ethernet packet length is 60 */
   ret = skb_put_padto(skb, ETH_ZLEN);
   if (unlikely(ret != 0)) {
@@ -826,6 +1140,8 @@ static int onic_start_xmit(struct sk_buff *skb, struct net_device *netdev)
   if (unlikely(!onic_req)) {
     netdev_err(netdev, "%s: onic_req allocation failed\n",
          __func__);
+    dev_kfree_skb_any(skb);
+    xpriv->tx_qstats[q_id].tx_dropped++;
     return -ENOMEM;
   }
   qdma_req = &onic_req->qdma;
@@ -906,6 +1222,35 @@ free_packet_data:
   return ret;
 }
 
+/* This function is called from networking stack in order to send packet.
+ * The device has no segmentation offload, a GSO packet is segmented in
+ * software and the segments are sent one by one.
+ */
+static int onic_start_xmit(struct sk_buff *skb, struct net_device *netdev)
+{
+  struct sk_buff *segs, *next;
+
+  if (likely(!skb_is_gso(skb)))
+    return onic_xmit_one(skb, netdev);
+
+  segs = skb_gso_segment(skb, netdev->features & ~NETIF_F_GSO_MASK);
+  if (IS_ERR_OR_NULL(segs)) {
+    netdev_err(netdev, "%s: skb_gso_segment() failed\n", __func__);
+    dev_kfree_skb_any(skb);
+    return NETDEV_TX_OK;
+  }
+  dev_consume_skb_any(skb);
+
+  while (segs) {
+    next = segs->next;
+    segs->next = NULL;
+    onic_xmit_one(segs, netdev);
+    segs = next;
+  }
+
+  return NETDEV_TX_OK;
+}
+
 static int onic_set_mac_address(struct net_device *dev, void *addr)
 {
   struct sockaddr *saddr = addr;
@@ -932,6 +1277,14 @@ static int onic_do_ioctl(struct net_device *netdev, struct ifreq *ifr, int cmd)
 static int onic_change_mtu(struct net_device *netdev, int mtu)
 {
   netdev_info(netdev, "Requestd MTU = %d", mtu);
+#ifdef ONIC_HAVE_XDP
+  if (READ_ONCE(((struct onic_priv *)netdev_priv(netdev))->xdp_prog) &&
+      mtu + ETH_HLEN + VLAN_HLEN > ONIC_XDP_MAX_LEN) {
+    netdev_err(netdev, "MTU %d too large while an XDP program is attached\n", mtu);
+    return -EINVAL;
+  }
+#endif
+  netdev->mtu = mtu;
   return 0;
 }
 
@@ -1202,10 +1555,9 @@ rx_not_aligned:
   return -EBUSY;
 }
 
-static void onic_init_reta(struct onic_priv *xpriv)
+void onic_set_qconf(struct onic_priv *xpriv)
 {
   u32 val;
-  int i;
 
   /* inform shell about the function map */
   val = (FIELD_SET(QDMA_FUNC_QCONF_QBASE_MASK, xpriv->pinfo->queue_base) |
@@ -1213,9 +1565,16 @@ static void onic_init_reta(struct onic_priv *xpriv)
        xpriv->netdev->real_num_rx_queues));
   writel(val, xpriv->bar_base +
          QDMA_FUNC_OFFSET_QCONF(xpriv->pinfo->port_id));
+}
+
+void onic_init_reta(struct onic_priv *xpriv)
+{
+  int i;
+
+  onic_set_qconf(xpriv);
 
   /* initialize indirection table */
-  for (i = 0; i < 128; i++) {
+  for (i = 0; i < ONIC_RETA_SIZE; i++) {
     u32 val = (i % xpriv->netdev->real_num_rx_queues) & 0x0000FFFF;
     u32 offset = QDMA_FUNC_OFFSET_INDIR_TABLE(xpriv->pinfo->port_id, i);
     writel(val, xpriv->bar_base + offset);
@@ -1266,7 +1625,10 @@ static const struct net_device_ops onic_netdev_ops = {
   .ndo_set_mac_address = onic_set_mac_address,
   .ndo_do_ioctl = onic_do_ioctl,
   .ndo_change_mtu = onic_change_mtu,
-  .ndo_get_stats64 = onic_get_stats64
+  .ndo_get_stats64 = onic_get_stats64,
+#ifdef ONIC_HAVE_XDP
+  .ndo_bpf = onic_xdp,
+#endif
 };
 
 extern void onic_set_ethtool_ops(struct net_device *netdev);
@@ -1310,6 +1672,11 @@ static int onic_pci_probe(struct pci_dev *pdev,
   SET_NETDEV_DEV(netdev, &pdev->dev);
   pci_set_drvdata(pdev, netdev);
   netdev->netdev_ops = &onic_netdev_ops;
+  /* Scatter-gather lets the stack hand over paged skbs and GSO segments
+   * without linearizing them, segmentation itself is done in software
+   */
+  netdev->hw_features |= NETIF_F_SG;
+  netdev->features |= NETIF_F_SG;
   onic_set_ethtool_ops(netdev);
 
   snprintf(dev_name, IFNAMSIZ, "onic%ds%df%d",
@@ -1353,6 +1720,10 @@ static int onic_pci_probe(struct pci_dev *pdev,
     netif_set_real_num_tx_queues(xpriv->netdev, xpriv->nb_queues);
     netif_set_real_num_rx_queues(xpriv->netdev, xpriv->nb_queues);
   }
+  /* Queues are created for the initial channel count, ethtool may later
+   * lower the number of channels exposed to the stack
+   */
+  xpriv->max_channels = xpriv->netdev->real_num_rx_queues;
 
   xpriv->dma_req = KMEM_CACHE(onic_dma_request, 0);
   if (!xpriv->dma_req) {
@@ -1411,7 +1782,7 @@ static int onic_pci_probe(struct pci_dev *pdev,
   }
 
   // Set up QDMA queues
-  ret = onic_qdma_rx_queue_setup(xpriv);
+  ret = onic_qdma_rx_queue_setup(xpriv, true);
   if (ret != 0) {
     netdev_err(netdev, "%s: onic_qdmx_rx_queue_setup() failed with status %d\n",
          __func__, ret);
@@ -1419,7 +1790,7 @@ static int onic_pci_probe(struct pci_dev *pdev,
     goto release_rx_queues;
   }
 
-  ret = onic_qdma_tx_queue_setup(xpriv);
+  ret = onic_qdma_tx_queue_setup(xpriv, true);
   if (ret != 0) {
     netdev_err(netdev, "%s: onic_qdmx_tx_queue_setup() failed with status %d\n",
          __func__, ret);
@@ -1431,9 +1802,9 @@ static int onic_pci_probe(struct pci_dev *pdev,
   return 0;
 
 release_queues:
-  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues);
+  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues, true);
 release_rx_queues:
-  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues);
+  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, true);
 disable_cmac:
   onic_disable_cmac(xpriv);
 iounmap_bar:
@@ -1469,8 +1840,8 @@ static void onic_pci_remove(struct pci_dev *pdev)
     return;
   }
 
-  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues);
-  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues);
+  onic_qdma_rx_queue_release(xpriv, xpriv->pinfo->active_rx_queues, true);
+  onic_qdma_tx_queue_release(xpriv, xpriv->pinfo->active_tx_queues, true);
   kfree(xpriv->tx_qstats);
 
   pci_set_drvdata(pdev, NULL);